@@ -5,3 +5,9 @@
 __author__ = """Paul Ross"""
 __email__ = 'apaulross@gmail.com'
 __version__ = '0.1.4'
+
+
+def get_include() -> str:
+    """The directory of the C headers, for extensions that use the ``cPyMemTrace`` C API in ``pymemtrace_capi.h``."""
+    import os
+    return os.path.join(os.path.dirname(__file__), 'src', 'include')
@@ -0,0 +1,249 @@
+"""
+Analyses the fragmentation of the pymalloc arenas.
+
+An arena is only returned to the OS when every pool in it is empty so a few long lived blocks can pin a whole arena,
+:py:attr:`pymemtrace.debug_malloc_stats.DebugMallocArenas.arenas_reclaimed` only gives the totals.
+This uses ``cDebugMallocStats.pools()`` to find every pool and report, for each arena, how many pools are used, full or
+empty, which size classes pin it and how many bytes could be reclaimed if some size classes were compacted.
+
+This is Linux only.
+
+For example:
+
+.. code-block:: python
+
+    from pymemtrace import arena_fragmentation
+
+    fragmentation = arena_fragmentation.ArenaFragmentation()
+    print(fragmentation)
+    # Bytes of arenas that could be released if 32 and 48 byte blocks were compacted.
+    print(fragmentation.reclaimable_arena_bytes([1, 2]))
+    fragmentation.write_gnuplot('gnuplot_dir')
+"""
+import math
+import typing
+
+from pymemtrace.util import gnuplot
+
+try:
+    from pymemtrace import cDebugMallocStats
+except ImportError:  # pragma: no cover
+    cDebugMallocStats = None
+
+
+class PoolStat(typing.NamedTuple):
+    """A pool, as found by ``cDebugMallocStats.pools()``."""
+    address: int
+    arena_index: int
+    size_class: int
+    blocks_in_use: int
+    capacity: int
+
+    @property
+    def is_empty(self) -> bool:
+        return self.blocks_in_use == 0
+
+    @property
+    def is_full(self) -> bool:
+        return self.blocks_in_use == self.capacity
+
+    @property
+    def free_blocks(self) -> int:
+        return self.capacity - self.blocks_in_use
+
+
+class ArenaStat:
+    """The pools in a single arena."""
+    def __init__(self, arena_index: int, pools_per_arena: int):
+        self.arena_index = arena_index
+        self.pools_per_arena = pools_per_arena
+        self.pools: typing.List[PoolStat] = []
+
+    @property
+    def address(self) -> int:
+        """The address of the lowest pool found."""
+        return min(pool.address for pool in self.pools)
+
+    @property
+    def pools_used(self) -> int:
+        """Pools that have some, but not all, blocks in use."""
+        return sum(1 for pool in self.pools if not pool.is_empty and not pool.is_full)
+
+    @property
+    def pools_full(self) -> int:
+        return sum(1 for pool in self.pools if pool.is_full)
+
+    @property
+    def pools_empty(self) -> int:
+        """Empty pools, including those never used. An arena that is not pool aligned has one pool fewer."""
+        return self.pools_per_arena - self.pools_used - self.pools_full
+
+    @property
+    def blocks_in_use(self) -> int:
+        return sum(pool.blocks_in_use for pool in self.pools)
+
+    def size_classes(self) -> typing.Dict[int, typing.Tuple[int, int, int]]:
+        """A dict of ``{size_class: (pools, blocks_in_use, capacity), ...}`` for the pools with blocks in use."""
+        ret: typing.Dict[int, typing.Tuple[int, int, int]] = {}
+        for pool in self.pools:
+            if not pool.is_empty:
+                pools, blocks_in_use, capacity = ret.get(pool.size_class, (0, 0, 0))
+                ret[pool.size_class] = (pools + 1, blocks_in_use + pool.blocks_in_use, capacity + pool.capacity)
+        return ret
+
+    def pinned_by(self) -> typing.List[int]:
+        """The size classes with blocks in use, the arena can not be released while any of these are."""
+        return sorted(self.size_classes())
+
+    def free_blocks(self, size_class: int) -> int:
+        """The free blocks in the pools of this size class that have blocks in use."""
+        return sum(pool.free_blocks for pool in self.pools if pool.size_class == size_class and not pool.is_empty)
+
+
+class ArenaFragmentation:
+    """A snapshot of every pymalloc pool grouped by arena."""
+    def __init__(self, pools: typing.Optional[typing.Dict[str, typing.Any]] = None):
+        """Constructor, this optionally takes the dict from ``cDebugMallocStats.pools()`` for testing.
+        If nothing is supplied this calls ``cDebugMallocStats.pools()``."""
+        if pools is None:
+            if cDebugMallocStats is None or not cDebugMallocStats.HAS_POOLS:
+                raise RuntimeError('Finding the pymalloc pools needs cDebugMallocStats on Linux.')
+            pools = cDebugMallocStats.pools()
+        self.pool_size: int = pools['pool_size']
+        self.arena_size: int = pools['arena_size']
+        self.alignment: int = pools['alignment']
+        self.pool_overhead: int = pools['pool_overhead']
+        self.pools_per_arena: int = self.arena_size // self.pool_size
+        self.pools: typing.List[PoolStat] = [PoolStat(*values) for values in pools['pools']]
+        self.arenas: typing.Dict[int, ArenaStat] = {}
+        for pool in self.pools:
+            if pool.arena_index not in self.arenas:
+                self.arenas[pool.arena_index] = ArenaStat(pool.arena_index, self.pools_per_arena)
+            self.arenas[pool.arena_index].pools.append(pool)
+        self.arenas = {k: self.arenas[k] for k in sorted(self.arenas)}
+
+    def block_size(self, size_class: int) -> int:
+        return (size_class + 1) * self.alignment
+
+    def capacity(self, size_class: int) -> int:
+        """Number of blocks in a pool of this size class."""
+        return (self.pool_size - self.pool_overhead) // self.block_size(size_class)
+
+    def size_classes(self) -> typing.List[int]:
+        """The size classes with blocks in use."""
+        return sorted(set(pool.size_class for pool in self.pools if not pool.is_empty))
+
+    def reclaimable_pool_bytes(self, size_classes: typing.Iterable[int]) -> int:
+        """The bytes of the pools that would be empty if the blocks of these size classes were compacted into as few
+        pools as possible. Empty pools can be reused by pymalloc for any size class but are only returned to the OS
+        with their arena."""
+        ret = 0
+        for size_class in set(size_classes):
+            pools = [pool for pool in self.pools if pool.size_class == size_class and not pool.is_empty]
+            blocks_in_use = sum(pool.blocks_in_use for pool in pools)
+            ret += (len(pools) - math.ceil(blocks_in_use / self.capacity(size_class))) * self.pool_size
+        return ret
+
+    def reclaimable_arena_bytes(self, size_classes: typing.Iterable[int]) -> int:
+        """The bytes of the arenas that could be released if the blocks of these size classes were moved elsewhere.
+
+        An arena can be released if all of its blocks in use are of these size classes and there is room for them in
+        the remaining arenas, either free blocks in pools of the same size class or empty pools.
+        Arenas with the fewest blocks in use are released first."""
+        size_classes = set(size_classes)
+        # Room in the arenas that stay and the blocks in the arenas that are released.
+        spare_blocks: typing.Dict[int, int] = {}
+        spare_pools = 0
+        for arena in self.arenas.values():
+            spare_pools += arena.pools_empty
+            for size_class in arena.size_classes():
+                spare_blocks[size_class] = spare_blocks.get(size_class, 0) + arena.free_blocks(size_class)
+        moved_blocks: typing.Dict[int, int] = {}
+        candidates = sorted(
+            (arena for arena in self.arenas.values() if set(arena.pinned_by()) <= size_classes),
+            key=lambda arena: arena.blocks_in_use,
+        )
+        released = 0
+        for arena in candidates:
+            arena_classes = arena.size_classes()
+            new_spare_blocks = dict(spare_blocks)
+            new_moved_blocks = dict(moved_blocks)
+            for size_class, (_pools, blocks_in_use, _capacity) in arena_classes.items():
+                new_spare_blocks[size_class] -= arena.free_blocks(size_class)
+                new_moved_blocks[size_class] = new_moved_blocks.get(size_class, 0) + blocks_in_use
+            pools_needed = sum(
+                math.ceil(max(0, blocks - new_spare_blocks.get(size_class, 0)) / self.capacity(size_class))
+                for size_class, blocks in new_moved_blocks.items()
+            )
+            if pools_needed <= spare_pools - arena.pools_empty:
+                spare_blocks = new_spare_blocks
+                moved_blocks = new_moved_blocks
+                spare_pools -= arena.pools_empty
+                released += 1
+        return released * self.arena_size
+
+    def arena_table(self) -> typing.List[typing.List[typing.Any]]:
+        """A table, with a header row, of the pools in each arena."""
+        ret: typing.List[typing.List[typing.Any]] = [
+            ['#Arena', 'Used', 'Full', 'Empty', 'Blocks', 'Pinned_by'],
+        ]
+        for arena in self.arenas.values():
+            ret.append([
+                arena.arena_index, arena.pools_used, arena.pools_full, arena.pools_empty, arena.blocks_in_use,
+                len(arena.pinned_by()),
+            ])
+        return ret
+
+    def occupancy_table(self) -> typing.List[typing.List[typing.Any]]:
+        """A table, with a header row, of ``(position, size_class, occupancy, arena_index, pools, blocks_in_use)`` for
+        every arena and size class. Occupancy is the fraction of the blocks in use in the pools of that size class
+        that have blocks in use, NaN if there are none.
+        position is the position of the arena which, unlike the arena index, has no gaps, so that the rows make a
+        regular grid for a gnuplot heatmap."""
+        ret: typing.List[typing.List[typing.Any]] = [
+            ['#Position', 'Size_class', 'Occupancy', 'Arena', 'Pools', 'Blocks'],
+        ]
+        size_class_count = max(self.size_classes(), default=-1) + 1
+        for position, arena in enumerate(self.arenas.values()):
+            arena_classes = arena.size_classes()
+            for size_class in range(size_class_count):
+                pools, blocks_in_use, capacity = arena_classes.get(size_class, (0, 0, 0))
+                occupancy = f'{blocks_in_use / capacity:.3f}' if capacity else 'NaN'
+                ret.append([position, size_class, occupancy, arena.arena_index, pools, blocks_in_use])
+        return ret
+
+    def write_gnuplot(self, path: str, name: str = 'arena_fragmentation') -> int:
+        """Writes the occupancy heatmap data and plot to the directory path and invokes gnuplot which writes
+        ``<name>.svg``. Returns the gnuplot error code."""
+        plt = gnuplot.PLOT.format(title='pymalloc arena occupancy by size class') + GNUPLOT_PLT.format(name=name)
+        return gnuplot.invoke_gnuplot(path, name, self.occupancy_table(), plt)
+
+    def __repr__(self):
+        """A summary of each arena followed by the totals."""
+        ret = [
+            f'{"Arena":>6} {"Address":>16} {"Used":>5} {"Full":>5} {"Empty":>5} {"Blocks":>8} Pinned by size classes',
+        ]
+        for arena in self.arenas.values():
+            pinned_by = ' '.join(str(v) for v in arena.pinned_by())
+            ret.append(
+                f'{arena.arena_index:6d} {arena.address:16x} {arena.pools_used:5d} {arena.pools_full:5d}'
+                f' {arena.pools_empty:5d} {arena.blocks_in_use:8d} {pinned_by}'
+            )
+        ret.append(
+            f'{len(self.arenas)} arenas * {self.arena_size} bytes, reclaimable if all size classes were compacted'
+            f' {self.reclaimable_arena_bytes(self.size_classes()):,d}'
+        )
+        return '\n'.join(ret)
+
+
+#: Plot for :py:meth:`ArenaFragmentation.write_gnuplot`, columns are from
+#: :py:meth:`ArenaFragmentation.occupancy_table`.
+GNUPLOT_PLT = """set terminal svg size 1400,700
+set output "{name}.svg"
+set xlabel "Arena (position)"
+set ylabel "Size class"
+set cblabel "Occupancy"
+set cbrange [0:1]
+set palette defined (0 "white", 0.5 "orange", 1 "red")
+plot "{name}.dat" using 1:2:3 with image notitle
+"""
@@ -0,0 +1,289 @@
+"""
+Benchmarks the overhead of ``cPyMemTrace`` for each tracer over workloads adapted from
+``pymemtrace/examples/ex_memory_exercise.py``.
+The C costs of each operation in an event, reading the RSS, formatting text and so on, are measured without Python by
+the ``pymemtrace_benchmark`` target in ``CMakeLists.txt``.
+
+With `pyperf <https://pyperf.readthedocs.io>`_ installed this is a pyperf suite, the results are written as pyperf
+JSON with ``-o``:
+
+.. code-block:: console
+
+    $ python -m pymemtrace.benchmarks.bm_cpymemtrace -o cpymemtrace.json
+    $ python -m pyperf compare_to baseline.json cpymemtrace.json
+
+Otherwise, or with ``--simple``, each benchmark is timed with ``time.perf_counter()`` and a summary with the overhead
+in nanoseconds per event is written as JSON:
+
+.. code-block:: console
+
+    $ python -m pymemtrace.benchmarks.bm_cpymemtrace --simple -o cpymemtrace.json
+"""
+import argparse
+import contextlib
+import json
+import logging
+import os
+import platform
+import statistics
+import sys
+import tempfile
+import time
+import typing
+
+from pymemtrace import cMemLeak
+from pymemtrace import cPyMemTrace
+from pymemtrace.examples.ex_memory_exercise import create_string
+
+logger = logging.getLogger(__file__)
+
+#: The number of times each workload repeats its inner loop.
+WORKLOAD_COUNT = 1000
+
+
+def _fibonacci(n: int) -> int:
+    if n < 2:
+        return n
+    return _fibonacci(n - 1) + _fibonacci(n - 2)
+
+
+def workload_calls() -> None:
+    """Python function calls with no allocation, the most events for the time taken."""
+    _fibonacci(15)
+
+
+def workload_strings() -> None:
+    """As ex_memory_exercise.exercise_memory() with many small strings and without the sleep."""
+    str_list = []
+    for _i in range(8):
+        str_list.append(create_string(1024 ** 2))
+    while len(str_list):
+        str_list.pop()
+    for _i in range(WORKLOAD_COUNT):
+        str_list.append(create_string(1024))
+    str_list.clear()
+
+
+def workload_c_malloc() -> None:
+    """As ex_memory_exercise.exercise_c_memory() without the prompts, C buffers allocated with malloc()."""
+    buffers = []
+    for _i in range(WORKLOAD_COUNT):
+        buffers.append(cMemLeak.CMalloc(1652))
+        buffers.pop()
+    for _i in range(8):
+        buffers.append(cMemLeak.CMalloc(1024 ** 2))
+    buffers.clear()
+
+
+def workload_py_malloc() -> None:
+    """Buffers from PyMem_Malloc() and PyMem_RawMalloc()."""
+    buffers = []
+    for _i in range(WORKLOAD_COUNT):
+        buffers.append(cMemLeak.PyMalloc(256))
+        buffers.append(cMemLeak.PyRawMalloc(1652))
+    buffers.clear()
+
+
+def workload_bulk_churn() -> None:
+    """Native churn with few Python events, the cost of the RSS reads and the estimate of bytes allocated.
+    The GIL is released while the blocks are allocated and freed."""
+    bulk = cMemLeak.BulkAlloc(WORKLOAD_COUNT, 16, 4096, 'log_uniform', touch=True, seed=1)
+    bulk.churn(8, 0.5)
+    bulk.free_pattern(1, 1)
+    bulk.free_all()
+
+
+#: Workload name to the function, each is called once per loop.
+WORKLOADS = {
+    'calls': workload_calls,
+    'strings': workload_strings,
+    'c_malloc': workload_c_malloc,
+    'py_malloc': workload_py_malloc,
+    'bulk_churn': workload_bulk_churn,
+}
+
+#: Tracer name to the cPyMemTrace class and its keyword arguments, None for no tracing.
+#: A d_rss_trigger of 0 writes every event so these measure the cost of the output as well as reading the RSS.
+TRACERS = {
+    'none': None,
+    'profile_text': ('Profile', {'d_rss_trigger': 0}),
+    'profile_binary': ('Profile', {'d_rss_trigger': 0, 'binary': True}),
+    'profile_default': ('Profile', {}),
+    'profile_estimate': ('Profile', {'estimate': True}),
+    'profile_sample_every': ('Profile', {'sample_every': 16}),
+    'profile_excluded': ('Profile', {'d_rss_trigger': 0, 'exclude': ['*']}),
+    'trace_text': ('Trace', {'d_rss_trigger': 0}),
+    'trace_binary': ('Trace', {'d_rss_trigger': 0, 'binary': True}),
+    'monitor_binary': ('Monitor', {'d_rss_trigger': 0, 'binary': True}),
+}
+
+
+def available_tracers() -> typing.List[str]:
+    """The tracer names that this Python supports, Monitor needs sys.monitoring."""
+    return [name for name, value in TRACERS.items() if value is None or hasattr(cPyMemTrace, value[0])]
+
+
+@contextlib.contextmanager
+def tracing(tracer: str, directory: str):
+    """Context manager that traces with the named tracer writing its log file to the directory."""
+    value = TRACERS[tracer]
+    if value is None:
+        yield
+    else:
+        klass_name, kwargs = value
+        with getattr(cPyMemTrace, klass_name)(directory=directory, **kwargs):
+            yield
+
+
+def time_workload(loops: int, tracer: str, workload: str, directory: str) -> float:
+    """Returns the time in seconds to run the workload loops times under the tracer."""
+    function = WORKLOADS[workload]
+    with tracing(tracer, directory):
+        start = time.perf_counter()
+        for _i in range(loops):
+            function()
+        return time.perf_counter() - start
+
+
+def count_events(workload: str, tracer: str) -> int:
+    """The number of events that a tracer of this kind sees for one call of the workload, a Python profile function
+    for Profile and Monitor, a Python trace function for Trace."""
+    events = 0
+
+    def _count(_frame, _event, _arg):
+        nonlocal events
+        events += 1
+        return _count
+
+    value = TRACERS[tracer]
+    if value is None:
+        return 0
+    if value[0] == 'Trace':
+        sys.settrace(_count)
+        try:
+            WORKLOADS[workload]()
+        finally:
+            sys.settrace(None)
+    else:
+        sys.setprofile(_count)
+        try:
+            WORKLOADS[workload]()
+        finally:
+            sys.setprofile(None)
+    # Less the call to WORKLOADS[workload] and the call to sys.settrace() or sys.setprofile().
+    return max(events - 2, 1)
+
+
+def run_simple(tracers: typing.List[str], workloads: typing.List[str], loops: int, repeat: int) -> typing.Dict:
+    """Times each tracer and workload, returns a dict suitable for JSON with the overhead in ns per event."""
+    results = []
+    with tempfile.TemporaryDirectory() as directory:
+        baselines = {}
+        for workload in workloads:
+            baseline = [time_workload(loops, 'none', workload, directory) / loops for _r in range(repeat)]
+            baselines[workload] = min(baseline)
+            for tracer in tracers:
+                if tracer == 'none':
+                    times = baseline
+                else:
+                    times = [time_workload(loops, tracer, workload, directory) / loops for _r in range(repeat)]
+                events = count_events(workload, tracer)
+                result = {
+                    'tracer': tracer,
+                    'workload': workload,
+                    'loops': loops,
+                    'seconds': times,
+                    'min': min(times),
+                    'median': statistics.median(times),
+                    'events': events,
+                    'ns_per_event': None,
+                }
+                if events:
+                    result['ns_per_event'] = (min(times) - baselines[workload]) * 1e9 / events
+                results.append(result)
+                logger.info('%-24s %-12s %12.3f ms %s', tracer, workload, min(times) * 1e3,
+                            '' if result['ns_per_event'] is None else f'{result["ns_per_event"]:10.1f} ns/event')
+    return {
+        'version': 1,
+        'python': sys.version,
+        'platform': platform.platform(),
+        'benchmarks': results,
+    }
+
+
+def _add_suite_arguments(parser: argparse.ArgumentParser) -> None:
+    """Add the options that select the benchmarks, shared by pyperf and the simple runner."""
+    parser.add_argument('--simple', action='store_true', help='Do not use pyperf even if it is installed.')
+    parser.add_argument('--tracer', type=str, action='append', choices=sorted(TRACERS),
+                        help='Tracer to run, can be repeated [default: all that are available]')
+    parser.add_argument('--workload', type=str, action='append', choices=sorted(WORKLOADS),
+                        help='Workload to run, can be repeated [default: all]')
+
+
+def _selected(parser: argparse.ArgumentParser,
+              args: argparse.Namespace) -> typing.Tuple[typing.List[str], typing.List[str]]:
+    """Returns the tracers and workloads selected by args."""
+    for tracer in args.tracer or []:
+        if tracer not in available_tracers():
+            parser.error(f'tracer "{tracer}" is not available on this Python')
+    return args.tracer or available_tracers(), args.workload or list(WORKLOADS)
+
+
+def run_pyperf() -> int:  # pragma: no cover
+    """Runs the suite with pyperf which parses the command line and runs each benchmark in worker processes."""
+    import pyperf
+
+    def add_cmdline_args(cmd, args):
+        for tracer in args.tracer or []:
+            cmd.extend(('--tracer', tracer))
+        for workload in args.workload or []:
+            cmd.extend(('--workload', workload))
+
+    runner = pyperf.Runner(add_cmdline_args=add_cmdline_args)
+    runner.metadata['description'] = 'cPyMemTrace overhead per workload'
+    _add_suite_arguments(runner.argparser)
+    args = runner.parse_args()
+    tracers, workloads = _selected(runner.argparser, args)
+    with tempfile.TemporaryDirectory() as directory:
+        for workload in workloads:
+            for tracer in tracers:
+                runner.bench_time_func(f'{tracer}-{workload}', time_workload, tracer, workload, directory)
+    return 0
+
+
+def main() -> int:
+    """Runs the benchmarks with pyperf if it is installed, otherwise times them simply."""
+    if '--simple' not in sys.argv[1:]:
+        try:
+            import pyperf  # noqa: F401
+        except ImportError:
+            pass
+        else:  # pragma: no cover
+            return run_pyperf()
+    parser = argparse.ArgumentParser(description='Benchmarks the overhead of cPyMemTrace.')
+    _add_suite_arguments(parser)
+    parser.add_argument('--loops', type=int, default=20, help='Loops of each workload [default: %(default)s]')
+    parser.add_argument('--repeat', type=int, default=5, help='Repeats of each benchmark [default: %(default)s]')
+    # Not stdout, cPyMemTrace writes the log file paths there.
+    parser.add_argument('-o', '--output', type=str, default='bm_cpymemtrace.json',
+                        help='Output JSON path [default: %(default)s]')
+    parser.add_argument("-l", "--log_level", type=int, dest="log_level", default=20,
+                        help="Log Level (debug=10, info=20, warning=30, error=40, critical=50)"
+                             " [default: %(default)s]"
+                        )
+    args = parser.parse_args()
+    tracers, workloads = _selected(parser, args)
+    if args.loops <= 0 or args.repeat <= 0:
+        parser.error('--loops and --repeat must be greater than zero.')
+    logging.basicConfig(level=args.log_level, stream=sys.stderr)
+    if not args.simple:
+        logger.info('pyperf is not installed, using --simple.')
+    result = run_simple(tracers, workloads, args.loops, args.repeat)
+    with open(args.output, 'w') as file:
+        json.dump(result, file, indent=2)
+    logger.info('Wrote %s', os.path.abspath(args.output))
+    return 0
+
+
+if __name__ == '__main__':  # pragma: no cover
+    sys.exit(main())
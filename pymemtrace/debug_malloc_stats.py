@@ -36,6 +36,13 @@ This calls::
     _PyTuple_DebugMallocStats(out); // in Objects/tupleobject.c, calls _PyDebugAllocatorStats in Objects/obmalloc.c for (i = 1; i < PyTuple_MAXSAVESIZE; i++)
 
 Note that only dict, float, frame, list, tuple are reported.
+
+Native Statistics
+------------------------------
+
+If the ``cDebugMallocStats`` extension is available the same two functions write to an in memory stream, stderr is not
+redirected, and the text is parsed in C. This is used by default whenever it gives the same results.
+``_PyObject_DebugTypeStats`` is not exported from Python 3.13 onwards so there the native statistics have no types.
 """
 import io
 import re
@@ -44,9 +51,22 @@ import typing
 
 from pymemtrace import redirect_stdout
 
+try:
+    from pymemtrace import cDebugMallocStats
+except ImportError:  # pragma: no cover
+    cDebugMallocStats = None
+
+
+def has_native_stats() -> bool:
+    """True if the native statistics are available and include the type statistics."""
+    return cDebugMallocStats is not None and cDebugMallocStats.HAS_TYPE_STATS
+
 
 def get_debugmallocstats() -> bytes:
-    """Invokes sys._debugmallocstats and captures the output as bytes."""
+    """Invokes sys._debugmallocstats and captures the output as bytes.
+    If the native statistics are available they are written to memory instead of redirecting stderr."""
+    if has_native_stats():
+        return cDebugMallocStats.debugmallocstats()
     stream = io.BytesIO()
     with redirect_stdout.stderr_redirector(stream):
         sys._debugmallocstats()
@@ -267,6 +287,16 @@ class DebugMallocArenas:
         if not all(hasattr(self, name) for name in expected_attrs):
             raise ValueError(f'Can not find required attributes {expected_attrs}')
 
+    @classmethod
+    def from_values(cls, ntimes_arena_allocated: int, narenas_highwater: int, narenas: int, arena_size: int):
+        """Alternative constructor from the values, for example ``cDebugMallocStats.stats()['arenas']``."""
+        ret = cls.__new__(cls)
+        ret.ntimes_arena_allocated = ntimes_arena_allocated
+        ret.narenas_highwater = narenas_highwater
+        ret.narenas = narenas
+        ret.arena_size = arena_size
+        return ret
+
     @property
     def arenas_reclaimed(self) -> int:
         return self.ntimes_arena_allocated - self.narenas
@@ -358,6 +388,20 @@ class DebugMallocPoolsBlocks:
         if not all(hasattr(self, name) for name in expected_attrs):
             raise ValueError(f'Can not find required attributes {expected_attrs}')
 
+    @classmethod
+    def from_values(cls, allocated_bytes: int, available_bytes: int, pool_header_bytes: int, quantization: int,
+                    arena_alignment: int, numfreepools: int, pool_size: int):
+        """Alternative constructor from the values, for example ``cDebugMallocStats.stats()['pools_blocks']``."""
+        ret = cls.__new__(cls)
+        ret.allocated_bytes = allocated_bytes
+        ret.available_bytes = available_bytes
+        ret.pool_header_bytes = pool_header_bytes
+        ret.quantization = quantization
+        ret.arena_alignment = arena_alignment
+        ret.numfreepools = numfreepools
+        ret.pool_size = pool_size
+        return ret
+
     @property
     def unused_pool_total(self) -> int:
         return self.numfreepools * self.pool_size
@@ -471,14 +515,26 @@ class SysDebugMallocStats:
     This class takes a snapshot of the debug malloc stats from ``sys._debugmallocstats``.
     Importantly it can identify the difference between two snapshots.
     """
-    def __init__(self, debug_malloc: bytes = b''):
+    def __init__(self, debug_malloc: bytes = b'', native: typing.Optional[bool] = None):
         """Constructor, this optionally takes a bytes object for testing.
         If nothing supplied this gets the bytes object from sys._debugmallocstats.
+
+        If native is True the values come from ``cDebugMallocStats.stats()`` which does not redirect stderr or parse
+        text in Python, on Python 3.13+ there are no type statistics. A bytes object is parsed by
+        ``cDebugMallocStats.parse()``.
+        If native is None the native statistics are used if :py:func:`has_native_stats` is True.
         """
         self.malloc_stats: typing.List[DebugMallocStat] = []
         self.type_stats: typing.List[DebugTypeStat] = []
         # Used for lookup by type
         self.type_map: typing.Dict[bytes, int] = {}
+        if native and cDebugMallocStats is None:
+            raise ValueError('native needs the cDebugMallocStats extension')
+        if native is None:
+            native = has_native_stats()
+        if native:
+            self._init_native(cDebugMallocStats.parse(debug_malloc) if debug_malloc else cDebugMallocStats.stats())
+            return
         if not debug_malloc:
             debug_malloc: bytes = get_debugmallocstats()
         for line in debug_malloc.splitlines(keepends=False):
@@ -509,6 +565,21 @@ class SysDebugMallocStats:
         global POOL_OVERHEAD
         POOL_OVERHEAD = pool_overhead
 
+    def _init_native(self, stats: typing.Dict[str, typing.Any]) -> None:
+        """Initialise from the dict returned by ``cDebugMallocStats.stats()``."""
+        self.small_block_threshold = stats['small_block_threshold']
+        self.size_classes = stats['size_classes']
+        self.malloc_stats = [DebugMallocStat(*values) for values in stats['malloc_stats']]
+        for values in stats['type_stats']:
+            self.type_map[values[1].encode('ascii')] = len(self.type_stats)
+            self.type_stats.append(DebugTypeStat(*values))
+        self.arenas = DebugMallocArenas.from_values(*stats['arenas'])
+        self.pools_blocks = DebugMallocPoolsBlocks.from_values(*stats['pools_blocks'])
+        # This is zero if there are no pools in use.
+        if stats['pool_overhead']:
+            global POOL_OVERHEAD
+            POOL_OVERHEAD = stats['pool_overhead']
+
     def object_types(self) -> typing.KeysView[bytes]:
         """Return all the known object types."""
         return self.type_map.keys()
@@ -673,21 +744,24 @@ def diff_debugmallocstats(a_stats: SysDebugMallocStats, b_stats: SysDebugMallocS
 
 class DiffSysDebugMallocStats:
     """Context manager that compares two snapshots of ``sys._getdebugmallocstats()`` and can provide a diff between
-    them."""
-    def __init__(self):
+    them.
+
+    native is passed to each :py:class:`SysDebugMallocStats`."""
+    def __init__(self, native: typing.Optional[bool] = None):
+        self.native = native
         self.before: typing.Optional[SysDebugMallocStats] = None
         self.after: typing.Optional[SysDebugMallocStats] = None
         self._diff: typing.Optional[str] = None
 
     def __enter__(self):
         """Enters the context manager taking a snapshot of ``sys._getdebugmallocstats()``."""
-        self.before = SysDebugMallocStats()
+        self.before = SysDebugMallocStats(native=self.native)
         self.after = None
         return self
 
     def __exit__(self, exc_type, exc_val, exc_tb):
         """Exits the context manager taking a snapshot of ``sys._getdebugmallocstats()``."""
-        self.after = SysDebugMallocStats()
+        self.after = SysDebugMallocStats(native=self.native)
         return False
 
     def diff(self) -> str:
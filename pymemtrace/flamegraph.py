@@ -0,0 +1,66 @@
+"""
+Writes the memory growth in a ``cPyMemTrace`` log file attributed by stack, for a flame graph, using
+``cTraceReader.Reader.export_stacks()``.
+Record the callers with ``stack_depth=...``, without them each event is attributed to just its own function.
+
+For example:
+
+.. code-block:: console
+
+    $ python -m pymemtrace.flamegraph 20201203_141016_62214.bin
+    $ flamegraph.pl --countname=bytes 20201203_141016_62214.bin.folded > memory.svg
+
+Or with ``--format=speedscope`` load the ``.speedscope.json`` file into https://www.speedscope.app
+"""
+import argparse
+import logging
+import sys
+import typing
+
+from pymemtrace import cTraceReader
+
+logger = logging.getLogger(__file__)
+
+#: Format name to the extension added to the log file path if no output path is given.
+EXTENSIONS = {
+    'folded': '.folded',
+    'speedscope': '.speedscope.json',
+}
+
+
+def export(path: str, output: typing.Optional[str] = None, format: str = 'folded') -> typing.Tuple[str, int, int]:
+    """Export the stacks of the log at path, returns the output path, the number of stacks and the bytes."""
+    if format not in EXTENSIONS:
+        raise ValueError(f'format must be one of {sorted(EXTENSIONS)} not "{format}"')
+    if output is None:
+        output = path + EXTENSIONS[format]
+    stacks, size = cTraceReader.Reader(path).export_stacks(output, format=format)
+    return output, stacks, size
+
+
+def main() -> int:
+    """Export each log file given on the command line."""
+    parser = argparse.ArgumentParser(
+        description='Writes the positive dRSS of cPyMemTrace logs by stack for a flame graph.',
+    )
+    parser.add_argument('paths', type=str, nargs='+', help='cPyMemTrace log files.')
+    parser.add_argument('-f', '--format', type=str, choices=sorted(EXTENSIONS), default='folded',
+                        help='Output format [default: %(default)s]')
+    parser.add_argument('-o', '--output', type=str, default=None,
+                        help='Output path for a single log, default is the log path with an extension for the format.')
+    parser.add_argument("-l", "--log_level", type=int, dest="log_level", default=20,
+                        help="Log Level (debug=10, info=20, warning=30, error=40, critical=50)"
+                             " [default: %(default)s]"
+                        )
+    args = parser.parse_args()
+    logging.basicConfig(level=args.log_level, stream=sys.stdout)
+    if args.output is not None and len(args.paths) > 1:
+        parser.error('--output can only be used with a single log file.')
+    for path in args.paths:
+        output, stacks, size = export(path, args.output, args.format)
+        logger.info('Wrote %d stacks, %d bytes to %s', stacks, size, output)
+    return 0
+
+
+if __name__ == '__main__':  # pragma: no cover
+    sys.exit(main())
@@ -0,0 +1,144 @@
+"""
+Merges the ``cPyMemTrace`` logs of a process and its forked children or ``multiprocessing`` workers into one timeline.
+The process tree comes from the PARENT marker that starts the log of each child, see ``pymemtrace.workers``.
+
+For example:
+
+.. code-block:: console
+
+    $ python -m pymemtrace.merge_logs 20201203_141016_62214.bin 20201203_141017_62215.bin -o timeline.txt
+
+The events are ordered by wall clock time, the start time of each log plus the clock of the event. Binary logs have
+their start time in the header, text logs only have it to the second in the file name so binary logs are better for
+this.
+"""
+import argparse
+import calendar
+import collections
+import heapq
+import logging
+import os
+import re
+import sys
+import time
+import typing
+
+from pymemtrace import cTraceReader
+
+logger = logging.getLogger(__file__)
+
+#: Matches the log file names made by cPyMemTrace, "YYYYmmdd_HHMMSS_<PID>..." the time is UTC.
+RE_LOG_FILE_NAME = re.compile(r'^(\d{8}_\d{6})_(\d+)')
+
+#: A log file and the process that wrote it. parent_pid and how are 0 and '' if the log has no PARENT marker.
+ProcessLog = collections.namedtuple('ProcessLog', 'path, pid, parent_pid, how, start_time')
+
+#: An event of the timeline, time is seconds since the Unix epoch.
+Event = collections.namedtuple('Event', 'time, pid, event, what, file, line, function, rss, d_rss')
+
+COLUMNS = ('event', 'clock', 'what', 'file', 'line', 'func', 'rss', 'd_rss')
+
+
+def read_process_log(path: str) -> ProcessLog:
+    """Read the process of a log from its header, falling back to the file name for a text log."""
+    reader = cTraceReader.Reader(path)
+    pid = reader.pid
+    start_time = reader.start_time
+    if pid is None or start_time is None:
+        match = RE_LOG_FILE_NAME.match(os.path.basename(path))
+        if match is None:
+            raise ValueError(f'Can not find the process of "{path}" from its header or file name.')
+        if pid is None:
+            pid = int(match.group(2))
+        if start_time is None:
+            start_time = float(calendar.timegm(time.strptime(match.group(1), '%Y%m%d_%H%M%S')))
+    parent_pid = 0
+    how = ''
+    for _event, _clock, kind, _thread_id, size, label in reader.markers():
+        if kind == 'PARENT':
+            parent_pid = size
+            how = label
+            break
+    return ProcessLog(path, pid, parent_pid, how, start_time)
+
+
+def _events(process_log: ProcessLog) -> typing.Iterator[Event]:
+    """The events of one log in the order that they were written."""
+    reader = cTraceReader.Reader(process_log.path)
+    for batch in reader:
+        columns = [memoryview(batch[name]).tolist() for name in COLUMNS]
+        for event, clock, what, file, line, func, rss, d_rss in zip(*columns):
+            yield Event(
+                process_log.start_time + clock, process_log.pid, event, cTraceReader.WHAT[what],
+                reader.strings.get(file, ''), line, reader.strings.get(func, ''), rss, d_rss,
+            )
+
+
+def merge(paths: typing.Sequence[str]) -> typing.Tuple[typing.List[ProcessLog], typing.Iterator[Event]]:
+    """Returns the process of each log and an iterator of the events of all of them in time order."""
+    process_logs = sorted((read_process_log(path) for path in paths), key=lambda p: (p.start_time, p.pid))
+    return process_logs, heapq.merge(*(_events(p) for p in process_logs), key=lambda e: e.time)
+
+
+def _write_tree(process_logs: typing.List[ProcessLog], file: typing.TextIO) -> None:
+    """Write the processes as a tree, a process whose parent has no log is a root."""
+    pids = {p.pid for p in process_logs}
+    children = collections.defaultdict(list)
+    for process_log in process_logs:
+        parent = process_log.parent_pid if process_log.parent_pid in pids else 0
+        children[parent].append(process_log)
+
+    def write(parent: int, depth: int) -> None:
+        for process_log in children.get(parent, []):
+            how = f' {process_log.how} of {process_log.parent_pid}' if process_log.parent_pid else ''
+            file.write(f'# {"    " * depth}{process_log.pid}{how} {process_log.path}\n')
+            if process_log.pid != parent:
+                write(process_log.pid, depth + 1)
+
+    file.write('# Processes:\n')
+    write(0, 0)
+
+
+def write_timeline(paths: typing.Sequence[str], output: typing.TextIO) -> int:
+    """Write the process tree and then the merged events of the logs at paths, returns the number of events.
+    Times are seconds since the start of the first log."""
+    process_logs, events = merge(paths)
+    _write_tree(process_logs, output)
+    start = process_logs[0].start_time if process_logs else 0.0
+    output.write(f'# Start: {time.strftime("%Y-%m-%d %H:%M:%S", time.gmtime(start))} UTC\n')
+    output.write(f'{"Time":>12} {"PID":>8} {"Event":>8} {"What":<9} {"File":<40} {"#line":>5} {"Function":<24}'
+                 f' {"RSS":>12} {"dRSS":>12}\n')
+    count = 0
+    for event in events:
+        output.write(
+            f'{event.time - start:12.6f} {event.pid:8d} {event.event:8d} {event.what:<9} {event.file:<40}'
+            f' {event.line:5d} {event.function:<24} {event.rss:12d} {event.d_rss:12d}\n'
+        )
+        count += 1
+    return count
+
+
+def main() -> int:
+    """Merge the log files given on the command line."""
+    parser = argparse.ArgumentParser(
+        description='Merges the cPyMemTrace logs of a process and its children into one timeline.',
+    )
+    parser.add_argument('paths', type=str, nargs='+', help='cPyMemTrace log files.')
+    parser.add_argument('-o', '--output', type=str, default=None, help='Output path, default is stdout.')
+    parser.add_argument("-l", "--log_level", type=int, dest="log_level", default=20,
+                        help="Log Level (debug=10, info=20, warning=30, error=40, critical=50)"
+                             " [default: %(default)s]"
+                        )
+    args = parser.parse_args()
+    logging.basicConfig(level=args.log_level, stream=sys.stderr)
+    if args.output is None:
+        count = write_timeline(args.paths, sys.stdout)
+    else:
+        with open(args.output, 'w') as output:
+            count = write_timeline(args.paths, output)
+    logger.info('Merged %d events from %d logs.', count, len(args.paths))
+    return 0
+
+
+if __name__ == '__main__':  # pragma: no cover
+    sys.exit(main())
@@ -9,6 +9,8 @@ There are several DoF here:
 - Logging level, DEBUG, INFO etc.
 - Logging verbosity, for example just memory? Or everything about the process (self._process.as_dict())
 
+When logging this process the samples are taken by a native thread, see :py:mod:`pymemtrace.cProcessSampler`, that
+does not need the GIL so the sampling interval can be well below the interval at which the log is written.
 """
 import argparse
 import contextlib
@@ -27,6 +29,11 @@ import psutil
 
 from pymemtrace.util import gnuplot
 
+try:
+    from pymemtrace import cProcessSampler
+except ImportError:  # pragma: no cover
+    cProcessSampler = None
+
 logger = logging.getLogger(__file__)
 
 
@@ -246,11 +253,14 @@ def add_message_to_queue(msg: str) -> None:
 class ProcessLoggingThread(threading.Thread):
     """Thread that regularly logs out process parameters."""
     def __init__(self, group=None, target=None, name=None, daemon=None,
-                 interval=1.0, log_level=logging.INFO, pid=-1,
+                 interval=1.0, log_level=logging.INFO, pid=-1, native=None, flush_interval=1.0,
                  ):
         """Constructor.
         args[0], or interval=... must be the reporting interval in seconds, default 1.0.
         args[1], or log_level=... must be the log level to report with, default logging.INFO.
+        native=... if True samples are taken by a native thread with :py:class:`pymemtrace.cProcessSampler.Sampler`
+        and written to the log, all at once, every ``max(interval, flush_interval)`` seconds.
+        This is only possible for this process. The default, None, uses the native sampler where possible.
         """
         if name is None:
             name = 'ProcMon'
@@ -263,6 +273,17 @@ class ProcessLoggingThread(threading.Thread):
         else:
             self._process = psutil.Process()
             self._pid = self._process.pid
+        if native is None:
+            native = cProcessSampler is not None and self._pid == os.getpid()
+        if native:
+            if cProcessSampler is None or self._pid != os.getpid():
+                raise ValueError('The native sampler can only be used for this process.')
+            self._sampler = cProcessSampler.Sampler(interval)
+            self._create_time = self._process.create_time()
+            self._sleep_interval = max(interval, flush_interval)
+        else:
+            self._sampler = None
+            self._sleep_interval = interval
         self._run = True
 
     def _get_process_data(self, **kwargs):
@@ -282,10 +303,37 @@ class ProcessLoggingThread(threading.Thread):
         ret.update(kwargs)
         return ret
 
+    def _get_sample_data(self, sample: typing.Tuple, **kwargs):
+        """Like :py:meth:`_get_process_data` for a tuple from :py:class:`pymemtrace.cProcessSampler.Sampler`."""
+        timestamp, rss, vms, page_faults, major_page_faults, user_time, system_time = sample
+        ret = {
+            KEY_TIMESTAMP: datetime.datetime.fromtimestamp(timestamp).strftime(DATETIME_NOW_FORMAT),
+            'memory_info': {'rss': rss, 'vms': vms, 'pfaults': page_faults, 'pageins': major_page_faults},
+            'cpu_times': {'user': user_time, 'system': system_time},
+            KEY_ELAPSED_TIME: timestamp - self._create_time,
+            KEY_PROCESS_ID: self._pid,
+        }
+        ret.update(kwargs)
+        return ret
+
+    def _write_samples_to_log(self, prefix: str) -> None:
+        """Write every sample taken by the native sampler, then for start, stop and messages a sample taken now."""
+        for sample in self._sampler.read():
+            logger.log(self._log_level, f'{LOGGER_PREFIX} {json.dumps(self._get_sample_data(sample))}')
+        if prefix != LOGGER_PREFIX:
+            logger.log(self._log_level, f'{prefix} {json.dumps(self._get_sample_data(self._sampler.sample()))}')
+        while not process_queue.empty():
+            msg = process_queue.get()
+            logger.log(
+                self._log_level, f'{prefix} {json.dumps(self._get_sample_data(self._sampler.sample(), label=msg))}'
+            )
+
     def _write_to_log(self, prefix: str) -> None:
         """Write process data to log flushing message queue if necessary."""
         if self._run:
-            if process_queue.empty():
+            if self._sampler is not None:
+                self._write_samples_to_log(prefix)
+            elif process_queue.empty():
                 logger.log(self._log_level, f'{prefix} {json.dumps(self._get_process_data())}')
             else:
                 while not process_queue.empty():
@@ -295,12 +343,16 @@ class ProcessLoggingThread(threading.Thread):
     def run(self) -> None:
         """thread.run(). Write to log then sleep."""
         self._write_to_log(LOGGER_PREFIX_START)
+        if self._sampler is not None:
+            self._sampler.start()
         while self._run:
-            time.sleep(self._interval)
+            time.sleep(self._sleep_interval)
             self._write_to_log(LOGGER_PREFIX)
 
     def join(self, *args, **kwargs):
         """thread.join(). Write to log last time."""
+        if self._sampler is not None:
+            self._sampler.stop()
         self._write_to_log(LOGGER_PREFIX_STOP)
         self._run = False
         super().join(*args, **kwargs)
@@ -0,0 +1,337 @@
+// Measures the cost in nanoseconds of each operation that cPyMemTrace makes for a trace event, without Python:
+// reading the RSS and the other memory counters, reading each clock, formatting a line of text and copying a binary
+// record into the ring buffer. The results are written as JSON, the per workload cost of Profile and Trace is measured
+// by pymemtrace/benchmarks/bm_cpymemtrace.py
+//
+// Usage: pymemtrace_benchmark [-n iterations] [-r repeat] [-o output.json] [name ...]
+// Each name selects the benchmarks that contain it, all benchmarks are run if there are none.
+
+#define _POSIX_C_SOURCE 200809L  // For clock_gettime() and getopt()
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "get_rss.h"
+#include "pymemtrace_clock.h"
+#include "trace_record.h"
+#include "trace_ring_buffer.h"
+
+/* As PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH in cPyMemTrace.c */
+#define BENCHMARK_TEXT_MAX_LENGTH 256
+#define BENCHMARK_RING_BUFFER_CAPACITY (1024 * 1024)
+#define BENCHMARK_DEFAULT_ITERATIONS 10000
+#define BENCHMARK_DEFAULT_REPEAT 5
+
+/* Stops the compiler optimising away the results. */
+static volatile uint64_t benchmark_sink;
+
+typedef struct {
+    /* From a PY_MEM_TRACE_MEM_* or PyMemTraceClockSource value. */
+    unsigned int field;
+    PyMemTraceClock clock;
+    TraceRingBuffer ring;
+    char text[BENCHMARK_TEXT_MAX_LENGTH];
+} BenchmarkContext;
+
+typedef void (*benchmark_function)(BenchmarkContext *context, size_t iterations);
+
+static uint64_t
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void
+bench_get_current_rss(BenchmarkContext *context, size_t iterations) {
+    (void)context;
+    for (size_t i = 0; i < iterations; ++i) {
+        benchmark_sink += getCurrentRSS();
+    }
+}
+
+static void
+bench_get_current_rss_alternate(BenchmarkContext *context, size_t iterations) {
+    (void)context;
+    for (size_t i = 0; i < iterations; ++i) {
+        benchmark_sink += getCurrentRSS_alternate();
+    }
+}
+
+static void
+bench_get_peak_rss(BenchmarkContext *context, size_t iterations) {
+    (void)context;
+    for (size_t i = 0; i < iterations; ++i) {
+        benchmark_sink += getPeakRSS();
+    }
+}
+
+static void
+bench_mem_counter(BenchmarkContext *context, size_t iterations) {
+    for (size_t i = 0; i < iterations; ++i) {
+        benchmark_sink += pymemtrace_mem_counter_read(context->field);
+    }
+}
+
+static void
+bench_clock(BenchmarkContext *context, size_t iterations) {
+    for (size_t i = 0; i < iterations; ++i) {
+        benchmark_sink += pymemtrace_clock_ticks(&context->clock);
+    }
+}
+
+/* The event line with interned strings as trace_or_profile_function() in cPyMemTrace.c */
+static void
+bench_text_format_interned(BenchmarkContext *context, size_t iterations) {
+    size_t rss = getCurrentRSS();
+    for (size_t i = 0; i < iterations; ++i) {
+        snprintf(context->text, BENCHMARK_TEXT_MAX_LENGTH, "%-12zu +%-6ld %-8s %-8u#%4d %-8u %12zu %12ld\n",
+                 i, 1L, "CALL", 12U, (int)(i & 0xFFF), 34U, rss + i, (long)i);
+        benchmark_sink += (unsigned char)context->text[0];
+    }
+}
+
+/* As above with the file and function names. */
+static void
+bench_text_format_names(BenchmarkContext *context, size_t iterations) {
+    size_t rss = getCurrentRSS();
+    for (size_t i = 0; i < iterations; ++i) {
+        snprintf(context->text, BENCHMARK_TEXT_MAX_LENGTH, "%-12zu +%-6ld %-8s %-80s#%4d %-32s %12zu %12ld\n",
+                 i, 1L, "CALL", "pymemtrace/examples/ex_memory_exercise.py", (int)(i & 0xFFF), "create_string",
+                 rss + i, (long)i);
+        benchmark_sink += (unsigned char)context->text[0];
+    }
+}
+
+/* The text line with a clock column. */
+static void
+bench_text_format_clock(BenchmarkContext *context, size_t iterations) {
+    size_t rss = getCurrentRSS();
+    for (size_t i = 0; i < iterations; ++i) {
+        double clock_time = pymemtrace_clock_seconds(&context->clock, pymemtrace_clock_ticks(&context->clock));
+        snprintf(context->text, BENCHMARK_TEXT_MAX_LENGTH, "%-12zu +%-6ld %-12.6f %-8s %-8u#%4d %-8u %12zu %12ld\n",
+                 i, 1L, clock_time, "CALL", 12U, (int)(i & 0xFFF), 34U, rss + i, (long)i);
+        benchmark_sink += (unsigned char)context->text[0];
+    }
+}
+
+static size_t
+discard_sink(void *sink_context, const void *data, size_t size) {
+    (void)sink_context;
+    (void)data;
+    return size;
+}
+
+/* A binary event record into the ring buffer, the writer thread discards it. */
+static void
+bench_binary_record(BenchmarkContext *context, size_t iterations) {
+    TraceRecordEvent record;
+    memset(&record, 0, sizeof(record));
+    record.type = TRACE_RECORD_EVENT;
+    record.file_id = 12;
+    record.func_id = 34;
+    for (size_t i = 0; i < iterations; ++i) {
+        record.line_number = (int32_t)(i & 0xFFF);
+        record.event_number = i;
+        record.clock = i;
+        record.rss = i;
+        record.d_rss = (int64_t)i;
+        trace_ring_buffer_write_wait(&context->ring, &record, sizeof(record));
+    }
+    trace_ring_buffer_flush(&context->ring);
+}
+
+/* A binary event record with the clock and the RSS read, the cost of a binary Profile event less Python. */
+static void
+bench_binary_event(BenchmarkContext *context, size_t iterations) {
+    TraceRecordEvent record;
+    memset(&record, 0, sizeof(record));
+    record.type = TRACE_RECORD_EVENT;
+    record.file_id = 12;
+    record.func_id = 34;
+    uint64_t rss = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+        uint64_t previous = rss;
+        rss = getCurrentRSS();
+        record.line_number = (int32_t)(i & 0xFFF);
+        record.event_number = i;
+        record.clock = pymemtrace_clock_ticks(&context->clock);
+        record.rss = rss;
+        record.d_rss = (int64_t)(rss - previous);
+        trace_ring_buffer_write_wait(&context->ring, &record, sizeof(record));
+    }
+    trace_ring_buffer_flush(&context->ring);
+}
+
+typedef struct {
+    char name[64];
+    benchmark_function function;
+    unsigned int field;
+} Benchmark;
+
+/* Returns the number of benchmarks written to benchmarks, at most max_count. */
+static size_t
+benchmark_list(Benchmark *benchmarks, size_t max_count) {
+    size_t count = 0;
+#define BENCHMARK_ADD(NAME, FUNCTION, FIELD) \
+    do { \
+        if (count < max_count) { \
+            snprintf(benchmarks[count].name, sizeof(benchmarks[count].name), "%s", NAME); \
+            benchmarks[count].function = FUNCTION; \
+            benchmarks[count].field = FIELD; \
+            count++; \
+        } \
+    } while (0)
+    BENCHMARK_ADD("getCurrentRSS", bench_get_current_rss, 0);
+    BENCHMARK_ADD("getCurrentRSS_alternate", bench_get_current_rss_alternate, 0);
+    BENCHMARK_ADD("getPeakRSS", bench_get_peak_rss, 0);
+    for (unsigned int field = PY_MEM_TRACE_MEM_RSS; field & PY_MEM_TRACE_MEM_ALL; field <<= 1) {
+        char name[64];
+        snprintf(name, sizeof(name), "mem_counter_%s", pymemtrace_mem_counter_name(field));
+        BENCHMARK_ADD(name, bench_mem_counter, field);
+    }
+    for (int source = 0; source < PY_MEM_TRACE_CLOCK_COUNT; ++source) {
+        if (pymemtrace_clock_available(source)) {
+            char name[64];
+            snprintf(name, sizeof(name), "clock_%s", pymemtrace_clock_source_name(source));
+            BENCHMARK_ADD(name, bench_clock, (unsigned int)source);
+        }
+    }
+    BENCHMARK_ADD("text_format_interned", bench_text_format_interned, PY_MEM_TRACE_CLOCK_MONOTONIC);
+    BENCHMARK_ADD("text_format_names", bench_text_format_names, PY_MEM_TRACE_CLOCK_MONOTONIC);
+    BENCHMARK_ADD("text_format_clock", bench_text_format_clock, PY_MEM_TRACE_CLOCK_MONOTONIC);
+    BENCHMARK_ADD("binary_record", bench_binary_record, PY_MEM_TRACE_CLOCK_MONOTONIC);
+    BENCHMARK_ADD("binary_event", bench_binary_event, PY_MEM_TRACE_CLOCK_MONOTONIC);
+#undef BENCHMARK_ADD
+    return count;
+}
+
+static int
+benchmark_selected(const Benchmark *benchmark, char **names, int name_count) {
+    if (name_count == 0) {
+        return 1;
+    }
+    for (int i = 0; i < name_count; ++i) {
+        if (strstr(benchmark->name, names[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Run one benchmark repeat times writing a JSON object to output.
+ * Returns 0 on success, non-zero on failure.
+ */
+static int
+benchmark_run(const Benchmark *benchmark, size_t iterations, int repeat, FILE *output, int first) {
+    BenchmarkContext context;
+    memset(&context, 0, sizeof(context));
+    context.field = benchmark->field;
+    /* Every benchmark that does not use a clock gets the default, all of them have an initialised clock. */
+    int source = benchmark->function == bench_clock ? (int)benchmark->field : PY_MEM_TRACE_CLOCK_MONOTONIC;
+    if (pymemtrace_clock_init(&context.clock, source)) {
+        fprintf(stderr, "Can not initialise clock for %s\n", benchmark->name);
+        return -1;
+    }
+    if (trace_ring_buffer_open(&context.ring, BENCHMARK_RING_BUFFER_CAPACITY, discard_sink, NULL)) {
+        fprintf(stderr, "Can not open the ring buffer for %s\n", benchmark->name);
+        return -1;
+    }
+    double *results = malloc(sizeof(double) * (size_t)repeat);
+    if (results == NULL) {
+        trace_ring_buffer_close(&context.ring);
+        return -1;
+    }
+    /* Warm up, this also faults in the ring buffer. */
+    benchmark->function(&context, iterations / 10 + 1);
+    for (int r = 0; r < repeat; ++r) {
+        uint64_t start = now_ns();
+        benchmark->function(&context, iterations);
+        results[r] = (double)(now_ns() - start) / (double)iterations;
+    }
+    size_t records_dropped = context.ring.records_dropped;
+    trace_ring_buffer_close(&context.ring);
+    double mean = 0.0;
+    for (int r = 0; r < repeat; ++r) {
+        mean += results[r];
+    }
+    mean /= repeat;
+    fprintf(output, "%s\n    {\"name\": \"%s\", \"iterations\": %zu, \"repeat\": %d, \"ns_per_op\": [",
+            first ? "" : ",", benchmark->name, iterations, repeat);
+    for (int r = 0; r < repeat; ++r) {
+        fprintf(output, "%s%.3f", r ? ", " : "", results[r]);
+    }
+    qsort(results, (size_t)repeat, sizeof(double), compare_double);
+    fprintf(output, "], \"min\": %.3f, \"median\": %.3f, \"mean\": %.3f, \"max\": %.3f, \"records_dropped\": %zu}",
+            results[0], results[repeat / 2], mean, results[repeat - 1], records_dropped);
+    free(results);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    size_t iterations = BENCHMARK_DEFAULT_ITERATIONS;
+    int repeat = BENCHMARK_DEFAULT_REPEAT;
+    const char *output_path = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "n:r:o:h")) != -1) {
+        switch (c) {
+            case 'n':
+                iterations = (size_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                repeat = atoi(optarg);
+                break;
+            case 'o':
+                output_path = optarg;
+                break;
+            case 'h':
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [-r repeat] [-o output.json] [name ...]\n", argv[0]);
+                return c == 'h' ? 0 : 1;
+        }
+    }
+    if (iterations == 0 || repeat <= 0) {
+        fprintf(stderr, "The iterations and repeat must be greater than zero.\n");
+        return 1;
+    }
+    FILE *output = stdout;
+    if (output_path) {
+        output = fopen(output_path, "w");
+        if (output == NULL) {
+            fprintf(stderr, "Can not open %s\n", output_path);
+            return 1;
+        }
+    }
+    Benchmark benchmarks[64];
+    size_t count = benchmark_list(benchmarks, sizeof(benchmarks) / sizeof(benchmarks[0]));
+    int result = 0;
+    int first = 1;
+    fprintf(output, "{\n  \"version\": 1,\n  \"iterations\": %zu,\n  \"repeat\": %d,\n  \"benchmarks\": [",
+            iterations, repeat);
+    for (size_t i = 0; i < count; ++i) {
+        if (benchmark_selected(benchmarks + i, argv + optind, argc - optind)) {
+            if (benchmark_run(benchmarks + i, iterations, repeat, output, first)) {
+                result = 1;
+                break;
+            }
+            first = 0;
+        }
+    }
+    fprintf(output, "\n  ]\n}\n");
+    if (output != stdout) {
+        fclose(output);
+    }
+    return result;
+}
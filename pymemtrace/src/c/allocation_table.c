@@ -0,0 +1,137 @@
+// Open addressing hash table with linear probing and backward shift deletion.
+// Address 0 is not a valid key as it marks an empty slot.
+// The table grows when it is half full, it never shrinks.
+
+#include <stdlib.h>
+
+#include "allocation_table.h"
+
+static size_t
+allocation_table_hash(uintptr_t address) {
+    /* Same as pointer_map_hash(), the low bits of addresses are mostly zero due to alignment. */
+    uint64_t value = (uint64_t)address;
+    value ^= value >> 33;
+    value *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(value ^ (value >> 29));
+}
+
+static size_t
+allocation_table_find(const AllocationEntry *entries, size_t capacity, uintptr_t address) {
+    size_t mask = capacity - 1;
+    size_t index = allocation_table_hash(address) & mask;
+    while (entries[index].address != 0 && entries[index].address != address) {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+static int
+allocation_table_grow(AllocationTable *table) {
+    size_t new_capacity = table->capacity * 2;
+    AllocationEntry *new_entries = calloc(new_capacity, sizeof(AllocationEntry));
+    if (new_entries == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (table->entries[i].address) {
+            new_entries[allocation_table_find(new_entries, new_capacity, table->entries[i].address)] =
+                table->entries[i];
+        }
+    }
+    free(table->entries);
+    table->entries = new_entries;
+    table->capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Initialise an empty table, capacity is rounded up to a power of two.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+allocation_table_init(AllocationTable *table, size_t capacity) {
+    table->capacity = 16;
+    while (table->capacity < capacity) {
+        table->capacity <<= 1;
+    }
+    table->size = 0;
+    table->total_bytes = 0;
+    table->entries = calloc(table->capacity, sizeof(AllocationEntry));
+    return table->entries == NULL ? -1 : 0;
+}
+
+void
+allocation_table_free(AllocationTable *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = 0;
+    table->size = 0;
+    table->total_bytes = 0;
+}
+
+/**
+ * Insert or replace the entry for entry->address.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+allocation_table_insert(AllocationTable *table, const AllocationEntry *entry) {
+    if (entry->address == 0) {
+        return -1;
+    }
+    if (2 * (table->size + 1) > table->capacity && allocation_table_grow(table)) {
+        return -1;
+    }
+    AllocationEntry *slot = table->entries + allocation_table_find(table->entries, table->capacity, entry->address);
+    if (slot->address == 0) {
+        table->size++;
+    } else {
+        table->total_bytes -= slot->size;
+    }
+    *slot = *entry;
+    table->total_bytes += entry->size;
+    return 0;
+}
+
+/**
+ * Remove the entry for address.
+ * Returns 1 if it was present, 0 otherwise.
+ */
+int
+allocation_table_remove(AllocationTable *table, uintptr_t address) {
+    if (address == 0 || table->size == 0) {
+        return 0;
+    }
+    size_t mask = table->capacity - 1;
+    size_t index = allocation_table_find(table->entries, table->capacity, address);
+    if (table->entries[index].address == 0) {
+        return 0;
+    }
+    table->total_bytes -= table->entries[index].size;
+    table->size--;
+    /* Backward shift: move later entries in the probe sequence into the hole if that is nearer their home slot. */
+    size_t hole = index;
+    size_t next = (hole + 1) & mask;
+    while (table->entries[next].address != 0) {
+        size_t home = allocation_table_hash(table->entries[next].address) & mask;
+        /* Distance from home to next and from home to hole, modulo capacity. */
+        if (((next - home) & mask) >= ((hole - home) & mask)) {
+            table->entries[hole] = table->entries[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    table->entries[hole].address = 0;
+    return 1;
+}
+
+/**
+ * Returns the entry for address or NULL.
+ */
+const AllocationEntry *
+allocation_table_get(const AllocationTable *table, uintptr_t address) {
+    if (address == 0) {
+        return NULL;
+    }
+    const AllocationEntry *entry = table->entries + allocation_table_find(table->entries, table->capacity, address);
+    return entry->address ? entry : NULL;
+}
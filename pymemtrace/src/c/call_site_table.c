@@ -0,0 +1,140 @@
+// Open addressing hash table with linear probing keyed on (code, line_number).
+// A NULL code is not a valid key as it marks an empty slot.
+// There is no removal, the table grows when it is half full.
+
+#include <stdlib.h>
+
+#include "call_site_table.h"
+
+static size_t
+call_site_table_hash(const void *code, int32_t line_number) {
+    /* As pointer_map_hash() with the line number mixed in. */
+    uint64_t value = (uint64_t)(uintptr_t)code ^ ((uint64_t)(uint32_t)line_number << 32);
+    value ^= value >> 33;
+    value *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(value ^ (value >> 29));
+}
+
+static CallSiteEntry *
+call_site_table_find(CallSiteEntry *entries, size_t capacity, const void *code, int32_t line_number) {
+    size_t mask = capacity - 1;
+    size_t index = call_site_table_hash(code, line_number) & mask;
+    while (entries[index].code != NULL
+           && (entries[index].code != code || entries[index].line_number != line_number)) {
+        index = (index + 1) & mask;
+    }
+    return entries + index;
+}
+
+static int
+call_site_table_grow(CallSiteTable *table) {
+    size_t new_capacity = table->capacity * 2;
+    CallSiteEntry *new_entries = calloc(new_capacity, sizeof(CallSiteEntry));
+    if (new_entries == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < table->capacity; ++i) {
+        const CallSiteEntry *entry = table->entries + i;
+        if (entry->code) {
+            *call_site_table_find(new_entries, new_capacity, entry->code, entry->line_number) = *entry;
+        }
+    }
+    free(table->entries);
+    table->entries = new_entries;
+    table->capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Initialise an empty table, capacity is rounded up to a power of two.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+call_site_table_init(CallSiteTable *table, size_t capacity) {
+    table->capacity = 16;
+    while (table->capacity < capacity) {
+        table->capacity <<= 1;
+    }
+    table->size = 0;
+    table->entries = calloc(table->capacity, sizeof(CallSiteEntry));
+    return table->entries == NULL ? -1 : 0;
+}
+
+void
+call_site_table_free(CallSiteTable *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = 0;
+    table->size = 0;
+}
+
+/**
+ * Returns the entry for (code, line_number), adding an empty one if it is not present, or NULL on failure.
+ * is_new is set non-zero if the entry was added.
+ * The pointer is only valid until the next call as the table may grow.
+ */
+CallSiteEntry *
+call_site_table_get(CallSiteTable *table, const void *code, int32_t line_number, int *is_new) {
+    *is_new = 0;
+    if (code == NULL) {
+        return NULL;
+    }
+    CallSiteEntry *entry = call_site_table_find(table->entries, table->capacity, code, line_number);
+    if (entry->code) {
+        return entry;
+    }
+    if (2 * (table->size + 1) > table->capacity) {
+        if (call_site_table_grow(table)) {
+            return NULL;
+        }
+        entry = call_site_table_find(table->entries, table->capacity, code, line_number);
+    }
+    entry->code = code;
+    entry->line_number = line_number;
+    table->size++;
+    *is_new = 1;
+    return entry;
+}
+
+void
+call_site_entry_add(CallSiteEntry *entry, int64_t d_rss) {
+    if (d_rss > 0) {
+        entry->d_rss_positive += d_rss;
+    } else {
+        entry->d_rss_negative += d_rss;
+    }
+    if (entry->count == 0 || d_rss > entry->d_rss_max) {
+        entry->d_rss_max = d_rss;
+    }
+    entry->count++;
+}
+
+static int
+call_site_compare(const void *a, const void *b) {
+    const CallSiteEntry *entry_a = *(const CallSiteEntry **)a;
+    const CallSiteEntry *entry_b = *(const CallSiteEntry **)b;
+    if (entry_a->d_rss_positive != entry_b->d_rss_positive) {
+        return entry_a->d_rss_positive > entry_b->d_rss_positive ? -1 : 1;
+    }
+    return (entry_a->count < entry_b->count) - (entry_a->count > entry_b->count);
+}
+
+/**
+ * Returns a new array of table->size pointers to the entries, largest total positive change in RSS first, or NULL on
+ * failure. The caller frees this.
+ */
+const CallSiteEntry **
+call_site_table_sorted(const CallSiteTable *table) {
+    const CallSiteEntry **sorted = malloc((table->size + 1) * sizeof(CallSiteEntry *));
+    if (sorted == NULL) {
+        return NULL;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (table->entries[i].code) {
+            sorted[count++] = table->entries + i;
+        }
+    }
+    qsort(sorted, count, sizeof(CallSiteEntry *), call_site_compare);
+    return sorted;
+}
@@ -11,6 +11,12 @@
  *          http://creativecommons.org/licenses/by/3.0/deed.en_US
  */
 
+#if defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
+#define _POSIX_C_SOURCE 200809L  // For pread() and O_CLOEXEC
+#endif
+
+#include <string.h>
+
 #include "get_rss.h"
 
 #if defined(_WIN32)
@@ -19,6 +25,7 @@
 #elif defined(__unix__) || defined(__unix) || defined(unix) || (defined(__APPLE__) && defined(__MACH__))
     #include <unistd.h>
     #include <sys/resource.h>
+    #include <sys/time.h>
     #if defined(__APPLE__) && defined(__MACH__)
         /* Added for faster (?) Mac OS X RSS value in getCurrentRSS_alternate. */
         #include <libproc.h>
@@ -27,12 +34,133 @@
         #include <fcntl.h>
         #include <procfs.h>
     #elif defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
-        #include <stdio.h>
+        #include <fcntl.h>
+        #include <pthread.h>
     #endif
 #else
     #error "Cannot define getPeakRSS( ) or getCurrentRSS( ) for an unknown OS."
 #endif
 
+#if defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
+/*
+ * Linux getCurrentRSS() support.
+ * Opening /proc/self/statm and calling sysconf() per sample dominates the cost of tracing so the file descriptor and
+ * the page size are cached here.
+ * /proc/self is resolved when the file is opened so after a fork() the inherited descriptor still reads the parent.
+ * A pthread_atfork() child handler discards it and the child reopens the file on its next sample.
+ */
+#define LINUX_STATM_BUFFER_SIZE 128
+
+static int linux_statm_file_descriptor = -1;
+static size_t linux_page_size = 0;
+static pthread_once_t linux_statm_once = PTHREAD_ONCE_INIT;
+
+/*
+ * pymemtrace_mem_counters_fill() support, these are cached in the same way as /proc/self/statm.
+ * -2 means that the file can not be opened, smaps_rollup needs Linux 4.14.
+ */
+#define LINUX_STATUS_BUFFER_SIZE 4096
+static int linux_status_file_descriptor = -1;
+static int linux_smaps_rollup_file_descriptor = -1;
+
+static void
+linux_close_cached(int *file_descriptor) {
+    if (*file_descriptor >= 0) {
+        close(*file_descriptor);
+    }
+    *file_descriptor = -1;
+}
+
+static void
+linux_statm_atfork_child(void) {
+    /* The child inherits the parent's descriptors which read the parent's /proc/self. */
+    linux_close_cached(&linux_statm_file_descriptor);
+    linux_close_cached(&linux_status_file_descriptor);
+    linux_close_cached(&linux_smaps_rollup_file_descriptor);
+}
+
+static void
+linux_statm_init(void) {
+    linux_page_size = (size_t)sysconf(_SC_PAGESIZE);
+    pthread_atfork(NULL, NULL, &linux_statm_atfork_child);
+}
+
+/**
+ * Returns the cached file descriptor of /proc/self/statm, opening it if necessary, or -1 on failure.
+ */
+static int
+linux_statm_fd(void) {
+    pthread_once(&linux_statm_once, &linux_statm_init);
+    if (linux_statm_file_descriptor < 0) {
+        linux_statm_file_descriptor = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    }
+    return linux_statm_file_descriptor;
+}
+
+/**
+ * Returns the cached file descriptor of a /proc/self file, opening it if necessary, or -1 on failure.
+ */
+static int
+linux_proc_fd(int *file_descriptor, const char *path) {
+    pthread_once(&linux_statm_once, &linux_statm_init);
+    if (*file_descriptor == -1) {
+        *file_descriptor = open(path, O_RDONLY | O_CLOEXEC);
+        if (*file_descriptor < 0) {
+            *file_descriptor = -2;
+        }
+    }
+    return *file_descriptor < 0 ? -1 : *file_descriptor;
+}
+
+/**
+ * Read a "Name:   value kB" file such as /proc/self/status into buffer.
+ * Returns the length read or 0 on failure.
+ */
+static size_t
+linux_read_proc(int *file_descriptor, const char *path, char *buffer, size_t size) {
+    int fd = linux_proc_fd(file_descriptor, path);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t len = pread(fd, buffer, size - 1, 0);
+    if (len <= 0) {
+        return 0;
+    }
+    buffer[len] = '\0';
+    return (size_t)len;
+}
+
+/**
+ * Find the line "<name> <value> kB" and set *value to the value in bytes.
+ * name includes the ':'. Returns non-zero if the line was found.
+ */
+static int
+linux_proc_value(const char *buffer, const char *name, size_t *value) {
+    size_t name_length = strlen(name);
+    const char *p = buffer;
+    while (p) {
+        if (strncmp(p, name, name_length) == 0) {
+            p += name_length;
+            while (*p == ' ' || *p == '\t') {
+                ++p;
+            }
+            size_t kilobytes = 0;
+            while (*p >= '0' && *p <= '9') {
+                kilobytes = kilobytes * 10 + (size_t)(*p - '0');
+                ++p;
+            }
+            *value = kilobytes * 1024;
+            return 1;
+        }
+        p = strchr(p, '\n');
+        if (p) {
+            ++p;
+        }
+    }
+    return 0;
+}
+#endif
+
 /**
  * Returns the peak (maximum so far) resident set size (physical
  * memory use) measured in bytes, or zero if the value cannot be
@@ -93,16 +221,37 @@ size_t getCurrentRSS(void) {
     return (size_t)info.resident_size;
 #elif defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
     /* Linux ---------------------------------------------------- */
-    long rss = 0L;
-    FILE* fp = NULL;
-    if ( (fp = fopen( "/proc/self/statm", "r" )) == NULL )
+    /*
+     * /proc/self/statm is "size resident shared text lib data dt" in pages.
+     * The file is opened once and re-read with pread(), see linux_statm_fd().
+     */
+    char buffer[LINUX_STATM_BUFFER_SIZE];
+    int fd = linux_statm_fd();
+    if (fd < 0) {
         return (size_t)0L;      /* Can't open? */
-    if ( fscanf( fp, "%*s%ld", &rss ) != 1 ) {
-        fclose( fp );
+    }
+    ssize_t len = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (len <= 0) {
         return (size_t)0L;      /* Can't read? */
     }
-    fclose( fp );
-    return (size_t)rss * (size_t)sysconf( _SC_PAGESIZE);
+    buffer[len] = '\0';
+    const char *p = buffer;
+    /* Skip the first field, size. */
+    while (*p && *p != ' ') {
+        ++p;
+    }
+    while (*p == ' ') {
+        ++p;
+    }
+    if (*p < '0' || *p > '9') {
+        return (size_t)0L;      /* Can't parse? */
+    }
+    size_t rss = 0;
+    while (*p >= '0' && *p <= '9') {
+        rss = rss * 10 + (size_t)(*p - '0');
+        ++p;
+    }
+    return rss * linux_page_size;
 #else
     /* AIX, BSD, Solaris, and Unknown OS ------------------------ */
     return (size_t)0L;          /* Unsupported. */
@@ -133,3 +282,177 @@ size_t getCurrentRSS_alternate(void) {
     return getCurrentRSS();
 }
 
+
+/**** Memory counters. ****/
+static const struct {
+    unsigned int field;
+    const char *name;
+} mem_counter_names[] = {
+    {PY_MEM_TRACE_MEM_RSS, "rss"},
+    {PY_MEM_TRACE_MEM_RSS_ANON, "rss_anon"},
+    {PY_MEM_TRACE_MEM_RSS_FILE, "rss_file"},
+    {PY_MEM_TRACE_MEM_RSS_SHMEM, "rss_shmem"},
+    {PY_MEM_TRACE_MEM_SWAP, "swap"},
+    {PY_MEM_TRACE_MEM_USS, "uss"},
+    {PY_MEM_TRACE_MEM_PSS, "pss"},
+    {PY_MEM_TRACE_MEM_PRIVATE, "private"},
+    {PY_MEM_TRACE_MEM_FAULTS, "faults"},
+};
+#define MEM_COUNTER_NAMES_COUNT (sizeof(mem_counter_names) / sizeof(mem_counter_names[0]))
+
+/**
+ * Returns the field for a name such as "rss_anon" or 0 if the name is not known.
+ */
+unsigned int
+pymemtrace_mem_counter_from_name(const char *name) {
+    for (size_t i = 0; i < MEM_COUNTER_NAMES_COUNT; ++i) {
+        if (strcmp(name, mem_counter_names[i].name) == 0) {
+            return mem_counter_names[i].field;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the name of a single field or NULL.
+ */
+const char *
+pymemtrace_mem_counter_name(unsigned int field) {
+    for (size_t i = 0; i < MEM_COUNTER_NAMES_COUNT; ++i) {
+        if (field == mem_counter_names[i].field) {
+            return mem_counter_names[i].name;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Fill in the fields of counters asked for, fields read from the same source may also be filled in.
+ * Returns the fields asked for that were filled in, a field may not be available on this platform.
+ */
+unsigned int
+pymemtrace_mem_counters_fill(pymemtrace_mem_counters *counters, unsigned int fields) {
+    unsigned int filled = 0;
+    if (fields & PY_MEM_TRACE_MEM_RSS) {
+        counters->rss = getCurrentRSS_alternate();
+        filled |= PY_MEM_TRACE_MEM_RSS;
+    }
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS_EX info;
+    if ((fields & (PY_MEM_TRACE_MEM_PRIVATE | PY_MEM_TRACE_MEM_FAULTS))
+        && GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&info, sizeof(info))) {
+        if (fields & PY_MEM_TRACE_MEM_PRIVATE) {
+            counters->private_bytes = (size_t)info.PrivateUsage;
+            filled |= PY_MEM_TRACE_MEM_PRIVATE;
+        }
+        if (fields & PY_MEM_TRACE_MEM_FAULTS) {
+            /* Windows does not distinguish between minor and major faults. */
+            counters->minor_faults = (uint64_t)info.PageFaultCount;
+            counters->major_faults = 0;
+            filled |= PY_MEM_TRACE_MEM_FAULTS;
+        }
+    }
+#else
+#if defined(__APPLE__) && defined(__MACH__)
+    const unsigned int vm_info_fields = PY_MEM_TRACE_MEM_RSS_ANON | PY_MEM_TRACE_MEM_RSS_FILE | PY_MEM_TRACE_MEM_SWAP
+                                        | PY_MEM_TRACE_MEM_PRIVATE;
+    if (fields & vm_info_fields) {
+        task_vm_info_data_t vm_info;
+        mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+        if (task_info(mach_task_self(), TASK_VM_INFO, (task_info_t)&vm_info, &count) == KERN_SUCCESS) {
+            counters->rss_anon = (size_t)vm_info.internal;
+            counters->rss_file = (size_t)vm_info.external;
+            /* Memory that has been compressed is the nearest equivalent to swap. */
+            counters->swap = (size_t)vm_info.compressed;
+            counters->private_bytes = (size_t)vm_info.phys_footprint;
+            filled |= fields & vm_info_fields;
+        }
+    }
+#elif defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
+    const unsigned int status_fields = PY_MEM_TRACE_MEM_RSS_ANON | PY_MEM_TRACE_MEM_RSS_FILE
+                                       | PY_MEM_TRACE_MEM_RSS_SHMEM | PY_MEM_TRACE_MEM_SWAP
+                                       | PY_MEM_TRACE_MEM_PRIVATE;
+    char buffer[LINUX_STATUS_BUFFER_SIZE];
+    if ((fields & status_fields)
+        && linux_read_proc(&linux_status_file_descriptor, "/proc/self/status", buffer, sizeof(buffer))) {
+        size_t rss_anon = 0;
+        size_t swap = 0;
+        int has_rss_anon = linux_proc_value(buffer, "RssAnon:", &rss_anon);
+        int has_swap = linux_proc_value(buffer, "VmSwap:", &swap);
+        if (has_rss_anon) {
+            counters->rss_anon = rss_anon;
+            filled |= fields & PY_MEM_TRACE_MEM_RSS_ANON;
+        }
+        if (has_swap) {
+            counters->swap = swap;
+            filled |= fields & PY_MEM_TRACE_MEM_SWAP;
+        }
+        if (has_rss_anon && has_swap) {
+            counters->private_bytes = rss_anon + swap;
+            filled |= fields & PY_MEM_TRACE_MEM_PRIVATE;
+        }
+        if (linux_proc_value(buffer, "RssFile:", &counters->rss_file)) {
+            filled |= fields & PY_MEM_TRACE_MEM_RSS_FILE;
+        }
+        if (linux_proc_value(buffer, "RssShmem:", &counters->rss_shmem)) {
+            filled |= fields & PY_MEM_TRACE_MEM_RSS_SHMEM;
+        }
+    }
+    if ((fields & (PY_MEM_TRACE_MEM_USS | PY_MEM_TRACE_MEM_PSS))
+        && linux_read_proc(&linux_smaps_rollup_file_descriptor, "/proc/self/smaps_rollup", buffer, sizeof(buffer))) {
+        size_t private_clean = 0;
+        size_t private_dirty = 0;
+        if (linux_proc_value(buffer, "Private_Clean:", &private_clean)
+            && linux_proc_value(buffer, "Private_Dirty:", &private_dirty)) {
+            counters->uss = private_clean + private_dirty;
+            filled |= fields & PY_MEM_TRACE_MEM_USS;
+        }
+        if (linux_proc_value(buffer, "Pss:", &counters->pss)) {
+            filled |= fields & PY_MEM_TRACE_MEM_PSS;
+        }
+    }
+#endif
+    if (fields & PY_MEM_TRACE_MEM_FAULTS) {
+        struct rusage rusage;
+        if (getrusage(RUSAGE_SELF, &rusage) == 0) {
+            counters->minor_faults = (uint64_t)rusage.ru_minflt;
+            counters->major_faults = (uint64_t)rusage.ru_majflt;
+            filled |= PY_MEM_TRACE_MEM_FAULTS;
+        }
+    }
+#endif
+    return filled;
+}
+
+/**
+ * Returns the current value of a single size field, such as PY_MEM_TRACE_MEM_RSS_ANON, or zero if it can not be
+ * determined on this OS.
+ */
+size_t
+pymemtrace_mem_counter_read(unsigned int field) {
+    if (field == PY_MEM_TRACE_MEM_RSS) {
+        return getCurrentRSS_alternate();
+    }
+    pymemtrace_mem_counters counters;
+    memset(&counters, 0, sizeof(counters));
+    pymemtrace_mem_counters_fill(&counters, field);
+    switch (field) {
+        case PY_MEM_TRACE_MEM_RSS_ANON:
+            return counters.rss_anon;
+        case PY_MEM_TRACE_MEM_RSS_FILE:
+            return counters.rss_file;
+        case PY_MEM_TRACE_MEM_RSS_SHMEM:
+            return counters.rss_shmem;
+        case PY_MEM_TRACE_MEM_SWAP:
+            return counters.swap;
+        case PY_MEM_TRACE_MEM_USS:
+            return counters.uss;
+        case PY_MEM_TRACE_MEM_PSS:
+            return counters.pss;
+        case PY_MEM_TRACE_MEM_PRIVATE:
+            return counters.private_bytes;
+        default:
+            return 0;
+    }
+}
+/**** END: Memory counters. ****/
@@ -0,0 +1,233 @@
+// Lock free per-thread record buffers, see malloc_trace_buffer.h
+//
+// Publication protocol for a record:
+//  1. The owner sets buffer->pending then takes a sequence number, both sequentially consistent.
+//  2. The owner writes the record and then increments chunk->committed with release semantics.
+//  3. The owner clears buffer->pending.
+// The drain first reads the global sequence number G. Any record with a sequence number below G either has been
+// committed or its owner still has pending set, so the drain waits for pending to clear and then takes every committed
+// record below G. Records at or above G are left for the next drain.
+
+#include <sched.h>
+#include <stdlib.h>
+
+#include "malloc_trace_buffer.h"
+
+static MallocTraceChunk *
+malloc_trace_chunk_new(void) {
+    /* calloc() so that next and committed are zero, records are written before they are committed. */
+    return calloc(1, sizeof(MallocTraceChunk));
+}
+
+/**
+ * Initialise an empty set of buffers.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+malloc_trace_buffers_init(MallocTraceBuffers *buffers) {
+    buffers->sequence = 0;
+    buffers->buffers = NULL;
+    buffers->records_dropped = 0;
+    if (pthread_key_create(&buffers->key, NULL)) {
+        return -1;
+    }
+    if (pthread_mutex_init(&buffers->mutex, NULL)) {
+        pthread_key_delete(buffers->key);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Free all the buffers. No thread may be appending when this is called.
+ */
+void
+malloc_trace_buffers_free(MallocTraceBuffers *buffers) {
+    MallocTraceBuffer *buffer = buffers->buffers;
+    while (buffer) {
+        MallocTraceChunk *chunk = buffer->read_chunk;
+        while (chunk) {
+            MallocTraceChunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        MallocTraceBuffer *next_buffer = buffer->next_buffer;
+        free(buffer);
+        buffer = next_buffer;
+    }
+    buffers->buffers = NULL;
+    pthread_mutex_destroy(&buffers->mutex);
+    pthread_key_delete(buffers->key);
+}
+
+/**
+ * Returns the buffer for the current thread, creating it on first use, or NULL on failure.
+ */
+MallocTraceBuffer *
+malloc_trace_buffer_get(MallocTraceBuffers *buffers) {
+    MallocTraceBuffer *buffer = pthread_getspecific(buffers->key);
+    if (buffer) {
+        return buffer;
+    }
+    buffer = calloc(1, sizeof(MallocTraceBuffer));
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->write_chunk = malloc_trace_chunk_new();
+    if (buffer->write_chunk == NULL) {
+        free(buffer);
+        return NULL;
+    }
+    buffer->read_chunk = buffer->write_chunk;
+    if (pthread_setspecific(buffers->key, buffer)) {
+        free(buffer->write_chunk);
+        free(buffer);
+        return NULL;
+    }
+    pthread_mutex_lock(&buffers->mutex);
+    buffer->next_buffer = buffers->buffers;
+    buffers->buffers = buffer;
+    pthread_mutex_unlock(&buffers->mutex);
+    return buffer;
+}
+
+/**
+ * Start a record, this returns its sequence number.
+ * This must be followed by malloc_trace_buffer_commit() on the same thread.
+ */
+uint64_t
+malloc_trace_buffer_begin(MallocTraceBuffers *buffers, MallocTraceBuffer *buffer) {
+    __atomic_store_n(&buffer->pending, 1, __ATOMIC_SEQ_CST);
+    return __atomic_fetch_add(&buffers->sequence, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Append the record (with the sequence number from malloc_trace_buffer_begin()) and clear pending.
+ * If a new chunk is needed and can not be allocated the record is dropped.
+ */
+void
+malloc_trace_buffer_commit(MallocTraceBuffers *buffers, MallocTraceBuffer *buffer, const MallocTraceRecord *record) {
+    MallocTraceChunk *chunk = buffer->write_chunk;
+    size_t committed = chunk->committed;
+    if (committed == MALLOC_TRACE_CHUNK_RECORDS) {
+        MallocTraceChunk *new_chunk = malloc_trace_chunk_new();
+        if (new_chunk == NULL) {
+            __atomic_add_fetch(&buffers->records_dropped, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&buffer->pending, 0, __ATOMIC_SEQ_CST);
+            return;
+        }
+        __atomic_store_n(&chunk->next, new_chunk, __ATOMIC_RELEASE);
+        buffer->write_chunk = new_chunk;
+        chunk = new_chunk;
+        committed = 0;
+    }
+    chunk->records[committed] = *record;
+    __atomic_store_n(&chunk->committed, committed + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&buffer->pending, 0, __ATOMIC_SEQ_CST);
+}
+
+static int
+malloc_trace_record_compare(const void *a, const void *b) {
+    uint64_t sequence_a = ((const MallocTraceRecord *)a)->sequence;
+    uint64_t sequence_b = ((const MallocTraceRecord *)b)->sequence;
+    return (sequence_a > sequence_b) - (sequence_a < sequence_b);
+}
+
+/**
+ * Count the committed records below limit in a buffer.
+ */
+static size_t
+malloc_trace_buffer_count(const MallocTraceBuffer *buffer, uint64_t limit) {
+    size_t count = 0;
+    size_t index = buffer->read_index;
+    const MallocTraceChunk *chunk = buffer->read_chunk;
+    while (chunk) {
+        size_t committed = __atomic_load_n(&chunk->committed, __ATOMIC_ACQUIRE);
+        /* Records within a buffer are in sequence order so stop at the first one at or above the limit. */
+        while (index < committed && chunk->records[index].sequence < limit) {
+            ++index;
+            ++count;
+        }
+        if (index < MALLOC_TRACE_CHUNK_RECORDS) {
+            break;
+        }
+        chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE);
+        index = 0;
+    }
+    return count;
+}
+
+/**
+ * Move count records from the buffer to records, freeing chunks that have been consumed.
+ */
+static void
+malloc_trace_buffer_take(MallocTraceBuffer *buffer, size_t count, MallocTraceRecord *records) {
+    MallocTraceChunk *chunk = buffer->read_chunk;
+    size_t index = buffer->read_index;
+    while (count) {
+        if (index == MALLOC_TRACE_CHUNK_RECORDS) {
+            /* This chunk is full and the owner has moved on to the next one so it is done with. */
+            MallocTraceChunk *next = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE);
+            free(chunk);
+            chunk = next;
+            index = 0;
+        }
+        *records++ = chunk->records[index++];
+        --count;
+    }
+    if (index == MALLOC_TRACE_CHUNK_RECORDS) {
+        MallocTraceChunk *next = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE);
+        if (next) {
+            free(chunk);
+            chunk = next;
+            index = 0;
+        }
+    }
+    buffer->read_chunk = chunk;
+    buffer->read_index = index;
+}
+
+/**
+ * Remove all complete records from every buffer and call callback on each one in sequence order.
+ * Only one thread may drain at a time. callback must not append to the buffers.
+ * Returns the number of records, (size_t)-1 if memory for sorting them could not be allocated in which case the
+ * records stay in the buffers.
+ */
+size_t
+malloc_trace_buffers_drain(MallocTraceBuffers *buffers, malloc_trace_record_callback callback, void *context) {
+    uint64_t limit = __atomic_load_n(&buffers->sequence, __ATOMIC_SEQ_CST);
+    size_t count = 0;
+
+    pthread_mutex_lock(&buffers->mutex);
+    for (MallocTraceBuffer *buffer = buffers->buffers; buffer; buffer = buffer->next_buffer) {
+        while (__atomic_load_n(&buffer->pending, __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+        count += malloc_trace_buffer_count(buffer, limit);
+    }
+    MallocTraceRecord *records = NULL;
+    if (count) {
+        records = malloc(count * sizeof(MallocTraceRecord));
+        if (records == NULL) {
+            pthread_mutex_unlock(&buffers->mutex);
+            return (size_t)-1;
+        }
+        /* Owners may have committed more since, take only what was counted. */
+        size_t taken = 0;
+        for (MallocTraceBuffer *buffer = buffers->buffers; buffer; buffer = buffer->next_buffer) {
+            size_t buffer_count = malloc_trace_buffer_count(buffer, limit);
+            malloc_trace_buffer_take(buffer, buffer_count, records + taken);
+            taken += buffer_count;
+        }
+    }
+    pthread_mutex_unlock(&buffers->mutex);
+    if (count == 0) {
+        return 0;
+    }
+    qsort(records, count, sizeof(MallocTraceRecord), malloc_trace_record_compare);
+    for (size_t i = 0; i < count; ++i) {
+        callback(context, &records[i]);
+    }
+    free(records);
+    return count;
+}
@@ -0,0 +1,113 @@
+// Open addressing hash map with linear probing.
+// NULL is not a valid key as it marks an empty slot.
+// There is no removal, the map grows when it is half full.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pointer_map.h"
+
+static size_t
+pointer_map_hash(const void *key) {
+    /* Fibonacci hashing, the low bits of pointers are mostly zero due to alignment. */
+    uint64_t value = (uint64_t)(uintptr_t)key;
+    value ^= value >> 33;
+    value *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(value ^ (value >> 29));
+}
+
+static PointerMapEntry *
+pointer_map_find(PointerMapEntry *entries, size_t capacity, const void *key) {
+    size_t mask = capacity - 1;
+    size_t index = pointer_map_hash(key) & mask;
+    while (entries[index].key != NULL && entries[index].key != key) {
+        index = (index + 1) & mask;
+    }
+    return entries + index;
+}
+
+static int
+pointer_map_grow(PointerMap *map) {
+    size_t new_capacity = map->capacity * 2;
+    PointerMapEntry *new_entries = calloc(new_capacity, sizeof(PointerMapEntry));
+    if (new_entries == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < map->capacity; ++i) {
+        if (map->entries[i].key) {
+            *pointer_map_find(new_entries, new_capacity, map->entries[i].key) = map->entries[i];
+        }
+    }
+    free(map->entries);
+    map->entries = new_entries;
+    map->capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Initialise an empty map, capacity is rounded up to a power of two.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+pointer_map_init(PointerMap *map, size_t capacity) {
+    map->capacity = 16;
+    while (map->capacity < capacity) {
+        map->capacity <<= 1;
+    }
+    map->size = 0;
+    map->entries = calloc(map->capacity, sizeof(PointerMapEntry));
+    return map->entries == NULL ? -1 : 0;
+}
+
+void
+pointer_map_free(PointerMap *map) {
+    free(map->entries);
+    map->entries = NULL;
+    map->capacity = 0;
+    map->size = 0;
+}
+
+/**
+ * Remove every entry, the capacity is kept.
+ */
+void
+pointer_map_clear(PointerMap *map) {
+    if (map->entries) {
+        memset(map->entries, 0, map->capacity * sizeof(PointerMapEntry));
+    }
+    map->size = 0;
+}
+
+/**
+ * If the key exists this sets value and returns 1, otherwise returns 0.
+ */
+int
+pointer_map_get(const PointerMap *map, const void *key, uint32_t *value) {
+    PointerMapEntry *entry = pointer_map_find(map->entries, map->capacity, key);
+    if (entry->key) {
+        *value = entry->value;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Insert or replace the value for the key.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+pointer_map_insert(PointerMap *map, const void *key, uint32_t value) {
+    if (key == NULL) {
+        return -1;
+    }
+    if (2 * (map->size + 1) > map->capacity && pointer_map_grow(map)) {
+        return -1;
+    }
+    PointerMapEntry *entry = pointer_map_find(map->entries, map->capacity, key);
+    if (entry->key == NULL) {
+        entry->key = key;
+        map->size++;
+    }
+    entry->value = value;
+    return 0;
+}
@@ -0,0 +1,303 @@
+// Native process sampler, see process_sampler.h
+//
+// The sources are:
+// Linux: /proc/self/stat, opened once and re-read with pread().
+// macOS: task_info() MACH_TASK_BASIC_INFO and TASK_EVENTS_INFO.
+// Windows: GetProcessMemoryInfo() and GetProcessTimes().
+
+#if defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
+#define _POSIX_C_SOURCE 200809L  // For pread(), O_CLOEXEC and clock_gettime()
+#define PROCESS_SAMPLER_LINUX
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+    #include <windows.h>
+    #include <psapi.h>
+#elif defined(__APPLE__) && defined(__MACH__)
+    #include <mach/mach.h>
+#elif defined(PROCESS_SAMPLER_LINUX)
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "process_sampler.h"
+
+#ifdef PROCESS_SAMPLER_LINUX
+/* /proc/self/stat is one line, the command name is at most 16 characters. */
+#define LINUX_STAT_BUFFER_SIZE 1024
+#endif
+
+static int64_t
+wall_time_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+#ifdef PROCESS_SAMPLER_LINUX
+/* Parse the next space separated unsigned integer, advancing *p. */
+static uint64_t
+parse_field(const char **p) {
+    while (**p == ' ') {
+        ++*p;
+    }
+    uint64_t value = 0;
+    while (**p >= '0' && **p <= '9') {
+        value = value * 10 + (uint64_t)(**p - '0');
+        ++*p;
+    }
+    /* Skip anything else, such as the state character or a negative number. */
+    while (**p && **p != ' ') {
+        ++*p;
+    }
+    return value;
+}
+#endif
+
+/**
+ * Read the current memory and CPU usage of this process.
+ * stat_file_descriptor is the open /proc/self/stat on Linux, it is ignored elsewhere.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+process_sample_read(int stat_file_descriptor, ProcessSample *sample) {
+    memset(sample, 0, sizeof(ProcessSample));
+    sample->time_ns = wall_time_ns();
+#if defined(_WIN32)
+    (void)stat_file_descriptor;
+    PROCESS_MEMORY_COUNTERS info;
+    if (! GetProcessMemoryInfo(GetCurrentProcess(), &info, sizeof(info))) {
+        return -1;
+    }
+    sample->rss = (uint64_t)info.WorkingSetSize;
+    sample->vms = (uint64_t)info.PagefileUsage;
+    sample->page_faults = (uint64_t)info.PageFaultCount;
+    FILETIME creation_time, exit_time, kernel_time, user_time;
+    if (! GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+        return -1;
+    }
+    /* FILETIME is in 100ns units. */
+    sample->user_time = (((uint64_t)user_time.dwHighDateTime << 32) | user_time.dwLowDateTime) * 1e-7;
+    sample->system_time = (((uint64_t)kernel_time.dwHighDateTime << 32) | kernel_time.dwLowDateTime) * 1e-7;
+    return 0;
+#elif defined(__APPLE__) && defined(__MACH__)
+    (void)stat_file_descriptor;
+    struct mach_task_basic_info info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) {
+        return -1;
+    }
+    sample->rss = (uint64_t)info.resident_size;
+    sample->vms = (uint64_t)info.virtual_size;
+    sample->user_time = info.user_time.seconds + info.user_time.microseconds * 1e-6;
+    sample->system_time = info.system_time.seconds + info.system_time.microseconds * 1e-6;
+    struct task_events_info events;
+    count = TASK_EVENTS_INFO_COUNT;
+    if (task_info(mach_task_self(), TASK_EVENTS_INFO, (task_info_t)&events, &count) == KERN_SUCCESS) {
+        sample->page_faults = (uint64_t)events.faults;
+        sample->major_page_faults = (uint64_t)events.pageins;
+    }
+    return 0;
+#elif defined(PROCESS_SAMPLER_LINUX)
+    static long clock_ticks = 0;
+    static long page_size = 0;
+    if (clock_ticks == 0) {
+        clock_ticks = sysconf(_SC_CLK_TCK);
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+    char buffer[LINUX_STAT_BUFFER_SIZE];
+    if (stat_file_descriptor < 0) {
+        return -1;
+    }
+    ssize_t length = pread(stat_file_descriptor, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+    /* The command name, field 2, is in parentheses and may contain spaces so start after the last ')'. */
+    const char *p = strrchr(buffer, ')');
+    if (p == NULL) {
+        return -1;
+    }
+    ++p;
+    /* Fields from 3, see proc(5). */
+    uint64_t fields[22];
+    for (int i = 0; i < 22; ++i) {
+        fields[i] = parse_field(&p);
+    }
+    sample->page_faults = fields[10 - 3] + fields[12 - 3];
+    sample->major_page_faults = fields[12 - 3];
+    sample->user_time = (double)fields[14 - 3] / clock_ticks;
+    sample->system_time = (double)fields[15 - 3] / clock_ticks;
+    sample->vms = fields[23 - 3];
+    sample->rss = fields[24 - 3] * (uint64_t)page_size;
+    return 0;
+#else
+    (void)stat_file_descriptor;
+    return -1;
+#endif
+}
+
+/**
+ * Initialise the sampler with room for capacity samples taken every interval_ns.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+process_sampler_init(ProcessSampler *sampler, size_t capacity, uint64_t interval_ns) {
+    memset(sampler, 0, sizeof(ProcessSampler));
+    sampler->stat_file_descriptor = -1;
+    if (capacity == 0) {
+        return -1;
+    }
+    sampler->samples = malloc(capacity * sizeof(ProcessSample));
+    if (sampler->samples == NULL) {
+        return -1;
+    }
+    sampler->capacity = capacity;
+    sampler->interval_ns = interval_ns;
+#ifdef PROCESS_SAMPLER_LINUX
+    sampler->stat_file_descriptor = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+    if (sampler->stat_file_descriptor < 0) {
+        free(sampler->samples);
+        sampler->samples = NULL;
+        return -1;
+    }
+#endif
+    pthread_mutex_init(&sampler->mutex, NULL);
+    pthread_cond_init(&sampler->cond, NULL);
+    return 0;
+}
+
+/* Add a sample to the ring overwriting the oldest if it is full. The mutex must be held. */
+static void
+process_sampler_append(ProcessSampler *sampler, const ProcessSample *sample) {
+    if (sampler->count == sampler->capacity) {
+        sampler->first = (sampler->first + 1) % sampler->capacity;
+        sampler->count--;
+        sampler->samples_lost++;
+    }
+    sampler->samples[(sampler->first + sampler->count) % sampler->capacity] = *sample;
+    sampler->count++;
+    sampler->samples_taken++;
+}
+
+static void *
+process_sampler_thread(void *arg) {
+    ProcessSampler *sampler = (ProcessSampler *)arg;
+    ProcessSample sample;
+    /* Samples are due at fixed times from the start so that the time taken to sample does not accumulate. */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    pthread_mutex_lock(&sampler->mutex);
+    while (! sampler->stop) {
+        pthread_mutex_unlock(&sampler->mutex);
+        int result = process_sample_read(sampler->stat_file_descriptor, &sample);
+        pthread_mutex_lock(&sampler->mutex);
+        if (result == 0) {
+            process_sampler_append(sampler, &sample);
+        }
+        uint64_t nanoseconds = (uint64_t)deadline.tv_nsec + sampler->interval_ns;
+        deadline.tv_sec += (time_t)(nanoseconds / 1000000000ULL);
+        deadline.tv_nsec = (long)(nanoseconds % 1000000000ULL);
+        while (! sampler->stop) {
+            if (pthread_cond_timedwait(&sampler->cond, &sampler->mutex, &deadline)) {
+                /* Timed out, or an error, so take the next sample. */
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&sampler->mutex);
+    return NULL;
+}
+
+/**
+ * Start the sampler thread, the first sample is taken immediately.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+process_sampler_start(ProcessSampler *sampler) {
+    if (sampler->thread_started) {
+        return -1;
+    }
+    sampler->stop = 0;
+    if (pthread_create(&sampler->thread, NULL, &process_sampler_thread, sampler) != 0) {
+        return -2;
+    }
+    sampler->thread_started = 1;
+    return 0;
+}
+
+/**
+ * Stop the sampler thread and wait for it to finish. The samples are kept.
+ */
+void
+process_sampler_stop(ProcessSampler *sampler) {
+    if (sampler->thread_started) {
+        pthread_mutex_lock(&sampler->mutex);
+        sampler->stop = 1;
+        pthread_cond_signal(&sampler->cond);
+        pthread_mutex_unlock(&sampler->mutex);
+        pthread_join(sampler->thread, NULL);
+        sampler->thread_started = 0;
+    }
+}
+
+/**
+ * Stop the sampler thread and free everything.
+ */
+void
+process_sampler_free(ProcessSampler *sampler) {
+    if (sampler->samples == NULL) {
+        return;
+    }
+    process_sampler_stop(sampler);
+    pthread_cond_destroy(&sampler->cond);
+    pthread_mutex_destroy(&sampler->mutex);
+#ifdef PROCESS_SAMPLER_LINUX
+    close(sampler->stat_file_descriptor);
+    sampler->stat_file_descriptor = -1;
+#endif
+    free(sampler->samples);
+    sampler->samples = NULL;
+}
+
+/**
+ * Take a sample now, this is not added to the ring.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+process_sampler_sample(ProcessSampler *sampler, ProcessSample *sample) {
+    return process_sample_read(sampler->stat_file_descriptor, sample);
+}
+
+/**
+ * Remove up to max_samples of the oldest samples from the ring and copy them to samples.
+ * Returns the number copied.
+ */
+size_t
+process_sampler_take(ProcessSampler *sampler, ProcessSample *samples, size_t max_samples) {
+    pthread_mutex_lock(&sampler->mutex);
+    size_t count = sampler->count < max_samples ? sampler->count : max_samples;
+    for (size_t i = 0; i < count; ++i) {
+        samples[i] = sampler->samples[(sampler->first + i) % sampler->capacity];
+    }
+    sampler->first = (sampler->first + count) % sampler->capacity;
+    sampler->count -= count;
+    pthread_mutex_unlock(&sampler->mutex);
+    return count;
+}
+
+/**
+ * Returns the number of samples in the ring.
+ */
+size_t
+process_sampler_count(ProcessSampler *sampler) {
+    pthread_mutex_lock(&sampler->mutex);
+    size_t count = sampler->count;
+    pthread_mutex_unlock(&sampler->mutex);
+    return count;
+}
@@ -0,0 +1,180 @@
+// Finds the pymalloc pools, see pymalloc_arenas.h
+//
+// From Objects/obmalloc.c a pool is initialised for a size class with:
+//
+//      pool->szidx = size;
+//      size = INDEX2SIZE(size);
+//      pool->nextoffset = POOL_OVERHEAD + (size << 1);
+//      pool->maxnextoffset = POOL_SIZE - size;
+//
+// And pool->ref.count is the number of blocks in use. An empty pool keeps its header.
+
+#if defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
+#define _POSIX_C_SOURCE 200809L  // For pread() and O_CLOEXEC
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pymalloc_arenas.h"
+
+#if PYMALLOC_ARENAS_SUPPORTED
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Returns non-zero if the header, read from address, is consistent with a pool of this geometry.
+ */
+int
+pymalloc_pool_header_is_valid(const PymallocGeometry *geometry, uintptr_t address, const PymallocPoolHeader *header) {
+    if (header->szidx >= geometry->size_classes) {
+        return 0;
+    }
+    size_t size = (header->szidx + 1) * geometry->alignment;
+    if (header->maxnextoffset != geometry->pool_size - size) {
+        return 0;
+    }
+    /* nextoffset is where the next never used block is, it starts two blocks in. */
+    if (header->nextoffset < geometry->pool_overhead + 2 * size
+        || header->nextoffset > header->maxnextoffset + size
+        || (header->nextoffset - geometry->pool_overhead) % size) {
+        return 0;
+    }
+    /* Only blocks below nextoffset have been used. */
+    if (header->ref.count > (header->nextoffset - geometry->pool_overhead) / size) {
+        return 0;
+    }
+    /* The free list is within the pool. */
+    if (header->freeblock) {
+        uintptr_t offset = (uintptr_t)header->freeblock - address;
+        if ((uintptr_t)header->freeblock < address || offset < geometry->pool_overhead
+            || offset >= header->nextoffset) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void
+pymalloc_pools_free(PymallocPools *pools) {
+    free(pools->pools);
+    pools->pools = NULL;
+    pools->count = 0;
+    pools->capacity = 0;
+}
+
+#if PYMALLOC_ARENAS_SUPPORTED
+
+static int
+pools_append(PymallocPools *pools, const PymallocPool *pool) {
+    if (pools->count == pools->capacity) {
+        size_t capacity = pools->capacity ? pools->capacity * 2 : 1024;
+        PymallocPool *new_pools = realloc(pools->pools, capacity * sizeof(PymallocPool));
+        if (new_pools == NULL) {
+            return -1;
+        }
+        pools->pools = new_pools;
+        pools->capacity = capacity;
+    }
+    pools->pools[pools->count++] = *pool;
+    return 0;
+}
+
+/* Returns non-zero if a line of /proc/self/maps is an anonymous private read/write mapping, or the heap. */
+static int
+is_candidate_mapping(const char *perms, const char *path) {
+    if (strncmp(perms, "rw", 2) || perms[3] != 'p') {
+        return 0;
+    }
+    return path[0] == '\0' || strcmp(path, "[heap]") == 0 || strncmp(path, "[anon:", 6) == 0;
+}
+
+static int
+scan_range(const PymallocGeometry *geometry, int mem_fd, uintptr_t start, uintptr_t end, PymallocPools *pools) {
+    uintptr_t mask = (uintptr_t)(geometry->pool_size - 1);
+    PymallocPoolHeader header;
+    for (uintptr_t address = (start + mask) & ~mask; address + sizeof(header) <= end && address >= start;
+         address += geometry->pool_size) {
+        if (pread(mem_fd, &header, sizeof(header), (off_t)address) != (ssize_t)sizeof(header)) {
+            ++pools->read_errors;
+            continue;
+        }
+        if (pymalloc_pool_header_is_valid(geometry, address, &header)) {
+            size_t size = (header.szidx + 1) * geometry->alignment;
+            PymallocPool pool = {
+                address,
+                header.arenaindex,
+                header.szidx,
+                header.ref.count,
+                (unsigned int)((geometry->pool_size - geometry->pool_overhead) / size),
+            };
+            if (pools_append(pools, &pool)) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find every pool, pools must be zero initialised and freed with pymalloc_pools_free() whatever the result.
+ * The GIL should be held so that the pools do not change during the walk.
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int
+pymalloc_pools_find(const PymallocGeometry *geometry, PymallocPools *pools) {
+    char line[512];
+    int ret = 0;
+
+    if (geometry->pool_size < sizeof(PymallocPoolHeader) || (geometry->pool_size & (geometry->pool_size - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL) {
+        return -1;
+    }
+    int mem_fd = open("/proc/self/mem", O_RDONLY | O_CLOEXEC);
+    if (mem_fd < 0) {
+        fclose(maps);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long start, end;
+        char perms[5];
+        int path_offset = 0;
+        /* "7f1c2a000000-7f1c2a100000 rw-p 00000000 00:00 0    [heap]" */
+        if (sscanf(line, "%lx-%lx %4s %*s %*s %*s%n", &start, &end, perms, &path_offset) != 3) {
+            continue;
+        }
+        char *path = line + path_offset;
+        while (*path == ' ' || *path == '\t') {
+            ++path;
+        }
+        path[strcspn(path, "\n")] = '\0';
+        if (is_candidate_mapping(perms, path)) {
+            if (scan_range(geometry, mem_fd, (uintptr_t)start, (uintptr_t)end, pools)) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    close(mem_fd);
+    fclose(maps);
+    return ret;
+}
+
+#else
+
+int
+pymalloc_pools_find(const PymallocGeometry *geometry, PymallocPools *pools) {
+    (void)geometry;
+    (void)pools;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
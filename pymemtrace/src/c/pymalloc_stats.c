@@ -0,0 +1,259 @@
+// Parser for the pymalloc statistics text, see pymalloc_stats.h
+//
+// The text comes from Objects/obmalloc.c, for example:
+//
+//  Small block threshold = 512, in 32 size classes.
+//
+//  class   size   num pools   blocks in use  avail blocks
+//  -----   ----   ---------   -------------  ------------
+//      0     16           2             297           209
+//  ...
+//  # arenas allocated total           =                2,033
+//  18 arenas * 262144 bytes/arena     =            4,718,592
+//  # bytes in allocated blocks        =            4,280,848
+//  63 unused pools * 4096 bytes       =              258,048
+//  ...
+//     34 free 2-sized PyTupleObjects * 40 bytes each =                1,360
+//
+// Values written by printone() have thousands separators.
+
+#include <string.h>
+
+#include "pymalloc_stats.h"
+
+typedef struct {
+    const char *pos;
+    const char *end;
+} Cursor;
+
+static void
+cursor_skip_spaces(Cursor *cursor) {
+    while (cursor->pos < cursor->end && (*cursor->pos == ' ' || *cursor->pos == '\t')) {
+        ++cursor->pos;
+    }
+}
+
+/* Match a literal string, on success this advances the cursor and returns 1. */
+static int
+cursor_match(Cursor *cursor, const char *literal) {
+    size_t length = strlen(literal);
+    if ((size_t)(cursor->end - cursor->pos) < length || memcmp(cursor->pos, literal, length)) {
+        return 0;
+    }
+    cursor->pos += length;
+    return 1;
+}
+
+/* Read an unsigned decimal, commas are ignored if allow_commas is set. Returns 1 if there is at least one digit. */
+static int
+cursor_read_size(Cursor *cursor, size_t *value, int allow_commas) {
+    size_t result = 0;
+    int digits = 0;
+    while (cursor->pos < cursor->end) {
+        char c = *cursor->pos;
+        if (c >= '0' && c <= '9') {
+            result = result * 10 + (size_t)(c - '0');
+            ++digits;
+        } else if (!(allow_commas && c == ',' && digits)) {
+            break;
+        }
+        ++cursor->pos;
+    }
+    *value = result;
+    return digits > 0;
+}
+
+static int
+cursor_at_end(Cursor *cursor) {
+    cursor_skip_spaces(cursor);
+    return cursor->pos == cursor->end;
+}
+
+/* The value of a printone() line, "label = 1,234". */
+static int
+printone_value(const char *line, size_t length, size_t *value) {
+    const char *equals = memchr(line, '=', length);
+    if (equals == NULL) {
+        return 0;
+    }
+    Cursor cursor = {equals + 1, line + length};
+    cursor_skip_spaces(&cursor);
+    return cursor_read_size(&cursor, value, 1) && cursor_at_end(&cursor);
+}
+
+static int
+starts_with(const char *line, size_t length, const char *prefix) {
+    size_t prefix_length = strlen(prefix);
+    return length >= prefix_length && memcmp(line, prefix, prefix_length) == 0;
+}
+
+/* printone() labels and where their values go. */
+typedef struct {
+    const char *label;
+    size_t offset;
+    unsigned int found;
+} PrintoneField;
+
+static const PrintoneField PRINTONE_FIELDS[] = {
+    {"# arenas allocated total", offsetof(PymallocStats, ntimes_arena_allocated),
+        PYMALLOC_STATS_FOUND_ARENAS_ALLOCATED},
+    {"# arenas highwater mark", offsetof(PymallocStats, narenas_highwater), PYMALLOC_STATS_FOUND_ARENAS_HIGHWATER},
+    {"# arenas allocated current", offsetof(PymallocStats, narenas), PYMALLOC_STATS_FOUND_ARENAS_CURRENT},
+    {"# bytes in allocated blocks", offsetof(PymallocStats, allocated_bytes), PYMALLOC_STATS_FOUND_ALLOCATED_BYTES},
+    {"# bytes in available blocks", offsetof(PymallocStats, available_bytes), PYMALLOC_STATS_FOUND_AVAILABLE_BYTES},
+    {"# bytes lost to pool headers", offsetof(PymallocStats, pool_header_bytes),
+        PYMALLOC_STATS_FOUND_POOL_HEADER_BYTES},
+    {"# bytes lost to quantization", offsetof(PymallocStats, quantization), PYMALLOC_STATS_FOUND_QUANTIZATION},
+    {"# bytes lost to arena alignment", offsetof(PymallocStats, arena_alignment),
+        PYMALLOC_STATS_FOUND_ARENA_ALIGNMENT},
+};
+#define PRINTONE_FIELDS_COUNT (sizeof(PRINTONE_FIELDS) / sizeof(PRINTONE_FIELDS[0]))
+
+void
+pymalloc_stats_init(PymallocStats *stats) {
+    memset(stats, 0, sizeof(PymallocStats));
+}
+
+/* Lines that start with a number, a size class or the arenas or unused pools summary. */
+static int
+parse_numeric_line(PymallocStats *stats, const char *line, size_t length) {
+    size_t values[5];
+    Cursor cursor = {line, line + length};
+    cursor_skip_spaces(&cursor);
+    if (!cursor_read_size(&cursor, &values[0], 0)) {
+        return -1;
+    }
+    cursor_skip_spaces(&cursor);
+    if (cursor_match(&cursor, "arenas * ")) {
+        /* "18 arenas * 262144 bytes/arena     =            4,718,592" */
+        if (cursor_read_size(&cursor, &stats->arena_size, 0) && cursor_match(&cursor, " bytes/arena")) {
+            stats->found |= PYMALLOC_STATS_FOUND_ARENA_SIZE;
+            return 0;
+        }
+        return -1;
+    }
+    if (cursor_match(&cursor, "unused pools * ")) {
+        /* "63 unused pools * 4096 bytes       =              258,048" */
+        if (cursor_read_size(&cursor, &stats->pool_size, 0) && cursor_match(&cursor, " bytes")) {
+            stats->numfreepools = values[0];
+            stats->found |= PYMALLOC_STATS_FOUND_UNUSED_POOLS;
+            return 0;
+        }
+        return -1;
+    }
+    /* "    0     16           2             297           209" */
+    for (int i = 1; i < 5; ++i) {
+        cursor_skip_spaces(&cursor);
+        if (!cursor_read_size(&cursor, &values[i], 0)) {
+            return -1;
+        }
+    }
+    if (!cursor_at_end(&cursor) || stats->class_count == PYMALLOC_STATS_MAX_CLASSES) {
+        return -1;
+    }
+    PymallocClassStat *class_stat = &stats->classes[stats->class_count++];
+    class_stat->block_class = values[0];
+    class_stat->size = values[1];
+    class_stat->num_pools = values[2];
+    class_stat->blocks_in_use = values[3];
+    class_stat->avail_blocks = values[4];
+    return 0;
+}
+
+/**
+ * Parse a single line of the _PyObject_DebugMallocStats() text into stats.
+ * Returns 0 if the line was recognised, -1 otherwise.
+ */
+int
+pymalloc_stats_parse_line(PymallocStats *stats, const char *line, size_t length) {
+    while (length && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+        --length;
+    }
+    Cursor cursor = {line, line + length};
+    if (cursor_match(&cursor, "Small block threshold = ")) {
+        if (cursor_read_size(&cursor, &stats->small_block_threshold, 0)
+            && cursor_match(&cursor, ", in ")
+            && cursor_read_size(&cursor, &stats->size_classes, 0)
+            && cursor_match(&cursor, " size classes.")) {
+            stats->found |= PYMALLOC_STATS_FOUND_HEADER;
+            return 0;
+        }
+        return -1;
+    }
+    for (size_t i = 0; i < PRINTONE_FIELDS_COUNT; ++i) {
+        if (starts_with(line, length, PRINTONE_FIELDS[i].label)) {
+            size_t *field = (size_t *)((char *)stats + PRINTONE_FIELDS[i].offset);
+            if (printone_value(line, length, field)) {
+                stats->found |= PRINTONE_FIELDS[i].found;
+                return 0;
+            }
+            return -1;
+        }
+    }
+    return parse_numeric_line(stats, line, length);
+}
+
+/**
+ * Parse all of the _PyObject_DebugMallocStats() text into stats, which must have been initialised.
+ * Unrecognised lines are ignored.
+ * Returns 0 if every value in PYMALLOC_STATS_FOUND_ALL was found, -1 otherwise.
+ */
+int
+pymalloc_stats_parse(PymallocStats *stats, const char *text, size_t length) {
+    const char *end = text + length;
+    while (text < end) {
+        const char *eol = memchr(text, '\n', (size_t)(end - text));
+        size_t line_length = eol ? (size_t)(eol - text) : (size_t)(end - text);
+        pymalloc_stats_parse_line(stats, text, line_length);
+        text += line_length + (eol ? 1 : 0);
+    }
+    return (stats->found & PYMALLOC_STATS_FOUND_ALL) == PYMALLOC_STATS_FOUND_ALL ? 0 : -1;
+}
+
+/**
+ * Parse a line of the _PyObject_DebugTypeStats() text such as:
+ *      "   34 free 2-sized PyTupleObjects * 40 bytes each =                1,360"
+ * Returns 0 on success, -1 if the line is not of that form.
+ */
+int
+pymalloc_type_stat_parse_line(PymallocTypeStat *type_stat, const char *line, size_t length) {
+    while (length && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+        --length;
+    }
+    Cursor cursor = {line, line + length};
+    cursor_skip_spaces(&cursor);
+    if (!cursor_read_size(&cursor, &type_stat->free_count, 0) || !cursor_match(&cursor, " free ")) {
+        return -1;
+    }
+    /* The type name may contain spaces, "2-sized PyTupleObjects", it ends at " * ". */
+    const char *name = cursor.pos;
+    while (cursor.pos < cursor.end && !cursor_match(&cursor, " * ")) {
+        ++cursor.pos;
+    }
+    if (cursor.pos == cursor.end) {
+        return -1;
+    }
+    size_t name_length = (size_t)(cursor.pos - 3 - name);
+    if (name_length >= PYMALLOC_STATS_TYPE_NAME_SIZE) {
+        name_length = PYMALLOC_STATS_TYPE_NAME_SIZE - 1;
+    }
+    memcpy(type_stat->object_type, name, name_length);
+    type_stat->object_type[name_length] = '\0';
+    if (!cursor_read_size(&cursor, &type_stat->bytes_each, 0) || !cursor_match(&cursor, " bytes each")) {
+        return -1;
+    }
+    return printone_value(cursor.pos, (size_t)(cursor.end - cursor.pos), &type_stat->bytes_total) ? 0 : -1;
+}
+
+/**
+ * The size of a pool header, the bytes lost to pool headers divided by the number of pools in use.
+ * This is how debug_malloc_stats.SysDebugMallocStats sets POOL_OVERHEAD. Returns 0 if no pools are in use.
+ */
+size_t
+pymalloc_stats_pool_overhead(const PymallocStats *stats) {
+    size_t num_pools = 0;
+    for (size_t i = 0; i < stats->class_count; ++i) {
+        num_pools += stats->classes[i].num_pools;
+    }
+    return num_pools ? stats->pool_header_bytes / num_pools : 0;
+}
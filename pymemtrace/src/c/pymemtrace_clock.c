@@ -0,0 +1,195 @@
+// Timestamp sources, see pymemtrace_clock.h
+
+#define _POSIX_C_SOURCE 200112L  // For clock_gettime() and nanosleep() in <time.h>
+
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PY_MEM_TRACE_HAVE_TSC
+#elif defined(__aarch64__)
+#define PY_MEM_TRACE_HAVE_TSC
+#endif
+
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+#include "pymemtrace_clock.h"
+
+static const char *clock_source_names[PY_MEM_TRACE_CLOCK_COUNT] = {
+    "monotonic", "monotonic_coarse", "monotonic_raw", "tsc", "mach", "cpu",
+};
+
+/* Returns the source for a name such as "monotonic" or -1 if the name is not known. */
+int
+pymemtrace_clock_source_from_name(const char *name) {
+    for (int source = 0; source < PY_MEM_TRACE_CLOCK_COUNT; ++source) {
+        if (strcmp(name, clock_source_names[source]) == 0) {
+            return source;
+        }
+    }
+    return -1;
+}
+
+const char *
+pymemtrace_clock_source_name(int source) {
+    if (source < 0 || source >= PY_MEM_TRACE_CLOCK_COUNT) {
+        return "unknown";
+    }
+    return clock_source_names[source];
+}
+
+/* Returns non-zero if the source can be used on this platform. */
+int
+pymemtrace_clock_available(int source) {
+    switch (source) {
+        case PY_MEM_TRACE_CLOCK_MONOTONIC:
+        case PY_MEM_TRACE_CLOCK_CPU:
+            return 1;
+        case PY_MEM_TRACE_CLOCK_MONOTONIC_COARSE:
+#ifdef CLOCK_MONOTONIC_COARSE
+            return 1;
+#else
+            return 0;
+#endif
+        case PY_MEM_TRACE_CLOCK_MONOTONIC_RAW:
+#ifdef CLOCK_MONOTONIC_RAW
+            return 1;
+#else
+            return 0;
+#endif
+        case PY_MEM_TRACE_CLOCK_TSC:
+#ifdef PY_MEM_TRACE_HAVE_TSC
+            return 1;
+#else
+            return 0;
+#endif
+        case PY_MEM_TRACE_CLOCK_MACH:
+#ifdef __APPLE__
+            return 1;
+#else
+            return 0;
+#endif
+        default:
+            return 0;
+    }
+}
+
+static uint64_t
+clock_gettime_ns(clockid_t clock_id) {
+    struct timespec now;
+    clock_gettime(clock_id, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+#ifdef PY_MEM_TRACE_HAVE_TSC
+static uint64_t
+read_tsc(void) {
+#if defined(__aarch64__)
+    uint64_t value;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return __rdtsc();
+#endif
+}
+
+/*
+ * The time stamp counter frequency, this is measured once against CLOCK_MONOTONIC over 20ms.
+ * Not thread safe, the first call should be made with the GIL held.
+ */
+static uint64_t
+tsc_ticks_per_second(void) {
+    static uint64_t ticks_per_second = 0;
+    if (ticks_per_second == 0) {
+#if defined(__aarch64__)
+        uint64_t frequency;
+        __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(frequency));
+        ticks_per_second = frequency;
+#else
+        struct timespec delay = {0, 20 * 1000 * 1000};
+        uint64_t start_ns = clock_gettime_ns(CLOCK_MONOTONIC);
+        uint64_t start_ticks = read_tsc();
+        nanosleep(&delay, NULL);
+        uint64_t end_ticks = read_tsc();
+        uint64_t end_ns = clock_gettime_ns(CLOCK_MONOTONIC);
+        ticks_per_second = (uint64_t)((double)(end_ticks - start_ticks) * 1e9 / (double)(end_ns - start_ns));
+#endif
+    }
+    return ticks_per_second;
+}
+#endif
+
+/* The current value of the clock in ticks. */
+uint64_t
+pymemtrace_clock_ticks(const PyMemTraceClock *trace_clock) {
+    switch (trace_clock->source) {
+#ifdef CLOCK_MONOTONIC_COARSE
+        case PY_MEM_TRACE_CLOCK_MONOTONIC_COARSE:
+            return clock_gettime_ns(CLOCK_MONOTONIC_COARSE);
+#endif
+#ifdef CLOCK_MONOTONIC_RAW
+        case PY_MEM_TRACE_CLOCK_MONOTONIC_RAW:
+            return clock_gettime_ns(CLOCK_MONOTONIC_RAW);
+#endif
+#ifdef PY_MEM_TRACE_HAVE_TSC
+        case PY_MEM_TRACE_CLOCK_TSC:
+            return read_tsc();
+#endif
+#ifdef __APPLE__
+        case PY_MEM_TRACE_CLOCK_MACH:
+            return mach_absolute_time();
+#endif
+        case PY_MEM_TRACE_CLOCK_CPU:
+            return (uint64_t)clock();
+        default:
+            return clock_gettime_ns(CLOCK_MONOTONIC);
+    }
+}
+
+/**
+ * Initialise the clock and its anchor.
+ * Returns 0 on success, non-zero if the source is not available on this platform.
+ */
+int
+pymemtrace_clock_init(PyMemTraceClock *trace_clock, int source) {
+    if (! pymemtrace_clock_available(source)) {
+        return -1;
+    }
+    trace_clock->source = source;
+    switch (source) {
+#ifdef PY_MEM_TRACE_HAVE_TSC
+        case PY_MEM_TRACE_CLOCK_TSC:
+            trace_clock->ticks_per_second = tsc_ticks_per_second();
+            break;
+#endif
+#ifdef __APPLE__
+        case PY_MEM_TRACE_CLOCK_MACH: {
+            mach_timebase_info_data_t timebase;
+            mach_timebase_info(&timebase);
+            /* mach_absolute_time() * numer / denom is nanoseconds. */
+            trace_clock->ticks_per_second = (uint64_t)(1e9 * timebase.denom / timebase.numer);
+            break;
+        }
+#endif
+        case PY_MEM_TRACE_CLOCK_CPU:
+            trace_clock->ticks_per_second = CLOCKS_PER_SEC;
+            break;
+        default:
+            trace_clock->ticks_per_second = 1000000000ULL;
+            break;
+    }
+    trace_clock->seconds_per_tick = 1.0 / (double)trace_clock->ticks_per_second;
+    trace_clock->anchor_ticks = pymemtrace_clock_ticks(trace_clock);
+    trace_clock->anchor_wall_ns = (int64_t)clock_gettime_ns(CLOCK_REALTIME);
+    return 0;
+}
+
+/* Convert ticks to seconds since the anchor. */
+double
+pymemtrace_clock_seconds(const PyMemTraceClock *trace_clock, uint64_t ticks) {
+    /* Signed as the time stamp counters of different cores may be slightly out of step. */
+    return (double)(int64_t)(ticks - trace_clock->anchor_ticks) * trace_clock->seconds_per_tick;
+}
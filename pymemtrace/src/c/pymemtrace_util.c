@@ -11,32 +11,81 @@
 
 #include "pymemtrace_util.h"
 
-#define PATH_MAX 4096
-
-char *create_filename(void) {
-    /* Not thread safe. */
-    static char filename[256];
-    static struct tm now;
-    time_t t = time(NULL);
-    gmtime_r(&t, &now);
-    size_t len = strftime(filename, 256, "%Y%m%d_%H%M%S", &now);
+/**
+ * Writes a file name of the form "YYYYmmdd_HHMMSS_<PID>.<extension>" to buffer which has size bytes.
+ * The time is start, in UTC.
+ * If thread_id is non-zero the name is "YYYYmmdd_HHMMSS_<PID>_<thread_id>.<extension>".
+ * If sequence is >= 0 it is added before the extension as "-<sequence>" with six digits so that the segments of a
+ * rotated log file sort in order, for example "YYYYmmdd_HHMMSS_<PID>-000001.<extension>".
+ * This is reentrant. Returns 0 on success, -1 on failure or if the name does not fit.
+ */
+int create_filename(char *buffer, size_t size, const char *extension, unsigned long thread_id, time_t start,
+                    long sequence) {
+    struct tm now;
+    gmtime_r(&start, &now);
+    size_t len = strftime(buffer, size, "%Y%m%d_%H%M%S", &now);
     if (len == 0) {
         fprintf(stderr, "create_filename(): strftime failed.");
-        return NULL;
+        return -1;
     }
     pid_t pid = getpid();
-    if (snprintf(filename + len, 256 - len - 1, "_%d.log", pid) == 0) {
+    int written;
+    if (thread_id) {
+        written = snprintf(buffer + len, size - len, "_%d_%lu", pid, thread_id);
+    } else {
+        written = snprintf(buffer + len, size - len, "_%d", pid);
+    }
+    if (written <= 0 || (size_t)written >= size - len) {
         fprintf(stderr, "create_filename(): failed to add PID.");
-        return NULL;
+        return -1;
+    }
+    len += (size_t)written;
+    if (sequence >= 0) {
+        written = snprintf(buffer + len, size - len, "-%06ld.%s", sequence, extension);
+    } else {
+        written = snprintf(buffer + len, size - len, ".%s", extension);
+    }
+    if (written <= 0 || (size_t)written >= size - len) {
+        fprintf(stderr, "create_filename(): failed to add extension.");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the path of a log file named by create_filename() to buffer which has size bytes.
+ * The log file is in directory or, if that is NULL or empty, the current working directory.
+ * This is reentrant. Returns 0 on success, -1 on failure or if the path does not fit.
+ */
+int create_log_path(char *buffer, size_t size, const char *directory, const char *extension, unsigned long thread_id,
+                    time_t start, long sequence) {
+    char filename[PYMEMTRACE_FILENAME_MAX];
+    if (create_filename(filename, sizeof(filename), extension, thread_id, start, sequence)) {
+        return -1;
+    }
+    char cwd[PYMEMTRACE_PATH_MAX];
+    if (directory == NULL || directory[0] == '\0') {
+        if (current_working_directory(cwd, sizeof(cwd))) {
+            return -1;
+        }
+        directory = cwd;
+    }
+    int written = snprintf(buffer, size, "%s%c%s", directory, PYMEMTRACE_PATH_SEPARATOR, filename);
+    if (written <= 0 || (size_t)written >= size) {
+        fprintf(stderr, "create_log_path(): path too long.\n");
+        return -1;
     }
-    return filename;
+    return 0;
 }
 
-char *current_working_directory(void) {
-    static char cwd[PATH_MAX];
-    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+/**
+ * Writes the current working directory to buffer which has size bytes.
+ * Returns 0 on success, -1 on failure.
+ */
+int current_working_directory(char *buffer, size_t size) {
+    if (getcwd(buffer, size) == NULL) {
         fprintf(stderr, "Can not get current working directory.\n");
-        return NULL;
+        return -1;
     }
-    return cwd;
+    return 0;
 }
@@ -0,0 +1,218 @@
+// The resident bytes of registered address ranges, see region_residency.h
+//
+// Regions are kept in the order that they were added, there are expected to be a few of them so lookup is linear.
+// A region is scanned in chunks of REGION_RESIDENCY_CHUNK_PAGES so that the residency vector is on the stack whatever
+// the size of the region.
+
+#define _DEFAULT_SOURCE  // For mincore()
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "region_residency.h"
+
+#if defined(_WIN32)
+    #include <windows.h>
+    #include <psapi.h>
+#else
+    #include <unistd.h>
+    #include <sys/mman.h>
+#endif
+
+/* Pages scanned with each call to mincore() or QueryWorkingSetEx(). */
+#define REGION_RESIDENCY_CHUNK_PAGES 1024
+
+static size_t
+region_residency_page_size(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (size_t)info.dwPageSize;
+#else
+    long page_size = sysconf(_SC_PAGESIZE);
+    return page_size > 0 ? (size_t)page_size : 4096;
+#endif
+}
+
+/*
+ * The number of resident pages of page_count pages from the page aligned address, at most
+ * REGION_RESIDENCY_CHUNK_PAGES. Pages that are no longer mapped, a buffer freed while it was registered, are not
+ * resident.
+ */
+static size_t
+region_residency_chunk(uintptr_t address, size_t page_count, size_t page_size) {
+    size_t resident = 0;
+#if defined(_WIN32)
+    PSAPI_WORKING_SET_EX_INFORMATION info[REGION_RESIDENCY_CHUNK_PAGES];
+    for (size_t i = 0; i < page_count; ++i) {
+        info[i].VirtualAddress = (PVOID)(address + i * page_size);
+    }
+    if (! QueryWorkingSetEx(GetCurrentProcess(), info, (DWORD)(page_count * sizeof(info[0])))) {
+        return 0;
+    }
+    for (size_t i = 0; i < page_count; ++i) {
+        resident += info[i].VirtualAttributes.Valid;
+    }
+#else
+#if defined(__APPLE__) && defined(__MACH__)
+    char vector[REGION_RESIDENCY_CHUNK_PAGES];
+#else
+    unsigned char vector[REGION_RESIDENCY_CHUNK_PAGES];
+#endif
+    if (mincore((void *)address, page_count * page_size, vector)) {
+        return 0;
+    }
+    for (size_t i = 0; i < page_count; ++i) {
+        resident += vector[i] & 1;
+    }
+#endif
+    return resident;
+}
+
+/* Scan one region, setting resident_bytes and clearing touched. */
+static void
+region_residency_scan_region(RegionResidencyTable *table, RegionResidency *region) {
+    uintptr_t start = region->address & ~((uintptr_t)table->page_size - 1);
+    uintptr_t end = region->address + region->size;
+    size_t pages = (end - start + table->page_size - 1) / table->page_size;
+    size_t resident = 0;
+    for (size_t page = 0; page < pages; page += REGION_RESIDENCY_CHUNK_PAGES) {
+        size_t page_count = pages - page < REGION_RESIDENCY_CHUNK_PAGES ? pages - page : REGION_RESIDENCY_CHUNK_PAGES;
+        resident += region_residency_chunk(start + page * table->page_size, page_count, table->page_size);
+    }
+    region->resident_bytes = resident * table->page_size;
+    region->touched = 0;
+    table->scans++;
+    table->pages_scanned += pages;
+}
+
+static RegionResidency *
+region_residency_find(RegionResidencyTable *table, const void *address) {
+    for (size_t i = 0; i < table->count; ++i) {
+        if (table->regions[i].address == (uintptr_t)address) {
+            return &table->regions[i];
+        }
+    }
+    return NULL;
+}
+
+void
+region_residency_init(RegionResidencyTable *table) {
+    memset(table, 0, sizeof(RegionResidencyTable));
+    table->page_size = region_residency_page_size();
+}
+
+void
+region_residency_free(RegionResidencyTable *table) {
+    free(table->regions);
+    region_residency_init(table);
+}
+
+/**
+ * Register the range of size bytes from address, replacing any region that starts at the same address.
+ * The label is truncated to REGION_RESIDENCY_LABEL_MAX - 1 bytes, if it is NULL or empty it is the address in hex.
+ * Returns 0 on success, -1 if the table can not be extended.
+ */
+int
+region_residency_add(RegionResidencyTable *table, const void *address, size_t size, const char *label) {
+    RegionResidency *region = region_residency_find(table, address);
+    if (region == NULL) {
+        if (table->count == table->capacity) {
+            size_t capacity = table->capacity ? table->capacity * 2 : 8;
+            RegionResidency *regions = realloc(table->regions, capacity * sizeof(RegionResidency));
+            if (regions == NULL) {
+                return -1;
+            }
+            table->regions = regions;
+            table->capacity = capacity;
+        }
+        region = &table->regions[table->count++];
+    }
+    region->address = (uintptr_t)address;
+    region->size = size;
+    if (label && label[0]) {
+        snprintf(region->label, REGION_RESIDENCY_LABEL_MAX, "%s", label);
+    } else {
+        snprintf(region->label, REGION_RESIDENCY_LABEL_MAX, "0x%" PRIxPTR, region->address);
+    }
+    region->resident_bytes = REGION_RESIDENCY_UNKNOWN;
+    region->reported_bytes = REGION_RESIDENCY_UNKNOWN;
+    region->touched = 1;
+    return 0;
+}
+
+/**
+ * Remove the region that starts at address, keeping the others in order.
+ * Returns 0 if it was removed, 1 if there is no such region.
+ */
+int
+region_residency_remove(RegionResidencyTable *table, const void *address) {
+    RegionResidency *region = region_residency_find(table, address);
+    if (region == NULL) {
+        return 1;
+    }
+    size_t index = (size_t)(region - table->regions);
+    memmove(region, region + 1, (table->count - index - 1) * sizeof(RegionResidency));
+    table->count--;
+    return 0;
+}
+
+/**
+ * Mark every region that contains address as touched so that the next scan rescans it.
+ * Returns 0 if there is such a region, 1 if there is none.
+ */
+int
+region_residency_touch(RegionResidencyTable *table, const void *address) {
+    int result = 1;
+    for (size_t i = 0; i < table->count; ++i) {
+        RegionResidency *region = &table->regions[i];
+        if ((uintptr_t)address >= region->address && (uintptr_t)address - region->address < region->size) {
+            region->touched = 1;
+            result = 0;
+        }
+    }
+    return result;
+}
+
+void
+region_residency_touch_all(RegionResidencyTable *table) {
+    for (size_t i = 0; i < table->count; ++i) {
+        table->regions[i].touched = 1;
+    }
+}
+
+/**
+ * Scan the regions that have been touched since their last scan.
+ * Returns the number of regions scanned.
+ */
+size_t
+region_residency_scan(RegionResidencyTable *table) {
+    size_t scanned = 0;
+    for (size_t i = 0; i < table->count; ++i) {
+        if (table->regions[i].touched) {
+            region_residency_scan_region(table, &table->regions[i]);
+            scanned++;
+        }
+    }
+    return scanned;
+}
+
+/**
+ * Iterate over the regions whose resident_bytes from the last scan differ from those last reported, marking them as
+ * reported. *index starts at 0 and is updated by each call.
+ * Returns the next such region or NULL when there are no more.
+ */
+RegionResidency *
+region_residency_changed(RegionResidencyTable *table, size_t *index) {
+    for (; *index < table->count; ++*index) {
+        RegionResidency *region = &table->regions[*index];
+        if (region->resident_bytes != REGION_RESIDENCY_UNKNOWN && region->resident_bytes != region->reported_bytes) {
+            region->reported_bytes = region->resident_bytes;
+            ++*index;
+            return region;
+        }
+    }
+    return NULL;
+}
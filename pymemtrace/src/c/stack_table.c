@@ -0,0 +1,148 @@
+// Open addressing hash table with linear probing keyed on (parent_id, code, line_number), see stack_table.h.
+// A NULL code is not a valid key as it marks an empty slot.
+// Only the entry last added can be removed, the table grows when it is half full.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stack_table.h"
+
+static size_t
+stack_table_hash(uint32_t parent_id, const void *code, int32_t line_number) {
+    /* As call_site_table_hash() with the parent mixed in. */
+    uint64_t value = (uint64_t)(uintptr_t)code ^ ((uint64_t)(uint32_t)line_number << 32);
+    value ^= (uint64_t)parent_id * 0xC2B2AE3D27D4EB4FULL;
+    value ^= value >> 33;
+    value *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(value ^ (value >> 29));
+}
+
+static StackTableEntry *
+stack_table_find(StackTableEntry *entries, size_t capacity, uint32_t parent_id, const void *code,
+                 int32_t line_number) {
+    size_t mask = capacity - 1;
+    size_t index = stack_table_hash(parent_id, code, line_number) & mask;
+    while (entries[index].code != NULL
+           && (entries[index].code != code || entries[index].line_number != line_number
+               || entries[index].parent_id != parent_id)) {
+        index = (index + 1) & mask;
+    }
+    return entries + index;
+}
+
+static int
+stack_table_grow(StackTable *table) {
+    size_t new_capacity = table->capacity * 2;
+    StackTableEntry *new_entries = calloc(new_capacity, sizeof(StackTableEntry));
+    if (new_entries == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < table->capacity; ++i) {
+        const StackTableEntry *entry = table->entries + i;
+        if (entry->code) {
+            *stack_table_find(new_entries, new_capacity, entry->parent_id, entry->code, entry->line_number) = *entry;
+        }
+    }
+    free(table->entries);
+    table->entries = new_entries;
+    table->capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Initialise an empty table, capacity is rounded up to a power of two.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+stack_table_init(StackTable *table, size_t capacity) {
+    table->capacity = 16;
+    while (table->capacity < capacity) {
+        table->capacity <<= 1;
+    }
+    table->size = 0;
+    table->entries = calloc(table->capacity, sizeof(StackTableEntry));
+    return table->entries == NULL ? -1 : 0;
+}
+
+void
+stack_table_free(StackTable *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = 0;
+    table->size = 0;
+}
+
+/**
+ * Remove every entry, the next id is 1 again.
+ */
+void
+stack_table_clear(StackTable *table) {
+    if (table->entries) {
+        memset(table->entries, 0, table->capacity * sizeof(StackTableEntry));
+    }
+    table->size = 0;
+}
+
+/**
+ * Returns the id of the stack that is the frame (code, line_number) called from the stack parent_id, adding it if it
+ * is not present. is_new is set non-zero if it was added.
+ * Returns 0 on failure, 0 is never a valid id.
+ */
+uint32_t
+stack_table_get(StackTable *table, uint32_t parent_id, const void *code, int32_t line_number, int *is_new) {
+    *is_new = 0;
+    if (code == NULL || table->entries == NULL) {
+        return 0;
+    }
+    StackTableEntry *entry = stack_table_find(table->entries, table->capacity, parent_id, code, line_number);
+    if (entry->code) {
+        return entry->id;
+    }
+    if (2 * (table->size + 1) > table->capacity) {
+        if (stack_table_grow(table)) {
+            return 0;
+        }
+        entry = stack_table_find(table->entries, table->capacity, parent_id, code, line_number);
+    }
+    entry->code = code;
+    entry->line_number = line_number;
+    entry->parent_id = parent_id;
+    entry->id = (uint32_t)(++table->size);
+    *is_new = 1;
+    return entry->id;
+}
+
+/**
+ * Remove the entry that was last added by stack_table_get(), such as when its record could not be written, so that its
+ * id is given to the next entry that is added.
+ * The entries after it in its probe sequence are moved back so that they can still be found.
+ */
+void
+stack_table_remove(StackTable *table, uint32_t parent_id, const void *code, int32_t line_number) {
+    if (code == NULL || table->entries == NULL) {
+        return;
+    }
+    StackTableEntry *entry = stack_table_find(table->entries, table->capacity, parent_id, code, line_number);
+    if (entry->code == NULL || entry->id != table->size) {
+        return;
+    }
+    size_t mask = table->capacity - 1;
+    size_t hole = (size_t)(entry - table->entries);
+    size_t index = hole;
+    table->entries[hole].code = NULL;
+    table->size--;
+    while (1) {
+        index = (index + 1) & mask;
+        StackTableEntry *next = table->entries + index;
+        if (next->code == NULL) {
+            break;
+        }
+        size_t home = stack_table_hash(next->parent_id, next->code, next->line_number) & mask;
+        /* Move it into the hole unless its home slot is cyclically after the hole. */
+        if (((index - home) & mask) >= ((index - hole) & mask)) {
+            table->entries[hole] = *next;
+            next->code = NULL;
+            hole = index;
+        }
+    }
+}
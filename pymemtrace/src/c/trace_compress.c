@@ -0,0 +1,212 @@
+// Streaming gzip compression with zlib, see trace_compress.h
+//
+// A TraceCompressor is used by one thread at a time, in cPyMemTrace that is the ring buffer writer thread apart from
+// when the ring buffer has been flushed or closed.
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace_compress.h"
+
+/* windowBits for a gzip wrapper, and for inflate to detect either a gzip or a zlib wrapper. */
+#define TRACE_COMPRESS_GZIP_WINDOW_BITS (15 + 16)
+#define TRACE_COMPRESS_DETECT_WINDOW_BITS (15 + 32)
+
+/**
+ * Start a gzip stream that is written to file, level is the zlib compression level.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+trace_compress_open(TraceCompressor *compressor, FILE *file, int level) {
+    memset(&compressor->stream, 0, sizeof(compressor->stream));
+    compressor->file = file;
+    compressor->block_input = 0;
+    compressor->bytes_in = 0;
+    compressor->bytes_out = 0;
+    if (deflateInit2(&compressor->stream, level, Z_DEFLATED, TRACE_COMPRESS_GZIP_WINDOW_BITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        compressor->is_open = 0;
+        return -1;
+    }
+    compressor->is_open = 1;
+    return 0;
+}
+
+/*
+ * Compress the input, which may be empty, with the given flush and write the output to the file.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+deflate_to_file(TraceCompressor *compressor, const unsigned char *data, size_t size, int flush) {
+    z_stream *stream = &compressor->stream;
+    stream->next_in = (Bytef *)data;
+    stream->avail_in = (uInt)size;
+    int ret;
+    do {
+        stream->next_out = compressor->buffer;
+        stream->avail_out = TRACE_COMPRESS_BUFFER_SIZE;
+        ret = deflate(stream, flush);
+        if (ret == Z_STREAM_ERROR) {
+            return -1;
+        }
+        size_t have = TRACE_COMPRESS_BUFFER_SIZE - stream->avail_out;
+        if (have && fwrite(compressor->buffer, 1, have, compressor->file) != have) {
+            return -1;
+        }
+        compressor->bytes_out += have;
+    } while (stream->avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    compressor->bytes_in += size;
+    return 0;
+}
+
+/**
+ * Compress data and write it to the file, the stream is sync flushed every TRACE_COMPRESS_BLOCK_SIZE bytes of input.
+ * This matches trace_ring_buffer_sink, it returns the number of bytes of data consumed.
+ */
+size_t
+trace_compress_write(TraceCompressor *compressor, const void *data, size_t size) {
+    const unsigned char *input = data;
+    size_t remaining = size;
+    if (! compressor->is_open) {
+        return 0;
+    }
+    while (remaining) {
+        size_t chunk = TRACE_COMPRESS_BLOCK_SIZE - compressor->block_input;
+        if (chunk > remaining) {
+            chunk = remaining;
+        }
+        if (deflate_to_file(compressor, input, chunk, Z_NO_FLUSH)) {
+            break;
+        }
+        compressor->block_input += chunk;
+        input += chunk;
+        remaining -= chunk;
+        if (compressor->block_input >= TRACE_COMPRESS_BLOCK_SIZE) {
+            if (deflate_to_file(compressor, NULL, 0, Z_SYNC_FLUSH)) {
+                break;
+            }
+            compressor->block_input = 0;
+        }
+    }
+    return size - remaining;
+}
+
+/**
+ * Write out everything compressed so far, with a sync flush, and flush the file.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+trace_compress_flush(TraceCompressor *compressor) {
+    if (! compressor->is_open) {
+        return -1;
+    }
+    if (compressor->block_input) {
+        if (deflate_to_file(compressor, NULL, 0, Z_SYNC_FLUSH)) {
+            return -1;
+        }
+        compressor->block_input = 0;
+    }
+    return fflush(compressor->file) ? -1 : 0;
+}
+
+/**
+ * Finish the gzip stream and free the compressor. The file is not closed, that is the responsibility of the caller.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+trace_compress_close(TraceCompressor *compressor) {
+    if (! compressor->is_open) {
+        return 0;
+    }
+    int result = deflate_to_file(compressor, NULL, 0, Z_FINISH);
+    deflateEnd(&compressor->stream);
+    compressor->is_open = 0;
+    return result;
+}
+
+/**
+ * Free the compressor without writing anything, such as in the child of a fork() where the file is the parent's.
+ */
+void
+trace_compress_abandon(TraceCompressor *compressor) {
+    if (compressor->is_open) {
+        deflateEnd(&compressor->stream);
+        compressor->is_open = 0;
+    }
+}
+
+/**
+ * Returns non-zero if data starts with the gzip magic number.
+ */
+int
+trace_compress_is_compressed(const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    return size >= 2 && bytes[0] == 0x1f && bytes[1] == 0x8b;
+}
+
+/**
+ * Decompress all of data, which may be several concatenated gzip members, into a new buffer that the caller must
+ * free(). A truncated stream, such as a log file that is still being written, gives everything up to where it ends.
+ * Returns 0 on success, -1 if data is corrupt or on memory failure.
+ */
+int
+trace_decompress(const void *data, size_t size, unsigned char **output, size_t *output_size) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, TRACE_COMPRESS_DETECT_WINDOW_BITS) != Z_OK) {
+        return -1;
+    }
+    const unsigned char *input = data;
+    size_t remaining = size;
+    size_t capacity = size < 8 * 1024 ? 64 * 1024 : size * 8;
+    size_t length = 0;
+    unsigned char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        goto except;
+    }
+    while (1) {
+        if (stream.avail_in == 0 && remaining) {
+            size_t chunk = remaining > UINT_MAX ? UINT_MAX : remaining;
+            stream.next_in = (Bytef *)input;
+            stream.avail_in = (uInt)chunk;
+            input += chunk;
+            remaining -= chunk;
+        }
+        if (length == capacity) {
+            unsigned char *new_buffer = realloc(buffer, capacity * 2);
+            if (new_buffer == NULL) {
+                goto except;
+            }
+            buffer = new_buffer;
+            capacity *= 2;
+        }
+        size_t space = capacity - length > UINT_MAX ? UINT_MAX : capacity - length;
+        stream.next_out = buffer + length;
+        stream.avail_out = (uInt)space;
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        length += space - stream.avail_out;
+        if (ret == Z_STREAM_END) {
+            if (stream.avail_in == 0 && remaining == 0) {
+                break;
+            }
+            /* Another gzip member follows. */
+            inflateReset(&stream);
+        } else if (ret == Z_OK || ret == Z_BUF_ERROR) {
+            /* No more input and room for more output means the stream is truncated. */
+            if (stream.avail_in == 0 && remaining == 0 && stream.avail_out != 0) {
+                break;
+            }
+        } else {
+            goto except;
+        }
+    }
+    inflateEnd(&stream);
+    *output = buffer;
+    *output_size = length;
+    return 0;
+except:
+    inflateEnd(&stream);
+    free(buffer);
+    return -1;
+}
@@ -0,0 +1,143 @@
+// Open addressing hash table with linear probing, see trace_diff_table.h
+// A NULL key is not a valid key as it marks an empty slot.
+// There is no removal, the table grows when it is half full.
+
+#include <stdlib.h>
+
+#include "trace_diff_table.h"
+
+static TraceDiffEntry *
+trace_diff_table_find(const TraceDiffTable *table, TraceDiffEntry *entries, size_t capacity, const void *key,
+                      uint64_t hash) {
+    size_t mask = capacity - 1;
+    size_t index = (size_t)hash & mask;
+    while (entries[index].key != NULL
+           && entries[index].key != key
+           && (entries[index].hash != hash || ! table->equal(entries[index].key, key))) {
+        index = (index + 1) & mask;
+    }
+    return entries + index;
+}
+
+static int
+trace_diff_table_grow(TraceDiffTable *table) {
+    size_t new_capacity = table->capacity * 2;
+    TraceDiffEntry *new_entries = calloc(new_capacity, sizeof(TraceDiffEntry));
+    if (new_entries == NULL) {
+        return -1;
+    }
+    size_t mask = new_capacity - 1;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        const TraceDiffEntry *entry = table->entries + i;
+        if (entry->key) {
+            /* Keys are unique so an empty slot is all that is needed. */
+            size_t index = (size_t)entry->hash & mask;
+            while (new_entries[index].key) {
+                index = (index + 1) & mask;
+            }
+            new_entries[index] = *entry;
+        }
+    }
+    free(table->entries);
+    table->entries = new_entries;
+    table->capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Initialise an empty table, capacity is rounded up to a power of two.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+trace_diff_table_init(TraceDiffTable *table, size_t capacity, trace_diff_key_equal equal) {
+    table->capacity = 16;
+    while (table->capacity < capacity) {
+        table->capacity <<= 1;
+    }
+    table->size = 0;
+    table->equal = equal;
+    table->entries = calloc(table->capacity, sizeof(TraceDiffEntry));
+    return table->entries == NULL ? -1 : 0;
+}
+
+void
+trace_diff_table_free(TraceDiffTable *table) {
+    free(table->entries);
+    table->entries = NULL;
+    table->capacity = 0;
+    table->size = 0;
+}
+
+/**
+ * Returns the entry for key, adding an empty one if it is not present, or NULL on failure.
+ * is_new is set non-zero if the entry was added, the caller may then replace the key with an equal one that it owns.
+ * The pointer is only valid until the next call as the table may grow.
+ */
+TraceDiffEntry *
+trace_diff_table_get(TraceDiffTable *table, const void *key, uint64_t hash, int *is_new) {
+    *is_new = 0;
+    if (key == NULL) {
+        return NULL;
+    }
+    TraceDiffEntry *entry = trace_diff_table_find(table, table->entries, table->capacity, key, hash);
+    if (entry->key) {
+        return entry;
+    }
+    if (2 * (table->size + 1) > table->capacity) {
+        if (trace_diff_table_grow(table)) {
+            return NULL;
+        }
+        entry = trace_diff_table_find(table, table->entries, table->capacity, key, hash);
+    }
+    entry->key = key;
+    entry->hash = hash;
+    table->size++;
+    *is_new = 1;
+    return entry;
+}
+
+static uint64_t
+abs_int64(int64_t value) {
+    return value < 0 ? (uint64_t)0 - (uint64_t)value : (uint64_t)value;
+}
+
+/* As tracemalloc.StatisticDiff._sort_key, largest first. */
+static int
+trace_diff_compare(const void *a, const void *b) {
+    const TraceDiffEntry *entry_a = *(const TraceDiffEntry **)a;
+    const TraceDiffEntry *entry_b = *(const TraceDiffEntry **)b;
+    uint64_t value_a = abs_int64(entry_a->size_diff);
+    uint64_t value_b = abs_int64(entry_b->size_diff);
+    if (value_a != value_b) {
+        return value_a > value_b ? -1 : 1;
+    }
+    if (entry_a->size != entry_b->size) {
+        return entry_a->size > entry_b->size ? -1 : 1;
+    }
+    value_a = abs_int64(entry_a->count_diff);
+    value_b = abs_int64(entry_b->count_diff);
+    if (value_a != value_b) {
+        return value_a > value_b ? -1 : 1;
+    }
+    return (entry_a->count < entry_b->count) - (entry_a->count > entry_b->count);
+}
+
+/**
+ * Returns a new array of table->size pointers to the entries, largest absolute change in size first, or NULL on
+ * failure. The caller frees this.
+ */
+const TraceDiffEntry **
+trace_diff_table_sorted(const TraceDiffTable *table) {
+    const TraceDiffEntry **sorted = malloc((table->size + 1) * sizeof(TraceDiffEntry *));
+    if (sorted == NULL) {
+        return NULL;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < table->capacity; ++i) {
+        if (table->entries[i].key) {
+            sorted[count++] = table->entries + i;
+        }
+    }
+    qsort(sorted, count, sizeof(TraceDiffEntry *), trace_diff_compare);
+    return sorted;
+}
@@ -0,0 +1,153 @@
+// Include and exclude patterns for cPyMemTrace, see trace_filter.h.
+// An empty filter traces everything. Otherwise a code object is traced if there are no include patterns or one of them
+// matches, and none of the exclude patterns match.
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace_filter.h"
+
+static int
+starts_with(const char *text, const char *prefix) {
+    return strncmp(text, prefix, strlen(prefix)) == 0;
+}
+
+static char *
+copy_string(const char *text) {
+    size_t size = strlen(text) + 1;
+    char *result = malloc(size);
+    if (result) {
+        memcpy(result, text, size);
+    }
+    return result;
+}
+
+/* A module prefix matches the module and its submodules, "a.b" matches "a.b" and "a.b.c" but not "a.bc". */
+static int
+module_match(const char *prefix, const char *module_name) {
+    size_t length = strlen(prefix);
+    return strncmp(module_name, prefix, length) == 0 && (module_name[length] == '\0' || module_name[length] == '.');
+}
+
+/**
+ * Add a pattern that is either included or excluded. The pattern can start with "file:", "module:" or "function:"
+ * to select what it matches, the file name if none of these.
+ * Returns 0 on success, non-zero on memory failure.
+ */
+int
+trace_filter_add(TraceFilter *filter, const char *pattern, int include) {
+    TraceFilterPattern entry = {TRACE_FILTER_FILE, include != 0, NULL};
+    if (starts_with(pattern, TRACE_FILTER_PREFIX_FILE)) {
+        pattern += strlen(TRACE_FILTER_PREFIX_FILE);
+    } else if (starts_with(pattern, TRACE_FILTER_PREFIX_MODULE)) {
+        entry.field = TRACE_FILTER_MODULE;
+        pattern += strlen(TRACE_FILTER_PREFIX_MODULE);
+    } else if (starts_with(pattern, TRACE_FILTER_PREFIX_FUNCTION)) {
+        entry.field = TRACE_FILTER_FUNCTION;
+        pattern += strlen(TRACE_FILTER_PREFIX_FUNCTION);
+    }
+    entry.text = copy_string(pattern);
+    if (entry.text == NULL) {
+        return -1;
+    }
+    TraceFilterPattern *patterns = realloc(filter->patterns, (filter->count + 1) * sizeof(TraceFilterPattern));
+    if (patterns == NULL) {
+        free(entry.text);
+        return -1;
+    }
+    patterns[filter->count++] = entry;
+    filter->patterns = patterns;
+    if (include) {
+        filter->include_count++;
+    }
+    return 0;
+}
+
+/**
+ * Make dst a copy of src, dst should be empty.
+ * Returns 0 on success, non-zero on memory failure when dst is left empty.
+ */
+int
+trace_filter_copy(TraceFilter *dst, const TraceFilter *src) {
+    memset(dst, 0, sizeof(TraceFilter));
+    if (src->count == 0) {
+        return 0;
+    }
+    dst->patterns = malloc(src->count * sizeof(TraceFilterPattern));
+    if (dst->patterns == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < src->count; ++i) {
+        dst->patterns[i] = src->patterns[i];
+        dst->patterns[i].text = copy_string(src->patterns[i].text);
+        if (dst->patterns[i].text == NULL) {
+            trace_filter_free(dst);
+            return -1;
+        }
+        dst->count++;
+    }
+    dst->include_count = src->include_count;
+    dst->generation = src->generation;
+    return 0;
+}
+
+/**
+ * Free the patterns, the filter is then empty.
+ */
+void
+trace_filter_free(TraceFilter *filter) {
+    for (size_t i = 0; i < filter->count; ++i) {
+        free(filter->patterns[i].text);
+    }
+    free(filter->patterns);
+    memset(filter, 0, sizeof(TraceFilter));
+}
+
+/**
+ * Returns non-zero if any pattern matches the module name, the caller need not find the module name otherwise.
+ */
+int
+trace_filter_uses_module(const TraceFilter *filter) {
+    for (size_t i = 0; i < filter->count; ++i) {
+        if (filter->patterns[i].field == TRACE_FILTER_MODULE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns non-zero if a code object with these names should be traced. Any name can be NULL if it is not known, no
+ * pattern for that field then matches.
+ */
+int
+trace_filter_match(const TraceFilter *filter, const char *file_name, const char *module_name,
+                   const char *function_name) {
+    int included = filter->include_count == 0;
+    for (size_t i = 0; i < filter->count; ++i) {
+        const TraceFilterPattern *entry = filter->patterns + i;
+        int match = 0;
+        switch (entry->field) {
+            case TRACE_FILTER_FILE:
+                match = file_name && fnmatch(entry->text, file_name, 0) == 0;
+                break;
+            case TRACE_FILTER_MODULE:
+                match = module_name && module_match(entry->text, module_name);
+                break;
+            case TRACE_FILTER_FUNCTION:
+                match = function_name && fnmatch(entry->text, function_name, 0) == 0;
+                break;
+            default:
+                break;
+        }
+        if (match) {
+            if (! entry->include) {
+                /* Any exclude wins. */
+                return 0;
+            }
+            included = 1;
+        }
+    }
+    return included;
+}
@@ -0,0 +1,124 @@
+// Append only log file written through a shared mapping, see trace_mapped_file.h
+//
+// Space is reserved with posix_fallocate() on Linux so that a full file system fails when the file is extended rather
+// than with SIGBUS on a store to the mapping. Elsewhere the file is extended with ftruncate().
+// The mapping is replaced rather than remapped when the file is extended, the new mapping is made before the old one
+// is unmapped so a failure leaves the file as it was.
+
+#define _POSIX_C_SOURCE 200809L  // For posix_fallocate() and ftruncate()
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trace_mapped_file.h"
+
+/* Extend the file, and the mapping, to size bytes. Returns 0 on success, -1 on failure with the file unchanged. */
+static int
+trace_mapped_file_resize(TraceMappedFile *file, size_t size) {
+#if defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
+    if (posix_fallocate(file->fd, 0, (off_t)size)) {
+        return -1;
+    }
+#else
+    if (ftruncate(file->fd, (off_t)size)) {
+        return -1;
+    }
+#endif
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    if (file->data) {
+        munmap(file->data, file->size);
+    }
+    file->data = data;
+    file->size = size;
+    return 0;
+}
+
+/**
+ * Start writing the log file fd through a mapping. The file is truncated and the header written, committed_offset
+ * is the offset in the header of the uint64_t committed length.
+ * The caller keeps fd open until trace_mapped_file_close().
+ * Returns 0 on success, -1 on failure.
+ */
+int
+trace_mapped_file_open(TraceMappedFile *file, int fd, size_t grow_size, const void *header, size_t header_size,
+                       size_t committed_offset) {
+    memset(file, 0, sizeof(TraceMappedFile));
+    file->fd = fd;
+    file->grow_size = grow_size > header_size ? grow_size : header_size;
+    file->committed_offset = committed_offset;
+    if (ftruncate(fd, 0) || trace_mapped_file_resize(file, file->grow_size)) {
+        return -1;
+    }
+    memcpy(file->data, header, header_size);
+    file->length = header_size;
+    __atomic_store_n((uint64_t *)(file->data + committed_offset), (uint64_t)file->length, __ATOMIC_RELEASE);
+    file->is_open = 1;
+    return 0;
+}
+
+/**
+ * Append a complete record and commit it.
+ * Returns 0 on success, -1 if the file could not be extended in which case the record is dropped and counted.
+ */
+int
+trace_mapped_file_write(TraceMappedFile *file, const void *data, size_t size) {
+    if (file->length + size > file->size) {
+        size_t new_size = file->size + file->grow_size;
+        while (file->length + size > new_size) {
+            new_size += file->grow_size;
+        }
+        if (trace_mapped_file_resize(file, new_size)) {
+            file->records_dropped++;
+            return -1;
+        }
+    }
+    memcpy(file->data + file->length, data, size);
+    file->length += size;
+    /* A reader that sees this length sees the record. */
+    __atomic_store_n((uint64_t *)(file->data + file->committed_offset), (uint64_t)file->length, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Start writing the pages to the file system. This is only needed against a failure of the machine, the kernel has
+ * the pages if the process dies.
+ */
+void
+trace_mapped_file_sync(TraceMappedFile *file) {
+    if (file->is_open) {
+        msync(file->data, file->length, MS_ASYNC);
+    }
+}
+
+/**
+ * Unmap the file and truncate it to the committed length, the caller closes the file descriptor.
+ * Returns 0 on success, -1 if the file could not be truncated.
+ */
+int
+trace_mapped_file_close(TraceMappedFile *file) {
+    if (! file->is_open) {
+        return 0;
+    }
+    munmap(file->data, file->size);
+    file->data = NULL;
+    file->is_open = 0;
+    return ftruncate(file->fd, (off_t)file->length) ? -1 : 0;
+}
+
+/**
+ * Unmap the file without changing it, such as in the child of a fork() where the mapping is the parent's file.
+ */
+void
+trace_mapped_file_abandon(TraceMappedFile *file) {
+    if (file->is_open) {
+        munmap(file->data, file->size);
+        file->data = NULL;
+        file->is_open = 0;
+    }
+}
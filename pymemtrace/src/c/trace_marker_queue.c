@@ -0,0 +1,118 @@
+// Bounded multiple producer, single consumer marker queue, see trace_marker_queue.h
+//
+// Publication protocol for position P in slot S = P & (capacity - 1):
+//  1. A producer reads head == P and S.sequence == P, the slot is free, and claims it with a compare and swap of head
+//     from P to P + 1. If S.sequence < P the slot still holds the marker from P - capacity and the queue is full.
+//  2. The producer copies the marker into S and sets S.sequence to P + 1 with release semantics.
+//  3. The consumer, at tail == P, takes the marker once S.sequence == P + 1 and sets S.sequence to P + capacity, which
+//     frees the slot for position P + capacity.
+// The slots are mapped directly, as the ring buffer is, and are never unmapped as a producer in another thread may be
+// using them at any time.
+
+#define _DEFAULT_SOURCE  // For MAP_ANONYMOUS
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#include "trace_marker_queue.h"
+
+/**
+ * Initialise an empty queue, capacity is rounded up to a power of two.
+ * This must be complete before any producer can see the queue.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+trace_marker_queue_open(TraceMarkerQueue *queue, size_t capacity) {
+    memset(queue, 0, sizeof(TraceMarkerQueue));
+    queue->capacity = 1;
+    while (queue->capacity < capacity) {
+        queue->capacity <<= 1;
+    }
+    void *slots = mmap(NULL, queue->capacity * sizeof(TraceMarkerSlot), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        return -1;
+    }
+    queue->slots = slots;
+    for (size_t i = 0; i < queue->capacity; ++i) {
+        queue->slots[i].sequence = i;
+    }
+    return 0;
+}
+
+/**
+ * Copy a NUL terminated label into the marker, truncating it to TRACE_MARKER_LABEL_MAX - 1 bytes.
+ * Control characters are replaced by '?' so that the label is a single field at the end of a line of the text log.
+ */
+void
+trace_marker_queue_set_label(TraceMarker *marker, const char *label) {
+    size_t i = 0;
+    if (label) {
+        for (; i < TRACE_MARKER_LABEL_MAX - 1 && label[i]; ++i) {
+            marker->label[i] = (unsigned char)label[i] < ' ' || label[i] == '\x7f' ? '?' : label[i];
+        }
+    }
+    marker->label[i] = '\0';
+}
+
+/**
+ * Add a marker, this can be called from any thread without the GIL.
+ * Returns 0 on success, non-zero if the queue is full and the marker was dropped.
+ */
+int
+trace_marker_queue_push(TraceMarkerQueue *queue, const TraceMarker *marker) {
+    size_t mask = queue->capacity - 1;
+    size_t position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    TraceMarkerSlot *slot;
+    while (1) {
+        slot = &queue->slots[position & mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            /* On failure this reloads position. */
+            if (__atomic_compare_exchange_n(&queue->head, &position, position + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (difference < 0) {
+            __atomic_add_fetch(&queue->records_dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        } else {
+            /* Another producer has claimed this position. */
+            position = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->marker = *marker;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Take the oldest published marker, only one thread at a time may do this.
+ * A marker whose producer has claimed a slot but not yet published it, and any after it, wait for the next call.
+ * Returns 1 if a marker was taken, 0 if there is none.
+ */
+int
+trace_marker_queue_pop(TraceMarkerQueue *queue, TraceMarker *marker) {
+    TraceMarkerSlot *slot = &queue->slots[queue->tail & (queue->capacity - 1)];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != queue->tail + 1) {
+        return 0;
+    }
+    *marker = slot->marker;
+    __atomic_store_n(&slot->sequence, queue->tail + queue->capacity, __ATOMIC_RELEASE);
+    queue->tail++;
+    return 1;
+}
+
+/**
+ * The number of markers dropped because the queue was full.
+ */
+size_t
+trace_marker_queue_records_dropped(const TraceMarkerQueue *queue) {
+    return __atomic_load_n(&queue->records_dropped, __ATOMIC_RELAXED);
+}
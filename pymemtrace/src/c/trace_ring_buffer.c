@@ -0,0 +1,243 @@
+// Single producer, single consumer ring buffer with a background writer thread.
+// Synchronisation between the producer and consumer uses the GCC/Clang __atomic builtins on head and tail.
+// The mutex and condition variable are only used to put the writer thread to sleep and to wake it up.
+// The buffer is mapped directly rather than with malloc() as freeing a large malloc() block raises the glibc dynamic
+// mmap threshold which changes how the traced process allocates memory, and so its RSS.
+
+#define _POSIX_C_SOURCE 200809L  // For clock_gettime() and nanosleep()
+#define _DEFAULT_SOURCE  // For MAP_ANONYMOUS
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#include "trace_ring_buffer.h"
+
+/* How long the writer thread sleeps when there is nothing to do. */
+#define TRACE_RING_BUFFER_WRITER_SLEEP_NS (10 * 1000 * 1000)
+/* How long the producer sleeps waiting for space in trace_ring_buffer_write_wait(). */
+#define TRACE_RING_BUFFER_PRODUCER_SLEEP_NS (50 * 1000)
+
+static size_t
+round_up_power_of_two(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+static void
+trace_ring_buffer_wake_writer(TraceRingBuffer *ring) {
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_signal(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+/*
+ * Write out everything between tail and head.
+ * This is at most two calls to the sink as the data may wrap around the end of the buffer.
+ */
+static void
+trace_ring_buffer_drain(TraceRingBuffer *ring) {
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return;
+    }
+    size_t mask = ring->capacity - 1;
+    size_t index = tail & mask;
+    size_t size = head - tail;
+    size_t first = ring->capacity - index;
+    if (first > size) {
+        first = size;
+    }
+    ring->bytes_written += ring->sink(ring->sink_context, ring->data + index, first);
+    if (size > first) {
+        ring->bytes_written += ring->sink(ring->sink_context, ring->data, size - first);
+    }
+    ring->batches_written++;
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+static void *
+trace_ring_buffer_writer(void *arg) {
+    TraceRingBuffer *ring = (TraceRingBuffer *)arg;
+    pthread_mutex_lock(&ring->mutex);
+    while (1) {
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+            pthread_mutex_unlock(&ring->mutex);
+            trace_ring_buffer_drain(ring);
+            pthread_mutex_lock(&ring->mutex);
+            continue;
+        }
+        if (ring->stop) {
+            break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += TRACE_RING_BUFFER_WRITER_SLEEP_NS;
+        if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        pthread_cond_timedwait(&ring->cond, &ring->mutex, &deadline);
+    }
+    pthread_mutex_unlock(&ring->mutex);
+    return NULL;
+}
+
+/**
+ * Initialise the ring buffer and start the writer thread.
+ * capacity is rounded up to a power of two.
+ * Returns 0 on success, non-zero on failure.
+ */
+int
+trace_ring_buffer_open(TraceRingBuffer *ring, size_t capacity, trace_ring_buffer_sink sink, void *sink_context) {
+    memset(ring, 0, sizeof(TraceRingBuffer));
+    ring->capacity = round_up_power_of_two(capacity);
+    void *data = mmap(NULL, ring->capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    ring->data = data;
+    ring->sink = sink;
+    ring->sink_context = sink_context;
+    pthread_mutex_init(&ring->mutex, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+    if (pthread_create(&ring->thread, NULL, &trace_ring_buffer_writer, ring) != 0) {
+        pthread_cond_destroy(&ring->cond);
+        pthread_mutex_destroy(&ring->mutex);
+        munmap(ring->data, ring->capacity);
+        ring->data = NULL;
+        return -2;
+    }
+    ring->thread_started = 1;
+    return 0;
+}
+
+/**
+ * Copy a complete record into the ring buffer.
+ * This never blocks, if there is no room the record is dropped and counted.
+ * Returns 0 on success, non-zero if the record was dropped.
+ */
+int
+trace_ring_buffer_write(TraceRingBuffer *ring, const void *data, size_t size) {
+    size_t head = ring->head;
+    size_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (size > ring->capacity - used) {
+        /* This may be read by another thread, such as a socket sink. */
+        __atomic_add_fetch(&ring->records_dropped, 1, __ATOMIC_RELAXED);
+        /* Only the first drop wakes the writer, the others would each take the mutex while it is still busy. */
+        if (! ring->woken_for_drop) {
+            ring->woken_for_drop = 1;
+            trace_ring_buffer_wake_writer(ring);
+        }
+        return -1;
+    }
+    ring->woken_for_drop = 0;
+    size_t mask = ring->capacity - 1;
+    size_t index = head & mask;
+    size_t first = ring->capacity - index;
+    if (first >= size) {
+        memcpy(ring->data + index, data, size);
+    } else {
+        memcpy(ring->data + index, data, first);
+        memcpy(ring->data, (const unsigned char *)data + first, size - first);
+    }
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+    /* Wake the writer as the buffer crosses half full rather than waiting for its timeout. */
+    if (used < ring->capacity / 2 && used + size >= ring->capacity / 2) {
+        trace_ring_buffer_wake_writer(ring);
+    }
+    return 0;
+}
+
+/**
+ * Copy a complete record into the ring buffer waiting for room if necessary.
+ * This is for records that must not be lost such as string table entries.
+ * Returns 0 on success, non-zero if the record can never fit.
+ */
+int
+trace_ring_buffer_write_wait(TraceRingBuffer *ring, const void *data, size_t size) {
+    if (size > ring->capacity) {
+        return -1;
+    }
+    while (size > ring->capacity - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))) {
+        struct timespec pause = {0, TRACE_RING_BUFFER_PRODUCER_SLEEP_NS};
+        trace_ring_buffer_wake_writer(ring);
+        nanosleep(&pause, NULL);
+    }
+    size_t dropped = ring->records_dropped;
+    int result = trace_ring_buffer_write(ring, data, size);
+    assert(result == 0 && ring->records_dropped == dropped);
+    (void)dropped;
+    return result;
+}
+
+/**
+ * Wait until the writer thread has passed everything currently in the buffer to the sink.
+ * This is called by the producer, the sink is not flushed, that is the responsibility of the caller.
+ */
+void
+trace_ring_buffer_flush(TraceRingBuffer *ring) {
+    size_t head = ring->head;
+    while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != head) {
+        struct timespec pause = {0, TRACE_RING_BUFFER_PRODUCER_SLEEP_NS};
+        trace_ring_buffer_wake_writer(ring);
+        nanosleep(&pause, NULL);
+    }
+}
+
+/**
+ * Change the sink once the writer thread has passed everything currently in the buffer to the old one.
+ * This is called by the producer, the writer thread keeps running.
+ */
+void
+trace_ring_buffer_set_sink(TraceRingBuffer *ring, trace_ring_buffer_sink sink, void *sink_context) {
+    trace_ring_buffer_flush(ring);
+    /* The writer thread only reads these after it sees a new head, which is stored with release semantics. */
+    ring->sink = sink;
+    ring->sink_context = sink_context;
+}
+
+/**
+ * Stop the writer thread once it has written everything in the buffer then free the buffer.
+ * The sink is not closed, that is the responsibility of the caller.
+ */
+void
+trace_ring_buffer_close(TraceRingBuffer *ring) {
+    if (ring->thread_started) {
+        pthread_mutex_lock(&ring->mutex);
+        ring->stop = 1;
+        pthread_cond_signal(&ring->cond);
+        pthread_mutex_unlock(&ring->mutex);
+        pthread_join(ring->thread, NULL);
+        ring->thread_started = 0;
+        pthread_cond_destroy(&ring->cond);
+        pthread_mutex_destroy(&ring->mutex);
+    }
+    if (ring->data) {
+        munmap(ring->data, ring->capacity);
+        ring->data = NULL;
+    }
+}
+
+/**
+ * Release the buffer in the child of a fork() without writing what is in it. The writer thread only exists in the
+ * parent and the mutex may have been held by it when the process forked so neither is touched.
+ */
+void
+trace_ring_buffer_abandon(TraceRingBuffer *ring) {
+    ring->thread_started = 0;
+    if (ring->data) {
+        munmap(ring->data, ring->capacity);
+        ring->data = NULL;
+    }
+}
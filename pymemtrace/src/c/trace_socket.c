@@ -0,0 +1,322 @@
+// Streams binary trace records as datagrams, see trace_socket.h
+//
+// A TraceSocket is used by one thread at a time, in cPyMemTrace that is the ring buffer writer thread apart from
+// when the ring buffer has been flushed or closed.
+
+#define _DEFAULT_SOURCE  // For the socket and fcntl declarations with -std=c99
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace_socket.h"
+
+/* The smallest record, enough to find the size of any record. */
+#define TRACE_SOCKET_MIN_RECORD sizeof(TraceRecordString)
+
+/*
+ * Returns the size of the record at data from the first available bytes of it, 0 if more bytes are needed to know or
+ * SIZE_MAX if it is not a record.
+ */
+static size_t
+record_size(const unsigned char *data, size_t available) {
+    if (available < TRACE_SOCKET_MIN_RECORD) {
+        return 0;
+    }
+    switch (data[0]) {
+        case TRACE_RECORD_EVENT:
+            return sizeof(TraceRecordEvent);
+        case TRACE_RECORD_STRING: {
+            TraceRecordString string;
+            memcpy(&string, data, sizeof(string));
+            return sizeof(TraceRecordString) + TRACE_RECORD_ALIGN(string.length);
+        }
+        case TRACE_RECORD_STACK:
+            return sizeof(TraceRecordStack);
+        case TRACE_RECORD_EVENT_STACK:
+            return sizeof(TraceRecordEventStack);
+        case TRACE_RECORD_STATS: {
+            TraceRecordStats stats;
+            memcpy(&stats, data, offsetof(TraceRecordStats, values));
+            return offsetof(TraceRecordStats, values) + (size_t)stats.count * sizeof(uint64_t);
+        }
+        case TRACE_RECORD_MARKER:
+            return sizeof(TraceRecordMarker);
+        default:
+            return SIZE_MAX;
+    }
+}
+
+/* Append data to a growable buffer. Returns 0 on success, -1 on memory failure. */
+static int
+append_bytes(unsigned char **buffer, size_t *length, size_t *capacity, const void *data, size_t size) {
+    if (*length + size > *capacity) {
+        size_t new_capacity = *capacity ? *capacity : 1024;
+        while (new_capacity < *length + size) {
+            new_capacity *= 2;
+        }
+        unsigned char *new_buffer = realloc(*buffer, new_capacity);
+        if (new_buffer == NULL) {
+            return -1;
+        }
+        *buffer = new_buffer;
+        *capacity = new_capacity;
+    }
+    memcpy(*buffer + *length, data, size);
+    *length += size;
+    return 0;
+}
+
+/*
+ * String and stack records define ids that later records use so they are never dropped, nor is the stats record
+ * that ends the stream.
+ */
+static inline int
+is_definition(unsigned char record_type) {
+    return record_type == TRACE_RECORD_STRING || record_type == TRACE_RECORD_STACK
+           || record_type == TRACE_RECORD_STATS;
+}
+
+/* Move as many whole pending string and stack records as fit into the datagram. */
+static void
+refill_from_pending(TraceSocket *sink) {
+    size_t offset = 0;
+    while (offset < sink->pending_length) {
+        size_t size = record_size(sink->pending + offset, sink->pending_length - offset);
+        if (size == 0 || size == SIZE_MAX || sink->datagram_length + size > TRACE_SOCKET_DATAGRAM_SIZE) {
+            break;
+        }
+        memcpy(sink->datagram + sink->datagram_length, sink->pending + offset, size);
+        sink->datagram_length += size;
+        offset += size;
+    }
+    memmove(sink->pending, sink->pending + offset, sink->pending_length - offset);
+    sink->pending_length -= offset;
+}
+
+/*
+ * Send the datagram if it has any records. If it can not be sent its event and marker records are counted as dropped
+ * and its string and stack records are kept to send again.
+ * Returns 1 if a datagram was sent, otherwise 0.
+ */
+static int
+send_datagram(TraceSocket *sink) {
+    if (sink->datagram_length <= sizeof(TraceSocketHeader)) {
+        return 0;
+    }
+    sink->header.sequence = sink->datagrams_sent;
+    sink->header.records_dropped = trace_socket_records_dropped(sink);
+    memcpy(sink->datagram, &sink->header, sizeof(TraceSocketHeader));
+    ssize_t sent;
+    do {
+        sent = sendto(sink->fd, sink->datagram, sink->datagram_length, 0, (struct sockaddr *)&sink->address,
+                      sink->address_length);
+    } while (sent < 0 && errno == EINTR);
+    size_t length = sink->datagram_length;
+    sink->datagram_length = sizeof(TraceSocketHeader);
+    if (sent == (ssize_t)length) {
+        sink->datagrams_sent++;
+        sink->bytes_sent += length;
+        refill_from_pending(sink);
+        return 1;
+    }
+    /* Do not refill from the pending records, that would just fill the datagram with what could not be sent. */
+    sink->datagrams_dropped++;
+    size_t offset = sizeof(TraceSocketHeader);
+    while (offset < length) {
+        size_t size = record_size(sink->datagram + offset, length - offset);
+        if (size == 0 || size == SIZE_MAX) {
+            break;
+        }
+        if (is_definition(sink->datagram[offset])) {
+            append_bytes(&sink->pending, &sink->pending_length, &sink->pending_capacity, sink->datagram + offset,
+                         size);
+        } else if (sink->datagram[offset] == TRACE_RECORD_EVENT || sink->datagram[offset] == TRACE_RECORD_MARKER) {
+            __atomic_add_fetch(&sink->records_dropped, 1, __ATOMIC_RELAXED);
+        }
+        offset += size;
+    }
+    return 0;
+}
+
+/* Add a whole record to the datagram, sending the datagram first if there is no room. */
+static void
+add_record(TraceSocket *sink, const unsigned char *record, size_t size) {
+    if (sizeof(TraceSocketHeader) + size > TRACE_SOCKET_DATAGRAM_SIZE) {
+        if (record[0] != TRACE_RECORD_STRING) {
+            __atomic_add_fetch(&sink->records_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        /* A string that is too long for a datagram is truncated and sent in a datagram of its own. */
+        while (sink->datagram_length > sizeof(TraceSocketHeader)) {
+            send_datagram(sink);
+        }
+        TraceRecordString string;
+        memcpy(&string, record, sizeof(string));
+        size_t room = TRACE_SOCKET_DATAGRAM_SIZE - sink->datagram_length - sizeof(TraceRecordString);
+        string.length = (uint32_t)(room & ~(size_t)7);
+        memcpy(sink->datagram + sink->datagram_length, &string, sizeof(string));
+        memcpy(sink->datagram + sink->datagram_length + sizeof(string), record + sizeof(string), string.length);
+        sink->datagram_length += sizeof(string) + string.length;
+        return;
+    }
+    /* Each successful send may refill the datagram with pending records, each failed one leaves it empty. */
+    while (sink->datagram_length + size > TRACE_SOCKET_DATAGRAM_SIZE) {
+        send_datagram(sink);
+    }
+    memcpy(sink->datagram + sink->datagram_length, record, size);
+    sink->datagram_length += size;
+}
+
+/**
+ * Create a non-blocking datagram socket that sends to address.
+ * thread_id identifies this stream together with the PID.
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int
+trace_socket_open(TraceSocket *sink, const struct sockaddr *address, socklen_t address_length, uint64_t thread_id) {
+    memset(sink, 0, sizeof(TraceSocket));
+    if (address_length > sizeof(sink->address)) {
+        errno = EINVAL;
+        return -1;
+    }
+    sink->fd = socket(address->sa_family, SOCK_DGRAM, 0);
+    if (sink->fd < 0) {
+        return -1;
+    }
+    int flags = fcntl(sink->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(sink->fd, F_SETFL, flags | O_NONBLOCK) < 0 || fcntl(sink->fd, F_SETFD, FD_CLOEXEC) < 0) {
+        int error = errno;
+        close(sink->fd);
+        sink->fd = -1;
+        errno = error;
+        return -1;
+    }
+    memcpy(&sink->address, address, address_length);
+    sink->address_length = address_length;
+    memcpy(sink->header.magic, TRACE_SOCKET_MAGIC, TRACE_SOCKET_MAGIC_LENGTH);
+    sink->header.byte_order_mark = TRACE_FILE_BYTE_ORDER_MARK;
+    sink->header.version = TRACE_SOCKET_VERSION;
+    sink->header.header_size = sizeof(TraceSocketHeader);
+    sink->header.pid = (uint32_t)getpid();
+    sink->header.thread_id = thread_id;
+    sink->datagram_length = sizeof(TraceSocketHeader);
+    return 0;
+}
+
+/**
+ * Set the log file header that is in every datagram, this must be called before trace_socket_write().
+ */
+void
+trace_socket_set_file_header(TraceSocket *sink, const TraceFileHeader *file_header) {
+    sink->header.file_header = *file_header;
+}
+
+/**
+ * Add the records in data, which may start or end part way through a record, and send them.
+ * This matches trace_ring_buffer_sink and never blocks, it returns size.
+ */
+size_t
+trace_socket_write(TraceSocket *sink, const void *data, size_t size) {
+    const unsigned char *input = data;
+    size_t remaining = size;
+    if (sink->datagram_length == sizeof(TraceSocketHeader)) {
+        /* Try again with strings from datagrams that were dropped. */
+        refill_from_pending(sink);
+    }
+    /* Complete a record that was split by the end of the ring buffer. */
+    while (sink->partial_length && remaining) {
+        size_t record = record_size(sink->partial, sink->partial_length);
+        if (record == SIZE_MAX) {
+            sink->partial_length = 0;
+            break;
+        }
+        size_t want = (record ? record : TRACE_SOCKET_MIN_RECORD) - sink->partial_length;
+        size_t take = want < remaining ? want : remaining;
+        if (append_bytes(&sink->partial, &sink->partial_length, &sink->partial_capacity, input, take)) {
+            sink->partial_length = 0;
+            break;
+        }
+        input += take;
+        remaining -= take;
+        if (record && sink->partial_length == record) {
+            add_record(sink, sink->partial, record);
+            sink->partial_length = 0;
+        }
+    }
+    while (remaining) {
+        size_t record = record_size(input, remaining);
+        if (record == SIZE_MAX) {
+            /* Not a record, this can not happen as the producer only writes whole records. */
+            break;
+        }
+        if (record == 0 || record > remaining) {
+            if (append_bytes(&sink->partial, &sink->partial_length, &sink->partial_capacity, input, remaining)) {
+                sink->partial_length = 0;
+            }
+            break;
+        }
+        add_record(sink, input, record);
+        input += record;
+        remaining -= record;
+    }
+    /* Send every batch from the ring buffer so that the consumer sees events within the writer thread interval. */
+    send_datagram(sink);
+    return size;
+}
+
+/**
+ * Send anything that has not been sent, this does not block.
+ */
+void
+trace_socket_flush(TraceSocket *sink) {
+    if (sink->datagram_length == sizeof(TraceSocketHeader)) {
+        refill_from_pending(sink);
+    }
+    send_datagram(sink);
+}
+
+/**
+ * Send anything that has not been sent, close the socket and free the buffers.
+ */
+void
+trace_socket_close(TraceSocket *sink) {
+    if (sink->fd >= 0) {
+        trace_socket_flush(sink);
+        close(sink->fd);
+        sink->fd = -1;
+    }
+    free(sink->partial);
+    sink->partial = NULL;
+    sink->partial_length = sink->partial_capacity = 0;
+    free(sink->pending);
+    sink->pending = NULL;
+    sink->pending_length = sink->pending_capacity = 0;
+}
+
+/**
+ * Close the socket and free the buffers without sending anything, such as in the child of a fork().
+ */
+void
+trace_socket_abandon(TraceSocket *sink) {
+    if (sink->fd >= 0) {
+        close(sink->fd);
+        sink->fd = -1;
+    }
+    trace_socket_close(sink);
+}
+
+/**
+ * Returns the number of event records dropped, by this and by other_records_dropped.
+ */
+uint64_t
+trace_socket_records_dropped(const TraceSocket *sink) {
+    /* This may be called by a thread other than the writer thread. */
+    uint64_t result = __atomic_load_n(&sink->records_dropped, __ATOMIC_RELAXED);
+    if (sink->other_records_dropped) {
+        result += __atomic_load_n(sink->other_records_dropped, __ATOMIC_RELAXED);
+    }
+    return result;
+}
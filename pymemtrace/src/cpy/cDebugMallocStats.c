@@ -0,0 +1,416 @@
+/*
+ * This contains a direct interface to the pymalloc arena, pool and block statistics.
+ *
+ * pymemtrace.debug_malloc_stats calls sys._debugmallocstats() which writes to C stderr, capturing that means
+ * redirecting file descriptor 2 to a temporary file and then parsing the text with regular expressions. Here the same
+ * functions that sys._debugmallocstats() calls write to an in memory stream and the text is parsed in C, see
+ * pymalloc_stats.h.
+ *
+ * _PyObject_DebugTypeStats() is not exported from Python 3.13 onwards so there are no type statistics there.
+ *
+ * pools() goes further and finds every pool, so which arena it is in, see pymalloc_arenas.h. This is Linux only.
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pymalloc_stats.h"
+#include "pymalloc_arenas.h"
+
+#if PY_VERSION_HEX >= 0x030B0000
+/* Exported but only declared in the internal headers. */
+PyAPI_FUNC(int) _PyObject_DebugMallocStats(FILE *out);
+#endif
+
+#if PY_VERSION_HEX < 0x030D0000
+#define HAS_TYPE_STATS 1
+#else
+#define HAS_TYPE_STATS 0
+#endif
+
+/* Which statistics to capture. */
+#define CAPTURE_MALLOC_STATS 1
+#define CAPTURE_TYPE_STATS 2
+
+/**
+ * Write the statistics to an in memory stream. On success this returns 0 and the caller must free(*buffer).
+ * *is_pymalloc is set to 0 if pymalloc is not the object allocator in which case there are no malloc statistics.
+ * On failure this sets an exception and returns -1.
+ */
+static int
+capture(int what, char **buffer, size_t *size, int *is_pymalloc) {
+    *buffer = NULL;
+    *size = 0;
+    FILE *stream = open_memstream(buffer, size);
+    if (stream == NULL) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    *is_pymalloc = 1;
+    if (what & CAPTURE_MALLOC_STATS) {
+#if PY_VERSION_HEX >= 0x03080000
+        *is_pymalloc = _PyObject_DebugMallocStats(stream);
+#else
+        _PyObject_DebugMallocStats(stream);
+#endif
+    }
+#if HAS_TYPE_STATS
+    if (what & CAPTURE_TYPE_STATS) {
+        if ((what & CAPTURE_MALLOC_STATS) && *is_pymalloc) {
+            /* As sys._debugmallocstats(). */
+            fputc('\n', stream);
+        }
+        _PyObject_DebugTypeStats(stream);
+    }
+#endif
+    if (fclose(stream)) {
+        free(*buffer);
+        *buffer = NULL;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+debugmallocstats(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args)) {
+    char *buffer;
+    size_t size;
+    int is_pymalloc;
+    if (capture(CAPTURE_MALLOC_STATS | CAPTURE_TYPE_STATS, &buffer, &size, &is_pymalloc)) {
+        return NULL;
+    }
+    PyObject *ret = PyBytes_FromStringAndSize(buffer, (Py_ssize_t)size);
+    free(buffer);
+    return ret;
+}
+
+static PyObject *
+class_stats_to_tuple(const PymallocStats *stats) {
+    PyObject *ret = PyTuple_New((Py_ssize_t)stats->class_count);
+    if (ret == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < stats->class_count; ++i) {
+        const PymallocClassStat *class_stat = &stats->classes[i];
+        PyObject *value = Py_BuildValue(
+            "nnnnn",
+            (Py_ssize_t)class_stat->block_class,
+            (Py_ssize_t)class_stat->size,
+            (Py_ssize_t)class_stat->num_pools,
+            (Py_ssize_t)class_stat->blocks_in_use,
+            (Py_ssize_t)class_stat->avail_blocks
+        );
+        if (value == NULL) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(ret, (Py_ssize_t)i, value);
+    }
+    return ret;
+}
+
+/* Append a (free_count, object_type, bytes_each, bytes_total) tuple for every type statistic line in the text. */
+static int
+append_type_stats(PyObject *list, const char *text, size_t length) {
+    const char *end = text + length;
+    PymallocTypeStat type_stat;
+    while (text < end) {
+        const char *eol = memchr(text, '\n', (size_t)(end - text));
+        size_t line_length = eol ? (size_t)(eol - text) : (size_t)(end - text);
+        if (pymalloc_type_stat_parse_line(&type_stat, text, line_length) == 0) {
+            PyObject *value = Py_BuildValue(
+                "nsnn",
+                (Py_ssize_t)type_stat.free_count,
+                type_stat.object_type,
+                (Py_ssize_t)type_stat.bytes_each,
+                (Py_ssize_t)type_stat.bytes_total
+            );
+            if (value == NULL) {
+                return -1;
+            }
+            int err = PyList_Append(list, value);
+            Py_DECREF(value);
+            if (err) {
+                return -1;
+            }
+        }
+        text += line_length + (eol ? 1 : 0);
+    }
+    return 0;
+}
+
+/**
+ * Returns the dict described in the stats() docstring from the malloc statistics text and the type statistics text.
+ * These may be the same text.
+ */
+static PyObject *
+stats_from_text(const char *malloc_text, size_t malloc_length, const char *type_text, size_t type_length) {
+    PyObject *ret = NULL;
+    PyObject *type_stats = NULL;
+    /* This is rather large for the stack. */
+    PymallocStats *malloc_stats = malloc(sizeof(PymallocStats));
+
+    if (malloc_stats == NULL) {
+        PyErr_NoMemory();
+        goto finally;
+    }
+    pymalloc_stats_init(malloc_stats);
+    if (pymalloc_stats_parse(malloc_stats, malloc_text, malloc_length)) {
+        PyErr_Format(
+            PyExc_ValueError, "Can not find all the pymalloc statistics, found 0x%x of 0x%x.",
+            malloc_stats->found, PYMALLOC_STATS_FOUND_ALL
+        );
+        goto finally;
+    }
+    type_stats = PyList_New(0);
+    if (type_stats == NULL) {
+        goto finally;
+    }
+    if (append_type_stats(type_stats, type_text, type_length)) {
+        goto finally;
+    }
+    PyObject *class_stats = class_stats_to_tuple(malloc_stats);
+    if (class_stats == NULL) {
+        goto finally;
+    }
+    ret = Py_BuildValue(
+        "{s:n,s:n,s:N,s:(nnnn),s:(nnnnnnn),s:n,s:O}",
+        "small_block_threshold", (Py_ssize_t)malloc_stats->small_block_threshold,
+        "size_classes", (Py_ssize_t)malloc_stats->size_classes,
+        "malloc_stats", class_stats,
+        "arenas",
+        (Py_ssize_t)malloc_stats->ntimes_arena_allocated,
+        (Py_ssize_t)malloc_stats->narenas_highwater,
+        (Py_ssize_t)malloc_stats->narenas,
+        (Py_ssize_t)malloc_stats->arena_size,
+        "pools_blocks",
+        (Py_ssize_t)malloc_stats->allocated_bytes,
+        (Py_ssize_t)malloc_stats->available_bytes,
+        (Py_ssize_t)malloc_stats->pool_header_bytes,
+        (Py_ssize_t)malloc_stats->quantization,
+        (Py_ssize_t)malloc_stats->arena_alignment,
+        (Py_ssize_t)malloc_stats->numfreepools,
+        (Py_ssize_t)malloc_stats->pool_size,
+        "pool_overhead", (Py_ssize_t)pymalloc_stats_pool_overhead(malloc_stats),
+        "type_stats", type_stats
+    );
+finally:
+    free(malloc_stats);
+    Py_XDECREF(type_stats);
+    return ret;
+}
+
+static PyObject *
+stats(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args)) {
+    char *malloc_text;
+    size_t malloc_length;
+    char *type_text = NULL;
+    size_t type_length = 0;
+    int is_pymalloc;
+    PyObject *ret = NULL;
+
+    if (capture(CAPTURE_MALLOC_STATS, &malloc_text, &malloc_length, &is_pymalloc)) {
+        return NULL;
+    }
+    if (!is_pymalloc) {
+        PyErr_SetString(PyExc_RuntimeError, "pymalloc is not the object allocator.");
+        goto finally;
+    }
+#if HAS_TYPE_STATS
+    if (capture(CAPTURE_TYPE_STATS, &type_text, &type_length, &is_pymalloc)) {
+        goto finally;
+    }
+#endif
+    ret = stats_from_text(malloc_text, malloc_length, type_text, type_length);
+finally:
+    free(malloc_text);
+    free(type_text);
+    return ret;
+}
+
+static PyObject *
+parse(PyObject *Py_UNUSED(module), PyObject *args, PyObject *kwargs) {
+    static char *kwlist[] = {"debug_malloc", NULL};
+    Py_buffer text;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*", kwlist, &text)) {
+        return NULL;
+    }
+    PyObject *ret = stats_from_text(text.buf, (size_t)text.len, text.buf, (size_t)text.len);
+    PyBuffer_Release(&text);
+    return ret;
+}
+
+/**
+ * Sets the geometry from the current malloc statistics which are also parsed into malloc_stats.
+ * On failure this sets an exception and returns -1.
+ */
+static int
+geometry_from_stats(PymallocGeometry *geometry, PymallocStats *malloc_stats) {
+    char *malloc_text;
+    size_t malloc_length;
+    int is_pymalloc;
+    int ret = -1;
+
+    if (capture(CAPTURE_MALLOC_STATS, &malloc_text, &malloc_length, &is_pymalloc)) {
+        return -1;
+    }
+    if (!is_pymalloc) {
+        PyErr_SetString(PyExc_RuntimeError, "pymalloc is not the object allocator.");
+        goto finally;
+    }
+    pymalloc_stats_init(malloc_stats);
+    if (pymalloc_stats_parse(malloc_stats, malloc_text, malloc_length) || malloc_stats->size_classes == 0) {
+        PyErr_SetString(PyExc_ValueError, "Can not find all the pymalloc statistics.");
+        goto finally;
+    }
+    geometry->pool_size = malloc_stats->pool_size;
+    geometry->arena_size = malloc_stats->arena_size;
+    geometry->size_classes = malloc_stats->size_classes;
+    geometry->alignment = malloc_stats->small_block_threshold / malloc_stats->size_classes;
+    /* POOL_OVERHEAD in Objects/obmalloc.c */
+    geometry->pool_overhead =
+        (sizeof(PymallocPoolHeader) + geometry->alignment - 1) / geometry->alignment * geometry->alignment;
+    ret = 0;
+finally:
+    free(malloc_text);
+    return ret;
+}
+
+static PyObject *
+pools(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args)) {
+    PymallocGeometry geometry;
+    PymallocPools found = {NULL, 0, 0, 0};
+    PyObject *pool_list = NULL;
+    PyObject *class_stats = NULL;
+    PyObject *ret = NULL;
+
+    if (!PYMALLOC_ARENAS_SUPPORTED) {
+        PyErr_SetString(PyExc_NotImplementedError, "Finding pymalloc pools is only supported on Linux.");
+        return NULL;
+    }
+    PymallocStats *malloc_stats = malloc(sizeof(PymallocStats));
+    if (malloc_stats == NULL) {
+        return PyErr_NoMemory();
+    }
+    if (geometry_from_stats(&geometry, malloc_stats)) {
+        goto finally;
+    }
+    /* No Python allocations until the walk is done, the GIL is held throughout. */
+    if (pymalloc_pools_find(&geometry, &found)) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        goto finally;
+    }
+    pool_list = PyList_New((Py_ssize_t)found.count);
+    if (pool_list == NULL) {
+        goto finally;
+    }
+    for (size_t i = 0; i < found.count; ++i) {
+        const PymallocPool *pool = &found.pools[i];
+        PyObject *value = Py_BuildValue(
+            "KIIII",
+            (unsigned long long)pool->address,
+            pool->arena_index,
+            pool->size_class,
+            pool->blocks_in_use,
+            pool->capacity
+        );
+        if (value == NULL) {
+            goto finally;
+        }
+        PyList_SET_ITEM(pool_list, (Py_ssize_t)i, value);
+    }
+    class_stats = class_stats_to_tuple(malloc_stats);
+    if (class_stats == NULL) {
+        goto finally;
+    }
+    ret = Py_BuildValue(
+        "{s:n,s:n,s:n,s:n,s:n,s:n,s:O,s:O}",
+        "pool_size", (Py_ssize_t)geometry.pool_size,
+        "arena_size", (Py_ssize_t)geometry.arena_size,
+        "alignment", (Py_ssize_t)geometry.alignment,
+        "pool_overhead", (Py_ssize_t)geometry.pool_overhead,
+        "read_errors", (Py_ssize_t)found.read_errors,
+        "narenas", (Py_ssize_t)malloc_stats->narenas,
+        "pools", pool_list,
+        "malloc_stats", class_stats
+    );
+finally:
+    pymalloc_pools_free(&found);
+    free(malloc_stats);
+    Py_XDECREF(pool_list);
+    Py_XDECREF(class_stats);
+    return ret;
+}
+
+static PyMethodDef cDebugMallocStatsMethods[] = {
+    {
+        "debugmallocstats", debugmallocstats, METH_NOARGS,
+        "Returns the text that ``sys._debugmallocstats()`` writes to stderr as bytes."
+        " This is written to memory, stderr is not touched."
+    },
+    {
+        "stats", stats, METH_NOARGS,
+        "Returns the pymalloc statistics as a dict with these keys:\n\n"
+        "- ``'small_block_threshold'`` and ``'size_classes'``, integers.\n"
+        "- ``'malloc_stats'`` a tuple of ``(block_class, size, num_pools, blocks_in_use, avail_blocks)`` for each"
+        " size class in use.\n"
+        "- ``'arenas'`` the tuple ``(ntimes_arena_allocated, narenas_highwater, narenas, arena_size)``.\n"
+        "- ``'pools_blocks'`` the tuple ``(allocated_bytes, available_bytes, pool_header_bytes, quantization,"
+        " arena_alignment, numfreepools, pool_size)``.\n"
+        "- ``'pool_overhead'`` the bytes lost to pool headers divided by the number of pools in use.\n"
+        "- ``'type_stats'`` a list of ``(free_count, object_type, bytes_each, bytes_total)``, this is empty if"
+        " ``HAS_TYPE_STATS`` is False.\n\n"
+        "This raises a RuntimeError if pymalloc is not the object allocator."
+    },
+    {
+        "parse", (PyCFunction) parse, METH_VARARGS | METH_KEYWORDS,
+        "Parse the bytes from ``sys._debugmallocstats()`` into the same dict as ``stats()``."
+        " This raises a ValueError if any of the malloc statistics are missing."
+    },
+    {
+        "pools", pools, METH_NOARGS,
+        "Finds every pymalloc pool and returns a dict with these keys:\n\n"
+        "- ``'pool_size'``, ``'arena_size'``, ``'alignment'`` and ``'pool_overhead'`` the pymalloc geometry.\n"
+        "- ``'pools'`` a list of ``(address, arena_index, size_class, blocks_in_use, capacity)`` for each pool,"
+        " including empty pools in arenas that are still allocated. Pools never used are not included.\n"
+        "- ``'read_errors'`` the number of candidate pools that could not be read.\n"
+        "- ``'narenas'`` and ``'malloc_stats'`` as ``stats()`` immediately before the pools were found.\n\n"
+        "This is Linux only, elsewhere it raises NotImplementedError."
+        " It raises a RuntimeError if pymalloc is not the object allocator."
+    },
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+static PyModuleDef cDebugMallocStatsmodule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "cDebugMallocStats",
+    .m_doc = "A module that reads the pymalloc statistics without redirecting stderr.",
+    .m_size = -1,
+    .m_methods = cDebugMallocStatsMethods,
+};
+
+PyMODINIT_FUNC
+PyInit_cDebugMallocStats(void) {
+    PyObject *m = PyModule_Create(&cDebugMallocStatsmodule);
+    if (m == NULL) {
+        return NULL;
+    }
+    PyObject *has_type_stats = PyBool_FromLong(HAS_TYPE_STATS);
+    if (PyModule_AddObject(m, "HAS_TYPE_STATS", has_type_stats) < 0) {
+        Py_DECREF(has_type_stats);
+        Py_DECREF(m);
+        return NULL;
+    }
+    PyObject *has_pools = PyBool_FromLong(PYMALLOC_ARENAS_SUPPORTED);
+    if (PyModule_AddObject(m, "HAS_POOLS", has_pools) < 0) {
+        Py_DECREF(has_pools);
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
+}
@@ -0,0 +1,842 @@
+/*
+ * This contains a native malloc tracker that records every allocation and free made through the Python memory
+ * allocators along with the Python file, line and function that made it.
+ *
+ * This is a portable alternative to the DTrace scripts in toolkit/ that need a DTrace enabled Python build and
+ * root access. The log file has the same format as the output of toolkit/py_flow_malloc_free.d so it can be read with
+ * pymemtrace.parse_dtrace_output.parse_py_flow_malloc_free()
+ *
+ * The tracker replaces the allocators of the chosen domains with PyMem_SetAllocator(), each hook calls the original
+ * allocator then appends a fixed size record to a per-thread buffer, see malloc_trace_buffer.h
+ * The hooks take no locks so PyMem_RawMalloc() etc. can be traced on threads that do not hold the GIL.
+ *
+ * With the GIL held the buffers are drained in sequence order into a table of live allocations, see
+ * allocation_table.h, and the log file. This happens when enough records are waiting, on flush() and on exit.
+ *
+ * The Python location is only recorded when the thread holds the GIL, on Python 3.11 there is no means of reading the
+ * current frame without allocating so the location is always unknown.
+ *
+ * libc malloc() itself is not traced, that would need LD_PRELOAD or the malloc hooks that glibc has removed.
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "structmember.h"
+#include "frameobject.h"
+
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "allocation_table.h"
+#include "malloc_trace_buffer.h"
+#include "pointer_map.h"
+#include "pymemtrace_util.h"
+
+/* Drain the buffers from a hook once this many records are waiting. */
+#define MALLOC_TRACE_DRAIN_THRESHOLD (64 * 1024)
+#define MALLOC_TRACE_DOMAIN_COUNT 3
+
+static const char *domain_names[MALLOC_TRACE_DOMAIN_COUNT] = {"RAW", "MEM", "OBJ"};
+
+#if PY_VERSION_HEX >= 0x030C0000
+#define SAVE_EXCEPTION(name) PyObject *name = PyErr_GetRaisedException()
+#define RESTORE_EXCEPTION(name) PyErr_SetRaisedException(name)
+#else
+#define SAVE_EXCEPTION(name) PyObject *name##_type, *name##_value, *name##_traceback; \
+    PyErr_Fetch(&name##_type, &name##_value, &name##_traceback)
+#define RESTORE_EXCEPTION(name) PyErr_Restore(name##_type, name##_value, name##_traceback)
+#endif
+
+struct MallocTrackerObject;
+
+/* The ctx of each hooked allocator. */
+typedef struct {
+    struct MallocTrackerObject *tracker;
+    PyMemAllocatorDomain domain;
+    int hooked;
+    PyMemAllocatorEx original;
+} MallocTraceDomain;
+
+/* A Python code object seen by the hooks, code ids are one more than the index of this in the code table. */
+typedef struct {
+    PyObject *code;
+    char *file;
+    char *function;
+} MallocTraceCode;
+
+typedef struct MallocTrackerObject {
+    PyObject_HEAD
+    int trace_domains[MALLOC_TRACE_DOMAIN_COUNT];
+    int log;
+    int full_path;
+    MallocTraceDomain domains[MALLOC_TRACE_DOMAIN_COUNT];
+    /* Non-zero when the buffers have been initialised. */
+    int buffers_initialised;
+    MallocTraceBuffers buffers;
+    /* Live allocations made while tracking. */
+    AllocationTable live;
+    /* Code object to code id. */
+    PointerMap code_ids;
+    MallocTraceCode *codes;
+    size_t code_count;
+    size_t code_capacity;
+    FILE *log_file;
+    PyObject *log_path;
+    int pid;
+    /* The sequence number when the buffers were last drained. */
+    uint64_t drained_sequence;
+    /* Number of records drained. */
+    size_t records;
+    int draining;
+} MallocTrackerObject;
+
+/* There can only be one tracker active at a time, this holds a reference to it. */
+static MallocTrackerObject *active_tracker = NULL;
+/* Set while the hooks should record, cleared before they are removed. */
+static int tracking = 0;
+/* The number of hooks that are executing, the tracker waits for this to reach zero when it stops. */
+static size_t hooks_in_flight = 0;
+
+/**
+ * Set code and line_number to the currently executing Python code, code is a borrowed reference or NULL.
+ * The GIL must be held. This must not allocate.
+ */
+static void
+current_location(PyCodeObject **code, int *line_number) {
+    *code = NULL;
+    *line_number = 0;
+    PyThreadState *tstate = _PyThreadState_UncheckedGet();
+    if (tstate == NULL) {
+        return;
+    }
+#if PY_VERSION_HEX >= 0x030C0000
+#if PY_VERSION_HEX >= 0x030D0000
+    struct _PyInterpreterFrame *frame = tstate->current_frame;
+#else
+    struct _PyInterpreterFrame *frame = tstate->cframe ? tstate->cframe->current_frame : NULL;
+#endif
+    if (frame) {
+        PyObject *frame_code = PyUnstable_InterpreterFrame_GetCode(frame);
+        if (frame_code) {
+            /* The frame holds a reference. */
+            Py_DECREF(frame_code);
+            *code = (PyCodeObject *)frame_code;
+            *line_number = PyUnstable_InterpreterFrame_GetLine(frame);
+            /* -1 for instructions that have no line such as RESUME. */
+            if (*line_number < 0) {
+                *line_number = 0;
+            }
+        }
+    }
+#elif PY_VERSION_HEX >= 0x030B0000
+    /* PyThreadState_GetFrame() may create a frame object. */
+    (void)tstate;
+#else
+    PyFrameObject *frame = tstate->frame;
+    if (frame) {
+        *code = frame->f_code;
+        *line_number = PyFrame_GetLineNumber(frame);
+    }
+#endif
+}
+
+static char *
+copy_string(const char *text) {
+    size_t length = strlen(text) + 1;
+    char *copy = malloc(length);
+    if (copy) {
+        memcpy(copy, text, length);
+    }
+    return copy;
+}
+
+/**
+ * Returns the id of the code object, adding it to the code table if necessary, or 0 on failure.
+ * The GIL must be held.
+ */
+static uint32_t
+code_id(MallocTrackerObject *self, PyCodeObject *code) {
+    uint32_t id = 0;
+    if (pointer_map_get(&self->code_ids, code, &id)) {
+        return id;
+    }
+    if (self->code_count == self->code_capacity) {
+        size_t new_capacity = self->code_capacity ? self->code_capacity * 2 : 256;
+        MallocTraceCode *new_codes = realloc(self->codes, new_capacity * sizeof(MallocTraceCode));
+        if (new_codes == NULL) {
+            return 0;
+        }
+        self->codes = new_codes;
+        self->code_capacity = new_capacity;
+    }
+    /* An exception may be set where the allocation was made. */
+    SAVE_EXCEPTION(exception);
+    const char *file = PyUnicode_AsUTF8(code->co_filename);
+    const char *function = file ? PyUnicode_AsUTF8(code->co_name) : NULL;
+    if (file == NULL || function == NULL) {
+        PyErr_Clear();
+        RESTORE_EXCEPTION(exception);
+        return 0;
+    }
+    RESTORE_EXCEPTION(exception);
+    if (! self->full_path) {
+        const char *base_name = strrchr(file, '/');
+        if (base_name) {
+            file = base_name + 1;
+        }
+    }
+    MallocTraceCode *entry = self->codes + self->code_count;
+    entry->file = copy_string(file);
+    entry->function = copy_string(function);
+    id = (uint32_t)(self->code_count + 1);
+    if (entry->file == NULL || entry->function == NULL || pointer_map_insert(&self->code_ids, code, id)) {
+        free(entry->file);
+        free(entry->function);
+        return 0;
+    }
+    Py_INCREF(code);
+    entry->code = (PyObject *)code;
+    self->code_count++;
+    return id;
+}
+
+static const char *
+code_file(MallocTrackerObject *self, uint32_t id) {
+    return id ? self->codes[id - 1].file : "?";
+}
+
+static const char *
+code_function(MallocTrackerObject *self, uint32_t id) {
+    return id ? self->codes[id - 1].function : "?";
+}
+
+/**
+ * Apply a drained record to the live allocation table and the log file.
+ * The log has the format of toolkit/py_flow_malloc_free.d, calloc is written as malloc and realloc as a free of the
+ * old address followed by a malloc of the new one.
+ * Frees of blocks allocated before tracking started are ignored.
+ */
+static void
+apply_record(void *context, const MallocTraceRecord *record) {
+    MallocTrackerObject *self = (MallocTrackerObject *)context;
+    const char *file = code_file(self, record->code_id);
+    const char *function = code_function(self, record->code_id);
+    self->records++;
+    if (record->old_address && allocation_table_remove(&self->live, record->old_address) && self->log_file) {
+        fprintf(self->log_file, " %6d %16s:%-4d -> %s free(0x%" PRIxPTR ")\n",
+                self->pid, file, record->line_number, function, record->old_address);
+    }
+    if (record->address) {
+        AllocationEntry entry = {
+            .address = record->address,
+            .size = record->size,
+            .sequence = record->sequence,
+            .code_id = record->code_id,
+            .line_number = record->line_number,
+            .domain = record->domain,
+        };
+        allocation_table_insert(&self->live, &entry);
+        if (self->log_file) {
+            fprintf(self->log_file, " %6d %16s:%-4d -> %s malloc(%zu) pntr 0x%" PRIxPTR "\n",
+                    self->pid, file, record->line_number, function, record->size, record->address);
+        }
+    }
+}
+
+/**
+ * Drain all complete records, the GIL must be held.
+ * Returns the number of records or (size_t)-1 on memory failure.
+ */
+static size_t
+drain(MallocTrackerObject *self) {
+    if (! self->buffers_initialised || self->draining) {
+        return 0;
+    }
+    self->draining = 1;
+    self->drained_sequence = __atomic_load_n(&self->buffers.sequence, __ATOMIC_SEQ_CST);
+    size_t count = malloc_trace_buffers_drain(&self->buffers, apply_record, self);
+    self->draining = 0;
+    return count;
+}
+
+/**
+ * Called on entry to a hook, returns the current thread's buffer if the allocation should be recorded.
+ * If this returns non-NULL then hook_leave() must be called.
+ */
+static MallocTraceBuffer *
+hook_enter(MallocTraceDomain *domain) {
+    __atomic_add_fetch(&hooks_in_flight, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&tracking, __ATOMIC_SEQ_CST)) {
+        MallocTraceBuffer *buffer = malloc_trace_buffer_get(&domain->tracker->buffers);
+        if (buffer && ! buffer->in_hook) {
+            buffer->in_hook = 1;
+            return buffer;
+        }
+    }
+    __atomic_sub_fetch(&hooks_in_flight, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void
+hook_leave(MallocTraceBuffer *buffer) {
+    buffer->in_hook = 0;
+    __atomic_sub_fetch(&hooks_in_flight, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Fill in the record location and append it. This is between malloc_trace_buffer_begin() and
+ * malloc_trace_buffer_commit() so must not wait on anything.
+ */
+static void
+hook_record(MallocTraceDomain *domain, MallocTraceBuffer *buffer, MallocTraceRecord *record, int gil_held) {
+    MallocTrackerObject *tracker = domain->tracker;
+    if (gil_held && ! tracker->draining) {
+        PyCodeObject *code;
+        current_location(&code, &record->line_number);
+        if (code) {
+            record->code_id = code_id(tracker, code);
+        }
+    }
+    malloc_trace_buffer_commit(&tracker->buffers, buffer, record);
+}
+
+static void
+hook_auto_drain(MallocTraceDomain *domain, uint64_t sequence, int gil_held) {
+    if (gil_held && sequence - domain->tracker->drained_sequence >= MALLOC_TRACE_DRAIN_THRESHOLD) {
+        drain(domain->tracker);
+    }
+}
+
+static int
+hook_gil_held(MallocTraceDomain *domain) {
+    return domain->domain != PYMEM_DOMAIN_RAW || PyGILState_Check();
+}
+
+static void
+hook_record_allocation(MallocTraceDomain *domain, MallocTraceBuffer *buffer, void *ptr, size_t size,
+                       uint8_t operation) {
+    if (ptr) {
+        int gil_held = hook_gil_held(domain);
+        MallocTraceRecord record = {
+            .sequence = malloc_trace_buffer_begin(&domain->tracker->buffers, buffer),
+            .address = (uintptr_t)ptr,
+            .size = size,
+            .operation = operation,
+            .domain = (uint8_t)domain->domain,
+        };
+        hook_record(domain, buffer, &record, gil_held);
+        hook_auto_drain(domain, record.sequence, gil_held);
+    }
+}
+
+/* The hook is entered before calling the original allocator so that any allocations that it makes are not recorded. */
+static void *
+hook_malloc(void *ctx, size_t size) {
+    MallocTraceDomain *domain = (MallocTraceDomain *)ctx;
+    MallocTraceBuffer *buffer = hook_enter(domain);
+    void *ptr = domain->original.malloc(domain->original.ctx, size);
+    if (buffer) {
+        hook_record_allocation(domain, buffer, ptr, size, MALLOC_TRACE_MALLOC);
+        hook_leave(buffer);
+    }
+    return ptr;
+}
+
+static void *
+hook_calloc(void *ctx, size_t nelem, size_t elsize) {
+    MallocTraceDomain *domain = (MallocTraceDomain *)ctx;
+    MallocTraceBuffer *buffer = hook_enter(domain);
+    void *ptr = domain->original.calloc(domain->original.ctx, nelem, elsize);
+    if (buffer) {
+        hook_record_allocation(domain, buffer, ptr, nelem * elsize, MALLOC_TRACE_CALLOC);
+        hook_leave(buffer);
+    }
+    return ptr;
+}
+
+static void *
+hook_realloc(void *ctx, void *ptr, size_t new_size) {
+    MallocTraceDomain *domain = (MallocTraceDomain *)ctx;
+    MallocTraceBuffer *buffer = hook_enter(domain);
+    if (buffer == NULL) {
+        return domain->original.realloc(domain->original.ctx, ptr, new_size);
+    }
+    int gil_held = hook_gil_held(domain);
+    /*
+     * Take the sequence number before the original realloc frees ptr. Otherwise another thread could be given ptr and
+     * record that allocation before this record that frees it.
+     */
+    MallocTraceRecord record = {
+        .sequence = malloc_trace_buffer_begin(&domain->tracker->buffers, buffer),
+        .old_address = (uintptr_t)ptr,
+        .size = new_size,
+        .operation = MALLOC_TRACE_REALLOC,
+        .domain = (uint8_t)domain->domain,
+    };
+    void *new_ptr = domain->original.realloc(domain->original.ctx, ptr, new_size);
+    record.address = (uintptr_t)new_ptr;
+    if (new_ptr == NULL) {
+        /* ptr is unchanged and still live. */
+        record.old_address = 0;
+    }
+    hook_record(domain, buffer, &record, gil_held);
+    hook_auto_drain(domain, record.sequence, gil_held);
+    hook_leave(buffer);
+    return new_ptr;
+}
+
+static void
+hook_free(void *ctx, void *ptr) {
+    MallocTraceDomain *domain = (MallocTraceDomain *)ctx;
+    MallocTraceBuffer *buffer = ptr ? hook_enter(domain) : NULL;
+    if (buffer) {
+        /* Record this before ptr can be reused. */
+        int gil_held = hook_gil_held(domain);
+        MallocTraceRecord record = {
+            .sequence = malloc_trace_buffer_begin(&domain->tracker->buffers, buffer),
+            .old_address = (uintptr_t)ptr,
+            .operation = MALLOC_TRACE_FREE,
+            .domain = (uint8_t)domain->domain,
+        };
+        hook_record(domain, buffer, &record, gil_held);
+        domain->original.free(domain->original.ctx, ptr);
+        hook_auto_drain(domain, record.sequence, gil_held);
+        hook_leave(buffer);
+        return;
+    }
+    domain->original.free(domain->original.ctx, ptr);
+}
+
+/**** MallocTracker ****/
+
+static void
+MallocTrackerObject_clear_results(MallocTrackerObject *self) {
+    allocation_table_free(&self->live);
+    pointer_map_free(&self->code_ids);
+    for (size_t i = 0; i < self->code_count; ++i) {
+        Py_DECREF(self->codes[i].code);
+        free(self->codes[i].file);
+        free(self->codes[i].function);
+    }
+    free(self->codes);
+    self->codes = NULL;
+    self->code_count = 0;
+    self->code_capacity = 0;
+    self->records = 0;
+    Py_CLEAR(self->log_path);
+}
+
+static void
+MallocTrackerObject_dealloc(MallocTrackerObject *self) {
+    /* An active tracker is referenced by active_tracker so it has been stopped by now. */
+    MallocTrackerObject_clear_results(self);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+MallocTrackerObject_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds)) {
+    /* tp_alloc zeroes the object so the tables are empty and safe to free. */
+    return type->tp_alloc(type, 0);
+}
+
+static int
+MallocTrackerObject_init(MallocTrackerObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"raw", "mem", "obj", "log", "full_path", NULL};
+    self->trace_domains[PYMEM_DOMAIN_RAW] = 0;
+    self->trace_domains[PYMEM_DOMAIN_MEM] = 1;
+    self->trace_domains[PYMEM_DOMAIN_OBJ] = 1;
+    self->log = 1;
+    self->full_path = 0;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|ppppp", kwlist,
+                                      &self->trace_domains[PYMEM_DOMAIN_RAW], &self->trace_domains[PYMEM_DOMAIN_MEM],
+                                      &self->trace_domains[PYMEM_DOMAIN_OBJ], &self->log, &self->full_path)) {
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+open_log_file(MallocTrackerObject *self) {
+    char path[PYMEMTRACE_PATH_MAX];
+    if (create_log_path(path, sizeof(path), NULL, "malloc.log", 0, time(NULL), -1)) {
+        PyErr_SetString(PyExc_RuntimeError, "Can not create the log file name.");
+        return NULL;
+    }
+    self->log_file = fopen(path, "w");
+    if (self->log_file == NULL) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return NULL;
+    }
+    self->log_path = PyUnicode_DecodeFSDefault(path);
+    return self->log_path;
+}
+
+/**
+ * Remove the hooks, wait for any that are executing, drain and close the log file.
+ */
+static void
+malloc_tracker_stop(MallocTrackerObject *self) {
+    __atomic_store_n(&tracking, 0, __ATOMIC_SEQ_CST);
+    for (int d = 0; d < MALLOC_TRACE_DOMAIN_COUNT; ++d) {
+        if (self->domains[d].hooked) {
+            PyMem_SetAllocator(self->domains[d].domain, &self->domains[d].original);
+            self->domains[d].hooked = 0;
+        }
+    }
+    /* Only threads using PyMem_RawMalloc() without the GIL can be in a hook now. */
+    while (__atomic_load_n(&hooks_in_flight, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+    }
+    if (self->buffers_initialised) {
+        drain(self);
+        malloc_trace_buffers_free(&self->buffers);
+        self->buffers_initialised = 0;
+    }
+    if (self->log_file) {
+        fclose(self->log_file);
+        self->log_file = NULL;
+    }
+    if (active_tracker == self) {
+        active_tracker = NULL;
+        Py_DECREF(self);
+    }
+}
+
+static PyObject *
+MallocTrackerObject_enter(MallocTrackerObject *self, PyObject *Py_UNUSED(args)) {
+    if (active_tracker) {
+        PyErr_SetString(PyExc_RuntimeError, "A MallocTracker is already active.");
+        return NULL;
+    }
+    /* Results from a previous use are discarded. */
+    MallocTrackerObject_clear_results(self);
+    if (allocation_table_init(&self->live, 1024) || pointer_map_init(&self->code_ids, 256)) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    if (malloc_trace_buffers_init(&self->buffers)) {
+        PyErr_SetString(PyExc_RuntimeError, "Can not create the record buffers.");
+        return NULL;
+    }
+    self->buffers_initialised = 1;
+    self->drained_sequence = 0;
+    self->pid = (int)getpid();
+    if (self->log && open_log_file(self) == NULL) {
+        malloc_trace_buffers_free(&self->buffers);
+        self->buffers_initialised = 0;
+        return NULL;
+    }
+    Py_INCREF(self);
+    active_tracker = self;
+    __atomic_store_n(&tracking, 1, __ATOMIC_SEQ_CST);
+    PyMemAllocatorEx hooks = {
+        .malloc = hook_malloc,
+        .calloc = hook_calloc,
+        .realloc = hook_realloc,
+        .free = hook_free,
+    };
+    for (int d = 0; d < MALLOC_TRACE_DOMAIN_COUNT; ++d) {
+        MallocTraceDomain *domain = &self->domains[d];
+        domain->tracker = self;
+        domain->domain = (PyMemAllocatorDomain)d;
+        if (self->trace_domains[d]) {
+            PyMem_GetAllocator(domain->domain, &domain->original);
+            hooks.ctx = domain;
+            PyMem_SetAllocator(domain->domain, &hooks);
+            domain->hooked = 1;
+        }
+    }
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+MallocTrackerObject_exit(MallocTrackerObject *self, PyObject *Py_UNUSED(args)) {
+    if (active_tracker == self) {
+        malloc_tracker_stop(self);
+    }
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+MallocTrackerObject_flush(MallocTrackerObject *self, PyObject *Py_UNUSED(args)) {
+    size_t count = drain(self);
+    if (count == (size_t)-1) {
+        return PyErr_NoMemory();
+    }
+    if (self->log_file) {
+        fflush(self->log_file);
+    }
+    return PyLong_FromSize_t(count);
+}
+
+static int
+entry_compare_sequence(const void *a, const void *b) {
+    uint64_t sequence_a = (*(const AllocationEntry **)a)->sequence;
+    uint64_t sequence_b = (*(const AllocationEntry **)b)->sequence;
+    return (sequence_a > sequence_b) - (sequence_a < sequence_b);
+}
+
+/**
+ * Returns a new array of pointers to the live entries in the order they were allocated, or NULL.
+ * An empty table gives a non-NULL array.
+ */
+static const AllocationEntry **
+live_entries(MallocTrackerObject *self) {
+    const AllocationEntry **entries = malloc((self->live.size + 1) * sizeof(AllocationEntry *));
+    if (entries == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < self->live.capacity; ++i) {
+        if (self->live.entries[i].address) {
+            entries[count++] = &self->live.entries[i];
+        }
+    }
+    qsort(entries, count, sizeof(AllocationEntry *), entry_compare_sequence);
+    return entries;
+}
+
+static PyObject *
+MallocTrackerObject_live(MallocTrackerObject *self, PyObject *Py_UNUSED(args)) {
+    if (drain(self) == (size_t)-1) {
+        return PyErr_NoMemory();
+    }
+    const AllocationEntry **entries = live_entries(self);
+    if (entries == NULL) {
+        return NULL;
+    }
+    PyObject *result = PyList_New((Py_ssize_t)self->live.size);
+    for (size_t i = 0; result && i < self->live.size; ++i) {
+        const AllocationEntry *entry = entries[i];
+        PyObject *item = Py_BuildValue(
+            "Knssis", (unsigned long long)entry->address, (Py_ssize_t)entry->size, domain_names[entry->domain],
+            code_file(self, entry->code_id), entry->line_number, code_function(self, entry->code_id)
+        );
+        if (item == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, (Py_ssize_t)i, item);
+    }
+    free((void *)entries);
+    return result;
+}
+
+typedef struct {
+    Py_ssize_t bytes;
+    /* Borrowed references to the key and value in the dict of call sites. */
+    PyObject *key;
+    PyObject *value;
+} CallSite;
+
+static int
+call_site_compare_bytes(const void *a, const void *b) {
+    Py_ssize_t bytes_a = ((const CallSite *)a)->bytes;
+    Py_ssize_t bytes_b = ((const CallSite *)b)->bytes;
+    return (bytes_a < bytes_b) - (bytes_a > bytes_b);
+}
+
+static PyObject *
+MallocTrackerObject_summary(MallocTrackerObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"n", NULL};
+    Py_ssize_t limit = 10;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|n", kwlist, &limit)) {
+        return NULL;
+    }
+    if (drain(self) == (size_t)-1) {
+        return PyErr_NoMemory();
+    }
+    /* Key is (file, line, function), value is (bytes, count). */
+    PyObject *sites = PyDict_New();
+    if (sites == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < self->live.capacity; ++i) {
+        const AllocationEntry *entry = &self->live.entries[i];
+        if (! entry->address) {
+            continue;
+        }
+        PyObject *key = Py_BuildValue("(sis)", code_file(self, entry->code_id), entry->line_number,
+                                      code_function(self, entry->code_id));
+        if (key == NULL) {
+            goto except;
+        }
+        Py_ssize_t count = 1;
+        Py_ssize_t bytes = (Py_ssize_t)entry->size;
+        PyObject *previous = PyDict_GetItem(sites, key);
+        if (previous) {
+            bytes += PyLong_AsSsize_t(PyTuple_GET_ITEM(previous, 0));
+            count += PyLong_AsSsize_t(PyTuple_GET_ITEM(previous, 1));
+        }
+        PyObject *value = Py_BuildValue("(nn)", bytes, count);
+        if (value == NULL || PyDict_SetItem(sites, key, value)) {
+            Py_XDECREF(value);
+            Py_DECREF(key);
+            goto except;
+        }
+        Py_DECREF(value);
+        Py_DECREF(key);
+    }
+    /* Sort by bytes, largest first. */
+    Py_ssize_t site_count = PyDict_Size(sites);
+    CallSite *call_sites = malloc((size_t)(site_count + 1) * sizeof(CallSite));
+    if (call_sites == NULL) {
+        PyErr_NoMemory();
+        goto except;
+    }
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    Py_ssize_t index = 0;
+    while (PyDict_Next(sites, &pos, &key, &value)) {
+        call_sites[index].key = key;
+        call_sites[index].value = value;
+        call_sites[index].bytes = PyLong_AsSsize_t(PyTuple_GET_ITEM(value, 0));
+        index++;
+    }
+    qsort(call_sites, (size_t)site_count, sizeof(CallSite), call_site_compare_bytes);
+    if (limit > site_count) {
+        limit = site_count;
+    }
+    PyObject *result = PyList_New(limit < 0 ? 0 : limit);
+    for (Py_ssize_t i = 0; result && i < limit; ++i) {
+        key = call_sites[i].key;
+        value = call_sites[i].value;
+        PyObject *item = Py_BuildValue("(OOOOO)", PyTuple_GET_ITEM(key, 0), PyTuple_GET_ITEM(key, 1),
+                                       PyTuple_GET_ITEM(key, 2), PyTuple_GET_ITEM(value, 1),
+                                       PyTuple_GET_ITEM(value, 0));
+        if (item == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+    free(call_sites);
+    Py_DECREF(sites);
+    return result;
+except:
+    Py_DECREF(sites);
+    return NULL;
+}
+
+static PyObject *
+MallocTrackerObject_live_count(MallocTrackerObject *self, void *Py_UNUSED(closure)) {
+    return PyLong_FromSize_t(self->live.size);
+}
+
+static PyObject *
+MallocTrackerObject_live_bytes(MallocTrackerObject *self, void *Py_UNUSED(closure)) {
+    return PyLong_FromSize_t(self->live.total_bytes);
+}
+
+static PyObject *
+MallocTrackerObject_records(MallocTrackerObject *self, void *Py_UNUSED(closure)) {
+    return PyLong_FromSize_t(self->records);
+}
+
+static PyObject *
+MallocTrackerObject_records_dropped(MallocTrackerObject *self, void *Py_UNUSED(closure)) {
+    if (! self->buffers_initialised) {
+        return PyLong_FromLong(0);
+    }
+    return PyLong_FromSize_t(__atomic_load_n(&self->buffers.records_dropped, __ATOMIC_RELAXED));
+}
+
+static PyObject *
+MallocTrackerObject_log_path(MallocTrackerObject *self, void *Py_UNUSED(closure)) {
+    if (self->log_path == NULL) {
+        Py_RETURN_NONE;
+    }
+    Py_INCREF(self->log_path);
+    return self->log_path;
+}
+
+static PyGetSetDef MallocTrackerObject_getset[] = {
+        {"live_count", (getter) MallocTrackerObject_live_count, NULL,
+         "The number of live allocations when the buffers were last drained.", NULL},
+        {"live_bytes", (getter) MallocTrackerObject_live_bytes, NULL,
+         "The total size of the live allocations when the buffers were last drained.", NULL},
+        {"records", (getter) MallocTrackerObject_records, NULL,
+         "The number of allocation and free records that have been drained.", NULL},
+        {"records_dropped", (getter) MallocTrackerObject_records_dropped, NULL,
+         "The number of records lost because memory for the buffers could not be allocated.", NULL},
+        {"log_path", (getter) MallocTrackerObject_log_path, NULL,
+         "The path to the log file or None.", NULL},
+        {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+static PyMethodDef MallocTrackerObject_methods[] = {
+        {"__enter__", (PyCFunction) MallocTrackerObject_enter, METH_NOARGS,
+         "Install the allocator hooks."},
+        {"__exit__", (PyCFunction) MallocTrackerObject_exit, METH_VARARGS,
+         "Remove the allocator hooks, process all the records and close the log file."},
+        {"flush", (PyCFunction) MallocTrackerObject_flush, METH_NOARGS,
+         "Process the waiting records and flush the log file. Returns the number of records."},
+        {"live", (PyCFunction) MallocTrackerObject_live, METH_NOARGS,
+         "Returns a list of the live allocations in the order they were made."
+         " Each is a tuple (address, size, domain, file, line, function) where domain is 'RAW', 'MEM' or 'OBJ'."},
+        {"summary", (PyCFunction) MallocTrackerObject_summary, METH_VARARGS | METH_KEYWORDS,
+         "Returns the n (default 10) call sites with the most live bytes."
+         " Each is a tuple (file, line, function, count, bytes)."},
+        {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static PyTypeObject MallocTrackerObjectType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "cMallocTrace.MallocTracker",
+        .tp_doc = "A context manager that records every allocation and free made through the Python memory allocators."
+                  "\n\nThe optional arguments ``raw``, ``mem`` and ``obj`` choose the allocator domains to trace,"
+                  " PyMem_RawMalloc(), PyMem_Malloc() and PyObject_Malloc() respectively."
+                  " Defaults are False, True, True."
+                  "\n\nIf ``log`` is True (the default) every allocation and free is written to a file in the current"
+                  " working directory named \"YYYYmmdd_HHMMSS_<PID>.malloc.log\" in the same format as"
+                  " toolkit/py_flow_malloc_free.d"
+                  "\n\nIf ``full_path`` is True the full path of the Python file is used, default is the file name."
+                  "\n\nThe live allocations made while tracking are available with ``live()`` and ``summary()``"
+                  " after the context manager exits."
+                  ,
+        .tp_basicsize = sizeof(MallocTrackerObject),
+        .tp_itemsize = 0,
+        .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+        .tp_new = MallocTrackerObject_new,
+        .tp_init = (initproc) MallocTrackerObject_init,
+        .tp_dealloc = (destructor) MallocTrackerObject_dealloc,
+        .tp_methods = MallocTrackerObject_methods,
+        .tp_getset = MallocTrackerObject_getset,
+};
+/**** END: MallocTracker ****/
+
+PyDoc_STRVAR(malloc_trace_doc,
+"Module that contains a native tracker of the Python memory allocators."
+"\nMallocTracker() records each allocation and free with the Python file, line and function that made it."
+);
+
+static PyModuleDef cMallocTracemodule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "cMallocTrace",
+    .m_doc = malloc_trace_doc,
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC
+PyInit_cMallocTrace(void) {
+    PyObject *m = PyModule_Create(&cMallocTracemodule);
+    if (m == NULL) {
+        return NULL;
+    }
+    if (PyType_Ready(&MallocTrackerObjectType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&MallocTrackerObjectType);
+    if (PyModule_AddObject(m, "MallocTracker", (PyObject *) &MallocTrackerObjectType) < 0) {
+        Py_DECREF(&MallocTrackerObjectType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
+}
@@ -8,6 +8,11 @@
 #include <Python.h>
 #include "structmember.h"
 
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
 
 /* If defined this reports any malloc and free for CMallocObject, PyRawMallocObject and PyMallocObject. */
 /*
@@ -299,6 +304,516 @@ static PyTypeObject PyMallocObjectType = {
 };
 /******** END: Allocate a buffer with Python's pymalloc memory interface ********/
 
+/******** Bulk allocation workloads ********/
+/*
+ * Allocates, frees and refills many blocks in C so that a benchmark measures the allocator, and the tracer, rather
+ * than the creation of millions of Python objects.
+ * Block sizes and the blocks that are freed come from a xorshift64* generator so a seed gives the same workload on
+ * every run.
+ * The GIL is released while malloc() or PyMem_RawMalloc() blocks are allocated or freed, PyMem_Malloc() needs the GIL.
+ */
+#define BULK_ALLOC_MALLOC   0
+#define BULK_ALLOC_RAW      1
+#define BULK_ALLOC_PYMALLOC 2
+
+#define BULK_DISTRIBUTION_FIXED       0
+#define BULK_DISTRIBUTION_UNIFORM     1
+#define BULK_DISTRIBUTION_LOG_UNIFORM 2
+
+/* xorshift64* needs a non-zero state. */
+#define BULK_DEFAULT_SEED 0x9E3779B97F4A7C15ULL
+
+static const char *bulk_allocator_names[] = {"malloc", "raw", "pymalloc", NULL};
+static const char *bulk_distribution_names[] = {"fixed", "uniform", "log_uniform", NULL};
+
+typedef struct {
+    PyObject_HEAD
+    size_t count;
+    void **blocks; /* count pointers, NULL if that block is freed. */
+    size_t *sizes; /* The size of each block that is held. */
+    size_t blocks_held;
+    size_t bytes_held;
+    int allocator;
+    int distribution;
+    size_t size;
+    size_t max_size;
+    int touch;
+    uint64_t random_state;
+    size_t page_size;
+    /* Set while the GIL is released so that another thread can not change the blocks. */
+    int busy;
+} BulkAllocObject;
+
+static uint64_t
+bulk_random(BulkAllocObject *self) {
+    uint64_t x = self->random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    self->random_state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* A double in [0, 1). */
+static double
+bulk_random_double(BulkAllocObject *self) {
+    return (bulk_random(self) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t
+bulk_next_size(BulkAllocObject *self) {
+    size_t size;
+    switch (self->distribution) {
+        case BULK_DISTRIBUTION_UNIFORM:
+            size = self->size + (size_t)(bulk_random(self) % (self->max_size - self->size + 1));
+            break;
+        case BULK_DISTRIBUTION_LOG_UNIFORM:
+            /* Many small blocks and a few large ones. */
+            size = (size_t)(self->size * pow((double)self->max_size / self->size, bulk_random_double(self)));
+            break;
+        default:
+            size = self->size;
+            break;
+    }
+    return size ? size : 1;
+}
+
+static void *
+bulk_malloc(int allocator, size_t size) {
+    switch (allocator) {
+        case BULK_ALLOC_RAW:
+            return PyMem_RawMalloc(size);
+        case BULK_ALLOC_PYMALLOC:
+            return PyMem_Malloc(size);
+        default:
+            return malloc(size);
+    }
+}
+
+static void
+bulk_free(int allocator, void *block) {
+    switch (allocator) {
+        case BULK_ALLOC_RAW:
+            PyMem_RawFree(block);
+            break;
+        case BULK_ALLOC_PYMALLOC:
+            PyMem_Free(block);
+            break;
+        default:
+            free(block);
+            break;
+    }
+}
+
+/* Write one byte in every page of the block so that it is resident. */
+static void
+bulk_touch(BulkAllocObject *self, size_t index) {
+    volatile char *block = self->blocks[index];
+    for (size_t offset = 0; offset < self->sizes[index]; offset += self->page_size) {
+        block[offset] = (char)offset;
+    }
+}
+
+/* Allocate every freed block with a new size. Returns the number allocated or -1 if an allocation failed. */
+static Py_ssize_t
+bulk_refill(BulkAllocObject *self) {
+    Py_ssize_t allocated = 0;
+    for (size_t i = 0; i < self->count; ++i) {
+        if (self->blocks[i] == NULL) {
+            size_t size = bulk_next_size(self);
+            self->blocks[i] = bulk_malloc(self->allocator, size);
+            if (self->blocks[i] == NULL) {
+                return -1;
+            }
+            self->sizes[i] = size;
+            if (self->touch) {
+                bulk_touch(self, i);
+            }
+            self->blocks_held++;
+            self->bytes_held += size;
+            allocated++;
+        }
+    }
+    return allocated;
+}
+
+static void
+bulk_free_block(BulkAllocObject *self, size_t index) {
+    bulk_free(self->allocator, self->blocks[index]);
+    self->blocks[index] = NULL;
+    self->blocks_held--;
+    self->bytes_held -= self->sizes[index];
+    self->sizes[index] = 0;
+}
+
+/* Free exactly number of the held blocks chosen at random, Knuth's selection sampling. */
+static size_t
+bulk_free_random(BulkAllocObject *self, size_t number) {
+    size_t remaining = self->blocks_held;
+    size_t freed = 0;
+    for (size_t i = 0; i < self->count && freed < number; ++i) {
+        if (self->blocks[i]) {
+            if (bulk_random_double(self) * remaining < (double)(number - freed)) {
+                bulk_free_block(self, i);
+                freed++;
+            }
+            remaining--;
+        }
+    }
+    return freed;
+}
+
+/* Free the blocks in a repeating pattern of keep blocks held then free blocks freed. */
+static size_t
+bulk_free_pattern(BulkAllocObject *self, size_t keep, size_t free_count) {
+    size_t freed = 0;
+    for (size_t i = 0; i < self->count; ++i) {
+        if (i % (keep + free_count) >= keep && self->blocks[i]) {
+            bulk_free_block(self, i);
+            freed++;
+        }
+    }
+    return freed;
+}
+
+static void
+bulk_free_all(BulkAllocObject *self) {
+    for (size_t i = 0; i < self->count; ++i) {
+        if (self->blocks[i]) {
+            bulk_free_block(self, i);
+        }
+    }
+}
+
+/* Set busy, raising RuntimeError if another thread is using the blocks. */
+static int
+bulk_acquire(BulkAllocObject *self) {
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "BulkAlloc is being used by another thread.");
+        return -1;
+    }
+    self->busy = 1;
+    return 0;
+}
+
+/* Run a workload with the GIL released if the allocator allows it. */
+#define BULK_RUN(self, statement) \
+    do { \
+        if ((self)->allocator == BULK_ALLOC_PYMALLOC) { \
+            statement; \
+        } else { \
+            Py_BEGIN_ALLOW_THREADS \
+            statement; \
+            Py_END_ALLOW_THREADS \
+        } \
+        (self)->busy = 0; \
+    } while (0)
+
+static void
+BulkAllocObject_dealloc(BulkAllocObject *self) {
+    if (self->blocks) {
+        bulk_free_all(self);
+    }
+    PyMem_RawFree(self->blocks);
+    PyMem_RawFree(self->sizes);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+BulkAllocObject_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds)) {
+    BulkAllocObject *self;
+    self = (BulkAllocObject *) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->count = 0;
+        self->blocks = NULL;
+        self->sizes = NULL;
+        self->blocks_held = 0;
+        self->bytes_held = 0;
+        self->allocator = BULK_ALLOC_MALLOC;
+        self->distribution = BULK_DISTRIBUTION_FIXED;
+        self->size = 0;
+        self->max_size = 0;
+        self->touch = 0;
+        self->random_state = BULK_DEFAULT_SEED;
+        self->page_size = (size_t)sysconf(_SC_PAGESIZE);
+        self->busy = 0;
+    }
+    return (PyObject *) self;
+}
+
+/* Returns the index of name in names or -1 with a ValueError set. */
+static int
+bulk_choice(const char *name, const char **names, const char *argument) {
+    for (int i = 0; names[i]; ++i) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    PyErr_Format(PyExc_ValueError, "Unknown %s \"%s\".", argument, name);
+    return -1;
+}
+
+static int
+BulkAllocObject_init(BulkAllocObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"count", "size", "max_size", "distribution", "allocator", "touch", "seed", NULL};
+    Py_ssize_t count;
+    Py_ssize_t size = 64;
+    Py_ssize_t max_size = 0;
+    const char *distribution = "fixed";
+    const char *allocator = "malloc";
+    int touch = 0;
+    unsigned long long seed = 0;
+
+    if (self->blocks) {
+        PyErr_SetString(PyExc_RuntimeError, "BulkAlloc can not be initialised twice.");
+        return -1;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|nnsspK", kwlist, &count, &size, &max_size, &distribution,
+                                     &allocator, &touch, &seed)) {
+        return -1;
+    }
+    if (count < 0 || size < 0 || max_size < 0) {
+        PyErr_SetString(PyExc_ValueError, "count, size and max_size must not be negative.");
+        return -1;
+    }
+    self->distribution = bulk_choice(distribution, bulk_distribution_names, "distribution");
+    if (self->distribution < 0) {
+        return -1;
+    }
+    self->allocator = bulk_choice(allocator, bulk_allocator_names, "allocator");
+    if (self->allocator < 0) {
+        return -1;
+    }
+    self->size = size ? (size_t)size : 1;
+    self->max_size = (size_t)max_size;
+    if (self->distribution != BULK_DISTRIBUTION_FIXED && self->max_size < self->size) {
+        PyErr_Format(PyExc_ValueError, "max_size %zu must be at least size %zu for distribution \"%s\".",
+                     self->max_size, self->size, distribution);
+        return -1;
+    }
+    self->touch = touch;
+    self->random_state = seed ? seed : BULK_DEFAULT_SEED;
+    self->count = (size_t)count;
+    /* At least one so that an empty workload is distinct from an uninitialised one. */
+    self->blocks = PyMem_RawCalloc(self->count ? self->count : 1, sizeof(void *));
+    self->sizes = PyMem_RawCalloc(self->count ? self->count : 1, sizeof(size_t));
+    if (self->blocks == NULL || self->sizes == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    Py_ssize_t allocated;
+    self->busy = 1;
+    BULK_RUN(self, allocated = bulk_refill(self));
+    if (allocated < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns 0 if the object has been initialised, -1 with an exception set if not. */
+static int
+bulk_check(BulkAllocObject *self) {
+    if (self->blocks == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "BulkAlloc has not been initialised.");
+        return -1;
+    }
+    return bulk_acquire(self);
+}
+
+static PyObject *
+BulkAllocObject_free_fraction(BulkAllocObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"fraction", NULL};
+    double fraction;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "d", kwlist, &fraction)) {
+        return NULL;
+    }
+    if (!(fraction >= 0.0 && fraction <= 1.0)) {
+        PyErr_SetString(PyExc_ValueError, "fraction must be from 0.0 to 1.0.");
+        return NULL;
+    }
+    if (bulk_check(self)) {
+        return NULL;
+    }
+    size_t freed;
+    size_t number = (size_t)(fraction * self->blocks_held + 0.5);
+    BULK_RUN(self, freed = bulk_free_random(self, number));
+    return PyLong_FromSize_t(freed);
+}
+
+static PyObject *
+BulkAllocObject_free_pattern(BulkAllocObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"keep", "free", NULL};
+    Py_ssize_t keep;
+    Py_ssize_t free_count;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "nn", kwlist, &keep, &free_count)) {
+        return NULL;
+    }
+    if (keep < 0 || free_count < 0 || keep + free_count == 0) {
+        PyErr_SetString(PyExc_ValueError, "keep and free must not be negative and one must be non-zero.");
+        return NULL;
+    }
+    if (bulk_check(self)) {
+        return NULL;
+    }
+    size_t freed;
+    BULK_RUN(self, freed = bulk_free_pattern(self, (size_t)keep, (size_t)free_count));
+    return PyLong_FromSize_t(freed);
+}
+
+static PyObject *
+BulkAllocObject_refill(BulkAllocObject *self, PyObject *Py_UNUSED(args)) {
+    if (bulk_check(self)) {
+        return NULL;
+    }
+    Py_ssize_t allocated;
+    BULK_RUN(self, allocated = bulk_refill(self));
+    if (allocated < 0) {
+        return PyErr_NoMemory();
+    }
+    return PyLong_FromSsize_t(allocated);
+}
+
+static PyObject *
+BulkAllocObject_churn(BulkAllocObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"cycles", "fraction", NULL};
+    Py_ssize_t cycles;
+    double fraction = 0.5;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|d", kwlist, &cycles, &fraction)) {
+        return NULL;
+    }
+    if (cycles < 0 || !(fraction >= 0.0 && fraction <= 1.0)) {
+        PyErr_SetString(PyExc_ValueError, "cycles must not be negative and fraction must be from 0.0 to 1.0.");
+        return NULL;
+    }
+    if (bulk_check(self)) {
+        return NULL;
+    }
+    Py_ssize_t allocated = 0;
+    BULK_RUN(
+        self,
+        for (Py_ssize_t cycle = 0; cycle < cycles && allocated >= 0; ++cycle) {
+            bulk_free_random(self, (size_t)(fraction * self->blocks_held + 0.5));
+            Py_ssize_t result = bulk_refill(self);
+            allocated = result < 0 ? result : allocated + result;
+        }
+    );
+    if (allocated < 0) {
+        return PyErr_NoMemory();
+    }
+    return PyLong_FromSsize_t(allocated);
+}
+
+static PyObject *
+BulkAllocObject_free_all(BulkAllocObject *self, PyObject *Py_UNUSED(args)) {
+    if (bulk_check(self)) {
+        return NULL;
+    }
+    BULK_RUN(self, bulk_free_all(self));
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+BulkAllocObject_touch(BulkAllocObject *self, PyObject *Py_UNUSED(args)) {
+    if (bulk_check(self)) {
+        return NULL;
+    }
+    BULK_RUN(
+        self,
+        for (size_t i = 0; i < self->count; ++i) {
+            if (self->blocks[i]) {
+                bulk_touch(self, i);
+            }
+        }
+    );
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+BulkAllocObject_getcount(BulkAllocObject *self, void *Py_UNUSED(closure)) {
+    return PyLong_FromSize_t(self->count);
+}
+
+static PyObject *
+BulkAllocObject_getblocks(BulkAllocObject *self, void *Py_UNUSED(closure)) {
+    return PyLong_FromSize_t(self->blocks_held);
+}
+
+static PyObject *
+BulkAllocObject_getbytes(BulkAllocObject *self, void *Py_UNUSED(closure)) {
+    return PyLong_FromSize_t(self->bytes_held);
+}
+
+static PyObject *
+BulkAllocObject_getallocator(BulkAllocObject *self, void *Py_UNUSED(closure)) {
+    return PyUnicode_FromString(bulk_allocator_names[self->allocator]);
+}
+
+static PyObject *
+BulkAllocObject_getdistribution(BulkAllocObject *self, void *Py_UNUSED(closure)) {
+    return PyUnicode_FromString(bulk_distribution_names[self->distribution]);
+}
+
+static PyGetSetDef BulkAllocObject_getsetters[] = {
+    {"count", (getter) BulkAllocObject_getcount, (setter) NULL, "The number of blocks, held or freed.", NULL},
+    {"blocks", (getter) BulkAllocObject_getblocks, (setter) NULL, "The number of blocks held.", NULL},
+    {"bytes", (getter) BulkAllocObject_getbytes, (setter) NULL, "The bytes requested for the blocks held.", NULL},
+    {"allocator", (getter) BulkAllocObject_getallocator, (setter) NULL,
+     "The allocator, \"malloc\", \"raw\" or \"pymalloc\".", NULL},
+    {"distribution", (getter) BulkAllocObject_getdistribution, (setter) NULL,
+     "The size distribution, \"fixed\", \"uniform\" or \"log_uniform\".", NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+static PyMethodDef BulkAllocObject_methods[] = {
+    {"free_fraction", (PyCFunction) BulkAllocObject_free_fraction, METH_VARARGS | METH_KEYWORDS,
+     "free_fraction(fraction) frees that fraction of the blocks held, chosen at random. Returns the number freed."},
+    {"free_pattern", (PyCFunction) BulkAllocObject_free_pattern, METH_VARARGS | METH_KEYWORDS,
+     "free_pattern(keep, free) frees blocks in a repeating pattern of keep blocks held then free blocks freed."
+     " For example free_pattern(1, 1) frees every other block. Returns the number freed."},
+    {"refill", (PyCFunction) BulkAllocObject_refill, METH_NOARGS,
+     "Allocates every freed block with a new size from the distribution. Returns the number allocated."},
+    {"churn", (PyCFunction) BulkAllocObject_churn, METH_VARARGS | METH_KEYWORDS,
+     "churn(cycles, fraction=0.5) repeats free_fraction(fraction) and refill() cycles times."
+     " Returns the number of blocks allocated."},
+    {"free_all", (PyCFunction) BulkAllocObject_free_all, METH_NOARGS,
+     "Frees every block, refill() allocates them again."},
+    {"touch", (PyCFunction) BulkAllocObject_touch, METH_NOARGS,
+     "Writes to every page of the blocks held so that they are resident."},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(
+    BulkAllocObjectType_tp_doc,
+    "BulkAlloc(count, size=64, max_size=0, distribution='fixed', allocator='malloc', touch=False, seed=0)\n\n"
+    "Allocates count blocks in C and holds them until they are freed by the methods or this object is deleted."
+    " This creates memory workloads at a high rate without a Python object per block.\n\n"
+    "distribution is ``'fixed'`` for blocks of ``size`` bytes, ``'uniform'`` for sizes from ``size`` to ``max_size``"
+    " or ``'log_uniform'`` for sizes in that range that are mostly small."
+    " allocator is ``'malloc'`` for ``malloc()``, ``'raw'`` for ``PyMem_RawMalloc()`` or ``'pymalloc'`` for"
+    " ``PyMem_Malloc()``. The GIL is released while blocks are allocated and freed except for ``'pymalloc'``."
+    " If touch is True every page of a block is written when it is allocated so that the RSS grows."
+    " The sizes and the blocks that are freed are random from seed, the same seed gives the same workload."
+);
+
+static PyTypeObject BulkAllocObjectType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "cMemLeak.BulkAllocObject",
+    .tp_doc = BulkAllocObjectType_tp_doc,
+    .tp_basicsize = sizeof(BulkAllocObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = BulkAllocObject_new,
+    .tp_init = (initproc) BulkAllocObject_init,
+    .tp_dealloc = (destructor) BulkAllocObject_dealloc,
+    .tp_methods = BulkAllocObject_methods,
+    .tp_getset = BulkAllocObject_getsetters,
+};
+/******** END: Bulk allocation workloads ********/
+
 /*
  * Increments the reference count of the supplied PyObject.
  * This will cause a memory leak.
@@ -389,6 +904,16 @@ PyInit_cMemLeak(void) {
         Py_DECREF(m);
         return NULL;
     }
+    /* Bulk allocation workloads */
+    if (PyType_Ready(&BulkAllocObjectType) < 0) {
+        return NULL;
+    }
+    Py_INCREF(&BulkAllocObjectType);
+    if (PyModule_AddObject(m, "BulkAlloc", (PyObject *) &BulkAllocObjectType) < 0) {
+        Py_DECREF(&BulkAllocObjectType);
+        Py_DECREF(m);
+        return NULL;
+    }
 
     return m;
 }
@@ -0,0 +1,303 @@
+/*
+ * This contains a native sampler of the memory and CPU usage of this process.
+ *
+ * pymemtrace.process.ProcessLoggingThread polls psutil from a Python thread, every sample needs the GIL and allocates.
+ * Here a native thread, see process_sampler.h, takes the samples into a preallocated ring without the GIL so the
+ * sampling interval can be much smaller than the logging interval. Python reads the samples out in bulk with read().
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "structmember.h"
+
+#include <stdint.h>
+
+#include "process_sampler.h"
+
+#define PROCESS_SAMPLER_DEFAULT_CAPACITY 65536
+
+/* The fields of a sample tuple, see sample_to_tuple(). */
+static const char *SAMPLE_FIELDS[] = {
+    "time", "rss", "vms", "page_faults", "major_page_faults", "user_time", "system_time",
+};
+#define SAMPLE_FIELDS_COUNT (sizeof(SAMPLE_FIELDS) / sizeof(SAMPLE_FIELDS[0]))
+
+static PyObject *
+sample_to_tuple(const ProcessSample *sample) {
+    return Py_BuildValue(
+        "dKKKKdd",
+        (double)sample->time_ns / 1e9,
+        (unsigned long long)sample->rss,
+        (unsigned long long)sample->vms,
+        (unsigned long long)sample->page_faults,
+        (unsigned long long)sample->major_page_faults,
+        sample->user_time,
+        sample->system_time
+    );
+}
+
+typedef struct {
+    PyObject_HEAD
+    double interval;
+    Py_ssize_t capacity;
+    int is_initialised;
+    ProcessSampler sampler;
+} SamplerObject;
+
+static void
+SamplerObject_dealloc(SamplerObject *self) {
+    if (self->is_initialised) {
+        /* Joining the sampler thread may take a moment, it never needs the GIL. */
+        Py_BEGIN_ALLOW_THREADS
+        process_sampler_free(&self->sampler);
+        Py_END_ALLOW_THREADS
+        self->is_initialised = 0;
+    }
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+SamplerObject_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds)) {
+    SamplerObject *self = (SamplerObject *) type->tp_alloc(type, 0);
+    return (PyObject *) self;
+}
+
+static int
+SamplerObject_init(SamplerObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"interval", "capacity", NULL};
+    self->interval = 1.0;
+    self->capacity = PROCESS_SAMPLER_DEFAULT_CAPACITY;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|dn", kwlist, &self->interval, &self->capacity)) {
+        return -1;
+    }
+    if (self->interval <= 0.0 || self->capacity <= 0) {
+        PyErr_SetString(PyExc_ValueError, "interval and capacity must be > 0");
+        return -1;
+    }
+    if (self->is_initialised) {
+        PyErr_SetString(PyExc_RuntimeError, "Sampler is already initialised.");
+        return -1;
+    }
+    if (process_sampler_init(&self->sampler, (size_t)self->capacity, (uint64_t)(self->interval * 1e9))) {
+        PyErr_SetString(PyExc_OSError, "Can not initialise the process sampler.");
+        return -1;
+    }
+    self->is_initialised = 1;
+    return 0;
+}
+
+static PyObject *
+SamplerObject_start(SamplerObject *self, PyObject *Py_UNUSED(args)) {
+    if (! self->is_initialised) {
+        PyErr_SetString(PyExc_RuntimeError, "Sampler is not initialised.");
+        return NULL;
+    }
+    if (self->sampler.thread_started) {
+        PyErr_SetString(PyExc_RuntimeError, "Sampler is already running.");
+        return NULL;
+    }
+    if (process_sampler_start(&self->sampler)) {
+        PyErr_SetString(PyExc_RuntimeError, "Can not start the sampler thread.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+SamplerObject_stop(SamplerObject *self, PyObject *Py_UNUSED(args)) {
+    if (self->is_initialised) {
+        Py_BEGIN_ALLOW_THREADS
+        process_sampler_stop(&self->sampler);
+        Py_END_ALLOW_THREADS
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+SamplerObject_enter(SamplerObject *self, PyObject *Py_UNUSED(args)) {
+    PyObject *result = SamplerObject_start(self, NULL);
+    if (result == NULL) {
+        return NULL;
+    }
+    Py_DECREF(result);
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+SamplerObject_exit(SamplerObject *self, PyObject *Py_UNUSED(args)) {
+    PyObject *result = SamplerObject_stop(self, NULL);
+    if (result == NULL) {
+        return NULL;
+    }
+    Py_DECREF(result);
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+SamplerObject_sample(SamplerObject *self, PyObject *Py_UNUSED(args)) {
+    if (! self->is_initialised) {
+        PyErr_SetString(PyExc_RuntimeError, "Sampler is not initialised.");
+        return NULL;
+    }
+    ProcessSample sample;
+    if (process_sampler_sample(&self->sampler, &sample)) {
+        PyErr_SetString(PyExc_OSError, "Can not read the process memory and CPU usage.");
+        return NULL;
+    }
+    return sample_to_tuple(&sample);
+}
+
+static PyObject *
+SamplerObject_read(SamplerObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"n", NULL};
+    Py_ssize_t limit = -1;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|n", kwlist, &limit)) {
+        return NULL;
+    }
+    if (! self->is_initialised) {
+        PyErr_SetString(PyExc_RuntimeError, "Sampler is not initialised.");
+        return NULL;
+    }
+    size_t count = process_sampler_count(&self->sampler);
+    if (limit >= 0 && (size_t)limit < count) {
+        count = (size_t)limit;
+    }
+    PyObject *ret = PyList_New(0);
+    if (ret == NULL || count == 0) {
+        return ret;
+    }
+    /* Copy out of the ring first so that the sampler thread is never held up by the creation of Python objects. */
+    ProcessSample *samples = PyMem_RawMalloc(count * sizeof(ProcessSample));
+    if (samples == NULL) {
+        Py_DECREF(ret);
+        return PyErr_NoMemory();
+    }
+    count = process_sampler_take(&self->sampler, samples, count);
+    for (size_t i = 0; i < count; ++i) {
+        PyObject *item = sample_to_tuple(&samples[i]);
+        if (item == NULL || PyList_Append(ret, item)) {
+            Py_XDECREF(item);
+            Py_DECREF(ret);
+            PyMem_RawFree(samples);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    PyMem_RawFree(samples);
+    return ret;
+}
+
+static PyObject *
+SamplerObject_getrunning(SamplerObject *self, void *Py_UNUSED(closure)) {
+    return PyBool_FromLong(self->is_initialised && self->sampler.thread_started);
+}
+
+static PyObject *
+SamplerObject_getpending(SamplerObject *self, void *Py_UNUSED(closure)) {
+    return PyLong_FromSize_t(self->is_initialised ? process_sampler_count(&self->sampler) : 0);
+}
+
+static PyObject *
+SamplerObject_getsamples_taken(SamplerObject *self, void *Py_UNUSED(closure)) {
+    return PyLong_FromSize_t(self->sampler.samples_taken);
+}
+
+static PyObject *
+SamplerObject_getsamples_lost(SamplerObject *self, void *Py_UNUSED(closure)) {
+    return PyLong_FromSize_t(self->sampler.samples_lost);
+}
+
+static PyMemberDef SamplerObject_members[] = {
+    {"interval", T_DOUBLE, offsetof(SamplerObject, interval), READONLY, "Sampling interval in seconds."},
+    {"capacity", T_PYSSIZET, offsetof(SamplerObject, capacity), READONLY,
+     "Maximum number of samples held, when full the oldest sample is overwritten."},
+    {NULL, 0, 0, 0, NULL}  /* Sentinel */
+};
+
+static PyGetSetDef SamplerObject_getsetters[] = {
+    {"running", (getter) SamplerObject_getrunning, (setter) NULL, "True if the sampler thread is running.", NULL},
+    {"pending", (getter) SamplerObject_getpending, (setter) NULL, "Number of samples waiting to be read.", NULL},
+    {"samples_taken", (getter) SamplerObject_getsamples_taken, (setter) NULL,
+     "Total number of samples taken by the sampler thread.", NULL},
+    {"samples_lost", (getter) SamplerObject_getsamples_lost, (setter) NULL,
+     "Number of samples overwritten before they were read.", NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+static PyMethodDef SamplerObject_methods[] = {
+    {"start", (PyCFunction) SamplerObject_start, METH_NOARGS,
+     "Start the sampler thread, the first sample is taken immediately."},
+    {"stop", (PyCFunction) SamplerObject_stop, METH_NOARGS,
+     "Stop the sampler thread, samples that have not been read are kept."},
+    {"__enter__", (PyCFunction) SamplerObject_enter, METH_NOARGS, "Start the sampler thread."},
+    {"__exit__", (PyCFunction) SamplerObject_exit, METH_VARARGS, "Stop the sampler thread."},
+    {"sample", (PyCFunction) SamplerObject_sample, METH_NOARGS,
+     "Take a sample now and return it as a tuple, see ``FIELDS``. This is not added to the samples to be read."},
+    {"read", (PyCFunction) SamplerObject_read, METH_VARARGS | METH_KEYWORDS,
+     "Remove and return up to ``n`` of the oldest samples, all of them if ``n`` is -1 (the default)."
+     " Each is a tuple, see ``FIELDS``."},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static PyTypeObject SamplerObjectType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "cProcessSampler.Sampler",
+    .tp_doc = "Sampler(interval=1.0, capacity=65536)\n\n"
+              "A native thread that samples the memory and CPU usage of this process every ``interval`` seconds"
+              " without the GIL. Up to ``capacity`` samples are held until they are read with ``read()``."
+              " This can be used as a context manager that starts and stops the thread.",
+    .tp_basicsize = sizeof(SamplerObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = SamplerObject_new,
+    .tp_init = (initproc) SamplerObject_init,
+    .tp_dealloc = (destructor) SamplerObject_dealloc,
+    .tp_members = SamplerObject_members,
+    .tp_methods = SamplerObject_methods,
+    .tp_getset = SamplerObject_getsetters,
+};
+
+static PyModuleDef cProcessSamplermodule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "cProcessSampler",
+    .m_doc = "A module that samples the memory and CPU usage of this process from a native thread.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC
+PyInit_cProcessSampler(void) {
+    PyObject *m = PyModule_Create(&cProcessSamplermodule);
+    if (m == NULL) {
+        return NULL;
+    }
+    if (PyType_Ready(&SamplerObjectType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&SamplerObjectType);
+    if (PyModule_AddObject(m, "Sampler", (PyObject *) &SamplerObjectType) < 0) {
+        Py_DECREF(&SamplerObjectType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    PyObject *fields = PyTuple_New(SAMPLE_FIELDS_COUNT);
+    if (fields == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    for (size_t i = 0; i < SAMPLE_FIELDS_COUNT; ++i) {
+        PyObject *value = PyUnicode_FromString(SAMPLE_FIELDS[i]);
+        if (value == NULL) {
+            Py_DECREF(fields);
+            Py_DECREF(m);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(fields, i, value);
+    }
+    if (PyModule_AddObject(m, "FIELDS", fields) < 0) {
+        Py_DECREF(fields);
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
+}
@@ -12,20 +12,136 @@
  *  registered using PyEval_SetTrace() will not receive PyTrace_C_CALL, PyTrace_C_EXCEPTION or PyTrace_C_RETURN as a
  *  value for the what parameter.
  *
+ * There are two output formats:
+ *
+ * Text: Events are formatted with snprintf() and written with fputs() as they occur.
+ *
+ * Binary: Fixed size records, see trace_record.h, are copied into a ring buffer on the traced thread and a native
+ *  writer thread, that does not need the GIL, writes them to the log file in batches.
+ *  File and function names are written once to a string table and events refer to them by id.
+ *
+ * The text format can also use a string table with intern_strings. Each new file or function name is written once as
+ *  a line "STR:  <id> <text>" and event lines have the id in place of the name.
+ *
+ * Event times are raw ticks from the clock selected by the clock option, see pymemtrace_clock.h. These are converted
+ *  to seconds since the log file was opened when written as text and by cTraceReader for binary logs.
+ *
+ * Estimate: The RSS is only read when the bytes requested from the Python allocators since the last read reach
+ *  d_rss_trigger. The allocators are wrapped with PyMem_SetAllocator() to count these, see estimate_install().
+ *
+ * Aggregate: No events are written. The change in RSS of each event is added to a table keyed by (code, line), see
+ *  call_site_table.h, and a summary sorted by the total increase in RSS is written when the log file is closed.
+ *
+ * Rotation: The log file is closed and the next segment opened when it reaches rotate_bytes, is rotate_seconds old,
+ *  when rotate() is called or when the signal from set_rotate_signal() has been raised. The signal handler only
+ *  increments a counter that is checked on the next event. Each segment has its own header and string table so can be
+ *  read on its own, event numbers and times carry on from the previous segment.
+ *
+ * Compression: With compression="gzip" the log is written as a gzip file, see trace_compress.h. Text is then also
+ *  written through the ring buffer so that the writer thread, not the thread being traced, compresses it.
+ *
+ * Output: Log files are written to the current working directory or to directory. Alternatively file is a file
+ *  descriptor, such as a pipe or a socket to a collector process, that is duplicated and written to instead. The log
+ *  file has a buffer of buffer_size bytes that is mapped directly, rather than from malloc(), so that it does not
+ *  change how the traced process allocates memory.
+ *
+ * Mapped: With mmap=True a binary log file is written through a shared mapping of the file, see trace_mapped_file.h,
+ *  by the traced thread rather than through the ring buffer. Each record is committed by updating the length after the
+ *  file header so that if the process is killed the log is complete up to the last record.
+ *
+ * Socket: With socket_address there is no log file, the binary records are sent as datagrams to a UNIX domain or
+ *  UDP socket by the writer thread, see trace_socket.h. Datagrams that can not be sent are dropped and counted.
+ *
+ * Filters: With include or exclude the events of code objects that do not pass, see trace_filter.h, are ignored
+ *  without reading the RSS. The decision is cached on the code object with co_extra, see is_code_traced().
+ *
+ * Markers: Other extensions use the C API in the capsule _C_API, see pymemtrace_capi.h, to record their own native
+ *  allocations or points of interest from any thread without the GIL. These go into a lock free queue, see
+ *  trace_marker_queue.h, and the next event of any traced thread writes them to its log, see write_markers().
+ *
+ * Regions: Address ranges such as large native buffers are registered with add_region() or the C API. Events that read
+ *  the RSS also rescan the regions touched since their last scan, see region_residency.h, and write a RESIDENT marker
+ *  for each region whose resident bytes have changed, see write_regions().
+ *
+ * Fork: The child of os.fork() inherits the parent's wrappers, their log files and their ring buffers but not their
+ *  writer threads. An os.register_at_fork() hook in the child drops all of these without writing anything, see
+ *  abandon_trace_wrapper(), and opens new log files, named with the child's pid, that start with a PARENT marker.
+ *  Other hooks, such as that of threading, can run first and be traced so a pthread_atfork() child handler, which runs
+ *  before any of them, sets fork_pending and events are not written until the hook has run, see trace_event().
+ *
 */
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 #include "structmember.h"
 #include "frameobject.h"
+#include "pythread.h"
 
+#include <inttypes.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
 #include <time.h>
 #include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
+#include "call_site_table.h"
 #include "get_rss.h"
+#include "pointer_map.h"
+#include "pymemtrace_clock.h"
 #include "pymemtrace_util.h"
+#include "region_residency.h"
+#include "stack_table.h"
+#include "trace_compress.h"
+#include "trace_filter.h"
+#include "trace_mapped_file.h"
+#include "trace_marker_queue.h"
+#include "trace_record.h"
+#include "trace_ring_buffer.h"
+#include "trace_socket.h"
+
+#define PYMEMTRACE_CAPI_IMPLEMENTATION
+#include "pymemtrace_capi.h"
+
+#if PY_VERSION_HEX < 0x03090000
+/* Python 3.9 added PyFrame_GetCode(), from Python 3.11 it is the only way to get the code object of a frame. */
+static inline PyCodeObject *
+PyFrame_GetCode(PyFrameObject *frame) {
+    Py_INCREF(frame->f_code);
+    return frame->f_code;
+}
+
+/* Python 3.9 added PyFrame_GetBack(), this returns a new reference. */
+static inline PyFrameObject *
+PyFrame_GetBack(PyFrameObject *frame) {
+    Py_XINCREF(frame->f_back);
+    return frame->f_back;
+}
+#endif
+
+#if PY_VERSION_HEX < 0x030C0000
+/* Python 3.12 renamed the co_extra functions, the old names are deprecated. */
+#define PyUnstable_Eval_RequestCodeExtraIndex _PyEval_RequestCodeExtraIndex
+#define PyUnstable_Code_GetExtra _PyCode_GetExtra
+#define PyUnstable_Code_SetExtra _PyCode_SetExtra
+#endif
 
 #define PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH 256
+/* Size of the ring buffer used in binary mode. */
+#define PY_MEM_TRACE_RING_BUFFER_SIZE (4 * 1024 * 1024)
+/* Default size of the stdio buffer of the log file. */
+#define PY_MEM_TRACE_FILE_BUFFER_SIZE (4 * 1024 * 1024)
+/* Largest stack_depth. */
+#define PY_MEM_TRACE_STACK_DEPTH_MAX 128
+/* Length of the text stats line, see write_stats_footer(). */
+#define PY_MEM_TRACE_STATS_TEXT_MAX_LENGTH 512
+/* Markers from other extensions that can be waiting for the next event. */
+#define PY_MEM_TRACE_MARKER_QUEUE_SIZE 1024
 
 #define PY_MEM_TRACE_WRITE_OUTPUT
 //#undef PY_MEM_TRACE_WRITE_OUTPUT
@@ -50,13 +166,150 @@ typedef struct {
     size_t previous_event_number;
     char event_text[PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH];
 #endif
+    /* Binary mode, only used if binary is non-zero. */
+    int binary;
+    /* Text mode with a string table, see write_string(). Always true in binary mode. */
+    int intern_strings;
+    int ring_is_open;
+    TraceRingBuffer ring;
+    TraceRecordEvent previous_record;
+    /* String table that maps a key, such as a str object, to an id. Ids start at 1. */
+    PointerMap string_ids;
+    /* Strong references that keep the string_ids keys alive. */
+    PyObject *string_id_references;
+    /*
+     * Sampling, if sample_every or sample_interval_us is non-zero the RSS is only read when a sample is due and
+     * other events carry forward the last value.
+     */
+    size_t sample_every;
+    long sample_interval_us;
+    size_t sample_event_number;
+    long sample_time_us;
+    /*
+     * Estimate mode, the RSS is also read when estimate_allocated_bytes() has increased by estimate_threshold since
+     * estimate_allocated. Frees do not trigger a read, they are seen at the next one.
+     */
+    int estimate;
+    uint64_t estimate_threshold;
+    uint64_t estimate_allocated;
+    /* Aggregate mode, the keys of call_sites are strong references to code objects. */
+    int aggregate;
+    CallSiteTable call_sites;
+    /* Source of event times, the anchor is when the log file was opened. */
+    PyMemTraceClock clock;
+    /* What is logged as the RSS, a PY_MEM_TRACE_MEM_... field. */
+    unsigned int memory_counter;
+    /*
+     * Rotation, segment is the sequence number in the log file name, -1 for the first segment if rotate_bytes and
+     * rotate_interval_us are both zero. The file name uses start, the time that the first segment was opened.
+     */
+    size_t rotate_bytes;
+    long rotate_interval_us;
+    long segment;
+    long segment_time_us;
+    /* Bytes written to a text segment. */
+    size_t segment_bytes;
+    /* The ring buffer head at the start of a binary segment, the ring buffer is kept from one segment to the next. */
+    size_t segment_head;
+    time_t start;
+    unsigned long thread_id;
+    const char *extension;
+    /* The values of rotate_signal_count and flush_signal_count that this wrapper has acted on. */
+    sig_atomic_t rotate_signal_seen;
+    sig_atomic_t flush_signal_seen;
+    /* A PY_MEM_TRACE_COMPRESSION_... value, the compressor is used by the ring buffer writer thread. */
+    int compression;
+    TraceCompressor compressor;
+    /* Where the log file is written, the current working directory if empty, or a file descriptor if fd >= 0. */
+    char directory[PYMEMTRACE_PATH_MAX];
+    int fd;
+    /* The stdio buffer of the log file, NULL for the stdio default. Each segment reuses it. */
+    char *file_buffer;
+    size_t file_buffer_size;
+    /* Send binary records to a socket rather than a log file, the socket is used by the ring buffer writer thread. */
+    int socket_is_open;
+    TraceSocket socket;
+    /*
+     * Binary mode, if stack_depth is non-zero up to that many callers are recorded for the events that pass
+     * d_rss_trigger. The code objects that are keys of stacks are kept alive by string_id_references.
+     */
+    int stack_depth;
+    StackTable stacks;
+    /* Only the events of code objects that pass this filter are logged, everything if it has no patterns. */
+    TraceFilter filter;
+    /*
+     * Counters of the tracer's own work indexed by TraceStatsCounter, see trace_wrapper_stats().
+     * The times are kept in ticks of clock, the bytes written are only used for text and mapped logs and the records
+     * dropped for text logs.
+     */
+    uint64_t stats[TRACE_STATS_COUNT];
+    /* Set if this wrapper writes markers from other extensions, see marker_attach(). */
+    int markers_attached;
+    /* Binary records are written to mapped_file instead of the ring buffer, extending it by file_buffer_size. */
+    int mapped;
+    TraceMappedFile mapped_file;
 } TraceFileWrapper;
 
+static void write_call_site_summary(TraceFileWrapper *trace_wrapper);
+static void write_stats_footer(TraceFileWrapper *trace_wrapper);
+static void write_markers(TraceFileWrapper *trace_wrapper);
+static void marker_detach(TraceFileWrapper *trace_wrapper);
+static int estimate_remove_pending;
+static void estimate_remove(void);
+static int rotate_trace_wrapper(TraceFileWrapper *trace_wrapper);
+static void flush_trace_wrapper(TraceFileWrapper *trace_wrapper);
+
+/* Incremented by the handlers installed by set_rotate_signal() and set_flush_signal(). */
+static volatile sig_atomic_t rotate_signal_count = 0;
+static volatile sig_atomic_t flush_signal_count = 0;
+
 static void
 TraceFileWrapper_dealloc(TraceFileWrapper *self) {
+    if (self->estimate || estimate_remove_pending) {
+        estimate_remove();
+    }
+    if (self->markers_attached) {
+        /* Any markers left are written before the footer. */
+        write_markers(self);
+        marker_detach(self);
+    }
+    if (self->ring_is_open || self->file) {
+        write_stats_footer(self);
+    }
+    if (self->ring_is_open) {
+        /* Let the writer thread finish without holding the GIL. */
+        Py_BEGIN_ALLOW_THREADS
+        trace_ring_buffer_close(&self->ring);
+        Py_END_ALLOW_THREADS
+        self->ring_is_open = 0;
+    }
+    if (self->socket_is_open) {
+        trace_socket_close(&self->socket);
+        self->socket_is_open = 0;
+    }
+    if (self->aggregate) {
+        if (self->file) {
+            write_call_site_summary(self);
+        }
+        for (size_t i = 0; i < self->call_sites.capacity; ++i) {
+            Py_XDECREF((PyObject *)self->call_sites.entries[i].code);
+        }
+        call_site_table_free(&self->call_sites);
+    }
+    if (self->compressor.is_open) {
+        trace_compress_close(&self->compressor);
+    }
+    trace_mapped_file_close(&self->mapped_file);
     if (self->file) {
         fclose(self->file);
     }
+    if (self->file_buffer) {
+        munmap(self->file_buffer, self->file_buffer_size);
+    }
+    pointer_map_free(&self->string_ids);
+    stack_table_free(&self->stacks);
+    trace_filter_free(&self->filter);
+    Py_XDECREF(self->string_id_references);
     Py_TYPE(self)->tp_free((PyObject *) self);
 }
 
@@ -66,6 +319,13 @@ TraceFileWrapper_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py
     self = (TraceFileWrapper *) type->tp_alloc(type, 0);
     if (self != NULL) {
         self->file = NULL;
+        self->binary = 0;
+        self->intern_strings = 0;
+        self->ring_is_open = 0;
+        self->socket_is_open = 0;
+        self->string_id_references = NULL;
+        self->fd = -1;
+        /* tp_alloc zeroes the object so string_ids is empty and safe to free. */
     }
     return (PyObject *) self;
 }
@@ -107,316 +367,3154 @@ static const char* WHAT_STRINGS[] = {
 };
 #endif
 
-static int
-trace_or_profile_function(PyObject *pobj, PyFrameObject *frame, int what, PyObject *arg) {
-    assert(Py_TYPE(pobj) == &TraceFileWrapperType && "trace_wrapper is not a TraceFileWrapperType.");
+/**** Estimating the RSS from the Python allocators. ****/
 
-    TraceFileWrapper *trace_wrapper = (TraceFileWrapper *)pobj;
-    size_t rss = getCurrentRSS_alternate();
-#ifdef PY_MEM_TRACE_WRITE_OUTPUT
-    const unsigned char *file_name = PyUnicode_1BYTE_DATA(frame->f_code->co_filename);
-    int line_number = PyFrame_GetLineNumber(frame);
-    const char *func_name = NULL;
-    if (what == PyTrace_C_CALL || what == PyTrace_C_EXCEPTION || what == PyTrace_C_RETURN) {
-        func_name = PyEval_GetFuncName(arg);
-    } else {
-        func_name = (const char *)PyUnicode_1BYTE_DATA(frame->f_code->co_name);
-    }
-    long d_rss = rss - trace_wrapper->rss;
-    if (labs(d_rss) >= trace_wrapper->d_rss_trigger
-        && trace_wrapper->event_number > 0
-        && (trace_wrapper->event_number - trace_wrapper->previous_event_number) > 1) {
-        // Previous event.
-#ifdef PY_MEM_TRACE_WRITE_OUTPUT_PREV_NEXT
-        fputs("PREV: ", trace_wrapper->file);
-#endif
-        fputs(trace_wrapper->event_text, trace_wrapper->file);
-    }
-#ifdef PY_MEM_TRACE_WRITE_OUTPUT_CLOCK
-    double clock_time = (double) clock() / CLOCKS_PER_SEC;
-    snprintf(trace_wrapper->event_text, PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH,
-             "%-12zu +%-6ld %-12.6f %-8s %-80s#%4d %-32s %12zu %12ld\n",
-             trace_wrapper->event_number, trace_wrapper->event_number - trace_wrapper->previous_event_number,
-             clock_time, WHAT_STRINGS[what], file_name, line_number, func_name, rss, d_rss);
-#else
-    snprintf(trace_wrapper->event_text, PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH,
-             "%-12zu +%-6ld %-8s %-80s#%4d %-32s %12zu %12ld\n",
-             trace_wrapper->event_number, trace_wrapper->event_number - trace_wrapper->previous_event_number,
-             WHAT_STRINGS[what], file_name, line_number, func_name, rss, d_rss);
-#endif // PY_MEM_TRACE_WRITE_OUTPUT_CLOCK
-    if (labs(d_rss) >= trace_wrapper->d_rss_trigger) {
-#ifdef PY_MEM_TRACE_WRITE_OUTPUT_PREV_NEXT
-        fputs("NEXT: ", trace_wrapper->file);
-//        fputs("      ", trace_wrapper->file);
-#endif
-        fputs(trace_wrapper->event_text, trace_wrapper->file);
-        trace_wrapper->previous_event_number = trace_wrapper->event_number;
-    }
-#endif // PY_MEM_TRACE_WRITE_OUTPUT
-    trace_wrapper->event_number++;
-    trace_wrapper->rss = rss;
-    return 0;
-}
+#define PY_MEM_TRACE_ESTIMATE_DOMAIN_COUNT 3
 
-static TraceFileWrapper *profile_wrapper = NULL;
-static TraceFileWrapper *trace_wrapper = NULL;
+/* The ctx of each wrapped allocator. This is static as a hook may still be called once it has been removed. */
+typedef struct {
+    PyMemAllocatorDomain domain;
+    PyMemAllocatorEx original;
+} EstimateDomain;
 
-static TraceFileWrapper *
-new_trace_wrapper(int d_rss_trigger) {
-    if (trace_wrapper) {
-        TraceFileWrapper_dealloc(trace_wrapper);
-        trace_wrapper = NULL;
-    }
-    char *filename = create_filename();
-    if (filename) {
-#ifdef _WIN32
-        char seperator = '\\';
-#else
-        char seperator = '/';
-#endif
-        fprintf(stdout, "Opening log file %s%c%s\n", current_working_directory(), seperator, filename);
-        trace_wrapper = (TraceFileWrapper *)TraceFileWrapper_new(&TraceFileWrapperType, NULL, NULL);
-        if (trace_wrapper) {
-            trace_wrapper->file = fopen(filename, "w");
-            if (trace_wrapper->file) {
-//                fprintf(trace_wrapper->file, "%s\n", filename);
-#ifdef PY_MEM_TRACE_WRITE_OUTPUT_CLOCK
-#ifdef PY_MEM_TRACE_WRITE_OUTPUT_PREV_NEXT
-                fprintf(trace_wrapper->file, "      %-12s %-6s  %-12s %-8s %-80s#%4s %-32s %12s %12s\n",
-                        "Event", "dEvent", "Clock", "What", "File", "line", "Function", "RSS", "dRSS"
-                );
-#else
-                fprintf(trace_wrapper->file, "%-12s %-6s  %-12s %-8s %-80s#%4s %-32s %12s %12s\n",
-                        "Event", "dEvent", "Clock", "What", "File", "line", "Function", "RSS", "dRSS"
-                );
-#endif
-#else
-#ifdef PY_MEM_TRACE_WRITE_OUTPUT_PREV_NEXT
-                fprintf(trace_wrapper->file, "      %-12s %-6s  %-8s %-80s#%4s %-32s %12s %12s\n",
-                        "Event", "dEvent", "What", "File", "line", "Function", "RSS", "dRSS"
-                );
-#else
-                fprintf(trace_wrapper->file, "%-12s %-6s  %-8s %-80s#%4s %-32s %12s %12s\n",
-                        "Event", "dEvent", "What", "File", "line", "Function", "RSS", "dRSS"
-                );
-#endif
-#endif
-                trace_wrapper->event_number = 0;
-                trace_wrapper->rss = 0;
-                if (d_rss_trigger < 0) {
-                    trace_wrapper->d_rss_trigger = getpagesize();
-                } else  {
-                    trace_wrapper->d_rss_trigger = d_rss_trigger;
-                }
-#ifdef PY_MEM_TRACE_WRITE_OUTPUT
-                trace_wrapper->previous_event_number = 0;
-#endif
-            } else {
-                TraceFileWrapper_dealloc(trace_wrapper);
-                fprintf(stderr, "Can not open writable file for TraceFileWrapper at %s\n", filename);
-                return NULL;
-            }
-        } else {
-            fprintf(stderr, "Can not create TraceFileWrapper.\n");
-        }
-    }
-    return trace_wrapper;
-}
+static EstimateDomain estimate_domains[PY_MEM_TRACE_ESTIMATE_DOMAIN_COUNT] = {
+    {PYMEM_DOMAIN_RAW, {NULL, NULL, NULL, NULL, NULL}},
+    {PYMEM_DOMAIN_MEM, {NULL, NULL, NULL, NULL, NULL}},
+    {PYMEM_DOMAIN_OBJ, {NULL, NULL, NULL, NULL, NULL}},
+};
+/* Total bytes requested from the wrapped allocators, the RAW domain may be used without the GIL. */
+static uint64_t estimate_bytes = 0;
+/* The number of TraceFileWrappers in estimate mode. */
+static size_t estimate_users = 0;
+/* Non-zero while the hooks are installed. */
+static int estimate_hooked = 0;
+/* Non-zero if the hooks are installed without a user as they could not be removed, see estimate_remove(). */
+static int estimate_remove_pending = 0;
 
-static PyObject *
-py_attach_profile_function(int d_rss_trigger) {
-    TraceFileWrapper *wrapper = new_trace_wrapper(d_rss_trigger);
-    if (wrapper) {
-        PyEval_SetProfile(&trace_or_profile_function, (PyObject *)wrapper);
-        Py_RETURN_NONE;
-    }
-    PyErr_SetString(PyExc_RuntimeError, "Could not attach profile function.");
-    return NULL;
+static inline uint64_t
+estimate_allocated_bytes(void) {
+    return __atomic_load_n(&estimate_bytes, __ATOMIC_RELAXED);
 }
 
-static PyObject *
-py_detach_profile_function() {
-    if (profile_wrapper) {
-        TraceFileWrapper_dealloc(profile_wrapper);
-        profile_wrapper = NULL;
-    }
-    PyEval_SetProfile(NULL, NULL);
-    Py_RETURN_NONE;
+static inline void
+estimate_count(size_t size) {
+    __atomic_add_fetch(&estimate_bytes, (uint64_t)size, __ATOMIC_RELAXED);
 }
 
-static PyObject *
-py_attach_trace_function(int d_rss_trigger) {
-    TraceFileWrapper *wrapper = new_trace_wrapper(d_rss_trigger);
-    if (wrapper) {
-        PyEval_SetTrace(&trace_or_profile_function, (PyObject *)wrapper);
-        Py_RETURN_NONE;
-    }
-    PyErr_SetString(PyExc_RuntimeError, "Could not attach trace function.");
-    return NULL;
+static void *
+estimate_malloc(void *ctx, size_t size) {
+    EstimateDomain *domain = (EstimateDomain *)ctx;
+    estimate_count(size);
+    return domain->original.malloc(domain->original.ctx, size);
 }
 
-static PyObject *
-py_detach_trace_function() {
-    if (trace_wrapper) {
-        TraceFileWrapper_dealloc(trace_wrapper);
-        trace_wrapper = NULL;
-    }
-    PyEval_SetTrace(NULL, NULL);
-    Py_RETURN_NONE;
+static void *
+estimate_calloc(void *ctx, size_t nelem, size_t elsize) {
+    EstimateDomain *domain = (EstimateDomain *)ctx;
+    estimate_count(nelem * elsize);
+    return domain->original.calloc(domain->original.ctx, nelem, elsize);
 }
 
-static PyObject *
-py_rss() {
-    return PyLong_FromSize_t(getCurrentRSS_alternate());
+/* The old size is not known so the whole of new_size is counted, geometric growth keeps this proportional. */
+static void *
+estimate_realloc(void *ctx, void *ptr, size_t new_size) {
+    EstimateDomain *domain = (EstimateDomain *)ctx;
+    estimate_count(new_size);
+    return domain->original.realloc(domain->original.ctx, ptr, new_size);
 }
 
-static PyObject *
-py_rss_peak() {
-    return PyLong_FromSize_t(getPeakRSS());
+static void
+estimate_free(void *ctx, void *ptr) {
+    EstimateDomain *domain = (EstimateDomain *)ctx;
+    domain->original.free(domain->original.ctx, ptr);
 }
 
-static PyMethodDef cPyMemTraceMethods[] = {
-    {"rss",   (PyCFunction) py_rss, METH_NOARGS, "Return the current RSS in bytes."},
-    {"rss_peak",   (PyCFunction) py_rss_peak, METH_NOARGS, "Return the peak RSS in bytes."},
-    {NULL, NULL, 0, NULL}        /* Sentinel */
-};
-
-/**** Context manager for attach_profile_function() and detach_profile_function() ****/
-typedef struct {
-    PyObject_HEAD
-    int d_rss_trigger;
-} ProfileObject;
+/*
+ * Wrap the RAW, MEM and OBJ allocators for the first user. The GIL must be held.
+ */
+static void
+estimate_install(void) {
+    if (estimate_users++ || estimate_hooked) {
+        /* Hooks left in place by estimate_remove() are used again. */
+        estimate_remove_pending = 0;
+        return;
+    }
+    PyMemAllocatorEx hooks = {
+        .malloc = estimate_malloc,
+        .calloc = estimate_calloc,
+        .realloc = estimate_realloc,
+        .free = estimate_free,
+    };
+    for (int d = 0; d < PY_MEM_TRACE_ESTIMATE_DOMAIN_COUNT; ++d) {
+        PyMem_GetAllocator(estimate_domains[d].domain, &estimate_domains[d].original);
+        hooks.ctx = &estimate_domains[d];
+        PyMem_SetAllocator(estimate_domains[d].domain, &hooks);
+    }
+    estimate_hooked = 1;
+}
 
+/*
+ * Restore the allocators after the last user, or retry that if removal is pending. The GIL must be held.
+ * If another hook, such as cMallocTrace, has been installed over ours then removing ours would remove that as well so
+ * ours are left in place and removal is pending. They only count bytes and are removed when this is next called, by
+ * the next TraceFileWrapper to be deallocated, once that hook has gone.
+ */
 static void
-ProfileObject_dealloc(ProfileObject *self) {
-    Py_TYPE(self)->tp_free((PyObject *) self);
+estimate_remove(void) {
+    if (estimate_users && --estimate_users) {
+        return;
+    }
+    if (! estimate_hooked) {
+        return;
+    }
+    for (int d = 0; d < PY_MEM_TRACE_ESTIMATE_DOMAIN_COUNT; ++d) {
+        PyMemAllocatorEx current;
+        PyMem_GetAllocator(estimate_domains[d].domain, &current);
+        if (current.malloc != estimate_malloc || current.ctx != &estimate_domains[d]) {
+            estimate_remove_pending = 1;
+            return;
+        }
+    }
+    for (int d = 0; d < PY_MEM_TRACE_ESTIMATE_DOMAIN_COUNT; ++d) {
+        PyMem_SetAllocator(estimate_domains[d].domain, &estimate_domains[d].original);
+    }
+    estimate_hooked = 0;
+    estimate_remove_pending = 0;
 }
 
-static PyObject *
-ProfileObject_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds)) {
-    ProfileObject *self = (ProfileObject *) type->tp_alloc(type, 0);
-    return (PyObject *) self;
+/* A monotonic time in microseconds for sample_interval_us. */
+static long
+monotonic_time_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long)now.tv_sec * 1000000L + now.tv_nsec / 1000L;
+}
+
+/* Non-zero if the RSS is not read on every event. */
+static inline int
+is_sampling(const TraceFileWrapper *trace_wrapper) {
+    return trace_wrapper->sample_every || trace_wrapper->sample_interval_us || trace_wrapper->estimate;
 }
 
+/*
+ * Decide if the RSS should be read for this event.
+ * The first event is always sampled.
+ */
 static int
-ProfileObject_init(ProfileObject *self, PyObject *args, PyObject *kwds) {
-    static char *kwlist[] = {"d_rss_trigger", NULL};
-    int d_rss_trigger = -1;
-    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &d_rss_trigger)) {
-        return -1;
+is_sample_due(TraceFileWrapper *trace_wrapper) {
+    if (! is_sampling(trace_wrapper)) {
+        return 1;
     }
-    self->d_rss_trigger = d_rss_trigger;
-    return 0;
+    int due = trace_wrapper->event_number == 0;
+    uint64_t allocated = 0;
+    if (trace_wrapper->estimate) {
+        allocated = estimate_allocated_bytes();
+        if (allocated - trace_wrapper->estimate_allocated >= trace_wrapper->estimate_threshold) {
+            due = 1;
+        }
+    }
+    if (trace_wrapper->sample_every
+        && trace_wrapper->event_number - trace_wrapper->sample_event_number >= trace_wrapper->sample_every) {
+        due = 1;
+    }
+    long now = 0;
+    if (trace_wrapper->sample_interval_us) {
+        now = monotonic_time_us();
+        if (now - trace_wrapper->sample_time_us >= trace_wrapper->sample_interval_us) {
+            due = 1;
+        }
+    }
+    if (due) {
+        trace_wrapper->sample_event_number = trace_wrapper->event_number;
+        trace_wrapper->sample_time_us = now;
+        trace_wrapper->estimate_allocated = allocated;
+    }
+    return due;
 }
 
-static PyObject *
-ProfileObject_enter(ProfileObject *self) {
-    py_attach_profile_function(self->d_rss_trigger);
-    Py_INCREF(self);
-    return (PyObject *) self;
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT
+/*
+ * When sampling add a final column to a line of text that ends with a newline.
+ */
+static void
+append_sampled_column(char *text, size_t size, const char *value) {
+    size_t length = strlen(text);
+    if (length > 0 && text[length - 1] == '\n') {
+        snprintf(text + length - 1, size - length + 1, " %s\n", value);
+    }
 }
+#endif
 
-static PyObject *
-ProfileObject_exit(ProfileObject *Py_UNUSED(self), PyObject *Py_UNUSED(args)) {
-    py_detach_profile_function();
-    Py_RETURN_FALSE;
+/*
+ * Write a binary record to the mapped file or to the ring buffer, where it may be dropped if the buffer is full.
+ * Returns 0 on success, non-zero if the record was dropped.
+ */
+static inline int
+write_record(TraceFileWrapper *trace_wrapper, const void *record, size_t size) {
+    if (trace_wrapper->mapped_file.is_open) {
+        if (trace_mapped_file_write(&trace_wrapper->mapped_file, record, size)) {
+            return -1;
+        }
+        trace_wrapper->stats[TRACE_STATS_BYTES_WRITTEN] += size;
+        return 0;
+    }
+    return trace_ring_buffer_write(&trace_wrapper->ring, record, size);
 }
 
-static PyMethodDef ProfileObject_methods[] = {
-        {"__enter__", (PyCFunction) ProfileObject_enter, METH_NOARGS,
-         "Attach a Profile object to the C runtime."},
-        {"__exit__", (PyCFunction) ProfileObject_exit, METH_VARARGS,
-         "Detach a Profile object from the C runtime."},
-        {NULL, NULL, 0, NULL}  /* Sentinel */
-};
-
-static PyTypeObject ProfileObjectType = {
-        PyVarObject_HEAD_INIT(NULL, 0)
-        .tp_name = "cPyMemTrace.Profile",
-        .tp_doc = "A context manager to attach a C profile function to the interpreter.\n"
-                  "This takes one optional argument, ``d_rss_trigger``, that decides when a trace event gets recorded."
-                  " Suitable values:\n\n-1 : whenever an RSS change >= page size (usually 4096 bytes) is noticed."
-                  "\n\n0 : every event.\n\nn: whenever an RSS change >= n is noticed."
-                  "\n\nDefault is -1."
-                  "\n\nThis is slightly less invasive profiling than ``cPyMemTrace.Trace`` as the profile function is"
-                  " called for all monitored events except the Python ``PyTrace_LINE PyTrace_OPCODE`` and"
-                  " ``PyTrace_EXCEPTION`` events."
-                  "\n\nThis writes to a file in the current working directory named \"YYYYmmdd_HHMMSS_<PID>.log\""
-                  ,
-        .tp_basicsize = sizeof(ProfileObject),
-        .tp_itemsize = 0,
-        .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
-        .tp_new = ProfileObject_new,
-        .tp_init = (initproc) ProfileObject_init,
-        .tp_dealloc = (destructor) ProfileObject_dealloc,
-        .tp_methods = ProfileObject_methods,
-};
-/**** END: Context manager for attach_profile_function() and detach_profile_function() ****/
-
-/**** Context manager for attach_trace_function() and detach_trace_function() ****/
-typedef struct {
-    PyObject_HEAD
-    int d_rss_trigger;
-} TraceObject;
-
-static void
-TraceObject_dealloc(TraceObject *self) {
-    Py_TYPE(self)->tp_free((PyObject *) self);
+/*
+ * Write a binary record that must not be dropped, such as a string, waiting for space in the ring buffer.
+ * The mapped file can still fail to be extended, a record that defines an id must then not be cached so that it is
+ * written again when the id is next needed.
+ * Returns 0 on success, non-zero if the record could not be written.
+ */
+static inline int
+write_record_wait(TraceFileWrapper *trace_wrapper, const void *record, size_t size) {
+    if (trace_wrapper->mapped_file.is_open) {
+        if (trace_mapped_file_write(&trace_wrapper->mapped_file, record, size)) {
+            return -1;
+        }
+        trace_wrapper->stats[TRACE_STATS_BYTES_WRITTEN] += size;
+        return 0;
+    }
+    return trace_ring_buffer_write_wait(&trace_wrapper->ring, record, size);
 }
 
-static PyObject *
-TraceObject_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds)) {
-    TraceObject *self = (TraceObject *) type->tp_alloc(type, 0);
-    return (PyObject *) self;
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT
+/*
+ * Write to a text log file counting the bytes for rotate_bytes.
+ * When compressing this goes through the ring buffer and is never dropped.
+ */
+static inline void
+write_text(TraceFileWrapper *trace_wrapper, const char *text) {
+    size_t length = strlen(text);
+    trace_wrapper->segment_bytes += length;
+    trace_wrapper->stats[TRACE_STATS_BYTES_WRITTEN] += length;
+    if (trace_wrapper->ring_is_open) {
+        trace_ring_buffer_write_wait(&trace_wrapper->ring, text, length);
+    } else if (! trace_wrapper->compression) {
+        fputs(text, trace_wrapper->file);
+    }
 }
 
+/*
+ * Write a string table entry.
+ * String records are never dropped by the ring buffer.
+ * Returns 0 on success, non-zero if the record could not be written.
+ */
 static int
-TraceObject_init(TraceObject *self, PyObject *args, PyObject *kwds) {
-    static char *kwlist[] = {"d_rss_trigger", NULL};
-    int d_rss_trigger = -1;
-    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &d_rss_trigger)) {
-        return -1;
+write_string(TraceFileWrapper *trace_wrapper, uint32_t id, const char *text) {
+    if (! trace_wrapper->binary) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "STR:  %-12u ", id);
+        write_text(trace_wrapper, prefix);
+        write_text(trace_wrapper, text);
+        write_text(trace_wrapper, "\n");
+        return 0;
     }
-    self->d_rss_trigger = d_rss_trigger;
-    return 0;
+    size_t length = strlen(text);
+    size_t size = TRACE_RECORD_ALIGN(sizeof(TraceRecordString) + length);
+    unsigned char buffer[512];
+    unsigned char *record = buffer;
+    if (size > sizeof(buffer)) {
+        record = malloc(size);
+        if (record == NULL) {
+            return -1;
+        }
+    }
+    memset(record, 0, size);
+    TraceRecordString *header = (TraceRecordString *)record;
+    header->type = TRACE_RECORD_STRING;
+    header->id = id;
+    header->length = (uint32_t)length;
+    memcpy(record + sizeof(TraceRecordString), text, length);
+    int result = write_record_wait(trace_wrapper, record, size);
+    if (record != buffer) {
+        free(record);
+    }
+    return result;
 }
 
-static PyObject *
-TraceObject_enter(TraceObject *self) {
-    /* Could use cPyMemTracemodule. */
-    py_attach_trace_function(self->d_rss_trigger);
-    Py_INCREF(self);
-    return (PyObject *) self;
+/*
+ * Returns the string table id for key, creating a new entry and writing a string record if key has not been seen.
+ * owner, if non-NULL, is the object that owns key and a reference is kept to it so that key can not be reused.
+ * text is only used for a new entry.
+ * Returns 0 on failure, 0 is never a valid id.
+ */
+static uint32_t
+string_id(TraceFileWrapper *trace_wrapper, const void *key, PyObject *owner, const char *text) {
+    uint32_t id;
+    if (pointer_map_get(&trace_wrapper->string_ids, key, &id)) {
+        return id;
+    }
+    id = (uint32_t)(trace_wrapper->string_ids.size + 1);
+    if (owner && PyList_Append(trace_wrapper->string_id_references, owner)) {
+        PyErr_Clear();
+        return 0;
+    }
+    /* Written before it is cached so a string that could not be written is tried again, with the same id. */
+    if (write_string(trace_wrapper, id, text ? text : "")) {
+        return 0;
+    }
+    if (pointer_map_insert(&trace_wrapper->string_ids, key, id)) {
+        return 0;
+    }
+    return id;
 }
 
-static PyObject *
-TraceObject_exit(TraceObject *Py_UNUSED(self), PyObject *Py_UNUSED(args)) {
-    /* Could use cPyMemTracemodule. */
-    py_detach_trace_function();
-    Py_RETURN_FALSE;
-}
+/* String table id for a str object. */
+static uint32_t
+string_id_from_str(TraceFileWrapper *trace_wrapper, PyObject *str) {
+    uint32_t id;
+    if (pointer_map_get(&trace_wrapper->string_ids, str, &id)) {
+        return id;
+    }
+    const char *text = PyUnicode_AsUTF8(str);
+    if (text == NULL) {
+        PyErr_Clear();
+        text = "";
+    }
+    return string_id(trace_wrapper, str, str, text);
+}
+
+/*
+ * String table id for the name of a C function.
+ * This is keyed on something stable, for builtins that is the PyMethodDef not the (possibly bound and temporary)
+ * PyCFunctionObject.
+ * The text is the same as PyEval_GetFuncName().
+ */
+static uint32_t
+string_id_from_c_function(TraceFileWrapper *trace_wrapper, PyObject *func) {
+    if (PyCFunction_Check(func)) {
+        PyMethodDef *method_def = ((PyCFunctionObject *)func)->m_ml;
+        return string_id(trace_wrapper, method_def, NULL, method_def->ml_name);
+    } else if (PyMethod_Check(func)) {
+        return string_id_from_c_function(trace_wrapper, PyMethod_GET_FUNCTION(func));
+    } else if (PyFunction_Check(func)) {
+        return string_id_from_str(trace_wrapper, ((PyFunctionObject *)func)->func_name);
+    } else if (PyType_Check(func)) {
+        /* A type called by sys.monitoring CALL, bytearray() for example. */
+        return string_id(trace_wrapper, func, func, ((PyTypeObject *)func)->tp_name);
+    }
+    return string_id(trace_wrapper, Py_TYPE(func), (PyObject *)Py_TYPE(func), Py_TYPE(func)->tp_name);
+}
+
+/*
+ * Write the stack records for up to stack_depth callers of frame and return the stack id of the innermost caller, 0 if
+ * there are none.
+ * If frame is NULL, as for sys.monitoring, the current frame is used unless it is the frame of code.
+ * This is only called for the events that pass d_rss_trigger, walking the frames may create frame objects.
+ */
+static uint32_t
+write_stack(TraceFileWrapper *trace_wrapper, PyFrameObject *frame, PyCodeObject *code) {
+    PyFrameObject *frames[PY_MEM_TRACE_STACK_DEPTH_MAX];
+    int depth = 0;
+    PyFrameObject *caller;
+    if (frame) {
+        caller = PyFrame_GetBack(frame);
+    } else {
+        caller = PyEval_GetFrame();
+        Py_XINCREF(caller);
+        if (caller) {
+            PyCodeObject *caller_code = PyFrame_GetCode(caller);
+            if (caller_code == code) {
+                PyFrameObject *back = PyFrame_GetBack(caller);
+                Py_DECREF(caller);
+                caller = back;
+            }
+            Py_DECREF(caller_code);
+        }
+    }
+    while (caller && depth < trace_wrapper->stack_depth) {
+        frames[depth++] = caller;
+        caller = PyFrame_GetBack(caller);
+    }
+    Py_XDECREF(caller);
+    /* From the outermost frame so that stacks with the same callers share their nodes. */
+    uint32_t stack_id = 0;
+    for (int i = depth - 1; i >= 0; --i) {
+        PyCodeObject *frame_code = PyFrame_GetCode(frames[i]);
+        int line_number = PyFrame_GetLineNumber(frames[i]);
+        int is_new;
+        uint32_t id = stack_table_get(&trace_wrapper->stacks, stack_id, frame_code, line_number, &is_new);
+        if (is_new) {
+            if (PyList_Append(trace_wrapper->string_id_references, (PyObject *)frame_code)) {
+                PyErr_Clear();
+            }
+            TraceRecordStack record;
+            memset(&record, 0, sizeof(record));
+            record.type = TRACE_RECORD_STACK;
+            record.id = id;
+            record.parent_id = stack_id;
+            record.file_id = string_id_from_str(trace_wrapper, frame_code->co_filename);
+            record.func_id = string_id_from_str(trace_wrapper, frame_code->co_name);
+            record.line_number = line_number;
+            /* Like strings these are never dropped by the ring buffer. */
+            if (write_record_wait(trace_wrapper, &record, sizeof(record))) {
+                /* Written when next seen, the callers of the event are then unknown. */
+                stack_table_remove(&trace_wrapper->stacks, stack_id, frame_code, line_number);
+                id = 0;
+            }
+        }
+        Py_DECREF(frame_code);
+        stack_id = id;
+        if (stack_id == 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < depth; ++i) {
+        Py_DECREF(frames[i]);
+    }
+    return stack_id;
+}
+
+/*
+ * Binary equivalent of the text output in trace_or_profile_function().
+ * The previous event is kept as a record rather than as text and is written with the PREV flag.
+ */
+static void
+write_binary_event(TraceFileWrapper *trace_wrapper, PyFrameObject *frame, PyCodeObject *code, int line_number,
+                   int what, PyObject *arg, size_t rss, int sampled, uint64_t clock) {
+    long d_rss = rss - trace_wrapper->rss;
+    int triggered = labs(d_rss) >= trace_wrapper->d_rss_trigger;
+    TraceRecordEvent *record = &trace_wrapper->previous_record;
+    if (triggered
+        && trace_wrapper->event_number > 0
+        && (trace_wrapper->event_number - trace_wrapper->previous_event_number) > 1) {
+        record->flags |= TRACE_RECORD_FLAG_PREV;
+        if (write_record(trace_wrapper, record, sizeof(TraceRecordEvent)) == 0) {
+            trace_wrapper->stats[TRACE_STATS_EVENTS_WRITTEN]++;
+        }
+    }
+    record->type = TRACE_RECORD_EVENT;
+    record->what = (uint8_t)what;
+    record->flags = sampled ? TRACE_RECORD_FLAG_SAMPLED : 0;
+    record->line_number = line_number;
+    record->file_id = string_id_from_str(trace_wrapper, code->co_filename);
+    if (what == PyTrace_C_CALL || what == PyTrace_C_EXCEPTION || what == PyTrace_C_RETURN) {
+        record->func_id = string_id_from_c_function(trace_wrapper, arg);
+    } else {
+        record->func_id = string_id_from_str(trace_wrapper, code->co_name);
+    }
+    record->event_number = trace_wrapper->event_number;
+    record->clock = clock;
+    record->rss = rss;
+    record->d_rss = d_rss;
+    if (triggered) {
+        /* Any new stack records must come first, the stack reference immediately follows its event. */
+        uint32_t stack_id = trace_wrapper->stack_depth ? write_stack(trace_wrapper, frame, code) : 0;
+        record->flags |= TRACE_RECORD_FLAG_NEXT;
+        if (write_record(trace_wrapper, record, sizeof(TraceRecordEvent)) == 0) {
+            trace_wrapper->stats[TRACE_STATS_EVENTS_WRITTEN]++;
+        }
+        if (stack_id) {
+            TraceRecordEventStack event_stack;
+            memset(&event_stack, 0, sizeof(event_stack));
+            event_stack.type = TRACE_RECORD_EVENT_STACK;
+            event_stack.stack_id = stack_id;
+            event_stack.event_number = record->event_number;
+            write_record(trace_wrapper, &event_stack, sizeof(event_stack));
+        }
+        trace_wrapper->previous_event_number = trace_wrapper->event_number;
+    }
+}
+#endif // PY_MEM_TRACE_WRITE_OUTPUT
+
+/*
+ * Add the change in RSS to the call site (code, line_number).
+ */
+static void
+aggregate_event(TraceFileWrapper *trace_wrapper, PyCodeObject *code, int line_number, long d_rss) {
+    int is_new;
+    CallSiteEntry *entry = call_site_table_get(&trace_wrapper->call_sites, code, line_number, &is_new);
+    if (entry == NULL) {
+        return;
+    }
+    if (is_new) {
+        /* Released in TraceFileWrapper_dealloc(). */
+        Py_INCREF(code);
+    }
+    call_site_entry_add(entry, d_rss);
+}
+
+/*
+ * Write the call sites, largest total increase in RSS first, to the log file.
+ */
+static void
+write_call_site_summary(TraceFileWrapper *trace_wrapper) {
+    const CallSiteEntry **sorted = call_site_table_sorted(&trace_wrapper->call_sites);
+    if (sorted == NULL) {
+        fprintf(stderr, "Can not sort call sites.\n");
+        return;
+    }
+    fprintf(trace_wrapper->file, "%-80s#%4s %-32s %12s %12s %12s %12s\n",
+            "File", "line", "Function", "Count", "dRSS+", "dRSS-", "dRSSmax");
+    for (size_t i = 0; i < trace_wrapper->call_sites.size; ++i) {
+        const CallSiteEntry *entry = sorted[i];
+        PyCodeObject *code = (PyCodeObject *)entry->code;
+        fprintf(trace_wrapper->file, "%-80s#%4d %-32s %12" PRIu64 " %12" PRId64 " %12" PRId64 " %12" PRId64 "\n",
+                PyUnicode_1BYTE_DATA(code->co_filename), entry->line_number, PyUnicode_1BYTE_DATA(code->co_name),
+                entry->count, entry->d_rss_positive, entry->d_rss_negative, entry->d_rss_max);
+    }
+    free((void *)sorted);
+}
+
+/* The size of the current segment of the log file. */
+static inline size_t
+segment_size(const TraceFileWrapper *trace_wrapper) {
+    if (trace_wrapper->binary) {
+        if (trace_wrapper->mapped_file.is_open) {
+            return trace_wrapper->mapped_file.length;
+        }
+        return sizeof(TraceFileHeader) + trace_wrapper->ring.head - trace_wrapper->segment_head;
+    }
+    return trace_wrapper->segment_bytes;
+}
+
+/*
+ * Act on the flush and rotate signals and rotate the log file if it has reached rotate_bytes or rotate_interval_us.
+ * This is called before each event is recorded.
+ */
+static inline void
+check_rotation(TraceFileWrapper *trace_wrapper) {
+    if (trace_wrapper->flush_signal_seen != flush_signal_count) {
+        trace_wrapper->flush_signal_seen = flush_signal_count;
+        flush_trace_wrapper(trace_wrapper);
+    }
+    int due = 0;
+    if (trace_wrapper->rotate_signal_seen != rotate_signal_count) {
+        trace_wrapper->rotate_signal_seen = rotate_signal_count;
+        due = 1;
+    } else if (trace_wrapper->rotate_bytes && segment_size(trace_wrapper) >= trace_wrapper->rotate_bytes) {
+        due = 1;
+    } else if (trace_wrapper->rotate_interval_us
+               && monotonic_time_us() - trace_wrapper->segment_time_us >= trace_wrapper->rotate_interval_us) {
+        due = 1;
+    }
+    if (due) {
+        /* On failure the current segment is kept. */
+        rotate_trace_wrapper(trace_wrapper);
+    }
+}
+
+/*
+ * Add the ticks since start to a stats counter and return the current ticks.
+ * A clock such as the time stamp counter may step back when the thread moves to another core.
+ */
+static inline uint64_t
+stats_add_ticks(TraceFileWrapper *trace_wrapper, int counter, uint64_t start) {
+    uint64_t now = pymemtrace_clock_ticks(&trace_wrapper->clock);
+    if (now > start) {
+        trace_wrapper->stats[counter] += now - start;
+    }
+    return now;
+}
+
+/**** Markers from other extensions, see pymemtrace_capi.h. ****/
+/*
+ * Any thread pushes markers on to marker_queue while marker_wrapper_count is non-zero. The queue is opened by the
+ * first wrapper that writes markers and is never closed as a thread may be pushing at any time.
+ * The traced threads pop them, they hold the GIL so there is only one consumer at a time.
+ * Each marker is written to one log, that of the first traced thread to have an event after it was pushed. Marker
+ * times are from the monotonic clock and are converted to the clock of that log.
+ */
+static TraceMarkerQueue marker_queue;
+static PyMemTraceClock marker_clock;
+static int marker_queue_is_open = 0;
+static int marker_wrapper_count = 0;
+
+/*
+ * Start writing markers to this wrapper's log, opening the queue the first time.
+ * Returns 0 on success, -1 if the queue can not be opened.
+ */
+static int
+marker_attach(TraceFileWrapper *trace_wrapper) {
+    if (! marker_queue_is_open) {
+        if (trace_marker_queue_open(&marker_queue, PY_MEM_TRACE_MARKER_QUEUE_SIZE)) {
+            return -1;
+        }
+        pymemtrace_clock_init(&marker_clock, PY_MEM_TRACE_CLOCK_MONOTONIC);
+        marker_queue_is_open = 1;
+    } else if (marker_wrapper_count == 0) {
+        /* Discard any markers pushed while the last tracer was stopping. */
+        TraceMarker marker;
+        while (trace_marker_queue_pop(&marker_queue, &marker)) {
+        }
+    }
+    /* Release so that a thread that sees the count also sees the open queue. */
+    __atomic_add_fetch(&marker_wrapper_count, 1, __ATOMIC_RELEASE);
+    trace_wrapper->markers_attached = 1;
+    return 0;
+}
+
+static void
+marker_detach(TraceFileWrapper *trace_wrapper) {
+    __atomic_sub_fetch(&marker_wrapper_count, 1, __ATOMIC_RELEASE);
+    trace_wrapper->markers_attached = 0;
+}
+
+/*
+ * Queue a marker, this is called by other extensions from any thread with or without the GIL.
+ * Returns one of the PYMEMTRACE_MARKER_... values.
+ */
+static int
+marker_push(int kind, size_t size, const char *label) {
+    if (__atomic_load_n(&marker_wrapper_count, __ATOMIC_ACQUIRE) == 0) {
+        return PYMEMTRACE_MARKER_NOT_TRACING;
+    }
+    TraceMarker marker;
+    marker.clock = pymemtrace_clock_ticks(&marker_clock);
+    /* This is pthread_self() and does not need the GIL. */
+    marker.thread_id = (uint64_t)PyThread_get_thread_ident();
+    marker.size = (int64_t)size;
+    marker.kind = (uint8_t)kind;
+    trace_marker_queue_set_label(&marker, label);
+    return trace_marker_queue_push(&marker_queue, &marker) ? PYMEMTRACE_MARKER_DROPPED : PYMEMTRACE_MARKER_QUEUED;
+}
+
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT
+/* The marker time in ticks of the wrapper's clock, via the wall clock anchors if that is not the monotonic clock. */
+static uint64_t
+marker_ticks(const TraceFileWrapper *trace_wrapper, uint64_t ticks) {
+    if (trace_wrapper->clock.source == marker_clock.source) {
+        return ticks;
+    }
+    double seconds = pymemtrace_clock_seconds(&marker_clock, ticks)
+                     + (double)(marker_clock.anchor_wall_ns - trace_wrapper->clock.anchor_wall_ns) / 1e9;
+    return trace_wrapper->clock.anchor_ticks
+           + (uint64_t)(int64_t)(seconds * (double)trace_wrapper->clock.ticks_per_second);
+}
+
+/*
+ * Write a marker as a record or a "MARK:" line, it comes before the event event_number.
+ * The label is interned so that the string table has one entry for each label.
+ */
+static void
+write_marker(TraceFileWrapper *trace_wrapper, const TraceMarker *marker) {
+    static const char *const kind_names[TRACE_MARKER_KIND_COUNT] = TRACE_MARKER_KIND_NAMES;
+    uint64_t clock = marker_ticks(trace_wrapper, marker->clock);
+    uint32_t label_id = 0;
+    if (trace_wrapper->intern_strings) {
+        PyObject *label = PyUnicode_DecodeUTF8(marker->label, (Py_ssize_t)strlen(marker->label), "replace");
+        if (label == NULL) {
+            PyErr_Clear();
+            return;
+        }
+        PyUnicode_InternInPlace(&label);
+        label_id = string_id_from_str(trace_wrapper, label);
+        Py_DECREF(label);
+    }
+    if (trace_wrapper->binary) {
+        TraceRecordMarker record;
+        memset(&record, 0, sizeof(record));
+        record.type = TRACE_RECORD_MARKER;
+        record.kind = marker->kind;
+        record.label_id = label_id;
+        record.event_number = trace_wrapper->event_number;
+        record.clock = clock;
+        record.thread_id = marker->thread_id;
+        record.size = marker->size;
+        /* Dropped like an event if the ring buffer is full. */
+        write_record(trace_wrapper, &record, sizeof(record));
+        return;
+    }
+    char text[PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH];
+    int length = snprintf(text, sizeof(text), "%s %-12zu %-12.6f %-8s %-20" PRIu64 " %12" PRId64 " ",
+                          TRACE_MARKER_TEXT_PREFIX, trace_wrapper->event_number,
+                          pymemtrace_clock_seconds(&trace_wrapper->clock, clock),
+                          kind_names[marker->kind < TRACE_MARKER_KIND_COUNT ? marker->kind : 0], marker->thread_id,
+                          marker->size);
+    if (trace_wrapper->intern_strings) {
+        snprintf(text + length, sizeof(text) - length, "%u\n", label_id);
+    } else {
+        snprintf(text + length, sizeof(text) - length, "%s\n", marker->label);
+    }
+    write_text(trace_wrapper, text);
+}
+#endif // PY_MEM_TRACE_WRITE_OUTPUT
+
+/*
+ * Write every marker that has been pushed to this wrapper's log.
+ * This is called before each event is recorded and when the log is flushed or closed.
+ */
+static void
+write_markers(TraceFileWrapper *trace_wrapper) {
+    TraceMarker marker;
+    while (trace_marker_queue_pop(&marker_queue, &marker)) {
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT
+        write_marker(trace_wrapper, &marker);
+#else
+        (void)trace_wrapper;
+#endif
+    }
+}
+/**** END: Markers from other extensions. ****/
+
+/**** Residency of registered regions, see region_residency.h. ****/
+/*
+ * The table is only used with the GIL held. Regions outlive the tracers so that they can be registered before tracing
+ * starts, they are removed with remove_region().
+ */
+static RegionResidencyTable region_table;
+static int region_table_is_init = 0;
+
+static RegionResidencyTable *
+region_table_get(void) {
+    if (! region_table_is_init) {
+        region_residency_init(&region_table);
+        region_table_is_init = 1;
+    }
+    return &region_table;
+}
+
+/*
+ * Scan the regions that have been touched and write a RESIDENT marker, before the event event_number, for each whose
+ * resident bytes have changed since they were last written to any log.
+ * This is called on events that read the RSS by wrappers that write markers.
+ */
+static void
+write_regions(TraceFileWrapper *trace_wrapper) {
+    region_residency_scan(&region_table);
+    size_t index = 0;
+    RegionResidency *region;
+    while ((region = region_residency_changed(&region_table, &index))) {
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT
+        TraceMarker marker;
+        marker.clock = pymemtrace_clock_ticks(&marker_clock);
+        marker.thread_id = (uint64_t)PyThread_get_thread_ident();
+        marker.size = (int64_t)region->resident_bytes;
+        marker.kind = TRACE_MARKER_RESIDENT;
+        trace_marker_queue_set_label(&marker, region->label);
+        write_marker(trace_wrapper, &marker);
+#else
+        (void)trace_wrapper;
+#endif
+    }
+}
+/**** END: Residency of registered regions. ****/
+
+/*
+ * Set in the child of a fork() until py_after_fork_child() has given it its own log files, events before that would
+ * be written into the parent's log, or wait on a ring buffer that has no writer thread.
+ */
+static volatile int fork_pending = 0;
+
+static void
+set_fork_pending(void) {
+    fork_pending = 1;
+}
+
+/*
+ * Record a single event, what is one of the PyTrace_... values.
+ * This is common to the profile/trace functions and the sys.monitoring callbacks, frame is NULL for the latter.
+ * Returns non-zero if the RSS was read for this event.
+ */
+static int
+trace_event(TraceFileWrapper *trace_wrapper, PyFrameObject *frame, PyCodeObject *code, int line_number, int what,
+            PyObject *arg) {
+    if (fork_pending) {
+        return 0;
+    }
+    if (! trace_wrapper->aggregate) {
+        check_rotation(trace_wrapper);
+    }
+    if (trace_wrapper->markers_attached) {
+        write_markers(trace_wrapper);
+    }
+    trace_wrapper->stats[TRACE_STATS_EVENTS_SEEN]++;
+    int sampled = is_sample_due(trace_wrapper);
+    size_t rss = trace_wrapper->rss;
+    /* The time of the event, after reading the RSS, and the start of the output. */
+    uint64_t clock = pymemtrace_clock_ticks(&trace_wrapper->clock);
+    if (sampled) {
+        rss = pymemtrace_mem_counter_read(trace_wrapper->memory_counter);
+        trace_wrapper->stats[TRACE_STATS_RSS_READS]++;
+        if (trace_wrapper->markers_attached && region_table.count) {
+            write_regions(trace_wrapper);
+        }
+        clock = stats_add_ticks(trace_wrapper, TRACE_STATS_RSS_NS, clock);
+    }
+    if (trace_wrapper->aggregate) {
+        /* The first event has no previous RSS. */
+        aggregate_event(trace_wrapper, code, line_number,
+                        trace_wrapper->event_number ? (long)(rss - trace_wrapper->rss) : 0);
+        trace_wrapper->event_number++;
+        trace_wrapper->rss = rss;
+        stats_add_ticks(trace_wrapper, TRACE_STATS_OUTPUT_NS, clock);
+        return sampled;
+    }
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT
+    if (trace_wrapper->binary) {
+        write_binary_event(trace_wrapper, frame, code, line_number, what, arg, rss, sampled, clock);
+        trace_wrapper->event_number++;
+        trace_wrapper->rss = rss;
+        stats_add_ticks(trace_wrapper, TRACE_STATS_OUTPUT_NS, clock);
+        return sampled;
+    }
+    const unsigned char *file_name = NULL;
+    const char *func_name = NULL;
+    uint32_t file_id = 0;
+    uint32_t func_id = 0;
+    int is_c_event = what == PyTrace_C_CALL || what == PyTrace_C_EXCEPTION || what == PyTrace_C_RETURN;
+    if (trace_wrapper->intern_strings) {
+        file_id = string_id_from_str(trace_wrapper, code->co_filename);
+        if (is_c_event) {
+            func_id = string_id_from_c_function(trace_wrapper, arg);
+        } else {
+            func_id = string_id_from_str(trace_wrapper, code->co_name);
+        }
+    } else {
+        file_name = PyUnicode_1BYTE_DATA(code->co_filename);
+        if (is_c_event) {
+            func_name = PyType_Check(arg) ? ((PyTypeObject *)arg)->tp_name : PyEval_GetFuncName(arg);
+        } else {
+            func_name = (const char *)PyUnicode_1BYTE_DATA(code->co_name);
+        }
+    }
+    long d_rss = rss - trace_wrapper->rss;
+    if (labs(d_rss) >= trace_wrapper->d_rss_trigger
+        && trace_wrapper->event_number > 0
+        && (trace_wrapper->event_number - trace_wrapper->previous_event_number) > 1) {
+        // Previous event.
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT_PREV_NEXT
+        write_text(trace_wrapper, "PREV: ");
+#endif
+        write_text(trace_wrapper, trace_wrapper->event_text);
+        trace_wrapper->stats[TRACE_STATS_EVENTS_WRITTEN]++;
+    }
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT_CLOCK
+    double clock_time = pymemtrace_clock_seconds(&trace_wrapper->clock, clock);
+    if (trace_wrapper->intern_strings) {
+        snprintf(trace_wrapper->event_text, PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH,
+                 "%-12zu +%-6ld %-12.6f %-8s %-8u#%4d %-8u %12zu %12ld\n",
+                 trace_wrapper->event_number, trace_wrapper->event_number - trace_wrapper->previous_event_number,
+                 clock_time, WHAT_STRINGS[what], file_id, line_number, func_id, rss, d_rss);
+    } else {
+        snprintf(trace_wrapper->event_text, PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH,
+                 "%-12zu +%-6ld %-12.6f %-8s %-80s#%4d %-32s %12zu %12ld\n",
+                 trace_wrapper->event_number, trace_wrapper->event_number - trace_wrapper->previous_event_number,
+                 clock_time, WHAT_STRINGS[what], file_name, line_number, func_name, rss, d_rss);
+    }
+#else
+    if (trace_wrapper->intern_strings) {
+        snprintf(trace_wrapper->event_text, PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH,
+                 "%-12zu +%-6ld %-8s %-8u#%4d %-8u %12zu %12ld\n",
+                 trace_wrapper->event_number, trace_wrapper->event_number - trace_wrapper->previous_event_number,
+                 WHAT_STRINGS[what], file_id, line_number, func_id, rss, d_rss);
+    } else {
+        snprintf(trace_wrapper->event_text, PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH,
+                 "%-12zu +%-6ld %-8s %-80s#%4d %-32s %12zu %12ld\n",
+                 trace_wrapper->event_number, trace_wrapper->event_number - trace_wrapper->previous_event_number,
+                 WHAT_STRINGS[what], file_name, line_number, func_name, rss, d_rss);
+    }
+#endif // PY_MEM_TRACE_WRITE_OUTPUT_CLOCK
+    if (is_sampling(trace_wrapper)) {
+        append_sampled_column(trace_wrapper->event_text, PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH, sampled ? "S" : "-");
+    }
+    if (labs(d_rss) >= trace_wrapper->d_rss_trigger) {
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT_PREV_NEXT
+        write_text(trace_wrapper, "NEXT: ");
+//        write_text(trace_wrapper, "      ");
+#endif
+        write_text(trace_wrapper, trace_wrapper->event_text);
+        trace_wrapper->stats[TRACE_STATS_EVENTS_WRITTEN]++;
+        trace_wrapper->previous_event_number = trace_wrapper->event_number;
+    }
+#else
+    (void)frame;
+    (void)code;
+    (void)line_number;
+    (void)what;
+    (void)arg;
+#endif // PY_MEM_TRACE_WRITE_OUTPUT
+    trace_wrapper->event_number++;
+    trace_wrapper->rss = rss;
+    stats_add_ticks(trace_wrapper, TRACE_STATS_OUTPUT_NS, clock);
+    return sampled;
+}
+
+/**** Filters. ****/
+/* The co_extra index of the cached filter decisions, -1 until the first filter is created. */
+static Py_ssize_t filter_code_extra_index = -1;
+/* The generation of the last filter created, each filter has its own so that decisions cached by others are ignored. */
+static uintptr_t filter_generation = 0;
+
+/* The cached decisions are integers rather than pointers so there is nothing to free. */
+static void
+filter_code_extra_free(void *Py_UNUSED(extra)) {
+}
+
+/* The module name, from the __name__ of the globals of the frame or the current frame if NULL, or NULL if unknown. */
+static const char *
+frame_module_name(PyFrameObject *frame) {
+    PyObject *globals;
+    if (frame) {
+#if PY_VERSION_HEX >= 0x030B0000
+        globals = PyFrame_GetGlobals(frame);
+        /* A borrowed reference is enough, the frame holds another. */
+        Py_DECREF(globals);
+#else
+        globals = frame->f_globals;
+#endif
+    } else {
+        globals = PyEval_GetGlobals();
+    }
+    PyObject *name = globals && PyDict_Check(globals) ? PyDict_GetItemString(globals, "__name__") : NULL;
+    return name && PyUnicode_Check(name) ? PyUnicode_AsUTF8(name) : NULL;
+}
+
+/*
+ * Returns non-zero if the events of code should be logged, frame is NULL for the sys.monitoring callbacks.
+ * The decision is cached on the code object as (generation << 1 | traced) so after the first event of a code object
+ * this is a single lookup. If the Profile and Trace are both active with different filters the two overwrite each
+ * other's decisions, which is slower but still correct.
+ */
+static int
+is_code_traced(const TraceFilter *filter, PyCodeObject *code, PyFrameObject *frame) {
+    void *extra = NULL;
+    if (PyUnstable_Code_GetExtra((PyObject *)code, filter_code_extra_index, &extra)) {
+        PyErr_Clear();
+        extra = NULL;
+    }
+    if (extra && (uintptr_t)extra >> 1 == filter->generation) {
+        return (int)((uintptr_t)extra & 1);
+    }
+    const char *file_name = PyUnicode_AsUTF8(code->co_filename);
+    const char *function_name = file_name ? PyUnicode_AsUTF8(code->co_name) : NULL;
+    const char *module_name = function_name && trace_filter_uses_module(filter) ? frame_module_name(frame) : NULL;
+    if (PyErr_Occurred()) {
+        /* A name that can not be encoded, it does not match any pattern. */
+        PyErr_Clear();
+    }
+    int traced = trace_filter_match(filter, file_name, module_name, function_name);
+    if (PyUnstable_Code_SetExtra((PyObject *)code, filter_code_extra_index,
+                                 (void *)(filter->generation << 1 | (uintptr_t)traced))) {
+        /* For example Python 3.6 where the index is per thread, decide again on the next event. */
+        PyErr_Clear();
+    }
+    return traced;
+}
+
+/**** END: Filters. ****/
+
+static int
+trace_or_profile_function(PyObject *pobj, PyFrameObject *frame, int what, PyObject *arg) {
+    assert(Py_TYPE(pobj) == &TraceFileWrapperType && "trace_wrapper is not a TraceFileWrapperType.");
+
+    TraceFileWrapper *trace_wrapper = (TraceFileWrapper *)pobj;
+    PyCodeObject *code = PyFrame_GetCode(frame);
+    if (trace_wrapper->filter.count == 0 || is_code_traced(&trace_wrapper->filter, code, frame)) {
+        trace_event(trace_wrapper, frame, code, PyFrame_GetLineNumber(frame), what, arg);
+    } else {
+        /* Seen but not traced. */
+        trace_wrapper->stats[TRACE_STATS_EVENTS_SEEN]++;
+        trace_wrapper->stats[TRACE_STATS_EVENTS_FILTERED]++;
+    }
+    Py_DECREF(code);
+    return 0;
+}
+
+/*
+ * Options shared by the Profile and Trace objects.
+ */
+typedef struct {
+    int d_rss_trigger;
+    int binary;
+    int intern_strings;
+    Py_ssize_t sample_every;
+    long sample_interval_us;
+    /* Trace every thread, each with its own TraceFileWrapper and log file. */
+    int all_threads;
+    /* Accumulate RSS changes by call site rather than logging events. */
+    int aggregate;
+    /* A PyMemTraceClockSource. */
+    int clock_source;
+    /* A PY_MEM_TRACE_MEM_... field to log instead of the RSS. */
+    unsigned int memory_counter;
+    /* Only read the RSS when the bytes allocated since the last read reach d_rss_trigger. */
+    int estimate;
+    /* Start a new segment of the log file when it reaches this size or age, 0 is never. */
+    Py_ssize_t rotate_bytes;
+    double rotate_seconds;
+    /* A PY_MEM_TRACE_COMPRESSION_... value. */
+    int compression;
+    /* Log files are written here, the current working directory if empty. */
+    char directory[PYMEMTRACE_PATH_MAX];
+    /* If >= 0 the log is written to a duplicate of this file descriptor instead. */
+    int fd;
+    /* Size of the stdio buffer of the log file, 0 is the stdio default. With mapped the size the file grows by. */
+    Py_ssize_t buffer_size;
+    /* Write the binary log through a shared mapping of the file, see trace_mapped_file.h. */
+    int mapped;
+    /* If socket_address_length is non-zero binary records are sent to this address instead of a log file. */
+    struct sockaddr_storage socket_address;
+    socklen_t socket_address_length;
+    /* Binary mode, record up to this many callers of the events that pass d_rss_trigger. */
+    int stack_depth;
+    /* The include and exclude patterns, owned by the Profile, Trace or Monitor object or by copy_trace_options(). */
+    TraceFilter filter;
+} TraceOptions;
+
+#define PY_MEM_TRACE_COMPRESSION_NONE 0
+#define PY_MEM_TRACE_COMPRESSION_GZIP 1
+
+/*
+ * Set options->compression from its name, NULL is no compression.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+parse_compression_option(const char *name, TraceOptions *options) {
+    if (name == NULL) {
+        options->compression = PY_MEM_TRACE_COMPRESSION_NONE;
+        return 0;
+    }
+    if (strcmp(name, "gzip") == 0) {
+        options->compression = PY_MEM_TRACE_COMPRESSION_GZIP;
+    } else {
+        PyErr_Format(PyExc_ValueError, "Unknown compression \"%s\"", name);
+        return -1;
+    }
+    if (options->aggregate) {
+        PyErr_SetString(PyExc_ValueError, "aggregate can not be used with compression");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Check the rotation options.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+check_rotate_options(const TraceOptions *options) {
+    if (options->rotate_bytes < 0 || options->rotate_seconds < 0.0) {
+        PyErr_SetString(PyExc_ValueError, "rotate_bytes and rotate_seconds must be >= 0");
+        return -1;
+    }
+    if (options->aggregate && (options->rotate_bytes || options->rotate_seconds)) {
+        PyErr_SetString(PyExc_ValueError, "aggregate can not be used with rotate_bytes or rotate_seconds");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set options->directory, options->fd and options->buffer_size from the directory, file and buffer_size arguments.
+ * directory and file may be NULL or None, file is an int file descriptor or an object with a fileno() method.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+parse_output_options(PyObject *directory, PyObject *file, Py_ssize_t buffer_size, TraceOptions *options) {
+    options->directory[0] = '\0';
+    options->fd = -1;
+    options->buffer_size = buffer_size < 0 ? PY_MEM_TRACE_FILE_BUFFER_SIZE : buffer_size;
+    if (directory && directory != Py_None) {
+        PyObject *path = NULL;
+        if (! PyUnicode_FSConverter(directory, &path)) {
+            return -1;
+        }
+        const char *path_str = PyBytes_AS_STRING(path);
+        struct stat status;
+        if (PyBytes_GET_SIZE(path) >= PYMEMTRACE_PATH_MAX) {
+            PyErr_SetString(PyExc_ValueError, "directory is too long");
+        } else if (stat(path_str, &status)) {
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, directory);
+        } else if (! S_ISDIR(status.st_mode)) {
+            errno = ENOTDIR;
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, directory);
+        } else {
+            memcpy(options->directory, path_str, (size_t)PyBytes_GET_SIZE(path) + 1);
+        }
+        Py_DECREF(path);
+        if (PyErr_Occurred()) {
+            return -1;
+        }
+    }
+    if (file && file != Py_None) {
+        if (options->directory[0]) {
+            PyErr_SetString(PyExc_ValueError, "directory and file can not both be given");
+            return -1;
+        }
+        options->fd = PyObject_AsFileDescriptor(file);
+        if (options->fd < 0) {
+            return -1;
+        }
+        if (options->all_threads) {
+            PyErr_SetString(PyExc_ValueError, "all_threads can not be used with file");
+            return -1;
+        }
+        if (options->rotate_bytes || options->rotate_seconds) {
+            PyErr_SetString(PyExc_ValueError, "file can not be used with rotate_bytes or rotate_seconds");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Set options->socket_address from address which may be NULL or None, a path to a UNIX domain socket or a
+ * (host, port) tuple for UDP. This must be called after the other options are parsed.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+parse_socket_option(PyObject *address, TraceOptions *options) {
+    options->socket_address_length = 0;
+    if (address == NULL || address == Py_None) {
+        return 0;
+    }
+    if (options->aggregate || options->compression || options->directory[0] || options->fd >= 0
+        || options->rotate_bytes || options->rotate_seconds) {
+        PyErr_SetString(PyExc_ValueError, "socket_address can not be used with aggregate, compression, directory,"
+                                          " file, rotate_bytes or rotate_seconds");
+        return -1;
+    }
+    memset(&options->socket_address, 0, sizeof(options->socket_address));
+    if (PyTuple_Check(address)) {
+        const char *host;
+        int port;
+        if (! PyArg_ParseTuple(address, "si;socket_address must be a path or a (host, port) tuple", &host, &port)) {
+            return -1;
+        }
+        char service[16];
+        snprintf(service, sizeof(service), "%d", port);
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        struct addrinfo *result = NULL;
+        int error;
+        Py_BEGIN_ALLOW_THREADS
+        error = getaddrinfo(host, service, &hints, &result);
+        Py_END_ALLOW_THREADS
+        if (error) {
+            PyErr_Format(PyExc_OSError, "Can not resolve socket_address %R: %s", address, gai_strerror(error));
+            return -1;
+        }
+        memcpy(&options->socket_address, result->ai_addr, result->ai_addrlen);
+        options->socket_address_length = result->ai_addrlen;
+        freeaddrinfo(result);
+    } else {
+        PyObject *path = NULL;
+        if (! PyUnicode_FSConverter(address, &path)) {
+            return -1;
+        }
+        struct sockaddr_un *unix_address = (struct sockaddr_un *)&options->socket_address;
+        /* A leading NUL is the Linux abstract namespace, that name is not NUL terminated. */
+        size_t length = (size_t)PyBytes_GET_SIZE(path);
+        int is_abstract = length && PyBytes_AS_STRING(path)[0] == '\0';
+        if (length == 0 || length + ! is_abstract > sizeof(unix_address->sun_path)) {
+            Py_DECREF(path);
+            PyErr_Format(PyExc_ValueError, "socket_address %R is not a valid UNIX domain socket path", address);
+            return -1;
+        }
+        unix_address->sun_family = AF_UNIX;
+        memcpy(unix_address->sun_path, PyBytes_AS_STRING(path), length);
+        options->socket_address_length = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length + ! is_abstract);
+        Py_DECREF(path);
+    }
+    /* The stream is always binary records. */
+    options->binary = 1;
+    return 0;
+}
+
+/*
+ * Check options->stack_depth, this must be called after parse_socket_option() as that sets binary.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+check_stack_option(const TraceOptions *options) {
+    if (options->stack_depth < 0 || options->stack_depth > PY_MEM_TRACE_STACK_DEPTH_MAX) {
+        PyErr_Format(PyExc_ValueError, "stack_depth must be in the range 0 to %d not %d",
+                     PY_MEM_TRACE_STACK_DEPTH_MAX, options->stack_depth);
+        return -1;
+    }
+    if (options->stack_depth && (! options->binary || options->aggregate)) {
+        PyErr_SetString(PyExc_ValueError, "stack_depth needs binary=True and can not be used with aggregate");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+check_mmap_option(const TraceOptions *options) {
+    if (options->mapped && (! options->binary || options->compression || options->fd >= 0
+                            || options->socket_address_length)) {
+        PyErr_SetString(PyExc_ValueError, "mmap needs binary=True and can not be used with compression, file or"
+                                          " socket_address");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Add the patterns of include or exclude, each None, a str or an iterable of str, to options->filter.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+parse_filter_patterns(PyObject *patterns, int include, TraceOptions *options) {
+    if (patterns == NULL || patterns == Py_None) {
+        return 0;
+    }
+    PyObject *sequence = PyUnicode_Check(patterns) ? PyTuple_Pack(1, patterns)
+                                                   : PySequence_Fast(patterns, "include and exclude must be a str"
+                                                                               " or an iterable of str");
+    if (sequence == NULL) {
+        return -1;
+    }
+    int result = 0;
+    for (Py_ssize_t i = 0; result == 0 && i < PySequence_Fast_GET_SIZE(sequence); ++i) {
+        PyObject *item = PySequence_Fast_GET_ITEM(sequence, i);
+        const char *pattern = PyUnicode_Check(item) ? PyUnicode_AsUTF8(item) : NULL;
+        if (pattern == NULL) {
+            if (! PyErr_Occurred()) {
+                PyErr_Format(PyExc_TypeError, "include and exclude patterns must be str not %s",
+                             Py_TYPE(item)->tp_name);
+            }
+            result = -1;
+        } else if (trace_filter_add(&options->filter, pattern, include)) {
+            PyErr_NoMemory();
+            result = -1;
+        }
+    }
+    Py_DECREF(sequence);
+    return result;
+}
+
+/*
+ * Set options->filter from the include and exclude arguments. Any previous filter is freed.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+parse_filter_options(PyObject *include, PyObject *exclude, TraceOptions *options) {
+    trace_filter_free(&options->filter);
+    if (parse_filter_patterns(include, 1, options) || parse_filter_patterns(exclude, 0, options)) {
+        trace_filter_free(&options->filter);
+        return -1;
+    }
+    if (options->filter.count == 0) {
+        return 0;
+    }
+    if (filter_code_extra_index < 0) {
+        filter_code_extra_index = PyUnstable_Eval_RequestCodeExtraIndex(filter_code_extra_free);
+        if (filter_code_extra_index < 0) {
+            trace_filter_free(&options->filter);
+            PyErr_SetString(PyExc_RuntimeError, "Can not get a co_extra index for include and exclude");
+            return -1;
+        }
+    }
+    options->filter.generation = ++filter_generation;
+    return 0;
+}
+
+/*
+ * Copy src to dst with a filter of its own, for options that are kept after the Profile, Trace or Monitor that owns
+ * src has gone. Any previous filter of dst is freed, trace_filter_free(&dst->filter) frees the copy.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+copy_trace_options(TraceOptions *dst, const TraceOptions *src) {
+    if (dst == src) {
+        return 0;
+    }
+    TraceFilter filter;
+    if (trace_filter_copy(&filter, &src->filter)) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    trace_filter_free(&dst->filter);
+    *dst = *src;
+    dst->filter = filter;
+    return 0;
+}
+/*
+ * Set options->memory_counter from its name, NULL is the RSS.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+parse_memory_counter_option(const char *name, TraceOptions *options) {
+    if (name == NULL) {
+        options->memory_counter = PY_MEM_TRACE_MEM_RSS;
+        return 0;
+    }
+    options->memory_counter = pymemtrace_mem_counter_from_name(name);
+    if (options->memory_counter == 0 || options->memory_counter == PY_MEM_TRACE_MEM_FAULTS) {
+        PyErr_Format(PyExc_ValueError, "Unknown memory counter \"%s\"", name);
+        return -1;
+    }
+    pymemtrace_mem_counters counters;
+    if (pymemtrace_mem_counters_fill(&counters, options->memory_counter) == 0) {
+        PyErr_Format(PyExc_ValueError, "The memory counter \"%s\" is not available on this platform", name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set options->clock_source from the name of a clock, NULL is the default.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+parse_clock_option(const char *clock_name, TraceOptions *options) {
+    if (clock_name == NULL) {
+        options->clock_source = PY_MEM_TRACE_CLOCK_MONOTONIC;
+        return 0;
+    }
+    options->clock_source = pymemtrace_clock_source_from_name(clock_name);
+    if (options->clock_source < 0) {
+        PyErr_Format(PyExc_ValueError, "Unknown clock \"%s\"", clock_name);
+        return -1;
+    }
+    if (! pymemtrace_clock_available(options->clock_source)) {
+        PyErr_Format(PyExc_ValueError, "The clock \"%s\" is not available on this platform", clock_name);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Parse the arguments to Profile.__init__() or Trace.__init__().
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+parse_trace_options(PyObject *args, PyObject *kwds, TraceOptions *options) {
+    static char *kwlist[] = {
+        "d_rss_trigger", "binary", "intern_strings", "sample_every", "sample_interval_us", "all_threads",
+        "aggregate", "clock", "memory_counter", "estimate", "rotate_bytes", "rotate_seconds", "compression",
+        "directory", "file", "buffer_size", "socket_address", "stack_depth", "include", "exclude", "mmap", NULL
+    };
+    const char *clock_name = NULL;
+    const char *compression_name = NULL;
+    const char *memory_counter_name = NULL;
+    PyObject *directory = NULL;
+    PyObject *file = NULL;
+    Py_ssize_t buffer_size = -1;
+    PyObject *socket_address = NULL;
+    PyObject *include = NULL;
+    PyObject *exclude = NULL;
+    options->d_rss_trigger = -1;
+    options->binary = 0;
+    options->intern_strings = 0;
+    options->sample_every = 0;
+    options->sample_interval_us = 0;
+    options->all_threads = 0;
+    options->aggregate = 0;
+    options->stack_depth = 0;
+    options->estimate = 0;
+    options->rotate_bytes = 0;
+    options->rotate_seconds = 0.0;
+    options->mapped = 0;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|ippnlppzzpndzOOnOiOOp", kwlist,
+                                      &options->d_rss_trigger, &options->binary, &options->intern_strings,
+                                      &options->sample_every, &options->sample_interval_us,
+                                      &options->all_threads, &options->aggregate, &clock_name,
+                                      &memory_counter_name, &options->estimate, &options->rotate_bytes,
+                                      &options->rotate_seconds, &compression_name, &directory, &file, &buffer_size,
+                                      &socket_address, &options->stack_depth, &include, &exclude,
+                                      &options->mapped)) {
+        return -1;
+    }
+    if (parse_clock_option(clock_name, options) || parse_memory_counter_option(memory_counter_name, options)
+        || parse_compression_option(compression_name, options)
+        || parse_output_options(directory, file, buffer_size, options)
+        || parse_socket_option(socket_address, options) || check_stack_option(options)
+        || check_mmap_option(options) || parse_filter_options(include, exclude, options)) {
+        return -1;
+    }
+    if (options->sample_every < 0 || options->sample_interval_us < 0) {
+        PyErr_SetString(PyExc_ValueError, "sample_every and sample_interval_us must be >= 0");
+        return -1;
+    }
+    if (options->aggregate && options->binary) {
+        PyErr_SetString(PyExc_ValueError, "aggregate can not be used with binary");
+        return -1;
+    }
+    return check_rotate_options(options);
+}
+
+static size_t
+trace_file_sink(void *context, const void *data, size_t size) {
+    return fwrite(data, 1, size, (FILE *)context);
+}
+
+static size_t
+trace_compress_sink(void *context, const void *data, size_t size) {
+    return trace_compress_write((TraceCompressor *)context, data, size);
+}
+
+static size_t
+trace_socket_sink(void *context, const void *data, size_t size) {
+    return trace_socket_write((TraceSocket *)context, data, size);
+}
+
+static void
+write_text_header(TraceFileWrapper *trace_wrapper, int intern_strings, int sampling) {
+    char header[PY_MEM_TRACE_EVENT_TEXT_MAX_LENGTH];
+    if (intern_strings) {
+        /* The File and Function columns are string table ids. */
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT_CLOCK
+        snprintf(header, sizeof(header), "      %-12s %-6s  %-12s %-8s %-8s#%4s %-8s %12s %12s\n",
+                "Event", "dEvent", "Clock", "What", "File", "line", "Function", "RSS", "dRSS"
+        );
+#else
+        snprintf(header, sizeof(header), "      %-12s %-6s  %-8s %-8s#%4s %-8s %12s %12s\n",
+                "Event", "dEvent", "What", "File", "line", "Function", "RSS", "dRSS"
+        );
+#endif
+    } else {
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT_CLOCK
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT_PREV_NEXT
+        snprintf(header, sizeof(header), "      %-12s %-6s  %-12s %-8s %-80s#%4s %-32s %12s %12s\n",
+                "Event", "dEvent", "Clock", "What", "File", "line", "Function", "RSS", "dRSS"
+        );
+#else
+        snprintf(header, sizeof(header), "%-12s %-6s  %-12s %-8s %-80s#%4s %-32s %12s %12s\n",
+                "Event", "dEvent", "Clock", "What", "File", "line", "Function", "RSS", "dRSS"
+        );
+#endif
+#else
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT_PREV_NEXT
+        snprintf(header, sizeof(header), "      %-12s %-6s  %-8s %-80s#%4s %-32s %12s %12s\n",
+                "Event", "dEvent", "What", "File", "line", "Function", "RSS", "dRSS"
+        );
+#else
+        snprintf(header, sizeof(header), "%-12s %-6s  %-8s %-80s#%4s %-32s %12s %12s\n",
+                "Event", "dEvent", "What", "File", "line", "Function", "RSS", "dRSS"
+        );
+#endif
+#endif
+    }
+    if (sampling) {
+        append_sampled_column(header, sizeof(header), "Sampled");
+    }
+    write_text(trace_wrapper, header);
+}
+
+/*
+ * Write the header of a binary log, for a mapped log this maps the file.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+write_binary_header(TraceFileWrapper *trace_wrapper) {
+    const PyMemTraceClock *trace_clock = &trace_wrapper->clock;
+    TraceFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_FILE_MAGIC, TRACE_FILE_MAGIC_LENGTH);
+    header.byte_order_mark = TRACE_FILE_BYTE_ORDER_MARK;
+    header.version = TRACE_FILE_VERSION;
+    header.header_size = sizeof(TraceFileHeader);
+    header.pid = (uint32_t)getpid();
+    header.clock_ticks_per_second = trace_clock->ticks_per_second;
+    header.d_rss_trigger = trace_wrapper->d_rss_trigger;
+    header.clock_source = (uint32_t)trace_clock->source;
+    header.memory_counter = trace_wrapper->memory_counter;
+    header.clock_anchor_ticks = trace_clock->anchor_ticks;
+    header.clock_anchor_wall_ns = trace_clock->anchor_wall_ns;
+    if (trace_wrapper->mapped) {
+        /* The committed length follows the header, records start after it. */
+        unsigned char mapped_header[sizeof(TraceFileHeader) + sizeof(TraceFileCommitted)];
+        header.header_size = sizeof(mapped_header);
+        memcpy(mapped_header, &header, sizeof(header));
+        memset(mapped_header + sizeof(header), 0, sizeof(TraceFileCommitted));
+        size_t grow_size = trace_wrapper->file_buffer_size ? trace_wrapper->file_buffer_size
+                                                           : PY_MEM_TRACE_FILE_BUFFER_SIZE;
+        if (trace_mapped_file_open(&trace_wrapper->mapped_file, fileno(trace_wrapper->file), grow_size,
+                                   mapped_header, sizeof(mapped_header),
+                                   sizeof(header) + offsetof(TraceFileCommitted, committed_length))) {
+            fprintf(stderr, "Can not map the TraceFileWrapper log file.\n");
+            return -1;
+        }
+    } else if (trace_wrapper->socket_is_open) {
+        /* This is in every datagram. */
+        trace_socket_set_file_header(&trace_wrapper->socket, &header);
+    } else if (trace_wrapper->compressor.is_open) {
+        trace_compress_write(&trace_wrapper->compressor, &header, sizeof(header));
+    } else {
+        fwrite(&header, sizeof(header), 1, trace_wrapper->file);
+    }
+    return 0;
+}
+
+/*
+ * Open the log file for a segment, segment is -1 for a log file that has no sequence number.
+ * Returns NULL on failure.
+ */
+static FILE *
+open_segment_file(const TraceFileWrapper *trace_wrapper, long segment) {
+    const char *mode = trace_wrapper->binary || trace_wrapper->compression ? "wb" : "w";
+    if (trace_wrapper->mapped) {
+        /* A shared writable mapping needs the file to be open for reading too. */
+        mode = "w+b";
+    }
+    if (trace_wrapper->fd >= 0) {
+        /* The caller keeps their file descriptor, closing the log file closes the duplicate. */
+        fprintf(stdout, "Opening log file on file descriptor %d\n", trace_wrapper->fd);
+        int fd = dup(trace_wrapper->fd);
+        FILE *file = fd < 0 ? NULL : fdopen(fd, mode);
+        if (file == NULL) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            fprintf(stderr, "Can not open file descriptor %d for TraceFileWrapper\n", trace_wrapper->fd);
+        }
+        return file;
+    }
+    char path[PYMEMTRACE_PATH_MAX];
+    if (create_log_path(path, sizeof(path), trace_wrapper->directory, trace_wrapper->extension,
+                        trace_wrapper->thread_id, trace_wrapper->start, segment)) {
+        return NULL;
+    }
+    fprintf(stdout, "Opening log file %s\n", path);
+    FILE *file = fopen(path, mode);
+    if (file == NULL) {
+        fprintf(stderr, "Can not open writable file for TraceFileWrapper at %s\n", path);
+    }
+    return file;
+}
+
+/*
+ * Write the header of a new segment, for binary or compressed logs start the writer thread or give it the new file.
+ * Returns 0 on success, -1 on failure.
+ */
+static int
+start_segment(TraceFileWrapper *trace_wrapper) {
+    /* This must be before anything is written to the file. */
+    if (trace_wrapper->file && trace_wrapper->file_buffer) {
+        setvbuf(trace_wrapper->file, trace_wrapper->file_buffer, _IOFBF, trace_wrapper->file_buffer_size);
+    }
+    trace_wrapper->segment_bytes = 0;
+    trace_wrapper->segment_time_us = monotonic_time_us();
+    if (trace_wrapper->compression
+        && trace_compress_open(&trace_wrapper->compressor, trace_wrapper->file, TRACE_COMPRESS_DEFAULT_LEVEL)) {
+        fprintf(stderr, "Can not create the TraceFileWrapper compressor.\n");
+        return -1;
+    }
+    if (trace_wrapper->binary && write_binary_header(trace_wrapper)) {
+        return -1;
+    }
+    if ((trace_wrapper->binary && ! trace_wrapper->mapped) || trace_wrapper->compression) {
+        trace_ring_buffer_sink sink = &trace_file_sink;
+        void *sink_context = trace_wrapper->file;
+        if (trace_wrapper->socket_is_open) {
+            sink = &trace_socket_sink;
+            sink_context = &trace_wrapper->socket;
+        } else if (trace_wrapper->compression) {
+            sink = &trace_compress_sink;
+            sink_context = &trace_wrapper->compressor;
+        }
+        if (trace_wrapper->ring_is_open) {
+            /* A rotation, the writer thread carries on with the new segment. */
+            trace_ring_buffer_set_sink(&trace_wrapper->ring, sink, sink_context);
+        } else {
+            if (trace_ring_buffer_open(&trace_wrapper->ring, PY_MEM_TRACE_RING_BUFFER_SIZE, sink, sink_context)) {
+                fprintf(stderr, "Can not create the TraceFileWrapper writer thread.\n");
+                return -1;
+            }
+            trace_wrapper->ring_is_open = 1;
+        }
+        trace_wrapper->segment_head = trace_wrapper->ring.head;
+    }
+    if (! trace_wrapper->binary && ! trace_wrapper->aggregate) {
+        write_text_header(trace_wrapper, trace_wrapper->intern_strings, is_sampling(trace_wrapper));
+    }
+    return 0;
+}
+
+/*
+ * Flush the log file, for binary logs this first waits for the writer thread to write everything so far.
+ */
+static void
+flush_trace_wrapper(TraceFileWrapper *trace_wrapper) {
+    if (trace_wrapper->markers_attached) {
+        write_markers(trace_wrapper);
+    }
+    if (trace_wrapper->ring_is_open) {
+        trace_ring_buffer_flush(&trace_wrapper->ring);
+    }
+    /* The writer thread is now idle so the compressor or the socket can be used here. */
+    if (trace_wrapper->socket_is_open) {
+        trace_socket_flush(&trace_wrapper->socket);
+    } else if (trace_wrapper->compressor.is_open) {
+        trace_compress_flush(&trace_wrapper->compressor);
+    } else if (trace_wrapper->mapped_file.is_open) {
+        trace_mapped_file_sync(&trace_wrapper->mapped_file);
+    } else if (trace_wrapper->file) {
+        fflush(trace_wrapper->file);
+    }
+}
+
+/*
+ * Close the current segment of the log file and open the next one.
+ * The new segment has its own string table and the first event in it is not preceded by a PREV event.
+ * Returns 0 on success, -1 on failure in which case, if the next log file could not be opened, the current one is
+ * kept.
+ */
+static int
+rotate_trace_wrapper(TraceFileWrapper *trace_wrapper) {
+    if (trace_wrapper->fd >= 0 || trace_wrapper->socket_is_open) {
+        /* There is no next file. */
+        return -1;
+    }
+    /* A log file without a sequence number is followed by segment 1. */
+    long segment = trace_wrapper->segment < 0 ? 1 : trace_wrapper->segment + 1;
+    FILE *file = open_segment_file(trace_wrapper, segment);
+    if (file == NULL) {
+        /* Do not try again until the next interval. */
+        trace_wrapper->segment_time_us = monotonic_time_us();
+        return -1;
+    }
+    write_stats_footer(trace_wrapper);
+    if (trace_wrapper->ring_is_open) {
+        /* The writer thread does not need the GIL, it is idle until start_segment() gives it the new file. */
+        trace_ring_buffer_flush(&trace_wrapper->ring);
+    }
+    if (trace_wrapper->compressor.is_open) {
+        trace_compress_close(&trace_wrapper->compressor);
+    }
+    trace_mapped_file_close(&trace_wrapper->mapped_file);
+    fclose(trace_wrapper->file);
+    trace_wrapper->file = file;
+    trace_wrapper->segment = segment;
+    if (trace_wrapper->intern_strings) {
+        /* Stack records refer to strings so they go too. */
+        pointer_map_clear(&trace_wrapper->string_ids);
+        stack_table_clear(&trace_wrapper->stacks);
+        if (PyList_SetSlice(trace_wrapper->string_id_references, 0,
+                            PyList_GET_SIZE(trace_wrapper->string_id_references), NULL)) {
+            PyErr_Clear();
+        }
+    }
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT
+    trace_wrapper->previous_event_number = trace_wrapper->event_number;
+#endif
+    return start_segment(trace_wrapper);
+}
+
+/*
+ * In the child of a fork() release everything that the wrapper shares with the parent without writing to it, the
+ * parent carries on with its log. The stdio buffer of the log file, with the parent's unwritten text, is discarded.
+ * The wrapper can then be deallocated as one without a log file.
+ */
+static void
+abandon_trace_wrapper(TraceFileWrapper *trace_wrapper) {
+    if (trace_wrapper->markers_attached) {
+        /* The queue has the parent's markers, marker_attach() discards them. */
+        marker_detach(trace_wrapper);
+    }
+    if (trace_wrapper->ring_is_open) {
+        trace_ring_buffer_abandon(&trace_wrapper->ring);
+        trace_wrapper->ring_is_open = 0;
+    }
+    if (trace_wrapper->socket_is_open) {
+        trace_socket_abandon(&trace_wrapper->socket);
+        trace_wrapper->socket_is_open = 0;
+    }
+    trace_compress_abandon(&trace_wrapper->compressor);
+    trace_mapped_file_abandon(&trace_wrapper->mapped_file);
+    if (trace_wrapper->file) {
+        /* With the file descriptor closed first fclose() can not write the buffer. */
+        close(fileno(trace_wrapper->file));
+        fclose(trace_wrapper->file);
+        trace_wrapper->file = NULL;
+    }
+}
+
+/*
+ * Returns a new TraceFileWrapper with an open log file or NULL on failure.
+ * thread_id, if non-zero, is added to the log file name.
+ */
+static TraceFileWrapper *
+new_trace_wrapper(const TraceOptions *options, unsigned long thread_id) {
+    TraceFileWrapper *trace_wrapper = (TraceFileWrapper *)TraceFileWrapper_new(&TraceFileWrapperType, NULL, NULL);
+    if (trace_wrapper == NULL) {
+        fprintf(stderr, "Can not create TraceFileWrapper.\n");
+        return NULL;
+    }
+    trace_wrapper->binary = options->binary;
+    trace_wrapper->compression = options->compression;
+    if (options->compression) {
+        trace_wrapper->extension = options->binary ? "bin.gz" : "log.gz";
+    } else {
+        trace_wrapper->extension = options->aggregate ? "sites" : (options->binary ? "bin" : "log");
+    }
+    trace_wrapper->thread_id = thread_id;
+    trace_wrapper->start = time(NULL);
+    trace_wrapper->rotate_bytes = (size_t)options->rotate_bytes;
+    trace_wrapper->rotate_interval_us = (long)(options->rotate_seconds * 1e6);
+    trace_wrapper->segment = trace_wrapper->rotate_bytes || trace_wrapper->rotate_interval_us ? 0 : -1;
+    trace_wrapper->rotate_signal_seen = rotate_signal_count;
+    trace_wrapper->flush_signal_seen = flush_signal_count;
+    memcpy(trace_wrapper->directory, options->directory, sizeof(trace_wrapper->directory));
+    trace_wrapper->fd = options->fd;
+    trace_wrapper->mapped = options->mapped;
+    if (options->mapped) {
+        /* There is no stdio buffer, the mapped file grows by this. */
+        trace_wrapper->file_buffer_size = (size_t)options->buffer_size;
+    } else if (options->buffer_size > 0 && ! options->socket_address_length) {
+        void *buffer = mmap(NULL, (size_t)options->buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1, 0);
+        if (buffer == MAP_FAILED) {
+            Py_DECREF(trace_wrapper);
+            fprintf(stderr, "Can not create the TraceFileWrapper file buffer.\n");
+            return NULL;
+        }
+        trace_wrapper->file_buffer = buffer;
+        trace_wrapper->file_buffer_size = (size_t)options->buffer_size;
+    }
+    if (options->socket_address_length) {
+        if (trace_socket_open(&trace_wrapper->socket, (const struct sockaddr *)&options->socket_address,
+                              options->socket_address_length, thread_id)) {
+            Py_DECREF(trace_wrapper);
+            fprintf(stderr, "Can not create the TraceFileWrapper socket.\n");
+            return NULL;
+        }
+        trace_wrapper->socket_is_open = 1;
+        trace_wrapper->socket.other_records_dropped = &trace_wrapper->ring.records_dropped;
+    } else {
+        trace_wrapper->file = open_segment_file(trace_wrapper, trace_wrapper->segment);
+        if (trace_wrapper->file == NULL) {
+            Py_DECREF(trace_wrapper);
+            return NULL;
+        }
+    }
+//    fprintf(trace_wrapper->file, "%s\n", filename);
+    trace_wrapper->event_number = 0;
+    trace_wrapper->rss = 0;
+    if (options->d_rss_trigger < 0) {
+        trace_wrapper->d_rss_trigger = getpagesize();
+    } else  {
+        trace_wrapper->d_rss_trigger = options->d_rss_trigger;
+    }
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT
+    trace_wrapper->previous_event_number = 0;
+#endif
+    trace_wrapper->sample_every = (size_t)options->sample_every;
+    trace_wrapper->sample_interval_us = options->sample_interval_us;
+    trace_wrapper->sample_event_number = 0;
+    trace_wrapper->sample_time_us = 0;
+    trace_wrapper->intern_strings = options->binary || options->intern_strings;
+    /* The source has been checked by parse_clock_option(). */
+    pymemtrace_clock_init(&trace_wrapper->clock, options->clock_source);
+    trace_wrapper->memory_counter = options->memory_counter;
+    if (options->estimate) {
+        trace_wrapper->estimate = 1;
+        /* A d_rss_trigger of 0 reads the RSS after any allocation. */
+        trace_wrapper->estimate_threshold = trace_wrapper->d_rss_trigger > 0 ?
+                                            (uint64_t)trace_wrapper->d_rss_trigger : 1;
+        estimate_install();
+        trace_wrapper->estimate_allocated = estimate_allocated_bytes();
+    }
+    if (trace_wrapper->intern_strings) {
+        trace_wrapper->string_id_references = PyList_New(0);
+        if (trace_wrapper->string_id_references == NULL
+            || pointer_map_init(&trace_wrapper->string_ids, 1024)) {
+            Py_DECREF(trace_wrapper);
+            fprintf(stderr, "Can not create TraceFileWrapper string table.\n");
+            return NULL;
+        }
+    }
+    if (trace_filter_copy(&trace_wrapper->filter, &options->filter)) {
+        Py_DECREF(trace_wrapper);
+        fprintf(stderr, "Can not create TraceFileWrapper filter.\n");
+        return NULL;
+    }
+    if (options->stack_depth) {
+        trace_wrapper->stack_depth = options->stack_depth;
+        if (stack_table_init(&trace_wrapper->stacks, 1024)) {
+            Py_DECREF(trace_wrapper);
+            fprintf(stderr, "Can not create TraceFileWrapper stack table.\n");
+            return NULL;
+        }
+    }
+    if (options->aggregate) {
+        trace_wrapper->aggregate = 1;
+        if (call_site_table_init(&trace_wrapper->call_sites, 1024)) {
+            Py_DECREF(trace_wrapper);
+            fprintf(stderr, "Can not create TraceFileWrapper call site table.\n");
+            return NULL;
+        }
+    }
+    if (start_segment(trace_wrapper)) {
+        Py_DECREF(trace_wrapper);
+        return NULL;
+    }
+    if (! options->aggregate && marker_attach(trace_wrapper)) {
+        Py_DECREF(trace_wrapper);
+        fprintf(stderr, "Can not create the marker queue.\n");
+        return NULL;
+    }
+    return trace_wrapper;
+}
+
+/*
+ * The wrappers currently attached to the interpreter.
+ * These are strong references, the interpreter holds another reference while the function is attached.
+ */
+static TraceFileWrapper *profile_wrapper = NULL;
+static TraceFileWrapper *trace_wrapper = NULL;
+/*
+ * The options of those wrappers, the child of a fork() opens its own log files with them. The Profile or Trace may
+ * have gone so they have their own filter, see copy_trace_options().
+ */
+static TraceOptions profile_options;
+static TraceOptions trace_options;
+
+/**** Tracing all threads. ****/
+/*
+ * With all_threads every other thread gets its own TraceFileWrapper, and log file, the first time it has an event.
+ * So the wrapper is only used by one thread and the hot path takes no lock.
+ *
+ * Existing threads have thread_start_profile_function() or thread_start_trace_function() attached to them. This
+ * replaces itself with trace_or_profile_function() and a new wrapper for that thread.
+ * New threads started by the threading module get the same treatment from a threading.setprofile() or
+ * threading.settrace() hook.
+ *
+ * The lists of these wrappers are NULL if all_threads is not being used.
+ */
+static PyObject *profile_thread_wrappers = NULL;
+static PyObject *trace_thread_wrappers = NULL;
+static TraceOptions profile_thread_options;
+static TraceOptions trace_thread_options;
+
+/* The thread id used in the log file name, this is the same as threading.get_native_id() where available. */
+static unsigned long
+current_thread_id(void) {
+#ifdef PY_HAVE_THREAD_NATIVE_ID
+    return PyThread_get_thread_native_id();
+#else
+    return PyThread_get_thread_ident();
+#endif
+}
+
+static void
+set_function_for_current_thread(int is_trace, Py_tracefunc func, PyObject *obj) {
+    if (is_trace) {
+        PyEval_SetTrace(func, obj);
+    } else {
+        PyEval_SetProfile(func, obj);
+    }
+}
+
+#if PY_VERSION_HEX < 0x030C0000
+/*
+ * Set the profile or trace function of another thread. The caller holds the GIL so that thread is not running.
+ */
+static void
+set_function_for_thread_state(PyThreadState *tstate, int is_trace, Py_tracefunc func, PyObject *obj) {
+#if PY_VERSION_HEX >= 0x03090000
+    if (is_trace) {
+        _PyEval_SetTrace(tstate, func, obj);
+    } else {
+        _PyEval_SetProfile(tstate, func, obj);
+    }
+#else
+    /* Same as PyEval_SetProfile() and PyEval_SetTrace() in Python/ceval.c but for any thread. */
+    PyObject *temp;
+    Py_XINCREF(obj);
+    if (is_trace) {
+        temp = tstate->c_traceobj;
+        tstate->c_tracefunc = NULL;
+        tstate->c_traceobj = NULL;
+        tstate->use_tracing = tstate->c_profilefunc != NULL;
+        Py_XDECREF(temp);
+        tstate->c_tracefunc = func;
+        tstate->c_traceobj = obj;
+    } else {
+        temp = tstate->c_profileobj;
+        tstate->c_profilefunc = NULL;
+        tstate->c_profileobj = NULL;
+        tstate->use_tracing = tstate->c_tracefunc != NULL;
+        Py_XDECREF(temp);
+        tstate->c_profilefunc = func;
+        tstate->c_profileobj = obj;
+    }
+    tstate->use_tracing = (tstate->c_profilefunc != NULL) || (tstate->c_tracefunc != NULL);
+#endif
+}
+#endif
+
+/* Set the function, with a NULL object, on every thread in this interpreter apart from the current one. */
+static void
+set_function_for_other_threads(int is_trace, Py_tracefunc func) {
+#if PY_VERSION_HEX >= 0x030C0000
+    /* This includes the current thread, the caller sets that afterwards. */
+    if (is_trace) {
+        PyEval_SetTraceAllThreads(func, NULL);
+    } else {
+        PyEval_SetProfileAllThreads(func, NULL);
+    }
+#else
+    PyThreadState *current = PyThreadState_Get();
+    PyThreadState *tstate = PyInterpreterState_ThreadHead(current->interp);
+    while (tstate) {
+        if (tstate != current) {
+            set_function_for_thread_state(tstate, is_trace, func, NULL);
+        }
+        tstate = PyThreadState_Next(tstate);
+    }
+#endif
+}
+
+/*
+ * Give the current thread its own wrapper and attach it.
+ * Returns a borrowed reference to the wrapper or NULL, in which case the current thread is detached.
+ */
+static TraceFileWrapper *
+attach_current_thread(int is_trace) {
+    PyObject *wrappers = is_trace ? trace_thread_wrappers : profile_thread_wrappers;
+    TraceFileWrapper *wrapper = NULL;
+    if (wrappers) {
+        wrapper = new_trace_wrapper(is_trace ? &trace_thread_options : &profile_thread_options,
+                                    current_thread_id());
+    }
+    if (wrapper == NULL || PyList_Append(wrappers, (PyObject *)wrapper)) {
+        Py_XDECREF(wrapper);
+        PyErr_Clear();
+        set_function_for_current_thread(is_trace, NULL, NULL);
+        return NULL;
+    }
+    set_function_for_current_thread(is_trace, &trace_or_profile_function, (PyObject *)wrapper);
+    /* The list and the thread state now hold references. */
+    Py_DECREF(wrapper);
+    return wrapper;
+}
+
+static int
+thread_start_profile_function(PyObject *Py_UNUSED(obj), PyFrameObject *frame, int what, PyObject *arg) {
+    TraceFileWrapper *wrapper = attach_current_thread(0);
+    return wrapper ? trace_or_profile_function((PyObject *)wrapper, frame, what, arg) : 0;
+}
+
+static int
+thread_start_trace_function(PyObject *Py_UNUSED(obj), PyFrameObject *frame, int what, PyObject *arg) {
+    TraceFileWrapper *wrapper = attach_current_thread(1);
+    return wrapper ? trace_or_profile_function((PyObject *)wrapper, frame, what, arg) : 0;
+}
+
+/*
+ * These are the threading.setprofile() and threading.settrace() hooks, called as (frame, event, arg) by the
+ * interpreter for the first event of a new thread. The event itself is not logged.
+ */
+static PyObject *
+py_thread_start_profile(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args)) {
+    attach_current_thread(0);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+py_thread_start_trace(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args)) {
+    attach_current_thread(1);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef thread_start_methods[] = {
+    {"_thread_start_profile", (PyCFunction) py_thread_start_profile, METH_VARARGS,
+     "threading.setprofile() hook that attaches a Profile to a new thread."},
+    {"_thread_start_trace", (PyCFunction) py_thread_start_trace, METH_VARARGS,
+     "threading.settrace() hook that attaches a Trace to a new thread."},
+};
+
+/* Call threading.setprofile(hook) or threading.settrace(hook). Returns 0 on success. */
+static int
+set_threading_hook(int is_trace, PyObject *hook) {
+    PyObject *threading = PyImport_ImportModule("threading");
+    if (threading == NULL) {
+        return -1;
+    }
+    PyObject *result = PyObject_CallMethod(threading, is_trace ? "settrace" : "setprofile", "O", hook);
+    Py_DECREF(threading);
+    if (result == NULL) {
+        return -1;
+    }
+    Py_DECREF(result);
+    return 0;
+}
+
+/*
+ * Arrange for all threads other than the current one to be traced.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+attach_other_threads(int is_trace, const TraceOptions *options) {
+    PyObject **wrappers = is_trace ? &trace_thread_wrappers : &profile_thread_wrappers;
+    TraceOptions *thread_options = is_trace ? &trace_thread_options : &profile_thread_options;
+    PyObject *new_wrappers = PyList_New(0);
+    if (new_wrappers == NULL) {
+        return -1;
+    }
+    /* The options outlive the Profile or Trace, new threads can start after it has gone. */
+    if (copy_trace_options(thread_options, options)) {
+        Py_DECREF(new_wrappers);
+        return -1;
+    }
+    PyObject *hook = PyCFunction_New(&thread_start_methods[is_trace], NULL);
+    if (hook == NULL || set_threading_hook(is_trace, hook)) {
+        Py_XDECREF(hook);
+        Py_DECREF(new_wrappers);
+        trace_filter_free(&thread_options->filter);
+        return -1;
+    }
+    Py_DECREF(hook);
+    Py_XSETREF(*wrappers, new_wrappers);
+    set_function_for_other_threads(is_trace, is_trace ? &thread_start_trace_function : &thread_start_profile_function);
+    return 0;
+}
+
+/* Detach all the threads attached by attach_other_threads(), this closes their log files. */
+static void
+detach_other_threads(int is_trace) {
+    PyObject **wrappers = is_trace ? &trace_thread_wrappers : &profile_thread_wrappers;
+    if (*wrappers == NULL) {
+        return;
+    }
+    if (set_threading_hook(is_trace, Py_None)) {
+        PyErr_Clear();
+    }
+    set_function_for_other_threads(is_trace, NULL);
+    Py_CLEAR(*wrappers);
+    trace_filter_free(is_trace ? &trace_thread_options.filter : &profile_thread_options.filter);
+}
+/**** END: Tracing all threads. ****/
+
+static PyObject *
+py_attach_profile_function(const TraceOptions *options) {
+    TraceFileWrapper *wrapper = new_trace_wrapper(options, options->all_threads ? current_thread_id() : 0);
+    if (wrapper) {
+        detach_other_threads(0);
+        if (options->all_threads && attach_other_threads(0, options)) {
+            Py_DECREF(wrapper);
+            return NULL;
+        }
+        if (copy_trace_options(&profile_options, options)) {
+            detach_other_threads(0);
+            Py_DECREF(wrapper);
+            return NULL;
+        }
+        PyEval_SetProfile(&trace_or_profile_function, (PyObject *)wrapper);
+        Py_XDECREF(profile_wrapper);
+        profile_wrapper = wrapper;
+        Py_RETURN_NONE;
+    }
+    PyErr_SetString(PyExc_RuntimeError, "Could not attach profile function.");
+    return NULL;
+}
+
+static PyObject *
+py_detach_profile_function() {
+    detach_other_threads(0);
+    PyEval_SetProfile(NULL, NULL);
+    /* This closes the log file. */
+    Py_CLEAR(profile_wrapper);
+    trace_filter_free(&profile_options.filter);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+py_attach_trace_function(const TraceOptions *options) {
+    TraceFileWrapper *wrapper = new_trace_wrapper(options, options->all_threads ? current_thread_id() : 0);
+    if (wrapper) {
+        detach_other_threads(1);
+        if (options->all_threads && attach_other_threads(1, options)) {
+            Py_DECREF(wrapper);
+            return NULL;
+        }
+        if (copy_trace_options(&trace_options, options)) {
+            detach_other_threads(1);
+            Py_DECREF(wrapper);
+            return NULL;
+        }
+        PyEval_SetTrace(&trace_or_profile_function, (PyObject *)wrapper);
+        Py_XDECREF(trace_wrapper);
+        trace_wrapper = wrapper;
+        Py_RETURN_NONE;
+    }
+    PyErr_SetString(PyExc_RuntimeError, "Could not attach trace function.");
+    return NULL;
+}
+
+static PyObject *
+py_detach_trace_function() {
+    detach_other_threads(1);
+    PyEval_SetTrace(NULL, NULL);
+    /* This closes the log file. */
+    Py_CLEAR(trace_wrapper);
+    trace_filter_free(&trace_options.filter);
+    Py_RETURN_NONE;
+}
+
+/**** Aggregate mode summaries. ****/
+/*
+ * Merge the call sites of a wrapper into sites, a dict of (file, line, function) to
+ * (count, d_rss_positive, d_rss_negative, d_rss_max).
+ * With all_threads the same call site may be in several wrappers.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+merge_call_sites(TraceFileWrapper *wrapper, PyObject *sites) {
+    for (size_t i = 0; i < wrapper->call_sites.capacity; ++i) {
+        const CallSiteEntry *entry = wrapper->call_sites.entries + i;
+        if (entry->code == NULL) {
+            continue;
+        }
+        PyCodeObject *code = (PyCodeObject *)entry->code;
+        PyObject *key = Py_BuildValue("(OiO)", code->co_filename, entry->line_number, code->co_name);
+        if (key == NULL) {
+            return -1;
+        }
+        unsigned long long count = entry->count;
+        long long d_rss_positive = entry->d_rss_positive;
+        long long d_rss_negative = entry->d_rss_negative;
+        long long d_rss_max = entry->d_rss_max;
+        PyObject *previous = PyDict_GetItem(sites, key);
+        if (previous) {
+            long long previous_max = PyLong_AsLongLong(PyTuple_GET_ITEM(previous, 3));
+            count += PyLong_AsUnsignedLongLong(PyTuple_GET_ITEM(previous, 0));
+            d_rss_positive += PyLong_AsLongLong(PyTuple_GET_ITEM(previous, 1));
+            d_rss_negative += PyLong_AsLongLong(PyTuple_GET_ITEM(previous, 2));
+            if (previous_max > d_rss_max) {
+                d_rss_max = previous_max;
+            }
+        }
+        PyObject *value = Py_BuildValue("(KLLL)", count, d_rss_positive, d_rss_negative, d_rss_max);
+        if (value == NULL || PyDict_SetItem(sites, key, value)) {
+            Py_XDECREF(value);
+            Py_DECREF(key);
+            return -1;
+        }
+        Py_DECREF(value);
+        Py_DECREF(key);
+    }
+    return 0;
+}
+
+static int
+call_site_compare_d_rss_positive(const void *a, const void *b) {
+    long long d_rss_a = PyLong_AsLongLong(PyTuple_GET_ITEM(*(PyObject *const *)a, 4));
+    long long d_rss_b = PyLong_AsLongLong(PyTuple_GET_ITEM(*(PyObject *const *)b, 4));
+    return (d_rss_a < d_rss_b) - (d_rss_a > d_rss_b);
+}
+
+/*
+ * Returns a new list of (file, line, function, count, d_rss_positive, d_rss_negative, d_rss_max) from the attached
+ * profile or trace wrappers, largest d_rss_positive first. Returns NULL on failure with an exception set.
+ */
+static PyObject *
+call_site_summary(int is_trace) {
+    TraceFileWrapper *wrapper = is_trace ? trace_wrapper : profile_wrapper;
+    PyObject *thread_wrappers = is_trace ? trace_thread_wrappers : profile_thread_wrappers;
+    PyObject *sites = PyDict_New();
+    if (sites == NULL) {
+        return NULL;
+    }
+    if (wrapper && wrapper->aggregate && merge_call_sites(wrapper, sites)) {
+        goto except;
+    }
+    for (Py_ssize_t i = 0; thread_wrappers && i < PyList_GET_SIZE(thread_wrappers); ++i) {
+        TraceFileWrapper *thread_wrapper = (TraceFileWrapper *)PyList_GET_ITEM(thread_wrappers, i);
+        if (thread_wrapper->aggregate && merge_call_sites(thread_wrapper, sites)) {
+            goto except;
+        }
+    }
+    PyObject *result = PyList_New(0);
+    if (result == NULL) {
+        goto except;
+    }
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(sites, &pos, &key, &value)) {
+        PyObject *item = PySequence_Concat(key, value);
+        if (item == NULL || PyList_Append(result, item)) {
+            Py_XDECREF(item);
+            Py_DECREF(result);
+            goto except;
+        }
+        Py_DECREF(item);
+    }
+    Py_DECREF(sites);
+    /* Not list.sort() with a key as importing operator here would itself be traced. */
+    qsort(((PyListObject *)result)->ob_item, (size_t)PyList_GET_SIZE(result), sizeof(PyObject *),
+          call_site_compare_d_rss_positive);
+    return result;
+except:
+    Py_DECREF(sites);
+    return NULL;
+}
+
+/*
+ * Implementation of Profile.summary() and Trace.summary().
+ * While attached this is the current state, after __exit__ it is the state at __exit__.
+ */
+static PyObject *
+trace_summary(const TraceOptions *options, int active, PyObject *final_summary, int is_trace,
+              PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"n", NULL};
+    Py_ssize_t limit = 0;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|n", kwlist, &limit)) {
+        return NULL;
+    }
+    if (! options->aggregate) {
+        PyErr_SetString(PyExc_RuntimeError, "summary() needs aggregate=True");
+        return NULL;
+    }
+    PyObject *result;
+    if (active) {
+        result = call_site_summary(is_trace);
+    } else if (final_summary) {
+        result = PyList_GetSlice(final_summary, 0, PyList_GET_SIZE(final_summary));
+    } else {
+        result = PyList_New(0);
+    }
+    if (result && limit > 0 && PyList_GET_SIZE(result) > limit
+        && PyList_SetSlice(result, limit, PyList_GET_SIZE(result), NULL)) {
+        Py_CLEAR(result);
+    }
+    return result;
+}
+#define TRACE_SUMMARY_DOC \
+    "With ``aggregate=True`` returns the call sites as a list of" \
+    " (file, line, function, count, d_rss_positive, d_rss_negative, d_rss_max), largest d_rss_positive first." \
+    " The optional argument ``n``, if non-zero, limits this to the first n."
+/**** END: Aggregate mode summaries. ****/
+
+/*
+ * Implementation of Profile.flush(), Profile.rotate(), Trace.flush() and Trace.rotate().
+ * This applies to the log file of every thread.
+ */
+static PyObject *
+trace_flush_or_rotate(const TraceOptions *options, int active, int is_trace, int rotate) {
+    if (! active) {
+        PyErr_SetString(PyExc_RuntimeError, "There is no log file until the context manager is entered.");
+        return NULL;
+    }
+    if (rotate && options->aggregate) {
+        PyErr_SetString(PyExc_RuntimeError, "rotate() can not be used with aggregate=True");
+        return NULL;
+    }
+    if (rotate && (options->fd >= 0 || options->socket_address_length)) {
+        PyErr_SetString(PyExc_RuntimeError, "rotate() can not be used with file or socket_address");
+        return NULL;
+    }
+    TraceFileWrapper *wrapper = is_trace ? trace_wrapper : profile_wrapper;
+    PyObject *thread_wrappers = is_trace ? trace_thread_wrappers : profile_thread_wrappers;
+    int result = 0;
+    for (Py_ssize_t i = -1; i < (thread_wrappers ? PyList_GET_SIZE(thread_wrappers) : 0); ++i) {
+        TraceFileWrapper *each = i < 0 ? wrapper : (TraceFileWrapper *)PyList_GET_ITEM(thread_wrappers, i);
+        if (each == NULL) {
+            continue;
+        }
+        if (rotate) {
+            result |= rotate_trace_wrapper(each);
+        } else {
+            flush_trace_wrapper(each);
+        }
+    }
+    if (result) {
+        PyErr_SetString(PyExc_RuntimeError, "Could not open the next log file.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+/*
+ * Returns the event records dropped so far by the log file of one thread.
+ */
+static uint64_t
+wrapper_records_dropped(TraceFileWrapper *trace_wrapper) {
+    if (trace_wrapper == NULL) {
+        return 0;
+    }
+    if (trace_wrapper->socket_is_open) {
+        /* This includes the ring buffer. */
+        return trace_socket_records_dropped(&trace_wrapper->socket);
+    }
+    if (trace_wrapper->mapped) {
+        return trace_wrapper->mapped_file.records_dropped;
+    }
+    return __atomic_load_n(&trace_wrapper->ring.records_dropped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns the event records dropped so far by the log files of every thread, optionally flushing them first.
+ */
+static uint64_t
+trace_records_dropped(int is_trace, int flush) {
+    TraceFileWrapper *wrapper = is_trace ? trace_wrapper : profile_wrapper;
+    PyObject *thread_wrappers = is_trace ? trace_thread_wrappers : profile_thread_wrappers;
+    uint64_t result = 0;
+    for (Py_ssize_t i = -1; i < (thread_wrappers ? PyList_GET_SIZE(thread_wrappers) : 0); ++i) {
+        TraceFileWrapper *each = i < 0 ? wrapper : (TraceFileWrapper *)PyList_GET_ITEM(thread_wrappers, i);
+        if (each && flush) {
+            flush_trace_wrapper(each);
+        }
+        result += wrapper_records_dropped(each);
+    }
+    return result;
+}
+
+/**** Stats of the tracer's own work. ****/
+static const char *const trace_stats_names[TRACE_STATS_COUNT] = TRACE_STATS_NAMES;
+
+/*
+ * Fill values, TRACE_STATS_COUNT of them, with the stats of the log file of one thread, the times in nanoseconds.
+ */
+static void
+trace_wrapper_stats(TraceFileWrapper *trace_wrapper, uint64_t *values) {
+    memcpy(values, trace_wrapper->stats, sizeof(trace_wrapper->stats));
+    double ns_per_tick = trace_wrapper->clock.seconds_per_tick * 1e9;
+    values[TRACE_STATS_RSS_NS] = (uint64_t)((double)values[TRACE_STATS_RSS_NS] * ns_per_tick);
+    values[TRACE_STATS_OUTPUT_NS] = (uint64_t)((double)values[TRACE_STATS_OUTPUT_NS] * ns_per_tick);
+    if (trace_wrapper->binary && ! trace_wrapper->mapped) {
+        /* Everything after the header goes through the ring buffer. */
+        values[TRACE_STATS_BYTES_WRITTEN] = trace_wrapper->ring.head;
+    }
+    values[TRACE_STATS_RECORDS_DROPPED] = wrapper_records_dropped(trace_wrapper);
+}
+
+/*
+ * Write the stats as the last record, or line, of a segment of the log file.
+ * Aggregate logs have the call site summary instead.
+ */
+static void
+write_stats_footer(TraceFileWrapper *trace_wrapper) {
+    if (trace_wrapper->aggregate) {
+        return;
+    }
+    TraceRecordStats record;
+    memset(&record, 0, sizeof(record));
+    record.type = TRACE_RECORD_STATS;
+    record.count = TRACE_STATS_COUNT;
+    trace_wrapper_stats(trace_wrapper, record.values);
+    if (trace_wrapper->binary) {
+        if (trace_wrapper->ring_is_open || trace_wrapper->mapped_file.is_open) {
+            /* Like strings this is never dropped. */
+            write_record_wait(trace_wrapper, &record, sizeof(record));
+        }
+        return;
+    }
+#ifdef PY_MEM_TRACE_WRITE_OUTPUT
+    char text[PY_MEM_TRACE_STATS_TEXT_MAX_LENGTH];
+    size_t length = (size_t)snprintf(text, sizeof(text), "%s", TRACE_STATS_TEXT_PREFIX);
+    for (int i = 0; i < TRACE_STATS_COUNT && length < sizeof(text); ++i) {
+        length += (size_t)snprintf(text + length, sizeof(text) - length, " %s=%" PRIu64,
+                                   trace_stats_names[i], record.values[i]);
+    }
+    if (length + 1 < sizeof(text)) {
+        text[length++] = '\n';
+        text[length] = '\0';
+        write_text(trace_wrapper, text);
+    }
+#endif
+}
+
+/*
+ * Fill values with the stats of the log files of every thread added together.
+ */
+static void
+trace_stats(int is_trace, uint64_t *values) {
+    TraceFileWrapper *wrapper = is_trace ? trace_wrapper : profile_wrapper;
+    PyObject *thread_wrappers = is_trace ? trace_thread_wrappers : profile_thread_wrappers;
+    memset(values, 0, sizeof(uint64_t) * TRACE_STATS_COUNT);
+    for (Py_ssize_t i = -1; i < (thread_wrappers ? PyList_GET_SIZE(thread_wrappers) : 0); ++i) {
+        TraceFileWrapper *each = i < 0 ? wrapper : (TraceFileWrapper *)PyList_GET_ITEM(thread_wrappers, i);
+        if (each) {
+            uint64_t each_values[TRACE_STATS_COUNT];
+            trace_wrapper_stats(each, each_values);
+            for (int j = 0; j < TRACE_STATS_COUNT; ++j) {
+                values[j] += each_values[j];
+            }
+        }
+    }
+}
+
+/*
+ * Returns a new dict of the stats names to values or NULL on failure.
+ */
+static PyObject *
+trace_stats_dict(const uint64_t *values) {
+    PyObject *ret = PyDict_New();
+    if (ret == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < TRACE_STATS_COUNT; ++i) {
+        PyObject *value = PyLong_FromUnsignedLongLong((unsigned long long)values[i]);
+        if (value == NULL || PyDict_SetItemString(ret, trace_stats_names[i], value)) {
+            Py_XDECREF(value);
+            Py_DECREF(ret);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+    return ret;
+}
+
+/*
+ * Implementation of Profile.stats() and Trace.stats(), final_stats is the value when __exit__ was called.
+ */
+static PyObject *
+trace_stats_result(int active, PyObject *final_stats, int is_trace) {
+    if (active) {
+        uint64_t values[TRACE_STATS_COUNT];
+        trace_stats(is_trace, values);
+        return trace_stats_dict(values);
+    }
+    if (final_stats == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "There are no stats until the context manager is entered.");
+        return NULL;
+    }
+    Py_INCREF(final_stats);
+    return final_stats;
+}
+#define TRACE_STATS_DOC \
+    "Return a dict of the counters of the work done by the tracer itself, for every thread, since the context" \
+    " manager was entered, or when it exited. ``events_seen`` are the events given to the tracer," \
+    " ``events_filtered`` those not logged because of ``include`` and ``exclude``, ``events_written`` the event" \
+    " records or lines written, ``rss_reads`` and ``rss_ns`` the reads of the memory counter and the nanoseconds" \
+    " spent in them, ``output_ns`` the nanoseconds spent formatting and writing events, ``bytes_written`` the size" \
+    " of the log before compression and ``records_dropped`` as the attribute. The times are measured with the" \
+    " ``clock``. These are also written as the last record of each log file, see ``cTraceReader.Reader.stats()``."
+/**** END: Stats of the tracer's own work. ****/
+
+#define TRACE_RECORDS_DROPPED_DOC \
+    "The number of event records dropped because the ring buffer was full or, with ``socket_address``," \
+    " the receiver fell behind. This is updated by ``flush()`` and ``__exit__``."
+#define TRACE_FLUSH_DOC \
+    "Write everything logged so far to the log file. With ``binary=True`` this waits for the writer thread."
+#define TRACE_ROTATE_DOC \
+    "Close the log file and continue in a new one, the next segment. This can not be used with ``aggregate=True``."
+
+static PyObject *
+py_rss() {
+    return PyLong_FromSize_t(getCurrentRSS_alternate());
+}
+
+static PyObject *
+py_rss_peak() {
+    return PyLong_FromSize_t(getPeakRSS());
+}
+
+/* Set key to value in dict if field was filled in. Returns 0 on success, -1 on failure. */
+static int
+set_memory_counter(PyObject *dict, unsigned int filled, unsigned int field, const char *key, uint64_t value) {
+    if (! (filled & field)) {
+        return 0;
+    }
+    PyObject *item = PyLong_FromUnsignedLongLong(value);
+    if (item == NULL) {
+        return -1;
+    }
+    int result = PyDict_SetItemString(dict, key, item);
+    Py_DECREF(item);
+    return result;
+}
+
+static PyObject *
+py_memory_counters(PyObject *Py_UNUSED(module), PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"fields", NULL};
+    PyObject *names = Py_None;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &names)) {
+        return NULL;
+    }
+    unsigned int fields = PY_MEM_TRACE_MEM_ALL;
+    if (names != Py_None) {
+        PyObject *iterator = PyObject_GetIter(names);
+        if (iterator == NULL) {
+            return NULL;
+        }
+        fields = 0;
+        PyObject *name;
+        while ((name = PyIter_Next(iterator))) {
+            const char *text = PyUnicode_Check(name) ? PyUnicode_AsUTF8(name) : NULL;
+            unsigned int field = text ? pymemtrace_mem_counter_from_name(text) : 0;
+            if (field == 0) {
+                if (! PyErr_Occurred()) {
+                    PyErr_Format(PyExc_ValueError, "Unknown memory counter %R", name);
+                }
+                Py_DECREF(name);
+                Py_DECREF(iterator);
+                return NULL;
+            }
+            fields |= field;
+            Py_DECREF(name);
+        }
+        Py_DECREF(iterator);
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+    pymemtrace_mem_counters counters;
+    unsigned int filled = pymemtrace_mem_counters_fill(&counters, fields);
+    PyObject *ret = PyDict_New();
+    if (ret == NULL
+        || set_memory_counter(ret, filled, PY_MEM_TRACE_MEM_RSS, "rss", counters.rss)
+        || set_memory_counter(ret, filled, PY_MEM_TRACE_MEM_RSS_ANON, "rss_anon", counters.rss_anon)
+        || set_memory_counter(ret, filled, PY_MEM_TRACE_MEM_RSS_FILE, "rss_file", counters.rss_file)
+        || set_memory_counter(ret, filled, PY_MEM_TRACE_MEM_RSS_SHMEM, "rss_shmem", counters.rss_shmem)
+        || set_memory_counter(ret, filled, PY_MEM_TRACE_MEM_SWAP, "swap", counters.swap)
+        || set_memory_counter(ret, filled, PY_MEM_TRACE_MEM_USS, "uss", counters.uss)
+        || set_memory_counter(ret, filled, PY_MEM_TRACE_MEM_PSS, "pss", counters.pss)
+        || set_memory_counter(ret, filled, PY_MEM_TRACE_MEM_PRIVATE, "private", counters.private_bytes)
+        || set_memory_counter(ret, filled, PY_MEM_TRACE_MEM_FAULTS, "minor_faults", counters.minor_faults)
+        || set_memory_counter(ret, filled, PY_MEM_TRACE_MEM_FAULTS, "major_faults", counters.major_faults)) {
+        Py_XDECREF(ret);
+        return NULL;
+    }
+    return ret;
+}
+
+/**** Signals that flush or rotate the log files. ****/
+/*
+ * The handler only increments a counter, each TraceFileWrapper compares this with the value it last saw on its next
+ * event. So the log file of every thread is flushed or rotated by that thread.
+ */
+static volatile sig_atomic_t rotate_signum = 0;
+static volatile sig_atomic_t flush_signum = 0;
+static struct sigaction rotate_previous_action;
+static struct sigaction flush_previous_action;
+
+static void
+trace_signal_handler(int signum) {
+    if (signum == rotate_signum) {
+        rotate_signal_count++;
+    } else if (signum == flush_signum) {
+        flush_signal_count++;
+    }
+}
+
+/*
+ * Install the handler for signum, or restore the previous handler if signum is 0.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+set_trace_signal(volatile sig_atomic_t *current, struct sigaction *previous, volatile sig_atomic_t other,
+                 int signum) {
+    if (signum < 0 || signum >= NSIG) {
+        PyErr_Format(PyExc_ValueError, "Signal number %d out of range", signum);
+        return -1;
+    }
+    if (signum && signum == other) {
+        PyErr_SetString(PyExc_ValueError, "The rotate and flush signals must be different");
+        return -1;
+    }
+    if (signum == *current) {
+        return 0;
+    }
+    struct sigaction action;
+    struct sigaction old_action;
+    if (signum) {
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = &trace_signal_handler;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(signum, &action, &old_action)) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+    }
+    if (*current) {
+        sigaction(*current, previous, NULL);
+    }
+    *current = signum;
+    if (signum) {
+        *previous = old_action;
+    }
+    return 0;
+}
+
+static PyObject *
+py_set_rotate_signal(PyObject *Py_UNUSED(module), PyObject *args) {
+    int signum;
+    if (! PyArg_ParseTuple(args, "i", &signum)
+        || set_trace_signal(&rotate_signum, &rotate_previous_action, flush_signum, signum)) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+py_set_flush_signal(PyObject *Py_UNUSED(module), PyObject *args) {
+    int signum;
+    if (! PyArg_ParseTuple(args, "i", &signum)
+        || set_trace_signal(&flush_signum, &flush_previous_action, rotate_signum, signum)) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+/**** END: Signals that flush or rotate the log files. ****/
+
+/**** The C API, see pymemtrace_capi.h. ****/
+static int
+capi_mark(const char *label) {
+    return marker_push(TRACE_MARKER_MARK, 0, label);
+}
+
+static int
+capi_mark_alloc(size_t size, const char *tag) {
+    return marker_push(TRACE_MARKER_ALLOC, size, tag);
+}
+
+static int
+capi_mark_free(size_t size, const char *tag) {
+    return marker_push(TRACE_MARKER_FREE, size, tag);
+}
+
+static int
+capi_is_tracing(void) {
+    return __atomic_load_n(&marker_wrapper_count, __ATOMIC_ACQUIRE) != 0;
+}
+
+static int
+capi_region_add(const void *address, size_t size, const char *label) {
+    return region_residency_add(region_table_get(), address, size, label) ? PYMEMTRACE_REGION_NO_MEMORY
+                                                                          : PYMEMTRACE_REGION_OK;
+}
+
+static int
+capi_region_remove(const void *address) {
+    return region_residency_remove(region_table_get(), address) ? PYMEMTRACE_REGION_NOT_FOUND : PYMEMTRACE_REGION_OK;
+}
+
+static int
+capi_region_touched(const void *address) {
+    return region_residency_touch(region_table_get(), address) ? PYMEMTRACE_REGION_NOT_FOUND : PYMEMTRACE_REGION_OK;
+}
+
+static const PyMemTraceCAPI pymemtrace_capi = {
+    .version = PYMEMTRACE_CAPI_VERSION,
+    .mark = capi_mark,
+    .mark_alloc = capi_mark_alloc,
+    .mark_free = capi_mark_free,
+    .is_tracing = capi_is_tracing,
+    .region_add = capi_region_add,
+    .region_remove = capi_region_remove,
+    .region_touched = capi_region_touched,
+};
+
+/* The same as the C API for Python code and for testing. */
+static PyObject *
+py_mark(PyObject *Py_UNUSED(module), PyObject *args) {
+    const char *label;
+    if (! PyArg_ParseTuple(args, "s", &label)) {
+        return NULL;
+    }
+    return PyLong_FromLong(capi_mark(label));
+}
+
+static PyObject *
+py_mark_alloc_or_free(PyObject *args, int kind) {
+    Py_ssize_t size;
+    const char *tag;
+    if (! PyArg_ParseTuple(args, "ns", &size, &tag)) {
+        return NULL;
+    }
+    if (size < 0) {
+        PyErr_SetString(PyExc_ValueError, "size must be >= 0");
+        return NULL;
+    }
+    return PyLong_FromLong(marker_push(kind, (size_t)size, tag));
+}
+
+static PyObject *
+py_mark_alloc(PyObject *Py_UNUSED(module), PyObject *args) {
+    return py_mark_alloc_or_free(args, TRACE_MARKER_ALLOC);
+}
+
+static PyObject *
+py_mark_free(PyObject *Py_UNUSED(module), PyObject *args) {
+    return py_mark_alloc_or_free(args, TRACE_MARKER_FREE);
+}
+
+static PyObject *
+py_mark_parent(PyObject *Py_UNUSED(module), PyObject *args) {
+    long pid;
+    const char *how;
+    if (! PyArg_ParseTuple(args, "ls", &pid, &how)) {
+        return NULL;
+    }
+    if (pid <= 0) {
+        PyErr_SetString(PyExc_ValueError, "pid must be > 0");
+        return NULL;
+    }
+    return PyLong_FromLong(marker_push(TRACE_MARKER_PARENT, (size_t)pid, how));
+}
+
+static PyObject *
+py_is_tracing(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args)) {
+    return PyBool_FromLong(capi_is_tracing());
+}
+
+static PyObject *
+py_markers_dropped(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args)) {
+    return PyLong_FromSize_t(marker_queue_is_open ? trace_marker_queue_records_dropped(&marker_queue) : 0);
+}
+
+static PyObject *
+py_add_region(PyObject *Py_UNUSED(module), PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"address", "size", "label", NULL};
+    unsigned long long address;
+    Py_ssize_t size;
+    const char *label = "";
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "Kn|s", kwlist, &address, &size, &label)) {
+        return NULL;
+    }
+    if (size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "size must be > 0");
+        return NULL;
+    }
+    if (capi_region_add((const void *)(uintptr_t)address, (size_t)size, label) != PYMEMTRACE_REGION_OK) {
+        return PyErr_NoMemory();
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+py_remove_region(PyObject *Py_UNUSED(module), PyObject *args) {
+    unsigned long long address;
+    if (! PyArg_ParseTuple(args, "K", &address)) {
+        return NULL;
+    }
+    return PyBool_FromLong(capi_region_remove((const void *)(uintptr_t)address) == PYMEMTRACE_REGION_OK);
+}
+
+static PyObject *
+py_touch_region(PyObject *Py_UNUSED(module), PyObject *args) {
+    unsigned long long address;
+    if (! PyArg_ParseTuple(args, "K", &address)) {
+        return NULL;
+    }
+    return PyBool_FromLong(capi_region_touched((const void *)(uintptr_t)address) == PYMEMTRACE_REGION_OK);
+}
+
+static PyObject *
+py_regions(PyObject *Py_UNUSED(module), PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"rescan", NULL};
+    int rescan = 0;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &rescan)) {
+        return NULL;
+    }
+    RegionResidencyTable *table = region_table_get();
+    if (rescan) {
+        region_residency_touch_all(table);
+    }
+    region_residency_scan(table);
+    PyObject *result = PyList_New(table->count);
+    if (result == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < table->count; ++i) {
+        const RegionResidency *region = &table->regions[i];
+        PyObject *item = Py_BuildValue("KnnN", (unsigned long long)region->address, (Py_ssize_t)region->size,
+                                       (Py_ssize_t)region->resident_bytes,
+                                       PyUnicode_DecodeUTF8(region->label, (Py_ssize_t)strlen(region->label),
+                                                            "replace"));
+        if (item == NULL) {
+            Py_DECREF(result);
+            return NULL;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+    return result;
+}
+/**** END: The C API. ****/
+
+static PyObject *py_detach_all(PyObject *module, PyObject *args);
+
+static PyMethodDef cPyMemTraceMethods[] = {
+    {"rss",   (PyCFunction) py_rss, METH_NOARGS, "Return the current RSS in bytes."},
+    {"rss_peak",   (PyCFunction) py_rss_peak, METH_NOARGS, "Return the peak RSS in bytes."},
+    {"memory_counters", (PyCFunction) py_memory_counters, METH_VARARGS | METH_KEYWORDS,
+     "Return a dict of memory counters in bytes, and page fault counts, for this process."
+     " The optional argument ``fields`` is an iterable of the names wanted from \"rss\", \"rss_anon\","
+     " \"rss_file\", \"rss_shmem\", \"swap\", \"uss\", \"pss\", \"private\" and \"faults\", default is all of them."
+     " Counters that are not available on this platform are left out."
+     " On Linux \"uss\" and \"pss\" read ``/proc/self/smaps_rollup`` which is much slower than the others."},
+    {"set_rotate_signal", (PyCFunction) py_set_rotate_signal, METH_VARARGS,
+     "Rotate the log files when the process receives this signal, for example ``signal.SIGUSR1``."
+     " Each log file is rotated on its next event, 0 restores the previous handler."
+     " This replaces any handler set with the ``signal`` module."},
+    {"set_flush_signal", (PyCFunction) py_set_flush_signal, METH_VARARGS,
+     "Flush the log files when the process receives this signal, for example ``signal.SIGUSR2``."
+     " Each log file is flushed on its next event, 0 restores the previous handler."
+     " This replaces any handler set with the ``signal`` module."},
+    {"mark", (PyCFunction) py_mark, METH_VARARGS,
+     "Write a marker with this label to the log, before the next event, as the C API ``pymemtrace_mark()`` does."
+     " Returns 0 if it was queued, 1 if nothing is being traced and -1 if the queue was full."},
+    {"mark_alloc", (PyCFunction) py_mark_alloc, METH_VARARGS,
+     "mark_alloc(size, tag)\n\nWrite an ALLOC marker of ``size`` bytes for ``tag`` to the log, as the C API"
+     " ``pymemtrace_alloc()`` does. Returns the same as ``mark()``."},
+    {"mark_free", (PyCFunction) py_mark_free, METH_VARARGS,
+     "mark_free(size, tag)\n\nWrite a FREE marker of ``size`` bytes for ``tag`` to the log, as the C API"
+     " ``pymemtrace_free()`` does. Returns the same as ``mark()``."},
+    {"mark_parent", (PyCFunction) py_mark_parent, METH_VARARGS,
+     "mark_parent(pid, how)\n\nWrite a PARENT marker to the log that says this process was started by ``pid``,"
+     " ``how`` is for example \"spawn\". The child of ``os.fork()`` writes this itself. Returns the same as"
+     " ``mark()``."},
+    {"is_tracing", (PyCFunction) py_is_tracing, METH_NOARGS,
+     "Return True if a Profile, Trace or Monitor is writing a log in this process."},
+    {"_detach_all", (PyCFunction) py_detach_all, METH_NOARGS,
+     "Detach every Profile, Trace and Monitor and close their log files, for a process that ends with"
+     " ``os._exit()`` such as a ``multiprocessing`` worker, see ``pymemtrace.workers``."},
+    {"markers_dropped", (PyCFunction) py_markers_dropped, METH_NOARGS,
+     "Return the number of markers dropped because too many were waiting for the next event."},
+    {"add_region", (PyCFunction) py_add_region, METH_VARARGS | METH_KEYWORDS,
+     "add_region(address, size, label='')\n\nRegister ``size`` bytes from ``address``, such as"
+     " ``cMemLeak.CMalloc(...).buffer`` or the address of a NumPy array, so that the bytes of it that are resident are"
+     " measured with ``mincore()``. While tracing, events that read the RSS write a RESIDENT marker with the resident"
+     " bytes of each region that has changed. Only regions that are new or touched, see ``touch_region()``, are"
+     " scanned again. The label defaults to the address in hex. This replaces a region at the same address."},
+    {"remove_region", (PyCFunction) py_remove_region, METH_VARARGS,
+     "Remove the region registered at this address, call this before the memory is freed."
+     " Returns True if there was such a region."},
+    {"touch_region", (PyCFunction) py_touch_region, METH_VARARGS,
+     "Mark the region that contains this address to be scanned again, for example after writing to it."
+     " Returns True if there is such a region."},
+    {"regions", (PyCFunction) py_regions, METH_VARARGS | METH_KEYWORDS,
+     "regions(rescan=False)\n\nReturn the registered regions as a list of tuples"
+     " ``(address, size, resident_bytes, label)`` after scanning the touched regions, or every region if"
+     " ``rescan`` is True. ``resident_bytes`` counts whole pages so can be up to a page more than ``size`` at"
+     " either end."},
+    {NULL, NULL, 0, NULL}        /* Sentinel */
+};
+
+/* The wall clock time, seconds since the Unix epoch, when the wrapper's log file was opened, 0.0 if none. */
+static double
+wrapper_start_time(const TraceFileWrapper *wrapper) {
+    return wrapper ? (double)wrapper->clock.anchor_wall_ns / 1e9 : 0.0;
+}
+
+/*
+ * The documentation of the arguments shared by Profile and Trace. C99 only guarantees string literals of 4095
+ * characters so the documentation of these types is joined from parts by set_type_doc().
+ */
+#define TRACE_OPTIONS_DOC_1 \
+    "This takes one optional argument, ``d_rss_trigger``, that decides when a trace event gets recorded." \
+    " Suitable values:\n\n-1 : whenever an RSS change >= page size (usually 4096 bytes) is noticed." \
+    "\n\n0 : every event.\n\nn: whenever an RSS change >= n is noticed." \
+    "\n\nDefault is -1." \
+    "\n\nThe optional argument ``binary``, if True, writes a binary log file named" \
+    " \"YYYYmmdd_HHMMSS_<PID>.bin\". Formatting and writing is then done by a separate native thread." \
+    " Default is False." \
+    "\n\nThe optional argument ``intern_strings``, if True, writes each file and function name once to" \
+    " the text log as a line \"STR:  <id> <name>\" and events then have the id instead of the name." \
+    " This is always the case for binary logs. Default is False." \
+    "\n\nThe optional arguments ``sample_every=N`` and ``sample_interval_us=T`` read the RSS only every N" \
+    " events and/or every T microseconds, events in between reuse the last value. The log then marks" \
+    " rows where the RSS was actually read. Default is 0, every event is sampled." \
+    "\n\nThe optional argument ``all_threads``, if True, also traces every other thread, existing and" \
+    " those started later by the ``threading`` module. Each thread has its own log file named" \
+    " \"YYYYmmdd_HHMMSS_<PID>_<TID>.log\" where TID is the native thread id. Default is False." \
+    "\n\nThe optional argument ``aggregate``, if True, writes no events. Instead the change in RSS is" \
+    " accumulated for each (file, line) and a summary, largest total increase first, is written on exit" \
+    " to a file named \"YYYYmmdd_HHMMSS_<PID>.sites\". See ``summary()``. This can not be used with" \
+    " ``binary``. Default is False."
+
+#define TRACE_OPTIONS_DOC_2 \
+    "\n\nThe optional argument ``clock`` selects the source of the event times, one of" \
+    " \"monotonic\", \"monotonic_coarse\" and \"monotonic_raw\" (Linux), \"tsc\" (the CPU time stamp" \
+    " counter, calibrated once), \"mach\" (macOS) or \"cpu\" (process CPU time from ``clock()``)." \
+    " Times are in seconds since ``start_time``. Default is \"monotonic\"." \
+    "\n\nThe optional argument ``memory_counter`` logs another counter, see ``memory_counters()``, in place" \
+    " of the RSS, for example \"rss_anon\". Default is \"rss\"." \
+    "\n\nIf the optional argument ``estimate`` is True the Python allocators are wrapped to count the bytes" \
+    " requested and the RSS is only read when that count has grown by ``d_rss_trigger`` since the last" \
+    " read, or when a sample is due. Default is False." \
+    "\n\nThe optional arguments ``rotate_bytes=N`` and ``rotate_seconds=T`` close the log file once it" \
+    " has reached N bytes or is T seconds old and continue in the next segment. Segments are named" \
+    " \"YYYYmmdd_HHMMSS_<PID>-<SEQ>.log\" where SEQ is a six digit sequence number starting at 0." \
+    " See also ``flush()``, ``rotate()`` and ``set_rotate_signal()``. Default is 0, never." \
+    "\n\nThe optional argument ``compression=\"gzip\"`` writes the log file as gzip, named" \
+    " \"YYYYmmdd_HHMMSS_<PID>.log.gz\" or \".bin.gz\". Compression is done by a separate native thread." \
+    " ``cTraceReader`` reads these directly. This can not be used with ``aggregate``. Default is None." \
+    "\n\nThe optional argument ``directory`` is where log files are written, or ``file``, a file" \
+    " descriptor or object with ``fileno()`` such as a pipe or socket, is duplicated and written to" \
+    " instead. ``file`` can not be used with ``all_threads`` or rotation. ``buffer_size`` is the log" \
+    " file buffer size, 0 is the C library default. Default is 4MiB." \
+    "\n\nThe optional argument ``socket_address``, a UNIX domain socket path or a ``(host, port)`` UDP" \
+    " address, streams binary records as datagrams to it instead of writing a log file. Datagrams the" \
+    " receiver can not keep up with are dropped, see ``records_dropped``. Default is None." \
+    "\n\nThe optional argument ``mmap``, if True with ``binary=True``, writes the log file through a shared" \
+    " mapping of it, extended by ``buffer_size`` at a time, rather than with a writer thread. Each record is" \
+    " committed as it is written so if the process is killed, for example by the OOM killer, the log is complete" \
+    " to the last event. This can not be used with ``compression``, ``file`` or ``socket_address``." \
+    " Default is False." \
+    "\n\nThe optional argument ``stack_depth=K``, with ``binary=True``, records up to K callers of each" \
+    " event that passes ``d_rss_trigger`` in a table of stacks, see ``cTraceReader``. Default is 0." \
+    "\n\nThe optional arguments ``include`` and ``exclude``, each a pattern or a list of them, select the code" \
+    " objects that are traced. A pattern is an ``fnmatch`` pattern of the file name, \"module:<name>\" for" \
+    " a module and its submodules or \"function:<pattern>\" for the function name. Any exclude wins and if" \
+    " there are includes one must match. Events of other code objects are skipped without reading the RSS." \
+    " The decision is made once for each code object. Default is None, trace everything."
+
+#define TRACE_FILE_NAME_DOC \
+    "\n\nThis writes to a file in the current working directory named \"YYYYmmdd_HHMMSS_<PID>.log\""
+
+#define TRACE_START_TIME_DOC \
+    "The wall clock time, seconds since the Unix epoch, when the log file was opened." \
+    " The ``Clock`` column of the log is in seconds since this time."
+
+/**** Context manager for attach_profile_function() and detach_profile_function() ****/
+typedef struct {
+    PyObject_HEAD
+    TraceOptions options;
+    int active;
+    /* With aggregate, the summary() when __exit__ was called. */
+    PyObject *summary;
+    /* Wall clock time when the log file was opened, seconds since the Unix epoch. */
+    double start_time;
+    /* As of the last flush() or __exit__. */
+    unsigned long long records_dropped;
+    /* The stats() when __exit__ was called. */
+    PyObject *stats;
+} ProfileObject;
+
+static void
+ProfileObject_dealloc(ProfileObject *self) {
+    trace_filter_free(&self->options.filter);
+    Py_XDECREF(self->summary);
+    Py_XDECREF(self->stats);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+ProfileObject_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds)) {
+    ProfileObject *self = (ProfileObject *) type->tp_alloc(type, 0);
+    return (PyObject *) self;
+}
+
+static int
+ProfileObject_init(ProfileObject *self, PyObject *args, PyObject *kwds) {
+    return parse_trace_options(args, kwds, &self->options);
+}
+
+static PyObject *
+ProfileObject_enter(ProfileObject *self) {
+    PyObject *result = py_attach_profile_function(&self->options);
+    if (result == NULL) {
+        return NULL;
+    }
+    Py_DECREF(result);
+    self->active = 1;
+    self->records_dropped = 0;
+    Py_CLEAR(self->summary);
+    Py_CLEAR(self->stats);
+    self->start_time = wrapper_start_time(profile_wrapper);
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+ProfileObject_exit(ProfileObject *self, PyObject *Py_UNUSED(args)) {
+    if (self->active && self->options.aggregate) {
+        self->summary = call_site_summary(0);
+        if (self->summary == NULL) {
+            PyErr_Clear();
+        }
+    }
+    if (self->active) {
+        self->records_dropped = trace_records_dropped(0, 1);
+        self->stats = trace_stats_result(1, NULL, 0);
+        if (self->stats == NULL) {
+            PyErr_Clear();
+        }
+    }
+    self->active = 0;
+    py_detach_profile_function();
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+ProfileObject_summary(ProfileObject *self, PyObject *args, PyObject *kwds) {
+    return trace_summary(&self->options, self->active, self->summary, 0, args, kwds);
+}
+
+static PyObject *
+ProfileObject_stats(ProfileObject *self, PyObject *Py_UNUSED(args)) {
+    return trace_stats_result(self->active, self->stats, 0);
+}
+
+static PyObject *
+ProfileObject_flush(ProfileObject *self, PyObject *Py_UNUSED(args)) {
+    PyObject *result = trace_flush_or_rotate(&self->options, self->active, 0, 0);
+    if (result) {
+        self->records_dropped = trace_records_dropped(0, 0);
+    }
+    return result;
+}
+
+static PyObject *
+ProfileObject_rotate(ProfileObject *self, PyObject *Py_UNUSED(args)) {
+    return trace_flush_or_rotate(&self->options, self->active, 0, 1);
+}
+
+static PyMethodDef ProfileObject_methods[] = {
+        {"__enter__", (PyCFunction) ProfileObject_enter, METH_NOARGS,
+         "Attach a Profile object to the C runtime."},
+        {"__exit__", (PyCFunction) ProfileObject_exit, METH_VARARGS,
+         "Detach a Profile object from the C runtime."},
+        {"summary", (PyCFunction) ProfileObject_summary, METH_VARARGS | METH_KEYWORDS, TRACE_SUMMARY_DOC},
+        {"stats", (PyCFunction) ProfileObject_stats, METH_NOARGS, TRACE_STATS_DOC},
+        {"flush", (PyCFunction) ProfileObject_flush, METH_NOARGS, TRACE_FLUSH_DOC},
+        {"rotate", (PyCFunction) ProfileObject_rotate, METH_NOARGS, TRACE_ROTATE_DOC},
+        {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static PyMemberDef ProfileObject_members[] = {
+        {"start_time", T_DOUBLE, offsetof(ProfileObject, start_time), READONLY, TRACE_START_TIME_DOC},
+        {"records_dropped", T_ULONGLONG, offsetof(ProfileObject, records_dropped), READONLY, TRACE_RECORDS_DROPPED_DOC},
+        {NULL, 0, 0, 0, NULL}  /* Sentinel */
+};
+
+static const char *const ProfileObject_doc_parts[] = {
+    "A context manager to attach a C profile function to the interpreter.\n",
+    TRACE_OPTIONS_DOC_1,
+    TRACE_OPTIONS_DOC_2,
+    "\n\nThis is slightly less invasive profiling than ``cPyMemTrace.Trace`` as the profile function is"
+    " called for all monitored events except the Python ``PyTrace_LINE PyTrace_OPCODE`` and"
+    " ``PyTrace_EXCEPTION`` events.",
+    TRACE_FILE_NAME_DOC,
+    NULL
+};
+
+static PyTypeObject ProfileObjectType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "cPyMemTrace.Profile",
+        /* Set by set_type_doc() from ProfileObject_doc_parts. */
+        .tp_basicsize = sizeof(ProfileObject),
+        .tp_itemsize = 0,
+        .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+        .tp_new = ProfileObject_new,
+        .tp_init = (initproc) ProfileObject_init,
+        .tp_dealloc = (destructor) ProfileObject_dealloc,
+        .tp_methods = ProfileObject_methods,
+        .tp_members = ProfileObject_members,
+};
+/**** END: Context manager for attach_profile_function() and detach_profile_function() ****/
+
+/**** Context manager for attach_trace_function() and detach_trace_function() ****/
+typedef struct {
+    PyObject_HEAD
+    TraceOptions options;
+    int active;
+    /* With aggregate, the summary() when __exit__ was called. */
+    PyObject *summary;
+    /* Wall clock time when the log file was opened, seconds since the Unix epoch. */
+    double start_time;
+    /* As of the last flush() or __exit__. */
+    unsigned long long records_dropped;
+    /* The stats() when __exit__ was called. */
+    PyObject *stats;
+} TraceObject;
+
+static void
+TraceObject_dealloc(TraceObject *self) {
+    trace_filter_free(&self->options.filter);
+    Py_XDECREF(self->summary);
+    Py_XDECREF(self->stats);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+TraceObject_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds)) {
+    TraceObject *self = (TraceObject *) type->tp_alloc(type, 0);
+    return (PyObject *) self;
+}
+
+static int
+TraceObject_init(TraceObject *self, PyObject *args, PyObject *kwds) {
+    return parse_trace_options(args, kwds, &self->options);
+}
+
+static PyObject *
+TraceObject_enter(TraceObject *self) {
+    /* Could use cPyMemTracemodule. */
+    PyObject *result = py_attach_trace_function(&self->options);
+    if (result == NULL) {
+        return NULL;
+    }
+    Py_DECREF(result);
+    self->active = 1;
+    self->records_dropped = 0;
+    Py_CLEAR(self->summary);
+    Py_CLEAR(self->stats);
+    self->start_time = wrapper_start_time(trace_wrapper);
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+TraceObject_exit(TraceObject *self, PyObject *Py_UNUSED(args)) {
+    if (self->active && self->options.aggregate) {
+        self->summary = call_site_summary(1);
+        if (self->summary == NULL) {
+            PyErr_Clear();
+        }
+    }
+    if (self->active) {
+        self->records_dropped = trace_records_dropped(1, 1);
+        self->stats = trace_stats_result(1, NULL, 1);
+        if (self->stats == NULL) {
+            PyErr_Clear();
+        }
+    }
+    self->active = 0;
+    /* Could use cPyMemTracemodule. */
+    py_detach_trace_function();
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+TraceObject_summary(TraceObject *self, PyObject *args, PyObject *kwds) {
+    return trace_summary(&self->options, self->active, self->summary, 1, args, kwds);
+}
+
+static PyObject *
+TraceObject_stats(TraceObject *self, PyObject *Py_UNUSED(args)) {
+    return trace_stats_result(self->active, self->stats, 1);
+}
+
+static PyObject *
+TraceObject_flush(TraceObject *self, PyObject *Py_UNUSED(args)) {
+    PyObject *result = trace_flush_or_rotate(&self->options, self->active, 1, 0);
+    if (result) {
+        self->records_dropped = trace_records_dropped(1, 0);
+    }
+    return result;
+}
+
+static PyObject *
+TraceObject_rotate(TraceObject *self, PyObject *Py_UNUSED(args)) {
+    return trace_flush_or_rotate(&self->options, self->active, 1, 1);
+}
 
 static PyMethodDef TraceObject_methods[] = {
         {"__enter__", (PyCFunction) TraceObject_enter, METH_NOARGS,
          "Attach a Trace object to the C runtime."},
         {"__exit__", (PyCFunction) TraceObject_exit, METH_VARARGS,
          "Detach a Trace object from the C runtime."},
+        {"summary", (PyCFunction) TraceObject_summary, METH_VARARGS | METH_KEYWORDS, TRACE_SUMMARY_DOC},
+        {"stats", (PyCFunction) TraceObject_stats, METH_NOARGS, TRACE_STATS_DOC},
+        {"flush", (PyCFunction) TraceObject_flush, METH_NOARGS, TRACE_FLUSH_DOC},
+        {"rotate", (PyCFunction) TraceObject_rotate, METH_NOARGS, TRACE_ROTATE_DOC},
         {NULL, NULL, 0, NULL}  /* Sentinel */
 };
 
+static PyMemberDef TraceObject_members[] = {
+        {"start_time", T_DOUBLE, offsetof(TraceObject, start_time), READONLY, TRACE_START_TIME_DOC},
+        {"records_dropped", T_ULONGLONG, offsetof(TraceObject, records_dropped), READONLY, TRACE_RECORDS_DROPPED_DOC},
+        {NULL, 0, 0, 0, NULL}  /* Sentinel */
+};
+
+static const char *const TraceObject_doc_parts[] = {
+    "A context manager to attach a C profile function to the interpreter.\n",
+    TRACE_OPTIONS_DOC_1,
+    TRACE_OPTIONS_DOC_2,
+    "\n\nThe tracing function does receive Python line-number events and per-opcode events"
+    " but does not receive any event related to C functionss being called."
+    " For that use ``cPyMemTrace.Profile``",
+    TRACE_FILE_NAME_DOC,
+    NULL
+};
+
 static PyTypeObject TraceObjectType = {
         PyVarObject_HEAD_INIT(NULL, 0)
         .tp_name = "cPyMemTrace.Trace",
-        .tp_doc = "A context manager to attach a C profile function to the interpreter.\n"
-                  "This takes one optional argument, ``d_rss_trigger``, that decides when a trace event gets recorded."
-                  " Suitable values:\n\n-1 : whenever an RSS change >= page size (usually 4096 bytes) is noticed."
-                  "\n\n0 : every event.\n\nn: whenever an RSS change >= n is noticed."
-                  "\n\nDefault is -1."
-                  "\n\nThe tracing function does receive Python line-number events and per-opcode events"
-                  " but does not receive any event related to C functionss being called."
-                  " For that use ``cPyMemTrace.Profile``"
-                  "\n\nThis writes to a file in the current working directory named \"YYYYmmdd_HHMMSS_<PID>.log\""
-                  ,
+        /* Set by set_type_doc() from TraceObject_doc_parts. */
         .tp_basicsize = sizeof(TraceObject),
         .tp_itemsize = 0,
         .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
@@ -424,9 +3522,621 @@ static PyTypeObject TraceObjectType = {
         .tp_init = (initproc) TraceObject_init,
         .tp_dealloc = (destructor) TraceObject_dealloc,
         .tp_methods = TraceObject_methods,
+        .tp_members = TraceObject_members,
 };
 /**** END: Context manager for attach_trace_function() and detach_trace_function() ****/
 
+#if PY_VERSION_HEX >= 0x030C0000
+/**** Context manager that uses sys.monitoring, PEP 669, rather than a profile or trace function. ****/
+/*
+ * The callbacks are C functions registered with sys.monitoring.register_callback() for only the events needed:
+ *
+ * PY_START, PY_RETURN: logged as CALL and RETURN.
+ * CALL, C_RETURN, C_RAISE: only if c_calls is true, logged as C_CALL, C_RETURN and C_EXCEPT for callables that are
+ *  not Python functions.
+ *
+ * If disable_after is non-zero then once a code object has had that many consecutive events where the RSS was read
+ * and was unchanged the callbacks return sys.monitoring.DISABLE for events at that location.
+ * The interpreter then stops calling us for that location until sys.monitoring.restart_events() is called, this is
+ * done on exit.
+ *
+ * sys.monitoring is per interpreter so every thread is monitored and the events from all threads go to one log.
+ */
+typedef struct {
+    PyObject_HEAD
+    TraceOptions options;
+    int c_calls;
+    Py_ssize_t disable_after;
+    /* The rest is only set between __enter__ and __exit__, tool_id is -1 otherwise. */
+    int tool_id;
+    TraceFileWrapper *wrapper;
+    PyObject *disable;
+    /* Code object to the count of consecutive RSS neutral events. */
+    PointerMap neutral_counts;
+    /* Strong references that keep the neutral_counts keys alive. */
+    PyObject *code_references;
+    /* Wall clock time when the log file was opened, seconds since the Unix epoch. */
+    double start_time;
+    /* As of the last flush() or __exit__. */
+    unsigned long long records_dropped;
+    /* The stats() when __exit__ was called. */
+    PyObject *stats;
+} MonitorObject;
+
+/* The Monitor between __enter__ and __exit__, there is only one as it has the PROFILER_ID tool. Borrowed. */
+static MonitorObject *monitor_active = NULL;
+
+static void
+MonitorObject_clear_state(MonitorObject *self) {
+    self->tool_id = -1;
+    Py_CLEAR(self->wrapper);
+    Py_CLEAR(self->disable);
+    pointer_map_free(&self->neutral_counts);
+    Py_CLEAR(self->code_references);
+}
+
+static void
+MonitorObject_dealloc(MonitorObject *self) {
+    MonitorObject_clear_state(self);
+    trace_filter_free(&self->options.filter);
+    Py_XDECREF(self->stats);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+MonitorObject_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds)) {
+    MonitorObject *self = (MonitorObject *) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        /* tp_alloc zeroes the object so neutral_counts is empty and safe to free. */
+        self->tool_id = -1;
+    }
+    return (PyObject *) self;
+}
+
+static int
+MonitorObject_init(MonitorObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {
+        "d_rss_trigger", "binary", "intern_strings", "sample_every", "sample_interval_us", "c_calls",
+        "disable_after", "clock", "memory_counter", "estimate", "rotate_bytes", "rotate_seconds", "compression",
+        "directory", "file", "buffer_size", "socket_address", "stack_depth", "include", "exclude", "mmap", NULL
+    };
+    const char *clock_name = NULL;
+    const char *compression_name = NULL;
+    const char *memory_counter_name = NULL;
+    PyObject *directory = NULL;
+    PyObject *file = NULL;
+    Py_ssize_t buffer_size = -1;
+    PyObject *socket_address = NULL;
+    PyObject *include = NULL;
+    PyObject *exclude = NULL;
+    TraceOptions *options = &self->options;
+    options->d_rss_trigger = -1;
+    options->binary = 0;
+    options->intern_strings = 0;
+    options->sample_every = 0;
+    options->sample_interval_us = 0;
+    options->all_threads = 0;
+    options->aggregate = 0;
+    options->stack_depth = 0;
+    options->estimate = 0;
+    options->rotate_bytes = 0;
+    options->rotate_seconds = 0.0;
+    self->c_calls = 0;
+    self->disable_after = 0;
+    options->mapped = 0;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|ippnlpnzzpndzOOnOiOOp", kwlist,
+                                      &options->d_rss_trigger, &options->binary, &options->intern_strings,
+                                      &options->sample_every, &options->sample_interval_us,
+                                      &self->c_calls, &self->disable_after, &clock_name, &memory_counter_name,
+                                      &options->estimate, &options->rotate_bytes, &options->rotate_seconds,
+                                      &compression_name, &directory, &file, &buffer_size, &socket_address,
+                                      &options->stack_depth, &include, &exclude, &options->mapped)) {
+        return -1;
+    }
+    if (parse_clock_option(clock_name, options) || parse_memory_counter_option(memory_counter_name, options)
+        || parse_compression_option(compression_name, options)
+        || parse_output_options(directory, file, buffer_size, options)
+        || parse_socket_option(socket_address, options) || check_stack_option(options)
+        || check_mmap_option(options) || parse_filter_options(include, exclude, options)) {
+        return -1;
+    }
+    if (options->sample_every < 0 || options->sample_interval_us < 0 || self->disable_after < 0) {
+        PyErr_SetString(PyExc_ValueError, "sample_every, sample_interval_us and disable_after must be >= 0");
+        return -1;
+    }
+    return check_rotate_options(options);
+}
+
+/*
+ * Log the event and return a new reference to None or to sys.monitoring.DISABLE.
+ * can_disable is false for C_RETURN and C_RAISE as those events can not be disabled.
+ */
+static PyObject *
+monitor_event(MonitorObject *self, PyObject *code, PyObject *offset, int what, PyObject *arg, int can_disable) {
+    if (self->wrapper == NULL || ! PyCode_Check(code)) {
+        Py_RETURN_NONE;
+    }
+    int instruction_offset = (int)PyLong_AsLong(offset);
+    if (instruction_offset == -1 && PyErr_Occurred()) {
+        PyErr_Clear();
+        instruction_offset = 0;
+    }
+    if (self->wrapper->filter.count && ! is_code_traced(&self->wrapper->filter, (PyCodeObject *)code, NULL)) {
+        /* Seen but not traced. */
+        self->wrapper->stats[TRACE_STATS_EVENTS_SEEN]++;
+        self->wrapper->stats[TRACE_STATS_EVENTS_FILTERED]++;
+        /* The filter is fixed while monitoring so this location need never be seen again. */
+        if (can_disable && self->disable) {
+            Py_INCREF(self->disable);
+            return self->disable;
+        }
+        Py_RETURN_NONE;
+    }
+    size_t rss = self->wrapper->rss;
+    int sampled = trace_event(self->wrapper, NULL, (PyCodeObject *)code,
+                              PyCode_Addr2Line((PyCodeObject *)code, instruction_offset), what, arg);
+    if (can_disable && self->disable_after) {
+        uint32_t count = 0;
+        if (! pointer_map_get(&self->neutral_counts, code, &count)) {
+            /* Added to both once, the list keeps the key alive. */
+            if (PyList_Append(self->code_references, code)) {
+                PyErr_Clear();
+                Py_RETURN_NONE;
+            }
+            if (pointer_map_insert(&self->neutral_counts, code, 0)) {
+                Py_RETURN_NONE;
+            }
+        }
+        if (sampled) {
+            count = self->wrapper->rss == rss ? count + 1 : 0;
+            pointer_map_insert(&self->neutral_counts, code, count);
+        }
+        if (count >= (size_t)self->disable_after) {
+            Py_INCREF(self->disable);
+            return self->disable;
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+static int
+is_python_function(PyObject *callable) {
+    if (PyMethod_Check(callable)) {
+        callable = PyMethod_GET_FUNCTION(callable);
+    }
+    return PyFunction_Check(callable);
+}
+
+/* PY_START(code, instruction_offset) */
+static PyObject *
+monitor_py_start(MonitorObject *self, PyObject *const *args, Py_ssize_t nargs) {
+    if (nargs < 2) {
+        Py_RETURN_NONE;
+    }
+    return monitor_event(self, args[0], args[1], PyTrace_CALL, NULL, 1);
+}
+
+/* PY_RETURN(code, instruction_offset, retval) */
+static PyObject *
+monitor_py_return(MonitorObject *self, PyObject *const *args, Py_ssize_t nargs) {
+    if (nargs < 2) {
+        Py_RETURN_NONE;
+    }
+    return monitor_event(self, args[0], args[1], PyTrace_RETURN, NULL, 1);
+}
+
+/*
+ * CALL(code, instruction_offset, callable, arg0)
+ * Calls of Python functions are logged by PY_START so are ignored here. The location is not disabled as the same call
+ * site may later call a C function, that is left to disable_after in monitor_event().
+ */
+static PyObject *
+monitor_call(MonitorObject *self, PyObject *const *args, Py_ssize_t nargs) {
+    if (nargs < 3) {
+        Py_RETURN_NONE;
+    }
+    if (is_python_function(args[2])) {
+        Py_RETURN_NONE;
+    }
+    return monitor_event(self, args[0], args[1], PyTrace_C_CALL, args[2], 1);
+}
+
+/* C_RETURN(code, instruction_offset, callable, arg0) */
+static PyObject *
+monitor_c_return(MonitorObject *self, PyObject *const *args, Py_ssize_t nargs) {
+    if (nargs < 3 || is_python_function(args[2])) {
+        Py_RETURN_NONE;
+    }
+    return monitor_event(self, args[0], args[1], PyTrace_C_RETURN, args[2], 0);
+}
+
+/* C_RAISE(code, instruction_offset, callable, arg0) */
+static PyObject *
+monitor_c_raise(MonitorObject *self, PyObject *const *args, Py_ssize_t nargs) {
+    if (nargs < 3 || is_python_function(args[2])) {
+        Py_RETURN_NONE;
+    }
+    return monitor_event(self, args[0], args[1], PyTrace_C_EXCEPTION, args[2], 0);
+}
+
+/* The ml_name is the sys.monitoring.events name. */
+static PyMethodDef MonitorObject_callbacks[] = {
+    {"PY_START", (PyCFunction)(void(*)(void)) monitor_py_start, METH_FASTCALL, "sys.monitoring PY_START callback."},
+    {"PY_RETURN", (PyCFunction)(void(*)(void)) monitor_py_return, METH_FASTCALL, "sys.monitoring PY_RETURN callback."},
+    {"CALL", (PyCFunction)(void(*)(void)) monitor_call, METH_FASTCALL, "sys.monitoring CALL callback."},
+    {"C_RETURN", (PyCFunction)(void(*)(void)) monitor_c_return, METH_FASTCALL, "sys.monitoring C_RETURN callback."},
+    {"C_RAISE", (PyCFunction)(void(*)(void)) monitor_c_raise, METH_FASTCALL, "sys.monitoring C_RAISE callback."},
+};
+#define MONITOR_CALLBACKS_COUNT (sizeof(MonitorObject_callbacks) / sizeof(MonitorObject_callbacks[0]))
+/* The callbacks from this index on are only used if c_calls is true. */
+#define MONITOR_CALLBACKS_C_CALLS_START 2
+/* The callbacks from this index on are for ancillary events, these are enabled by CALL not by set_events(). */
+#define MONITOR_CALLBACKS_ANCILLARY_START 3
+
+/* Call a sys.monitoring function and discard the result. Returns 0 on success. */
+static int
+call_monitoring(PyObject *monitoring, const char *name, const char *format, ...) {
+    va_list va;
+    va_start(va, format);
+    PyObject *args = Py_VaBuildValue(format, va);
+    va_end(va);
+    if (args == NULL) {
+        return -1;
+    }
+    PyObject *function = PyObject_GetAttrString(monitoring, name);
+    PyObject *result = NULL;
+    if (function) {
+        result = PyObject_Call(function, args, NULL);
+        Py_DECREF(function);
+    }
+    Py_DECREF(args);
+    Py_XDECREF(result);
+    return result ? 0 : -1;
+}
+
+/* Get the bit for a sys.monitoring.events name. Returns -1 on failure. */
+static long
+monitoring_event_bit(PyObject *monitoring, const char *name) {
+    PyObject *events = PyObject_GetAttrString(monitoring, "events");
+    if (events == NULL) {
+        return -1;
+    }
+    PyObject *value = PyObject_GetAttrString(events, name);
+    Py_DECREF(events);
+    if (value == NULL) {
+        return -1;
+    }
+    long bit = PyLong_AsLong(value);
+    Py_DECREF(value);
+    return bit;
+}
+
+/* Unregister everything and close the log file. Any current exception is preserved. */
+static void
+monitor_stop(MonitorObject *self) {
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    if (monitor_active == self) {
+        monitor_active = NULL;
+    }
+    PyObject *monitoring = PySys_GetObject("monitoring");
+    if (monitoring && self->tool_id >= 0) {
+        if (call_monitoring(monitoring, "set_events", "(ii)", self->tool_id, 0)) {
+            PyErr_Clear();
+        }
+        for (size_t i = 0; i < MONITOR_CALLBACKS_COUNT; ++i) {
+            long bit = monitoring_event_bit(monitoring, MonitorObject_callbacks[i].ml_name);
+            if (bit < 0 || call_monitoring(monitoring, "register_callback", "(ilO)", self->tool_id, bit, Py_None)) {
+                PyErr_Clear();
+            }
+        }
+        if (call_monitoring(monitoring, "free_tool_id", "(i)", self->tool_id)
+            || call_monitoring(monitoring, "restart_events", "()")) {
+            PyErr_Clear();
+        }
+    }
+    if (self->wrapper) {
+        flush_trace_wrapper(self->wrapper);
+        self->records_dropped = wrapper_records_dropped(self->wrapper);
+        uint64_t values[TRACE_STATS_COUNT];
+        trace_wrapper_stats(self->wrapper, values);
+        Py_XSETREF(self->stats, trace_stats_dict(values));
+        if (self->stats == NULL) {
+            PyErr_Clear();
+        }
+    }
+    /* This closes the log file. */
+    MonitorObject_clear_state(self);
+    PyErr_Restore(type, value, traceback);
+}
+
+static PyObject *
+MonitorObject_enter(MonitorObject *self) {
+    if (self->tool_id >= 0) {
+        PyErr_SetString(PyExc_RuntimeError, "Monitor is already active.");
+        return NULL;
+    }
+    PyObject *monitoring = PySys_GetObject("monitoring");
+    if (monitoring == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "sys.monitoring is not available.");
+        return NULL;
+    }
+    PyObject *tool_id = PyObject_GetAttrString(monitoring, "PROFILER_ID");
+    if (tool_id == NULL) {
+        return NULL;
+    }
+    int id = (int)PyLong_AsLong(tool_id);
+    Py_DECREF(tool_id);
+    if (PyErr_Occurred() || call_monitoring(monitoring, "use_tool_id", "(is)", id, "pymemtrace")) {
+        return NULL;
+    }
+    self->tool_id = id;
+    self->wrapper = new_trace_wrapper(&self->options, 0);
+    if (self->wrapper == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "Could not create the log file.");
+        goto except;
+    }
+    self->start_time = wrapper_start_time(self->wrapper);
+    self->records_dropped = 0;
+    Py_CLEAR(self->stats);
+    self->disable = PyObject_GetAttrString(monitoring, "DISABLE");
+    self->code_references = PyList_New(0);
+    if (self->disable == NULL || self->code_references == NULL) {
+        goto except;
+    }
+    if (pointer_map_init(&self->neutral_counts, 1024)) {
+        PyErr_NoMemory();
+        goto except;
+    }
+    long events = 0;
+    size_t count = self->c_calls ? MONITOR_CALLBACKS_COUNT : MONITOR_CALLBACKS_C_CALLS_START;
+    for (size_t i = 0; i < count; ++i) {
+        long bit = monitoring_event_bit(monitoring, MonitorObject_callbacks[i].ml_name);
+        if (bit < 0) {
+            goto except;
+        }
+        PyObject *callback = PyCFunction_New(&MonitorObject_callbacks[i], (PyObject *)self);
+        if (callback == NULL) {
+            goto except;
+        }
+        int result = call_monitoring(monitoring, "register_callback", "(ilO)", id, bit, callback);
+        Py_DECREF(callback);
+        if (result) {
+            goto except;
+        }
+        if (i < MONITOR_CALLBACKS_ANCILLARY_START) {
+            events |= bit;
+        }
+    }
+    if (call_monitoring(monitoring, "set_events", "(il)", id, events)) {
+        goto except;
+    }
+    monitor_active = self;
+    Py_INCREF(self);
+    return (PyObject *) self;
+except:
+    monitor_stop(self);
+    return NULL;
+}
+
+static PyObject *
+MonitorObject_exit(MonitorObject *self, PyObject *Py_UNUSED(args)) {
+    monitor_stop(self);
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+MonitorObject_flush(MonitorObject *self, PyObject *Py_UNUSED(args)) {
+    if (self->wrapper == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "There is no log file until the context manager is entered.");
+        return NULL;
+    }
+    flush_trace_wrapper(self->wrapper);
+    self->records_dropped = wrapper_records_dropped(self->wrapper);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+MonitorObject_stats(MonitorObject *self, PyObject *Py_UNUSED(args)) {
+    if (self->wrapper) {
+        uint64_t values[TRACE_STATS_COUNT];
+        trace_wrapper_stats(self->wrapper, values);
+        return trace_stats_dict(values);
+    }
+    return trace_stats_result(0, self->stats, 0);
+}
+
+static PyObject *
+MonitorObject_rotate(MonitorObject *self, PyObject *Py_UNUSED(args)) {
+    if (self->wrapper == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "There is no log file until the context manager is entered.");
+        return NULL;
+    }
+    if (self->options.fd >= 0 || self->options.socket_address_length) {
+        PyErr_SetString(PyExc_RuntimeError, "rotate() can not be used with file or socket_address");
+        return NULL;
+    }
+    if (rotate_trace_wrapper(self->wrapper)) {
+        PyErr_SetString(PyExc_RuntimeError, "Could not open the next log file.");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef MonitorObject_methods[] = {
+        {"__enter__", (PyCFunction) MonitorObject_enter, METH_NOARGS,
+         "Register the sys.monitoring callbacks."},
+        {"__exit__", (PyCFunction) MonitorObject_exit, METH_VARARGS,
+         "Unregister the sys.monitoring callbacks and close the log file."},
+        {"stats", (PyCFunction) MonitorObject_stats, METH_NOARGS, TRACE_STATS_DOC},
+        {"flush", (PyCFunction) MonitorObject_flush, METH_NOARGS, TRACE_FLUSH_DOC},
+        {"rotate", (PyCFunction) MonitorObject_rotate, METH_NOARGS, TRACE_ROTATE_DOC},
+        {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static PyMemberDef MonitorObject_members[] = {
+        {"start_time", T_DOUBLE, offsetof(MonitorObject, start_time), READONLY, TRACE_START_TIME_DOC},
+        {"records_dropped", T_ULONGLONG, offsetof(MonitorObject, records_dropped), READONLY,
+         TRACE_RECORDS_DROPPED_DOC},
+        {NULL, 0, 0, 0, NULL}  /* Sentinel */
+};
+
+static PyTypeObject MonitorObjectType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "cPyMemTrace.Monitor",
+        .tp_doc = "A context manager that uses ``sys.monitoring`` (Python 3.12+) to log memory usage events.\n"
+                  "This has the same ``d_rss_trigger``, ``binary``, ``intern_strings``, ``sample_every``,"
+                  " ``sample_interval_us``, ``clock``, ``memory_counter``, ``estimate``, ``rotate_bytes``, ``rotate_seconds``,"
+                  " ``compression``, ``directory``, ``file``, ``buffer_size``, ``socket_address``, ``stack_depth``,"
+                  " ``include``, ``exclude`` and ``mmap`` arguments, and the ``stats()``, ``flush()`` and ``rotate()`` methods, as"
+                  " ``cPyMemTrace.Profile``. Locations in code objects that are not included are disabled."
+                  "\n\nOnly the events that are needed are monitored, Python function calls and returns and,"
+                  " if the optional argument ``c_calls`` is True, calls to and returns from C functions."
+                  " Default is False."
+                  "\n\nThe optional argument ``disable_after=N``, if non-zero, stops monitoring a code object once"
+                  " it has had N consecutive events where the RSS was read and did not change."
+                  " Default is 0, never disable."
+                  "\n\n``sys.monitoring`` is per interpreter, all threads are logged to the same file."
+                  "\n\nThis writes to a file in the current working directory named \"YYYYmmdd_HHMMSS_<PID>.log\""
+                  ,
+        .tp_basicsize = sizeof(MonitorObject),
+        .tp_itemsize = 0,
+        .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+        .tp_new = MonitorObject_new,
+        .tp_init = (initproc) MonitorObject_init,
+        .tp_dealloc = (destructor) MonitorObject_dealloc,
+        .tp_methods = MonitorObject_methods,
+        .tp_members = MonitorObject_members,
+};
+/**** END: Context manager that uses sys.monitoring ****/
+#endif // PY_VERSION_HEX >= 0x030C0000
+
+/**** Following fork(). ****/
+/*
+ * In the child of a fork() give the Profile or Trace its own log files, and wrappers, with the same options.
+ * With all_threads the other threads are gone so only the forking thread is attached, then new threads as before.
+ * A log written to the caller's file descriptor, and so shared with the parent, is not continued.
+ * Returns 1 if there is a new log file, 0 otherwise.
+ */
+static int
+fork_profile_or_trace(int is_trace) {
+    TraceFileWrapper *wrapper = is_trace ? trace_wrapper : profile_wrapper;
+    PyObject *thread_wrappers = is_trace ? trace_thread_wrappers : profile_thread_wrappers;
+    const TraceOptions *options = is_trace ? &trace_options : &profile_options;
+    if (wrapper == NULL) {
+        return 0;
+    }
+    for (Py_ssize_t i = 0; i < (thread_wrappers ? PyList_GET_SIZE(thread_wrappers) : 0); ++i) {
+        abandon_trace_wrapper((TraceFileWrapper *)PyList_GET_ITEM(thread_wrappers, i));
+    }
+    abandon_trace_wrapper(wrapper);
+    PyObject *result = NULL;
+    if (options->fd < 0) {
+        result = is_trace ? py_attach_trace_function(options) : py_attach_profile_function(options);
+    }
+    if (result == NULL) {
+        PyErr_Clear();
+        result = is_trace ? py_detach_trace_function() : py_detach_profile_function();
+        Py_XDECREF(result);
+        return 0;
+    }
+    Py_DECREF(result);
+    return 1;
+}
+
+#if PY_VERSION_HEX >= 0x030C0000
+/* The same as fork_profile_or_trace() for the active Monitor. */
+static int
+fork_monitor(void) {
+    MonitorObject *monitor = monitor_active;
+    if (monitor == NULL || monitor->wrapper == NULL) {
+        return 0;
+    }
+    abandon_trace_wrapper(monitor->wrapper);
+    TraceFileWrapper *wrapper = monitor->options.fd < 0 ? new_trace_wrapper(&monitor->options, 0) : NULL;
+    if (wrapper == NULL) {
+        monitor_stop(monitor);
+        return 0;
+    }
+    Py_SETREF(monitor->wrapper, wrapper);
+    monitor->start_time = wrapper_start_time(wrapper);
+    monitor->records_dropped = 0;
+    return 1;
+}
+#endif
+
+/*
+ * The os.register_at_fork(after_in_child=...) hook. The child only has the thread that called fork() and holds the
+ * GIL.
+ */
+static PyObject *
+py_after_fork_child(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args)) {
+    fork_pending = 0;
+    int forked = fork_profile_or_trace(0);
+    forked |= fork_profile_or_trace(1);
+#if PY_VERSION_HEX >= 0x030C0000
+    forked |= fork_monitor();
+#endif
+    if (forked) {
+        marker_push(TRACE_MARKER_PARENT, (size_t)getppid(), "fork");
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef fork_methods[] = {
+    {"_after_fork_child", (PyCFunction) py_after_fork_child, METH_NOARGS,
+     "os.register_at_fork() hook that gives the child process its own log files."},
+};
+
+/*
+ * Register py_after_fork_child() with os.register_at_fork(), and set_fork_pending() with pthread_atfork(), this needs
+ * Python 3.7 and is skipped before that.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+register_fork_handler(void) {
+    PyObject *os = PyImport_ImportModule("os");
+    if (os == NULL) {
+        return -1;
+    }
+    PyObject *register_at_fork = PyObject_GetAttrString(os, "register_at_fork");
+    Py_DECREF(os);
+    if (register_at_fork == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+    PyObject *hook = PyCFunction_New(&fork_methods[0], NULL);
+    PyObject *args = PyTuple_New(0);
+    PyObject *kwargs = hook ? Py_BuildValue("{sO}", "after_in_child", hook) : NULL;
+    PyObject *result = args && kwargs ? PyObject_Call(register_at_fork, args, kwargs) : NULL;
+    Py_XDECREF(result);
+    Py_XDECREF(kwargs);
+    Py_XDECREF(args);
+    Py_XDECREF(hook);
+    Py_DECREF(register_at_fork);
+    if (result == NULL) {
+        return -1;
+    }
+    if (pthread_atfork(NULL, NULL, &set_fork_pending)) {
+        PyErr_SetString(PyExc_RuntimeError, "Could not register the fork handler.");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject *
+py_detach_all(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args)) {
+    Py_XDECREF(py_detach_profile_function());
+    Py_XDECREF(py_detach_trace_function());
+#if PY_VERSION_HEX >= 0x030C0000
+    if (monitor_active) {
+        monitor_stop(monitor_active);
+    }
+#endif
+    Py_RETURN_NONE;
+}
+/**** END: Following fork(). ****/
+
 const char *PY_MEM_TRACE_DOC = "Module that contains C memory tracer classes and functions.";
 
 PyDoc_STRVAR(py_mem_trace_doc,
@@ -442,6 +4152,33 @@ static PyModuleDef cPyMemTracemodule = {
     .m_methods = cPyMemTraceMethods,
 };
 
+/*
+ * Set type->tp_doc to the parts joined together, this must be called before PyType_Ready().
+ * The documentation is kept for the life of the process as the type is static.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+set_type_doc(PyTypeObject *type, const char *const *parts) {
+    if (type->tp_doc) {
+        return 0;
+    }
+    size_t size = 1;
+    for (const char *const *part = parts; *part; ++part) {
+        size += strlen(*part);
+    }
+    char *doc = PyMem_RawMalloc(size);
+    if (doc == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    doc[0] = '\0';
+    for (const char *const *part = parts; *part; ++part) {
+        strcat(doc, *part);
+    }
+    type->tp_doc = doc;
+    return 0;
+}
+
 PyMODINIT_FUNC
 PyInit_cPyMemTrace(void) {
     PyObject *m = PyModule_Create(&cPyMemTracemodule);
@@ -459,7 +4196,7 @@ PyInit_cPyMemTrace(void) {
     Py_INCREF(&TraceFileWrapperType);
 
     /* Add the Profile object. */
-    if (PyType_Ready(&ProfileObjectType) < 0) {
+    if (set_type_doc(&ProfileObjectType, ProfileObject_doc_parts) || PyType_Ready(&ProfileObjectType) < 0) {
         Py_DECREF(m);
         return NULL;
     }
@@ -471,7 +4208,7 @@ PyInit_cPyMemTrace(void) {
     }
 
     /* Add the Trace object. */
-    if (PyType_Ready(&TraceObjectType) < 0) {
+    if (set_type_doc(&TraceObjectType, TraceObject_doc_parts) || PyType_Ready(&TraceObjectType) < 0) {
         Py_DECREF(m);
         return NULL;
     }
@@ -481,5 +4218,29 @@ PyInit_cPyMemTrace(void) {
         Py_DECREF(m);
         return NULL;
     }
+#if PY_VERSION_HEX >= 0x030C0000
+    /* Add the Monitor object. */
+    if (PyType_Ready(&MonitorObjectType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&MonitorObjectType);
+    if (PyModule_AddObject(m, "Monitor", (PyObject *) &MonitorObjectType) < 0) {
+        Py_DECREF(&MonitorObjectType);
+        Py_DECREF(m);
+        return NULL;
+    }
+#endif
+    /* The C API for other extensions, the table is static and lives as long as the process. */
+    PyObject *capi = PyCapsule_New((void *)&pymemtrace_capi, PYMEMTRACE_CAPI_CAPSULE_NAME, NULL);
+    if (capi == NULL || PyModule_AddObject(m, "_C_API", capi) < 0) {
+        Py_XDECREF(capi);
+        Py_DECREF(m);
+        return NULL;
+    }
+    if (register_fork_handler()) {
+        Py_DECREF(m);
+        return NULL;
+    }
     return m;
 }
@@ -0,0 +1,568 @@
+/*
+ * This contains a native diff of the traces of the tracemalloc module.
+ *
+ * pymemtrace.trace_malloc.TraceMalloc takes two tracemalloc snapshots and calls compare_to(). Each snapshot holds a
+ * Python object for every trace and compare_to() groups both of them into dicts before sorting, on a large heap this
+ * takes seconds and doubles the memory used.
+ *
+ * Here each walk of _tracemalloc._get_traces() goes straight into a table keyed by the allocation site, see
+ * trace_diff_table.h, the first walk subtracts and the second adds so only one list of traces is alive at a time and
+ * the result is the diff. The table is allocated with calloc() so it is not itself traced. Traces whose most recent
+ * frame is in an excluded file, by default tracemalloc's own, are skipped as they are walked.
+ * Only the top N sites are turned into Python objects.
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "structmember.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pointer_map.h"
+#include "trace_diff_table.h"
+
+#define TRACE_DIFF_TABLE_CAPACITY 1024
+
+typedef enum {
+    KEY_TYPE_FILENAME,
+    KEY_TYPE_LINENO,
+    KEY_TYPE_TRACEBACK,
+} TraceDiffKeyType;
+
+static const char *KEY_TYPE_NAMES[] = {"filename", "lineno", "traceback"};
+
+/* Values in the PointerMap of file names that have been checked against the exclusions. */
+#define FILENAME_INCLUDED 1
+#define FILENAME_EXCLUDED 2
+
+typedef struct {
+    PyObject_HEAD
+    TraceDiffKeyType key_type;
+    /* A tuple of str. */
+    PyObject *exclude;
+    int is_initialised;
+    /* The keys are strong references, a str for filename, a frame tuple for lineno, a traceback tuple otherwise. */
+    TraceDiffTable table;
+    /* 0 before start(), 1 after start() and 2 after finish(). */
+    int state;
+    long long size_diff;
+    long long count_diff;
+    unsigned long long size;
+    unsigned long long count;
+    unsigned long long traces_excluded;
+} SnapshotDiffObject;
+
+static uint64_t
+mix_hash(uint64_t hash, uint64_t value) {
+    /* As call_site_table_hash(). */
+    hash ^= value + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+    hash ^= hash >> 33;
+    hash *= 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+}
+
+/* The str hash is cached in the object so this is cheap after the first time. */
+static uint64_t
+filename_hash(PyObject *filename) {
+    return (uint64_t)PyObject_Hash(filename);
+}
+
+static int
+filename_equal(PyObject *filename_a, PyObject *filename_b) {
+    return filename_a == filename_b || PyUnicode_Compare(filename_a, filename_b) == 0;
+}
+
+/* A frame is a tuple (filename, lineno), these have been checked by walk_traces(). */
+static uint64_t
+frame_hash(PyObject *frame) {
+    return mix_hash(filename_hash(PyTuple_GET_ITEM(frame, 0)),
+                    (uint64_t)PyLong_AsLong(PyTuple_GET_ITEM(frame, 1)));
+}
+
+static int
+frame_equal(PyObject *frame_a, PyObject *frame_b) {
+    return frame_a == frame_b
+           || (filename_equal(PyTuple_GET_ITEM(frame_a, 0), PyTuple_GET_ITEM(frame_b, 0))
+               && PyLong_AsLong(PyTuple_GET_ITEM(frame_a, 1)) == PyLong_AsLong(PyTuple_GET_ITEM(frame_b, 1)));
+}
+
+static uint64_t
+traceback_hash(PyObject *traceback) {
+    uint64_t hash = (uint64_t)PyTuple_GET_SIZE(traceback);
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(traceback); ++i) {
+        hash = mix_hash(hash, frame_hash(PyTuple_GET_ITEM(traceback, i)));
+    }
+    return hash;
+}
+
+static int
+key_equal_filename(const void *key_a, const void *key_b) {
+    return filename_equal((PyObject *)key_a, (PyObject *)key_b);
+}
+
+static int
+key_equal_lineno(const void *key_a, const void *key_b) {
+    return frame_equal((PyObject *)key_a, (PyObject *)key_b);
+}
+
+static int
+key_equal_traceback(const void *key_a, const void *key_b) {
+    PyObject *traceback_a = (PyObject *)key_a;
+    PyObject *traceback_b = (PyObject *)key_b;
+    if (PyTuple_GET_SIZE(traceback_a) != PyTuple_GET_SIZE(traceback_b)) {
+        return 0;
+    }
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(traceback_a); ++i) {
+        if (! frame_equal(PyTuple_GET_ITEM(traceback_a, i), PyTuple_GET_ITEM(traceback_b, i))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const trace_diff_key_equal KEY_EQUAL[] = {key_equal_filename, key_equal_lineno, key_equal_traceback};
+
+static void
+SnapshotDiffObject_clear_table(SnapshotDiffObject *self) {
+    if (self->is_initialised) {
+        for (size_t i = 0; i < self->table.capacity; ++i) {
+            Py_XDECREF((PyObject *)self->table.entries[i].key);
+        }
+        trace_diff_table_free(&self->table);
+        self->is_initialised = 0;
+    }
+    self->state = 0;
+    self->size_diff = 0;
+    self->count_diff = 0;
+    self->size = 0;
+    self->count = 0;
+    self->traces_excluded = 0;
+}
+
+static void
+SnapshotDiffObject_dealloc(SnapshotDiffObject *self) {
+    SnapshotDiffObject_clear_table(self);
+    Py_XDECREF(self->exclude);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+SnapshotDiffObject_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds)) {
+    SnapshotDiffObject *self = (SnapshotDiffObject *) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->key_type = KEY_TYPE_LINENO;
+        self->exclude = NULL;
+        self->is_initialised = 0;
+        self->state = 0;
+    }
+    return (PyObject *) self;
+}
+
+/* Returns a new reference to (tracemalloc.__file__,) or NULL on failure. */
+static PyObject *
+default_exclude(void) {
+    PyObject *tracemalloc = PyImport_ImportModule("tracemalloc");
+    if (tracemalloc == NULL) {
+        return NULL;
+    }
+    PyObject *file = PyObject_GetAttrString(tracemalloc, "__file__");
+    Py_DECREF(tracemalloc);
+    if (file == NULL) {
+        return NULL;
+    }
+    PyObject *ret = PyTuple_Pack(1, file);
+    Py_DECREF(file);
+    return ret;
+}
+
+static int
+SnapshotDiffObject_init(SnapshotDiffObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"key_type", "exclude", NULL};
+    const char *key_type = "lineno";
+    PyObject *exclude = Py_None;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|sO", kwlist, &key_type, &exclude)) {
+        return -1;
+    }
+    int found = 0;
+    for (int i = 0; i < (int)(sizeof(KEY_TYPE_NAMES) / sizeof(KEY_TYPE_NAMES[0])); ++i) {
+        if (strcmp(key_type, KEY_TYPE_NAMES[i]) == 0) {
+            self->key_type = (TraceDiffKeyType)i;
+            found = 1;
+        }
+    }
+    if (! found) {
+        PyErr_Format(PyExc_ValueError, "key_type must be 'filename', 'lineno' or 'traceback' not '%s'", key_type);
+        return -1;
+    }
+    PyObject *exclude_tuple = exclude == Py_None ? default_exclude() : PySequence_Tuple(exclude);
+    if (exclude_tuple == NULL) {
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(exclude_tuple); ++i) {
+        if (! PyUnicode_Check(PyTuple_GET_ITEM(exclude_tuple, i))) {
+            PyErr_SetString(PyExc_TypeError, "exclude must be an iterable of str");
+            Py_DECREF(exclude_tuple);
+            return -1;
+        }
+    }
+    Py_XSETREF(self->exclude, exclude_tuple);
+    SnapshotDiffObject_clear_table(self);
+    return 0;
+}
+
+/* Returns non-zero if the file name is one of the exclusions, filenames caches the answer by object. */
+static int
+is_excluded(SnapshotDiffObject *self, PointerMap *filenames, PyObject *filename) {
+    uint32_t value;
+    if (pointer_map_get(filenames, filename, &value)) {
+        return value == FILENAME_EXCLUDED;
+    }
+    value = FILENAME_INCLUDED;
+    for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(self->exclude); ++i) {
+        if (filename_equal(filename, PyTuple_GET_ITEM(self->exclude, i))) {
+            value = FILENAME_EXCLUDED;
+            break;
+        }
+    }
+    /* If this fails the answer is worked out again next time. */
+    pointer_map_insert(filenames, filename, value);
+    return value == FILENAME_EXCLUDED;
+}
+
+/* Returns 1 if frame is a (str, int) tuple. */
+static int
+is_frame(PyObject *frame) {
+    return PyTuple_Check(frame) && PyTuple_GET_SIZE(frame) == 2
+           && PyUnicode_Check(PyTuple_GET_ITEM(frame, 0)) && PyLong_Check(PyTuple_GET_ITEM(frame, 1));
+}
+
+/*
+ * Walk the current traces into the table, adding if is_finish is non-zero otherwise subtracting.
+ * Returns 0 on success, -1 on failure with an exception set.
+ */
+static int
+walk_traces(SnapshotDiffObject *self, int is_finish) {
+    PyObject *module = PyImport_ImportModule("_tracemalloc");
+    if (module == NULL) {
+        return -1;
+    }
+    PyObject *is_tracing = PyObject_CallMethod(module, "is_tracing", NULL);
+    if (is_tracing == NULL) {
+        Py_DECREF(module);
+        return -1;
+    }
+    int tracing = PyObject_IsTrue(is_tracing);
+    Py_DECREF(is_tracing);
+    if (tracing != 1) {
+        Py_DECREF(module);
+        if (tracing == 0) {
+            PyErr_SetString(PyExc_RuntimeError, "the tracemalloc module must be tracing memory allocations");
+        }
+        return -1;
+    }
+    PyObject *traces = PyObject_CallMethod(module, "_get_traces", NULL);
+    Py_DECREF(module);
+    if (traces == NULL) {
+        return -1;
+    }
+    if (! PyList_Check(traces)) {
+        PyErr_SetString(PyExc_TypeError, "_tracemalloc._get_traces() did not return a list");
+        Py_DECREF(traces);
+        return -1;
+    }
+    PointerMap filenames;
+    if (pointer_map_init(&filenames, 256)) {
+        Py_DECREF(traces);
+        PyErr_NoMemory();
+        return -1;
+    }
+    int result = 0;
+    for (Py_ssize_t i = 0; i < PyList_GET_SIZE(traces); ++i) {
+        /* (domain, size, traceback) with total_nframe on Python 3.9+. */
+        PyObject *trace = PyList_GET_ITEM(traces, i);
+        if (! PyTuple_Check(trace) || PyTuple_GET_SIZE(trace) < 3 || ! PyTuple_Check(PyTuple_GET_ITEM(trace, 2))) {
+            continue;
+        }
+        PyObject *traceback = PyTuple_GET_ITEM(trace, 2);
+        if (PyTuple_GET_SIZE(traceback) == 0 || ! is_frame(PyTuple_GET_ITEM(traceback, 0))) {
+            continue;
+        }
+        Py_ssize_t size = PyLong_AsSsize_t(PyTuple_GET_ITEM(trace, 1));
+        if (size == -1 && PyErr_Occurred()) {
+            result = -1;
+            break;
+        }
+        /* The most recent frame is first. */
+        PyObject *frame = PyTuple_GET_ITEM(traceback, 0);
+        PyObject *filename = PyTuple_GET_ITEM(frame, 0);
+        if (is_excluded(self, &filenames, filename)) {
+            self->traces_excluded += is_finish;
+            continue;
+        }
+        PyObject *key;
+        uint64_t hash;
+        switch (self->key_type) {
+            case KEY_TYPE_FILENAME:
+                key = filename;
+                hash = filename_hash(filename);
+                break;
+            case KEY_TYPE_LINENO:
+                key = frame;
+                hash = frame_hash(frame);
+                break;
+            default:
+                for (Py_ssize_t f = 1; f < PyTuple_GET_SIZE(traceback); ++f) {
+                    if (! is_frame(PyTuple_GET_ITEM(traceback, f))) {
+                        PyErr_SetString(PyExc_TypeError, "_tracemalloc._get_traces() frame is not (str, int)");
+                        Py_DECREF(traces);
+                        pointer_map_free(&filenames);
+                        return -1;
+                    }
+                }
+                key = traceback;
+                hash = traceback_hash(traceback);
+                break;
+        }
+        int is_new;
+        TraceDiffEntry *entry = trace_diff_table_get(&self->table, key, hash, &is_new);
+        if (entry == NULL) {
+            PyErr_NoMemory();
+            result = -1;
+            break;
+        }
+        if (is_new) {
+            /* This does not allocate so it is not traced. */
+            Py_INCREF(key);
+        }
+        if (is_finish) {
+            entry->size += (uint64_t)size;
+            entry->count++;
+            entry->size_diff += size;
+            entry->count_diff++;
+            self->size += (unsigned long long)size;
+            self->count++;
+            self->size_diff += size;
+            self->count_diff++;
+        } else {
+            entry->size_diff -= size;
+            entry->count_diff--;
+            self->size_diff -= size;
+            self->count_diff--;
+        }
+    }
+    pointer_map_free(&filenames);
+    Py_DECREF(traces);
+    return result;
+}
+
+static PyObject *
+SnapshotDiffObject_start(SnapshotDiffObject *self, PyObject *Py_UNUSED(args)) {
+    SnapshotDiffObject_clear_table(self);
+    if (trace_diff_table_init(&self->table, TRACE_DIFF_TABLE_CAPACITY, KEY_EQUAL[self->key_type])) {
+        return PyErr_NoMemory();
+    }
+    self->is_initialised = 1;
+    if (walk_traces(self, 0)) {
+        SnapshotDiffObject_clear_table(self);
+        return NULL;
+    }
+    self->state = 1;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+SnapshotDiffObject_finish(SnapshotDiffObject *self, PyObject *Py_UNUSED(args)) {
+    if (self->state != 1) {
+        PyErr_SetString(PyExc_RuntimeError, "start() must be called before finish().");
+        return NULL;
+    }
+    if (walk_traces(self, 1)) {
+        SnapshotDiffObject_clear_table(self);
+        return NULL;
+    }
+    self->state = 2;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+SnapshotDiffObject_enter(SnapshotDiffObject *self, PyObject *Py_UNUSED(args)) {
+    PyObject *result = SnapshotDiffObject_start(self, NULL);
+    if (result == NULL) {
+        return NULL;
+    }
+    Py_DECREF(result);
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+SnapshotDiffObject_exit(SnapshotDiffObject *self, PyObject *Py_UNUSED(args)) {
+    PyObject *result = SnapshotDiffObject_finish(self, NULL);
+    if (result == NULL) {
+        return NULL;
+    }
+    Py_DECREF(result);
+    Py_RETURN_FALSE;
+}
+
+/* Returns a new reference to the frames of an entry as tracemalloc.Snapshot.compare_to() would group them. */
+static PyObject *
+entry_frames(const SnapshotDiffObject *self, const TraceDiffEntry *entry) {
+    PyObject *key = (PyObject *)entry->key;
+    switch (self->key_type) {
+        case KEY_TYPE_FILENAME:
+            return Py_BuildValue("((Oi))", key, 0);
+        case KEY_TYPE_LINENO:
+            return PyTuple_Pack(1, key);
+        default:
+            Py_INCREF(key);
+            return key;
+    }
+}
+
+static PyObject *
+SnapshotDiffObject_statistics(SnapshotDiffObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"limit", NULL};
+    Py_ssize_t limit = -1;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|n", kwlist, &limit)) {
+        return NULL;
+    }
+    if (self->state != 2) {
+        PyErr_SetString(PyExc_RuntimeError, "finish() must be called before statistics().");
+        return NULL;
+    }
+    Py_ssize_t count = (Py_ssize_t)self->table.size;
+    if (limit >= 0 && limit < count) {
+        count = limit;
+    }
+    const TraceDiffEntry **sorted = trace_diff_table_sorted(&self->table);
+    if (sorted == NULL) {
+        return PyErr_NoMemory();
+    }
+    PyObject *ret = PyList_New(count);
+    if (ret == NULL) {
+        free(sorted);
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        const TraceDiffEntry *entry = sorted[i];
+        PyObject *frames = entry_frames(self, entry);
+        PyObject *item = frames ? Py_BuildValue(
+            "NKLKL", frames,
+            (unsigned long long)entry->size, (long long)entry->size_diff,
+            (unsigned long long)entry->count, (long long)entry->count_diff
+        ) : NULL;
+        if (item == NULL) {
+            free(sorted);
+            Py_DECREF(ret);
+            return NULL;
+        }
+        PyList_SET_ITEM(ret, i, item);
+    }
+    free(sorted);
+    return ret;
+}
+
+static PyObject *
+SnapshotDiffObject_get_key_type(SnapshotDiffObject *self, void *Py_UNUSED(closure)) {
+    return PyUnicode_FromString(KEY_TYPE_NAMES[self->key_type]);
+}
+
+static PyObject *
+SnapshotDiffObject_get_exclude(SnapshotDiffObject *self, void *Py_UNUSED(closure)) {
+    if (self->exclude == NULL) {
+        return PyTuple_New(0);
+    }
+    Py_INCREF(self->exclude);
+    return self->exclude;
+}
+
+static PyObject *
+SnapshotDiffObject_get_sites(SnapshotDiffObject *self, void *Py_UNUSED(closure)) {
+    return PyLong_FromSize_t(self->is_initialised ? self->table.size : 0);
+}
+
+static PyGetSetDef SnapshotDiffObject_getsetters[] = {
+    {"key_type", (getter) SnapshotDiffObject_get_key_type, NULL, "'filename', 'lineno' or 'traceback'.", NULL},
+    {"exclude", (getter) SnapshotDiffObject_get_exclude, NULL,
+     "Tuple of file names, traces whose most recent frame is in one of these are skipped.", NULL},
+    {"sites", (getter) SnapshotDiffObject_get_sites, NULL,
+     "The number of allocation sites seen by either walk.", NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+static PyMemberDef SnapshotDiffObject_members[] = {
+    {"size_diff", T_LONGLONG, offsetof(SnapshotDiffObject, size_diff), READONLY,
+     "The change in traced bytes over all sites, not just those returned by ``statistics()``."},
+    {"count_diff", T_LONGLONG, offsetof(SnapshotDiffObject, count_diff), READONLY,
+     "The change in the number of traced blocks over all sites."},
+    {"size", T_ULONGLONG, offsetof(SnapshotDiffObject, size), READONLY,
+     "The traced bytes at ``finish()``."},
+    {"count", T_ULONGLONG, offsetof(SnapshotDiffObject, count), READONLY,
+     "The number of traced blocks at ``finish()``."},
+    {"traces_excluded", T_ULONGLONG, offsetof(SnapshotDiffObject, traces_excluded), READONLY,
+     "The number of traces at ``finish()`` that were skipped by ``exclude``."},
+    {NULL, 0, 0, 0, NULL}  /* Sentinel */
+};
+
+static PyMethodDef SnapshotDiffObject_methods[] = {
+    {"start", (PyCFunction) SnapshotDiffObject_start, METH_NOARGS,
+     "Walk the current traces, this discards any previous results."},
+    {"finish", (PyCFunction) SnapshotDiffObject_finish, METH_NOARGS,
+     "Walk the current traces and compute the change since ``start()``."},
+    {"__enter__", (PyCFunction) SnapshotDiffObject_enter, METH_NOARGS, "Call ``start()``."},
+    {"__exit__", (PyCFunction) SnapshotDiffObject_exit, METH_VARARGS, "Call ``finish()``."},
+    {"statistics", (PyCFunction) SnapshotDiffObject_statistics, METH_VARARGS | METH_KEYWORDS,
+     "Return a list of up to ``limit``, all of them if -1 (the default), of the sites with the largest change in"
+     " size as (frames, size, size_diff, count, count_diff). The order and frames are those of"
+     " ``tracemalloc.Snapshot.compare_to()``, ``tracemalloc.StatisticDiff(tracemalloc.Traceback(frames), *rest)``"
+     " gives the same object."},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+static PyTypeObject SnapshotDiffObjectType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "cTraceMalloc.SnapshotDiff",
+    .tp_doc = "SnapshotDiff(key_type='lineno', exclude=None)\n\n"
+              "The difference between two walks of the tracemalloc traces grouped by ``key_type``, 'filename',"
+              " 'lineno' or 'traceback', as ``tracemalloc.Snapshot.compare_to()`` but without taking snapshots."
+              " Traces whose most recent frame is in one of the files in ``exclude`` are skipped, None is"
+              " tracemalloc's own file. This can be used as a context manager that calls ``start()`` and"
+              " ``finish()``.",
+    .tp_basicsize = sizeof(SnapshotDiffObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = SnapshotDiffObject_new,
+    .tp_init = (initproc) SnapshotDiffObject_init,
+    .tp_dealloc = (destructor) SnapshotDiffObject_dealloc,
+    .tp_members = SnapshotDiffObject_members,
+    .tp_methods = SnapshotDiffObject_methods,
+    .tp_getset = SnapshotDiffObject_getsetters,
+};
+
+static PyModuleDef cTraceMallocmodule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "cTraceMalloc",
+    .m_doc = "A module that computes the difference between two walks of the tracemalloc traces.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC
+PyInit_cTraceMalloc(void) {
+    PyObject *m = PyModule_Create(&cTraceMallocmodule);
+    if (m == NULL) {
+        return NULL;
+    }
+    if (PyType_Ready(&SnapshotDiffObjectType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&SnapshotDiffObjectType);
+    if (PyModule_AddObject(m, "SnapshotDiff", (PyObject *) &SnapshotDiffObjectType) < 0) {
+        Py_DECREF(&SnapshotDiffObjectType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
+}
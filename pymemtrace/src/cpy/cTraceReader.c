@@ -0,0 +1,1869 @@
+/*
+ * A streaming reader for the log files written by cPyMemTrace.
+ *
+ * This reads both the text format, with or without a string table, and the binary format described in trace_record.h.
+ * The file is memory mapped and parsed in C into batches of columns.
+ * Each column is a Column object that supports the buffer protocol so can be used with memoryview() or
+ * numpy.frombuffer() without copying.
+ *
+ * File and function names are always given as ids, Reader.strings maps the id to the name.
+ * For text logs without a string table the reader creates the ids itself.
+ *
+ * Compressed logs, see trace_compress.h, are decompressed into memory when the Reader is created.
+ *
+ * Binary logs written with stack_depth have a stack id for the events that passed d_rss_trigger, Reader.stacks maps
+ * this to the caller and its stack id and Reader.stack() gives the frames.
+ *
+ * Markers written by other extensions with the C API of cPyMemTrace are skipped when reading events,
+ * Reader.markers() reads them all.
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include "structmember.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "get_rss.h"
+#include "pymemtrace_clock.h"
+#include "trace_compress.h"
+#include "trace_record.h"
+
+/* Default number of events in a batch. */
+#define TRACE_READER_DEFAULT_BATCH_SIZE 65536
+
+/* Longest numeric token, such as the clock, that is copied out of a text line to parse it. */
+#define TRACE_READER_MAX_TOKEN_LENGTH 64
+
+/* Same order as the PyTrace_... values. */
+static const char *WHAT_STRINGS[] = {
+    "CALL",
+    "EXCEPT",
+    "LINE",
+    "RETURN",
+    "C_CALL",
+    "C_EXCEPT",
+    "C_RETURN",
+    "OPCODE",
+};
+#define WHAT_STRINGS_COUNT (sizeof(WHAT_STRINGS) / sizeof(WHAT_STRINGS[0]))
+
+/**** Column, a typed array that exposes the buffer protocol. ****/
+typedef struct {
+    PyObject_HEAD
+    char *data;
+    Py_ssize_t length;
+    Py_ssize_t capacity;
+    Py_ssize_t itemsize;
+    /* A struct module format character, static storage. */
+    const char *format;
+    Py_ssize_t exports;
+} ColumnObject;
+
+static void
+ColumnObject_dealloc(ColumnObject *self) {
+    PyMem_Free(self->data);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+ColumnObject_getbuffer(ColumnObject *self, Py_buffer *view, int flags) {
+    if (PyBuffer_FillInfo(view, (PyObject *)self, self->data, self->length * self->itemsize, 1, flags)) {
+        return -1;
+    }
+    view->itemsize = self->itemsize;
+    if (flags & PyBUF_FORMAT) {
+        view->format = (char *)self->format;
+    }
+    if (flags & PyBUF_ND) {
+        view->ndim = 1;
+        view->shape = &self->length;
+    }
+    if (flags & PyBUF_STRIDES) {
+        view->strides = &view->itemsize;
+    }
+    self->exports++;
+    return 0;
+}
+
+static void
+ColumnObject_releasebuffer(ColumnObject *self, Py_buffer *Py_UNUSED(view)) {
+    self->exports--;
+}
+
+static PyBufferProcs ColumnObject_as_buffer = {
+    .bf_getbuffer = (getbufferproc) ColumnObject_getbuffer,
+    .bf_releasebuffer = (releasebufferproc) ColumnObject_releasebuffer,
+};
+
+static Py_ssize_t
+ColumnObject_length(ColumnObject *self) {
+    return self->length;
+}
+
+static PySequenceMethods ColumnObject_as_sequence = {
+    .sq_length = (lenfunc) ColumnObject_length,
+};
+
+static PyObject *
+ColumnObject_getformat(ColumnObject *self, void *Py_UNUSED(closure)) {
+    return PyUnicode_FromString(self->format);
+}
+
+static PyGetSetDef ColumnObject_getsetters[] = {
+    {"format", (getter) ColumnObject_getformat, (setter) NULL, "The struct module format of each item.", NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(
+    ColumnObjectType_tp_doc,
+    "A column of values from a trace log. This supports the buffer protocol,"
+    " for example ``memoryview(column).tolist()`` or ``numpy.frombuffer(column, dtype=column.format)``."
+);
+
+static PyTypeObject ColumnObjectType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "cTraceReader.Column",
+    .tp_doc = ColumnObjectType_tp_doc,
+    .tp_basicsize = sizeof(ColumnObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) ColumnObject_dealloc,
+    .tp_as_buffer = &ColumnObject_as_buffer,
+    .tp_as_sequence = &ColumnObject_as_sequence,
+    .tp_getset = ColumnObject_getsetters,
+};
+
+static ColumnObject *
+new_column(const char *format, Py_ssize_t itemsize, Py_ssize_t capacity) {
+    ColumnObject *column = PyObject_New(ColumnObject, &ColumnObjectType);
+    if (column == NULL) {
+        return NULL;
+    }
+    column->data = PyMem_Malloc(capacity * itemsize);
+    if (column->data == NULL) {
+        column->length = 0;
+        Py_DECREF(column);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    column->length = 0;
+    column->capacity = capacity;
+    column->itemsize = itemsize;
+    column->format = format;
+    column->exports = 0;
+    return column;
+}
+/**** END: Column ****/
+
+/**** The columns of a single batch. ****/
+enum {
+    COLUMN_EVENT,
+    COLUMN_CLOCK,
+    COLUMN_WHAT,
+    COLUMN_FILE,
+    COLUMN_LINE,
+    COLUMN_FUNC,
+    COLUMN_RSS,
+    COLUMN_D_RSS,
+    COLUMN_FLAGS,
+    COLUMN_STACK,
+    COLUMN_COUNT,
+};
+
+static const char *COLUMN_NAMES[COLUMN_COUNT] = {
+    "event", "clock", "what", "file", "line", "func", "rss", "d_rss", "flags", "stack",
+};
+
+static const char *COLUMN_FORMATS[COLUMN_COUNT] = {
+    "Q", "d", "B", "I", "i", "I", "Q", "q", "B", "I",
+};
+
+static const Py_ssize_t COLUMN_ITEMSIZES[COLUMN_COUNT] = {
+    sizeof(uint64_t), sizeof(double), sizeof(uint8_t), sizeof(uint32_t), sizeof(int32_t), sizeof(uint32_t),
+    sizeof(uint64_t), sizeof(int64_t), sizeof(uint8_t), sizeof(uint32_t),
+};
+
+/* A parsed event regardless of the log format. */
+typedef struct {
+    uint64_t event_number;
+    double clock;
+    uint8_t what;
+    uint32_t file_id;
+    int32_t line_number;
+    uint32_t func_id;
+    uint64_t rss;
+    int64_t d_rss;
+    uint8_t flags;
+    /* 0 if there is no stack. */
+    uint32_t stack_id;
+} TraceEvent;
+
+typedef struct {
+    ColumnObject *columns[COLUMN_COUNT];
+} Batch;
+
+static void
+batch_clear(Batch *batch) {
+    for (int i = 0; i < COLUMN_COUNT; ++i) {
+        Py_CLEAR(batch->columns[i]);
+    }
+}
+
+static int
+batch_init(Batch *batch, Py_ssize_t capacity) {
+    memset(batch, 0, sizeof(Batch));
+    for (int i = 0; i < COLUMN_COUNT; ++i) {
+        batch->columns[i] = new_column(COLUMN_FORMATS[i], COLUMN_ITEMSIZES[i], capacity);
+        if (batch->columns[i] == NULL) {
+            batch_clear(batch);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#define BATCH_SET(batch, column, type, value) \
+    ((type *)(batch)->columns[column]->data)[(batch)->columns[column]->length++] = (value)
+
+static void
+batch_append(Batch *batch, const TraceEvent *event) {
+    BATCH_SET(batch, COLUMN_EVENT, uint64_t, event->event_number);
+    BATCH_SET(batch, COLUMN_CLOCK, double, event->clock);
+    BATCH_SET(batch, COLUMN_WHAT, uint8_t, event->what);
+    BATCH_SET(batch, COLUMN_FILE, uint32_t, event->file_id);
+    BATCH_SET(batch, COLUMN_LINE, int32_t, event->line_number);
+    BATCH_SET(batch, COLUMN_FUNC, uint32_t, event->func_id);
+    BATCH_SET(batch, COLUMN_RSS, uint64_t, event->rss);
+    BATCH_SET(batch, COLUMN_D_RSS, int64_t, event->d_rss);
+    BATCH_SET(batch, COLUMN_FLAGS, uint8_t, event->flags);
+    BATCH_SET(batch, COLUMN_STACK, uint32_t, event->stack_id);
+}
+
+#undef BATCH_SET
+
+static Py_ssize_t
+batch_length(const Batch *batch) {
+    return batch->columns[COLUMN_EVENT]->length;
+}
+
+/* Returns a new dict of column name to Column and clears the batch. */
+static PyObject *
+batch_to_dict(Batch *batch) {
+    PyObject *result = PyDict_New();
+    if (result == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < COLUMN_COUNT; ++i) {
+        if (PyDict_SetItemString(result, COLUMN_NAMES[i], (PyObject *)batch->columns[i])) {
+            Py_DECREF(result);
+            return NULL;
+        }
+    }
+    batch_clear(batch);
+    return result;
+}
+/**** END: Batch ****/
+
+/**** Hash table of text, used to give ids to names in text logs that do not have a string table. ****/
+typedef struct {
+    const char *text;
+    size_t length;
+    uint32_t id;
+} NameEntry;
+
+typedef struct {
+    NameEntry *entries;
+    size_t capacity;
+    size_t size;
+} NameTable;
+
+static uint64_t
+name_hash(const char *text, size_t length) {
+    /* FNV-1a */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)text[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static NameEntry *
+name_table_find(NameEntry *entries, size_t capacity, const char *text, size_t length) {
+    size_t mask = capacity - 1;
+    size_t index = (size_t)name_hash(text, length) & mask;
+    while (entries[index].text != NULL
+           && (entries[index].length != length || memcmp(entries[index].text, text, length) != 0)) {
+        index = (index + 1) & mask;
+    }
+    return entries + index;
+}
+
+static void
+name_table_free(NameTable *table) {
+    PyMem_Free(table->entries);
+    table->entries = NULL;
+    table->capacity = 0;
+    table->size = 0;
+}
+
+/*
+ * Returns the id of the text, creating one if necessary. text must remain valid for the life of the table.
+ * Returns 0 on failure.
+ */
+static uint32_t
+name_table_id(NameTable *table, const char *text, size_t length) {
+    if (table->entries == NULL || 2 * (table->size + 1) > table->capacity) {
+        size_t new_capacity = table->capacity ? table->capacity * 2 : 1024;
+        NameEntry *new_entries = PyMem_Calloc(new_capacity, sizeof(NameEntry));
+        if (new_entries == NULL) {
+            return 0;
+        }
+        for (size_t i = 0; i < table->capacity; ++i) {
+            if (table->entries[i].text) {
+                *name_table_find(new_entries, new_capacity, table->entries[i].text, table->entries[i].length) =
+                    table->entries[i];
+            }
+        }
+        PyMem_Free(table->entries);
+        table->entries = new_entries;
+        table->capacity = new_capacity;
+    }
+    NameEntry *entry = name_table_find(table->entries, table->capacity, text, length);
+    if (entry->text == NULL) {
+        entry->text = text;
+        entry->length = length;
+        entry->id = (uint32_t)(++table->size);
+    }
+    return entry->id;
+}
+/**** END: NameTable ****/
+
+/**** Reader ****/
+enum TraceLogFormat {
+    TRACE_LOG_TEXT,
+    TRACE_LOG_BINARY,
+};
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *path;
+    int fd;
+    const char *data;
+    /* The end of the records, this is less than mapped_size for a mapped log with a committed length. */
+    size_t size;
+    size_t mapped_size;
+    /* If set data is a decompressed copy of the file from malloc() rather than a memory map. */
+    int decompressed;
+    /* Offset of the next record or line to parse. */
+    size_t offset;
+    size_t start_offset;
+    int format;
+    Py_ssize_t batch_size;
+    /* Text format. */
+    int text_has_clock;
+    int text_has_sampled;
+    /* Set once a "STR:" line is seen, file and function are then ids. */
+    int text_interned;
+    NameTable names;
+    /* Binary format. */
+    double clock_seconds_per_tick;
+    /* The process that wrote the log, 0 if not known. */
+    unsigned long pid;
+    /* Version 2, -1 otherwise. */
+    int clock_source;
+    unsigned int memory_counter;
+    uint64_t clock_anchor_ticks;
+    int64_t clock_anchor_wall_ns;
+    /* Map of id to str. */
+    PyObject *strings;
+    /* Map of stack id to (parent stack id, file id, line, function id). */
+    PyObject *stacks;
+    /* The stats footer as a dict of counter names to values, NULL until it is read. */
+    PyObject *trace_stats;
+    /* The list that markers are appended to while markers() is reading, NULL otherwise when they are skipped. */
+    PyObject *markers;
+} TraceReaderObject;
+
+static void
+TraceReaderObject_close_file(TraceReaderObject *self) {
+    if (self->data) {
+        if (self->decompressed) {
+            free((void *)self->data);
+        } else {
+            munmap((void *)self->data, self->mapped_size);
+        }
+        self->data = NULL;
+        self->decompressed = 0;
+    }
+    if (self->fd >= 0) {
+        close(self->fd);
+        self->fd = -1;
+    }
+}
+
+static void
+TraceReaderObject_dealloc(TraceReaderObject *self) {
+    TraceReaderObject_close_file(self);
+    name_table_free(&self->names);
+    Py_XDECREF(self->path);
+    Py_XDECREF(self->strings);
+    Py_XDECREF(self->stacks);
+    Py_XDECREF(self->trace_stats);
+    Py_XDECREF(self->markers);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+TraceReaderObject_new(PyTypeObject *type, PyObject *Py_UNUSED(args), PyObject *Py_UNUSED(kwds)) {
+    TraceReaderObject *self = (TraceReaderObject *) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        self->fd = -1;
+        self->data = NULL;
+        self->strings = PyDict_New();
+        self->stacks = PyDict_New();
+        if (self->strings == NULL || self->stacks == NULL) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+    return (PyObject *) self;
+}
+
+/* Add a stack record to the stacks dict. Returns 0 on success. */
+static int
+reader_add_stack(TraceReaderObject *self, const TraceRecordStack *record) {
+    PyObject *key = PyLong_FromUnsignedLong(record->id);
+    PyObject *value = Py_BuildValue("(kkik)", (unsigned long)record->parent_id, (unsigned long)record->file_id,
+                                    (int)record->line_number, (unsigned long)record->func_id);
+    int result = -1;
+    if (key && value) {
+        result = PyDict_SetItem(self->stacks, key, value);
+    }
+    Py_XDECREF(key);
+    Py_XDECREF(value);
+    return result;
+}
+
+/* Add id: text to the strings dict. Returns 0 on success. */
+static int
+reader_add_string(TraceReaderObject *self, uint32_t id, const char *text, size_t length) {
+    PyObject *key = PyLong_FromUnsignedLong(id);
+    PyObject *value = PyUnicode_DecodeUTF8(text, (Py_ssize_t)length, "replace");
+    int result = -1;
+    if (key && value) {
+        result = PyDict_SetItem(self->strings, key, value);
+    }
+    Py_XDECREF(key);
+    Py_XDECREF(value);
+    return result;
+}
+
+/*
+ * Append (event, clock, kind, thread_id, size, label) to the markers list.
+ * label is a new reference that is stolen, it may be NULL if there was an error. Returns 0 on success.
+ */
+static int
+reader_add_marker(TraceReaderObject *self, uint64_t event_number, double clock, unsigned int kind,
+                  uint64_t thread_id, int64_t size, PyObject *label) {
+    static const char *const kind_names[TRACE_MARKER_KIND_COUNT] = TRACE_MARKER_KIND_NAMES;
+    if (label == NULL) {
+        return -1;
+    }
+    PyObject *marker = Py_BuildValue("(KdsKLN)", (unsigned long long)event_number, clock,
+                                     kind_names[kind < TRACE_MARKER_KIND_COUNT ? kind : 0],
+                                     (unsigned long long)thread_id, (long long)size, label);
+    if (marker == NULL) {
+        return -1;
+    }
+    int result = PyList_Append(self->markers, marker);
+    Py_DECREF(marker);
+    return result;
+}
+
+/* The string with this id as a new reference, "<id>" if there is none. NULL on error. */
+static PyObject *
+reader_string(TraceReaderObject *self, uint32_t id) {
+    PyObject *key = PyLong_FromUnsignedLong(id);
+    if (key == NULL) {
+        return NULL;
+    }
+    PyObject *value = PyDict_GetItemWithError(self->strings, key);
+    Py_DECREF(key);
+    if (value == NULL) {
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        return PyUnicode_FromFormat("<%u>", id);
+    }
+    Py_INCREF(value);
+    return value;
+}
+
+/* Set the stats footer from the first count values of a stats record. Returns 0 on success. */
+static int
+reader_set_stats(TraceReaderObject *self, const uint64_t *values, size_t count) {
+    static const char *const names[TRACE_STATS_COUNT] = TRACE_STATS_NAMES;
+    PyObject *stats = PyDict_New();
+    if (stats == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count && i < TRACE_STATS_COUNT; ++i) {
+        PyObject *value = PyLong_FromUnsignedLongLong((unsigned long long)values[i]);
+        if (value == NULL || PyDict_SetItemString(stats, names[i], value)) {
+            Py_XDECREF(value);
+            Py_DECREF(stats);
+            return -1;
+        }
+        Py_DECREF(value);
+    }
+    Py_XSETREF(self->trace_stats, stats);
+    return 0;
+}
+
+/* Find or create the id of a name in a text log without a string table. Returns 0 on success. */
+static int
+reader_name_id(TraceReaderObject *self, const char *text, size_t length, uint32_t *id) {
+    size_t size = self->names.size;
+    *id = name_table_id(&self->names, text, length);
+    if (*id == 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (self->names.size != size) {
+        return reader_add_string(self, *id, text, length);
+    }
+    return 0;
+}
+
+/* Returns the end of the line starting at p, that is the '\n' or end. */
+static const char *
+line_end(const char *p, const char *end) {
+    const char *newline = memchr(p, '\n', end - p);
+    return newline ? newline : end;
+}
+
+static const char *
+skip_spaces(const char *p, const char *end) {
+    while (p < end && *p == ' ') {
+        ++p;
+    }
+    return p;
+}
+
+static const char *
+skip_token(const char *p, const char *end) {
+    while (p < end && *p != ' ') {
+        ++p;
+    }
+    return p;
+}
+
+/* Parse an unsigned integer, returns the position after it or NULL if there are no digits. */
+static const char *
+parse_uint64(const char *p, const char *end, uint64_t *value) {
+    const char *start = p;
+    uint64_t result = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        result = result * 10 + (uint64_t)(*p - '0');
+        ++p;
+    }
+    *value = result;
+    return p == start ? NULL : p;
+}
+
+static const char *
+parse_int64(const char *p, const char *end, int64_t *value) {
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+    uint64_t magnitude;
+    p = parse_uint64(p, end, &magnitude);
+    *value = negative ? -(int64_t)magnitude : (int64_t)magnitude;
+    return p;
+}
+
+/* Parse the token ending before token_end, scanning backwards. Returns the start of the token. */
+static const char *
+previous_token(const char *start, const char *token_end) {
+    const char *p = token_end;
+    while (p > start && p[-1] != ' ') {
+        --p;
+    }
+    return p;
+}
+
+static const char *
+rskip_spaces(const char *start, const char *p) {
+    while (p > start && p[-1] == ' ') {
+        --p;
+    }
+    return p;
+}
+
+static int
+what_from_text(const char *text, size_t length) {
+    for (size_t i = 0; i < WHAT_STRINGS_COUNT; ++i) {
+        if (strlen(WHAT_STRINGS[i]) == length && memcmp(WHAT_STRINGS[i], text, length) == 0) {
+            return (int)i;
+        }
+    }
+    return 0xFF;
+}
+
+/*
+ * Parse the text header line to find which optional columns are present.
+ * Returns the offset of the first line after the header.
+ */
+static size_t
+reader_parse_text_header(TraceReaderObject *self) {
+    const char *p = self->data;
+    const char *end = self->data + self->size;
+    const char *eol = line_end(p, end);
+    self->text_has_clock = 0;
+    self->text_has_sampled = 0;
+    while (p < eol) {
+        p = skip_spaces(p, eol);
+        const char *token = p;
+        p = skip_token(p, eol);
+        if ((size_t)(p - token) == 5 && memcmp(token, "Clock", 5) == 0) {
+            self->text_has_clock = 1;
+        }
+        if ((size_t)(p - token) == 7 && memcmp(token, "Sampled", 7) == 0) {
+            self->text_has_sampled = 1;
+        }
+    }
+    return eol < end ? (size_t)(eol - self->data) + 1 : self->size;
+}
+
+/*
+ * Parse one text line from [p, eol).
+ * Returns 1 if an event was parsed, 0 if the line was not an event (STR: and STATS: lines, blank lines), -1 on error.
+ *
+ * Event lines are:
+ * [PREV: |NEXT: ]<event> +<dEvent> [<clock>] <what> <file>#<line> <function> <rss> <dRSS>[ S|-]
+ * The file name can contain spaces and can overflow its column so it is found by parsing from both ends.
+ */
+static int
+reader_parse_text_line(TraceReaderObject *self, const char *p, const char *eol, TraceEvent *event) {
+    size_t stats_prefix_length = strlen(TRACE_STATS_TEXT_PREFIX);
+    if ((size_t)(eol - p) >= stats_prefix_length && memcmp(p, TRACE_STATS_TEXT_PREFIX, stats_prefix_length) == 0) {
+        /* " name=value" for each counter. */
+        PyObject *stats = PyDict_New();
+        if (stats == NULL) {
+            return -1;
+        }
+        p = skip_spaces(p + stats_prefix_length, eol);
+        while (p < eol && *p != '\r') {
+            const char *token_end = skip_token(p, eol);
+            const char *equals = memchr(p, '=', token_end - p);
+            uint64_t value;
+            if (equals == NULL || parse_uint64(equals + 1, token_end, &value) == NULL) {
+                Py_DECREF(stats);
+                return -1;
+            }
+            PyObject *key = PyUnicode_DecodeUTF8(p, equals - p, "replace");
+            PyObject *number = PyLong_FromUnsignedLongLong((unsigned long long)value);
+            int result = key && number ? PyDict_SetItem(stats, key, number) : -1;
+            Py_XDECREF(key);
+            Py_XDECREF(number);
+            if (result) {
+                Py_DECREF(stats);
+                return -1;
+            }
+            p = skip_spaces(token_end, eol);
+        }
+        Py_XSETREF(self->trace_stats, stats);
+        return 0;
+    }
+    size_t marker_prefix_length = strlen(TRACE_MARKER_TEXT_PREFIX);
+    if ((size_t)(eol - p) >= marker_prefix_length && memcmp(p, TRACE_MARKER_TEXT_PREFIX, marker_prefix_length) == 0) {
+        if (self->markers == NULL) {
+            return 0;
+        }
+        /* "<event> <clock> <kind> <thread_id> <size> <label>" where the label is the rest of the line. */
+        static const char *const kind_names[TRACE_MARKER_KIND_COUNT] = TRACE_MARKER_KIND_NAMES;
+        uint64_t event_number, thread_id;
+        int64_t size;
+        char buffer[TRACE_READER_MAX_TOKEN_LENGTH];
+        p = parse_uint64(skip_spaces(p + marker_prefix_length, eol), eol, &event_number);
+        if (p == NULL) {
+            return -1;
+        }
+        const char *token = skip_spaces(p, eol);
+        p = skip_token(token, eol);
+        if (p == token || (size_t)(p - token) >= sizeof(buffer)) {
+            return -1;
+        }
+        memcpy(buffer, token, p - token);
+        buffer[p - token] = '\0';
+        double clock = strtod(buffer, NULL);
+        token = skip_spaces(p, eol);
+        p = skip_token(token, eol);
+        unsigned int kind = 0;
+        for (unsigned int i = 1; i < TRACE_MARKER_KIND_COUNT; ++i) {
+            if (strlen(kind_names[i]) == (size_t)(p - token) && memcmp(kind_names[i], token, p - token) == 0) {
+                kind = i;
+            }
+        }
+        p = parse_uint64(skip_spaces(p, eol), eol, &thread_id);
+        if (p == NULL || (p = parse_int64(skip_spaces(p, eol), eol, &size)) == NULL) {
+            return -1;
+        }
+        /* A single space separates the size from the label, which may itself start with spaces. */
+        const char *label_end = eol > p && eol[-1] == '\r' ? eol - 1 : eol;
+        const char *label = p < label_end ? p + 1 : p;
+        PyObject *label_text;
+        if (self->text_interned) {
+            uint64_t id;
+            if (parse_uint64(label, label_end, &id) == NULL) {
+                return -1;
+            }
+            label_text = reader_string(self, (uint32_t)id);
+        } else {
+            label_text = PyUnicode_DecodeUTF8(label, label_end - label, "replace");
+        }
+        return reader_add_marker(self, event_number, clock, kind, thread_id, size, label_text);
+    }
+    if (eol - p >= 5 && memcmp(p, "STR:", 4) == 0) {
+        uint64_t id;
+        p = skip_spaces(p + 4, eol);
+        p = parse_uint64(p, eol, &id);
+        if (p == NULL) {
+            return -1;
+        }
+        p = skip_spaces(p, eol);
+        if (reader_add_string(self, (uint32_t)id, p, eol - p)) {
+            return -1;
+        }
+        self->text_interned = 1;
+        return 0;
+    }
+    p = skip_spaces(p, eol);
+    if (p == eol) {
+        return 0;
+    }
+    event->flags = 0;
+    event->stack_id = 0;
+    if (eol - p >= 5 && memcmp(p, "PREV:", 5) == 0) {
+        event->flags = TRACE_RECORD_FLAG_PREV;
+        p = skip_spaces(p + 5, eol);
+    } else if (eol - p >= 5 && memcmp(p, "NEXT:", 5) == 0) {
+        event->flags = TRACE_RECORD_FLAG_NEXT;
+        p = skip_spaces(p + 5, eol);
+    }
+    p = parse_uint64(p, eol, &event->event_number);
+    if (p == NULL) {
+        return -1;
+    }
+    /* dEvent, not needed. */
+    p = skip_token(skip_spaces(p, eol), eol);
+    event->clock = 0.0;
+    if (self->text_has_clock) {
+        char buffer[TRACE_READER_MAX_TOKEN_LENGTH];
+        const char *token = skip_spaces(p, eol);
+        p = skip_token(token, eol);
+        size_t length = p - token;
+        if (length == 0 || length >= sizeof(buffer)) {
+            return -1;
+        }
+        memcpy(buffer, token, length);
+        buffer[length] = '\0';
+        event->clock = strtod(buffer, NULL);
+    }
+    const char *token = skip_spaces(p, eol);
+    p = skip_token(token, eol);
+    event->what = (uint8_t)what_from_text(token, p - token);
+    const char *middle = skip_spaces(p, eol);
+    /* Now from the right hand end. */
+    const char *right = rskip_spaces(middle, eol);
+    if (right > middle && right[-1] == '\r') {
+        --right;
+    }
+    if (self->text_has_sampled) {
+        const char *sampled = previous_token(middle, right);
+        if (right - sampled == 1 && *sampled == 'S') {
+            event->flags |= TRACE_RECORD_FLAG_SAMPLED;
+        }
+        right = rskip_spaces(middle, sampled);
+    } else {
+        event->flags |= TRACE_RECORD_FLAG_SAMPLED;
+    }
+    const char *d_rss = previous_token(middle, right);
+    if (parse_int64(d_rss, right, &event->d_rss) == NULL) {
+        return -1;
+    }
+    right = rskip_spaces(middle, d_rss);
+    const char *rss = previous_token(middle, right);
+    if (parse_uint64(rss, right, &event->rss) == NULL) {
+        return -1;
+    }
+    right = rskip_spaces(middle, rss);
+    const char *func = previous_token(middle, right);
+    const char *func_end = right;
+    right = rskip_spaces(middle, func);
+    /* What remains is "<file>#<line>" with possible spaces before the '#' and between it and the line number. */
+    const char *hash = right;
+    while (hash > middle && hash[-1] != '#') {
+        --hash;
+    }
+    if (hash == middle) {
+        return -1;
+    }
+    int64_t line_number;
+    if (parse_int64(skip_spaces(hash, right), right, &line_number) == NULL) {
+        return -1;
+    }
+    event->line_number = (int32_t)line_number;
+    const char *file_end = rskip_spaces(middle, hash - 1);
+    if (self->text_interned) {
+        uint64_t file_id, func_id;
+        if (parse_uint64(middle, file_end, &file_id) != file_end || parse_uint64(func, func_end, &func_id) != func_end) {
+            return -1;
+        }
+        event->file_id = (uint32_t)file_id;
+        event->func_id = (uint32_t)func_id;
+        return 1;
+    }
+    /* No string table, give the names ids. */
+    if (reader_name_id(self, middle, file_end - middle, &event->file_id)
+        || reader_name_id(self, func, func_end - func, &event->func_id)) {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Parse the next event from the current offset.
+ * Returns 1 if an event was read, 0 at end of file, -1 on error with an exception set.
+ */
+static int
+reader_next_event(TraceReaderObject *self, TraceEvent *event) {
+    const char *end = self->data + self->size;
+    if (self->format == TRACE_LOG_BINARY) {
+        while (self->offset < self->size) {
+            const char *p = self->data + self->offset;
+            switch ((unsigned char)*p) {
+                case TRACE_RECORD_EVENT: {
+                    if (self->offset + sizeof(TraceRecordEvent) > self->size) {
+                        /* Truncated, for example the process was killed. */
+                        self->offset = self->size;
+                        return 0;
+                    }
+                    TraceRecordEvent record;
+                    memcpy(&record, p, sizeof(record));
+                    event->event_number = record.event_number;
+                    /* Signed as time stamp counters of different cores may be slightly out of step. */
+                    event->clock = (double)(int64_t)(record.clock - self->clock_anchor_ticks)
+                                   * self->clock_seconds_per_tick;
+                    event->what = record.what;
+                    event->file_id = record.file_id;
+                    event->line_number = record.line_number;
+                    event->func_id = record.func_id;
+                    event->rss = record.rss;
+                    event->d_rss = record.d_rss;
+                    event->flags = record.flags;
+                    event->stack_id = 0;
+                    self->offset += sizeof(TraceRecordEvent);
+                    /* The stack of this event, if any, immediately follows it. */
+                    TraceRecordEventStack event_stack;
+                    if (self->offset + sizeof(event_stack) <= self->size
+                        && (unsigned char)self->data[self->offset] == TRACE_RECORD_EVENT_STACK) {
+                        memcpy(&event_stack, self->data + self->offset, sizeof(event_stack));
+                        if (event_stack.event_number == record.event_number) {
+                            event->stack_id = event_stack.stack_id;
+                            self->offset += sizeof(event_stack);
+                        }
+                    }
+                    return 1;
+                }
+                case TRACE_RECORD_STACK: {
+                    TraceRecordStack record;
+                    if (self->offset + sizeof(record) > self->size) {
+                        self->offset = self->size;
+                        return 0;
+                    }
+                    memcpy(&record, p, sizeof(record));
+                    if (reader_add_stack(self, &record)) {
+                        return -1;
+                    }
+                    self->offset += sizeof(record);
+                    break;
+                }
+                case TRACE_RECORD_EVENT_STACK:
+                    /* The ring buffer was full and its event was dropped. */
+                    self->offset += sizeof(TraceRecordEventStack);
+                    break;
+                case TRACE_RECORD_STATS: {
+                    /* count values follow the type and count, a later version may have more than are known. */
+                    TraceRecordStats record;
+                    size_t values_offset = offsetof(TraceRecordStats, values);
+                    if (self->offset + values_offset > self->size) {
+                        self->offset = self->size;
+                        return 0;
+                    }
+                    memcpy(&record, p, values_offset);
+                    size_t size = values_offset + (size_t)record.count * sizeof(uint64_t);
+                    if (self->offset + size > self->size) {
+                        self->offset = self->size;
+                        return 0;
+                    }
+                    size_t count = record.count < TRACE_STATS_COUNT ? record.count : TRACE_STATS_COUNT;
+                    memcpy(record.values, p + values_offset, count * sizeof(uint64_t));
+                    if (reader_set_stats(self, record.values, count)) {
+                        return -1;
+                    }
+                    self->offset += size;
+                    break;
+                }
+                case TRACE_RECORD_MARKER: {
+                    TraceRecordMarker record;
+                    if (self->offset + sizeof(record) > self->size) {
+                        self->offset = self->size;
+                        return 0;
+                    }
+                    memcpy(&record, p, sizeof(record));
+                    if (self->markers) {
+                        double clock = (double)(int64_t)(record.clock - self->clock_anchor_ticks)
+                                       * self->clock_seconds_per_tick;
+                        if (reader_add_marker(self, record.event_number, clock, record.kind, record.thread_id,
+                                              record.size, reader_string(self, record.label_id))) {
+                            return -1;
+                        }
+                    }
+                    self->offset += sizeof(record);
+                    break;
+                }
+                case TRACE_RECORD_STRING: {
+                    TraceRecordString record;
+                    if (self->offset + sizeof(record) > self->size) {
+                        self->offset = self->size;
+                        return 0;
+                    }
+                    memcpy(&record, p, sizeof(record));
+                    size_t size = TRACE_RECORD_ALIGN(sizeof(record) + record.length);
+                    if (self->offset + size > self->size) {
+                        self->offset = self->size;
+                        return 0;
+                    }
+                    if (reader_add_string(self, record.id, p + sizeof(record), record.length)) {
+                        return -1;
+                    }
+                    self->offset += size;
+                    break;
+                }
+                default:
+                    PyErr_Format(PyExc_ValueError, "Unknown record type %d at offset %zu",
+                                 (int)(unsigned char)*p, self->offset);
+                    return -1;
+            }
+        }
+        return 0;
+    }
+    while (self->offset < self->size) {
+        const char *p = self->data + self->offset;
+        const char *eol = line_end(p, end);
+        self->offset = (size_t)(eol - self->data) + (eol < end ? 1 : 0);
+        int result = reader_parse_text_line(self, p, eol, event);
+        if (result < 0) {
+            if (! PyErr_Occurred()) {
+                PyErr_Format(PyExc_ValueError, "Can not parse line at offset %zu: \"%.*s\"",
+                             (size_t)(p - self->data), (int)(eol - p), p);
+            }
+            return -1;
+        }
+        if (result > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int
+TraceReaderObject_init(TraceReaderObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"path", "batch_size", NULL};
+    PyObject *path = NULL;
+    self->batch_size = TRACE_READER_DEFAULT_BATCH_SIZE;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O&|n", kwlist, PyUnicode_FSConverter, &path, &self->batch_size)) {
+        return -1;
+    }
+    if (self->batch_size <= 0) {
+        Py_DECREF(path);
+        PyErr_SetString(PyExc_ValueError, "batch_size must be > 0");
+        return -1;
+    }
+    TraceReaderObject_close_file(self);
+    Py_XSETREF(self->path, path);
+    self->fd = open(PyBytes_AS_STRING(path), O_RDONLY);
+    if (self->fd < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        return -1;
+    }
+    struct stat file_stat;
+    if (fstat(self->fd, &file_stat)) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        return -1;
+    }
+    self->size = (size_t)file_stat.st_size;
+    self->mapped_size = self->size;
+    if (self->size) {
+        void *data = mmap(NULL, self->size, PROT_READ, MAP_PRIVATE, self->fd, 0);
+        if (data == MAP_FAILED) {
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+            return -1;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(data, self->size, MADV_SEQUENTIAL);
+#endif
+        self->data = data;
+    }
+    if (trace_compress_is_compressed(self->data, self->size)) {
+        unsigned char *decompressed;
+        size_t decompressed_size;
+        int result;
+        Py_BEGIN_ALLOW_THREADS
+        result = trace_decompress(self->data, self->size, &decompressed, &decompressed_size);
+        Py_END_ALLOW_THREADS
+        if (result) {
+            PyErr_Format(PyExc_ValueError, "Can not decompress %R", self->path);
+            return -1;
+        }
+        munmap((void *)self->data, self->mapped_size);
+        self->data = (const char *)decompressed;
+        self->size = decompressed_size;
+        self->decompressed = 1;
+    }
+    self->clock_source = -1;
+    self->clock_anchor_ticks = 0;
+    self->clock_anchor_wall_ns = 0;
+    self->pid = 0;
+    if (self->size >= TRACE_FILE_HEADER_V1_SIZE
+        && memcmp(self->data, TRACE_FILE_MAGIC, TRACE_FILE_MAGIC_LENGTH) == 0) {
+        TraceFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(&header, self->data, TRACE_FILE_HEADER_V1_SIZE);
+        if (header.byte_order_mark != TRACE_FILE_BYTE_ORDER_MARK) {
+            PyErr_SetString(PyExc_ValueError, "Binary trace file has a different byte order.");
+            return -1;
+        }
+        if (header.version > TRACE_FILE_VERSION) {
+            PyErr_Format(PyExc_ValueError, "Binary trace file version %u is not supported.", header.version);
+            return -1;
+        }
+        if (header.version >= 2) {
+            if (header.header_size < sizeof(TraceFileHeader) || self->size < sizeof(TraceFileHeader)) {
+                PyErr_SetString(PyExc_ValueError, "Binary trace file header is truncated.");
+                return -1;
+            }
+            memcpy(&header, self->data, sizeof(header));
+            if (header.version >= 6 && header.header_size >= sizeof(TraceFileHeader) + sizeof(TraceFileCommitted)
+                && self->size >= sizeof(TraceFileHeader) + sizeof(TraceFileCommitted)) {
+                /* A mapped file, the records end at the committed length. */
+                TraceFileCommitted committed;
+                memcpy(&committed, self->data + sizeof(TraceFileHeader), sizeof(committed));
+                if (committed.committed_length >= header.header_size && committed.committed_length < self->size) {
+                    self->size = (size_t)committed.committed_length;
+                }
+            }
+            self->clock_source = (int)header.clock_source;
+            self->memory_counter = header.memory_counter ? header.memory_counter : PY_MEM_TRACE_MEM_RSS;
+            self->clock_anchor_ticks = header.clock_anchor_ticks;
+            self->clock_anchor_wall_ns = header.clock_anchor_wall_ns;
+        }
+        self->format = TRACE_LOG_BINARY;
+        self->pid = header.pid;
+        self->clock_seconds_per_tick = header.clock_ticks_per_second ? 1.0 / header.clock_ticks_per_second : 0.0;
+        self->start_offset = header.header_size;
+    } else {
+        self->format = TRACE_LOG_TEXT;
+        self->text_interned = 0;
+        self->start_offset = self->data ? reader_parse_text_header(self) : 0;
+    }
+    self->offset = self->start_offset;
+    return 0;
+}
+
+static PyObject *
+TraceReaderObject_iter(TraceReaderObject *self) {
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+/* Read the next batch, returns NULL at the end without an exception set. */
+static PyObject *
+TraceReaderObject_iternext(TraceReaderObject *self) {
+    if (self->data == NULL || self->offset >= self->size) {
+        return NULL;
+    }
+    Batch batch;
+    if (batch_init(&batch, self->batch_size)) {
+        return NULL;
+    }
+    TraceEvent event;
+    while (batch_length(&batch) < self->batch_size) {
+        int result = reader_next_event(self, &event);
+        if (result < 0) {
+            batch_clear(&batch);
+            return NULL;
+        }
+        if (result == 0) {
+            break;
+        }
+        batch_append(&batch, &event);
+    }
+    if (batch_length(&batch) == 0) {
+        batch_clear(&batch);
+        return NULL;
+    }
+    return batch_to_dict(&batch);
+}
+
+static PyObject *
+TraceReaderObject_rewind(TraceReaderObject *self, PyObject *Py_UNUSED(args)) {
+    self->offset = self->start_offset;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+TraceReaderObject_stats(TraceReaderObject *self, PyObject *Py_UNUSED(args)) {
+    if (self->trace_stats == NULL && self->data) {
+        /* The footer is the last record so read on from here. */
+        size_t saved_offset = self->offset;
+        TraceEvent event;
+        int result;
+        while ((result = reader_next_event(self, &event)) > 0) {
+        }
+        self->offset = saved_offset;
+        if (result < 0) {
+            return NULL;
+        }
+    }
+    if (self->trace_stats == NULL) {
+        Py_RETURN_NONE;
+    }
+    return PyDict_Copy(self->trace_stats);
+}
+
+static PyObject *
+TraceReaderObject_markers(TraceReaderObject *self, PyObject *Py_UNUSED(args)) {
+    PyObject *markers = PyList_New(0);
+    if (markers == NULL) {
+        return NULL;
+    }
+    size_t saved_offset = self->offset;
+    self->offset = self->start_offset;
+    self->markers = markers;
+    TraceEvent event;
+    int result = 0;
+    while (self->data && (result = reader_next_event(self, &event)) > 0) {
+    }
+    self->markers = NULL;
+    self->offset = saved_offset;
+    if (result < 0) {
+        Py_DECREF(markers);
+        return NULL;
+    }
+    return markers;
+}
+
+/**** Call site aggregation. ****/
+typedef struct {
+    /* 0 is empty. */
+    uint64_t key;
+    /* 0 for top_call_sites(), export_stacks() keys by the callers as well. */
+    uint32_t stack_id;
+    uint32_t file_id;
+    int32_t line_number;
+    uint32_t func_id;
+    uint64_t count;
+    int64_t d_rss;
+    int64_t d_rss_positive;
+} CallSite;
+
+typedef struct {
+    CallSite *sites;
+    size_t capacity;
+    size_t size;
+} CallSiteTable;
+
+static uint64_t
+call_site_key(uint32_t stack_id, uint32_t file_id, int32_t line_number, uint32_t func_id) {
+    uint64_t key = ((uint64_t)file_id << 40) ^ ((uint64_t)func_id << 20) ^ (uint32_t)line_number
+                   ^ ((uint64_t)stack_id << 28);
+    key *= 0x9E3779B97F4A7C15ULL;
+    return key ? key : 1;
+}
+
+static CallSite *
+call_site_find(CallSite *sites, size_t capacity, uint64_t key, uint32_t stack_id, uint32_t file_id,
+               int32_t line_number, uint32_t func_id) {
+    size_t mask = capacity - 1;
+    size_t index = (size_t)(key >> 17) & mask;
+    while (sites[index].key != 0
+           && ! (sites[index].key == key && sites[index].stack_id == stack_id && sites[index].file_id == file_id
+                 && sites[index].line_number == line_number && sites[index].func_id == func_id)) {
+        index = (index + 1) & mask;
+    }
+    return sites + index;
+}
+
+static CallSite *
+call_site_get(CallSiteTable *table, uint32_t stack_id, uint32_t file_id, int32_t line_number, uint32_t func_id) {
+    if (table->sites == NULL || 2 * (table->size + 1) > table->capacity) {
+        size_t new_capacity = table->capacity ? table->capacity * 2 : 4096;
+        CallSite *new_sites = PyMem_Calloc(new_capacity, sizeof(CallSite));
+        if (new_sites == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < table->capacity; ++i) {
+            CallSite *site = table->sites + i;
+            if (site->key) {
+                *call_site_find(new_sites, new_capacity, site->key, site->stack_id, site->file_id,
+                                site->line_number, site->func_id) = *site;
+            }
+        }
+        PyMem_Free(table->sites);
+        table->sites = new_sites;
+        table->capacity = new_capacity;
+    }
+    uint64_t key = call_site_key(stack_id, file_id, line_number, func_id);
+    CallSite *site = call_site_find(table->sites, table->capacity, key, stack_id, file_id, line_number, func_id);
+    if (site->key == 0) {
+        site->key = key;
+        site->stack_id = stack_id;
+        site->file_id = file_id;
+        site->line_number = line_number;
+        site->func_id = func_id;
+        table->size++;
+    }
+    return site;
+}
+
+static int
+call_site_compare_d_rss(const void *a, const void *b) {
+    int64_t left = ((const CallSite *)a)->d_rss;
+    int64_t right = ((const CallSite *)b)->d_rss;
+    return left < right ? 1 : (left > right ? -1 : 0);
+}
+
+static PyObject *
+TraceReaderObject_top_call_sites(TraceReaderObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"n", NULL};
+    Py_ssize_t n = 10;
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "|n", kwlist, &n)) {
+        return NULL;
+    }
+    size_t saved_offset = self->offset;
+    self->offset = self->start_offset;
+    CallSiteTable table = {NULL, 0, 0};
+    TraceEvent event;
+    int result;
+    PyObject *ret = NULL;
+    while (self->data && (result = reader_next_event(self, &event)) > 0) {
+        CallSite *site = call_site_get(&table, 0, event.file_id, event.line_number, event.func_id);
+        if (site == NULL) {
+            PyErr_NoMemory();
+            goto finally;
+        }
+        site->count++;
+        site->d_rss += event.d_rss;
+        if (event.d_rss > 0) {
+            site->d_rss_positive += event.d_rss;
+        }
+    }
+    if (PyErr_Occurred()) {
+        goto finally;
+    }
+    /* Compact and sort. */
+    size_t count = 0;
+    for (size_t i = 0; i < table.capacity; ++i) {
+        if (table.sites[i].key) {
+            table.sites[count++] = table.sites[i];
+        }
+    }
+    qsort(table.sites, count, sizeof(CallSite), &call_site_compare_d_rss);
+    if (n >= 0 && (size_t)n < count) {
+        count = (size_t)n;
+    }
+    ret = PyList_New(count);
+    if (ret == NULL) {
+        goto finally;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        CallSite *site = table.sites + i;
+        PyObject *file = reader_string(self, site->file_id);
+        PyObject *func = reader_string(self, site->func_id);
+        if (file == NULL || func == NULL) {
+            Py_XDECREF(file);
+            Py_XDECREF(func);
+            Py_CLEAR(ret);
+            goto finally;
+        }
+        PyObject *item = Py_BuildValue("(NiNKLL)", file, site->line_number, func,
+                                       (unsigned long long)site->count, (long long)site->d_rss,
+                                       (long long)site->d_rss_positive);
+        if (item == NULL) {
+            Py_CLEAR(ret);
+            goto finally;
+        }
+        PyList_SET_ITEM(ret, i, item);
+    }
+finally:
+    PyMem_Free(table.sites);
+    self->offset = saved_offset;
+    return ret;
+}
+/**** END: Call site aggregation. ****/
+
+typedef struct {
+    uint32_t file_id;
+    int32_t line_number;
+    uint32_t func_id;
+} StackFrame;
+
+/*
+ * Set *frames to a PyMem_Malloc() array of the frames of stack_id, the innermost caller first, and *count to their
+ * number. The caller frees *frames. Returns 0 on success, -1 with an exception set, KeyError if a stack record has
+ * not been read.
+ */
+static int
+reader_stack_frames(TraceReaderObject *self, uint32_t stack_id, StackFrame **frames, size_t *count) {
+    size_t capacity = 0;
+    *frames = NULL;
+    *count = 0;
+    /* Each parent id is smaller than its child so this terminates whatever is in the file. */
+    uint64_t previous_id = (uint64_t)stack_id + 1;
+    while (stack_id && stack_id < previous_id) {
+        PyObject *key = PyLong_FromUnsignedLong(stack_id);
+        if (key == NULL) {
+            goto except;
+        }
+        PyObject *node = PyDict_GetItemWithError(self->stacks, key);
+        Py_DECREF(key);
+        if (node == NULL) {
+            if (! PyErr_Occurred()) {
+                PyErr_Format(PyExc_KeyError, "Stack %lu has not been read", (unsigned long)stack_id);
+            }
+            goto except;
+        }
+        unsigned long parent_id, file_id, func_id;
+        int line_number;
+        if (! PyArg_ParseTuple(node, "kkik", &parent_id, &file_id, &line_number, &func_id)) {
+            goto except;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            StackFrame *new_frames = PyMem_Realloc(*frames, capacity * sizeof(StackFrame));
+            if (new_frames == NULL) {
+                PyErr_NoMemory();
+                goto except;
+            }
+            *frames = new_frames;
+        }
+        (*frames)[(*count)++] = (StackFrame){(uint32_t)file_id, line_number, (uint32_t)func_id};
+        previous_id = stack_id;
+        stack_id = (uint32_t)parent_id;
+    }
+    return 0;
+except:
+    PyMem_Free(*frames);
+    *frames = NULL;
+    *count = 0;
+    return -1;
+}
+
+static PyObject *
+TraceReaderObject_stack(TraceReaderObject *self, PyObject *args) {
+    unsigned long stack_id;
+    if (! PyArg_ParseTuple(args, "k", &stack_id)) {
+        return NULL;
+    }
+    StackFrame *frames;
+    size_t count;
+    if (stack_id > UINT32_MAX) {
+        PyErr_Format(PyExc_KeyError, "Stack %lu has not been read", stack_id);
+        return NULL;
+    }
+    if (reader_stack_frames(self, (uint32_t)stack_id, &frames, &count)) {
+        return NULL;
+    }
+    PyObject *result = PyList_New((Py_ssize_t)count);
+    for (size_t i = 0; result && i < count; ++i) {
+        PyObject *file = reader_string(self, frames[i].file_id);
+        PyObject *func = reader_string(self, frames[i].func_id);
+        PyObject *frame = file && func ? Py_BuildValue("(OiO)", file, frames[i].line_number, func) : NULL;
+        Py_XDECREF(file);
+        Py_XDECREF(func);
+        if (frame == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, frame);
+    }
+    PyMem_Free(frames);
+    return result;
+}
+
+/**** Stack export. ****/
+enum StackExportFormat {
+    STACK_EXPORT_FOLDED,
+    STACK_EXPORT_SPEEDSCOPE,
+};
+
+static int
+call_site_compare_d_rss_positive(const void *a, const void *b) {
+    int64_t left = ((const CallSite *)a)->d_rss_positive;
+    int64_t right = ((const CallSite *)b)->d_rss_positive;
+    return left < right ? 1 : (left > right ? -1 : 0);
+}
+
+/* Write a name, if json escape it as a JSON string, otherwise replace the characters that separate folded stacks. */
+static void
+export_write_name(FILE *file, PyObject *name, int json) {
+    Py_ssize_t length;
+    const char *text = PyUnicode_AsUTF8AndSize(name, &length);
+    if (text == NULL) {
+        /* For example a lone surrogate. */
+        PyErr_Clear();
+        text = "?";
+        length = 1;
+    }
+    for (Py_ssize_t i = 0; i < length; ++i) {
+        unsigned char c = (unsigned char)text[i];
+        if (json) {
+            if (c == '"' || c == '\\') {
+                fputc('\\', file);
+                fputc(c, file);
+            } else if (c < 0x20) {
+                fprintf(file, "\\u%04x", c);
+            } else {
+                fputc(c, file);
+            }
+        } else {
+            fputc(c == ';' || c == '\n' || c == '\r' ? '_' : c, file);
+        }
+    }
+}
+
+/* Write a folded frame "function (file:line)". Returns 0 on success, -1 with an exception set. */
+static int
+export_write_folded_frame(TraceReaderObject *self, FILE *file, const StackFrame *frame) {
+    PyObject *func = reader_string(self, frame->func_id);
+    PyObject *path = reader_string(self, frame->file_id);
+    if (func && path) {
+        export_write_name(file, func, 0);
+        fputs(" (", file);
+        export_write_name(file, path, 0);
+        fprintf(file, ":%d)", frame->line_number);
+    }
+    Py_XDECREF(func);
+    Py_XDECREF(path);
+    return func && path ? 0 : -1;
+}
+
+/*
+ * The frames of a stack with the event as the innermost, in *frames with *count of them. The caller frees *frames.
+ * Returns 0 on success, -1 with an exception set.
+ */
+static int
+export_site_frames(TraceReaderObject *self, const CallSite *site, StackFrame **frames, size_t *count) {
+    if (reader_stack_frames(self, site->stack_id, frames, count)) {
+        return -1;
+    }
+    StackFrame *new_frames = PyMem_Realloc(*frames, (*count + 1) * sizeof(StackFrame));
+    if (new_frames == NULL) {
+        PyMem_Free(*frames);
+        PyErr_NoMemory();
+        return -1;
+    }
+    memmove(new_frames + 1, new_frames, *count * sizeof(StackFrame));
+    new_frames[0] = (StackFrame){site->file_id, site->line_number, site->func_id};
+    *frames = new_frames;
+    (*count)++;
+    return 0;
+}
+
+/* One line for each stack "outermost;...;innermost weight". Returns 0 on success, -1 with an exception set. */
+static int
+export_folded(TraceReaderObject *self, FILE *file, const CallSite *sites, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        StackFrame *frames;
+        size_t depth;
+        if (export_site_frames(self, sites + i, &frames, &depth)) {
+            return -1;
+        }
+        for (size_t j = depth; j-- > 0;) {
+            if (export_write_folded_frame(self, file, frames + j)) {
+                PyMem_Free(frames);
+                return -1;
+            }
+            fputc(j ? ';' : ' ', file);
+        }
+        fprintf(file, "%lld\n", (long long)sites[i].d_rss_positive);
+        PyMem_Free(frames);
+    }
+    return 0;
+}
+
+/*
+ * A speedscope "sampled" profile with a sample for each stack weighted by bytes, see
+ * https://github.com/jlfwong/speedscope/wiki/Importing-from-custom-sources
+ * Returns 0 on success, -1 with an exception set.
+ */
+static int
+export_speedscope(TraceReaderObject *self, FILE *file, const CallSite *sites, size_t count) {
+    /* The shared frames keyed by (file, line, function) with count as their index. */
+    CallSiteTable frame_table = {NULL, 0, 0};
+    CallSite *frame_list = NULL;
+    int result = -1;
+    long long total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        StackFrame *frames;
+        size_t depth;
+        if (export_site_frames(self, sites + i, &frames, &depth)) {
+            goto finally;
+        }
+        for (size_t j = 0; j < depth; ++j) {
+            CallSite *frame = call_site_get(&frame_table, 0, frames[j].file_id, frames[j].line_number,
+                                            frames[j].func_id);
+            if (frame == NULL) {
+                PyMem_Free(frames);
+                PyErr_NoMemory();
+                goto finally;
+            }
+            if (frame->count == 0) {
+                frame->count = frame_table.size;
+            }
+        }
+        PyMem_Free(frames);
+        total += (long long)sites[i].d_rss_positive;
+    }
+    frame_list = PyMem_Calloc(frame_table.size ? frame_table.size : 1, sizeof(CallSite));
+    if (frame_list == NULL) {
+        PyErr_NoMemory();
+        goto finally;
+    }
+    for (size_t i = 0; i < frame_table.capacity; ++i) {
+        if (frame_table.sites[i].key) {
+            frame_list[frame_table.sites[i].count - 1] = frame_table.sites[i];
+        }
+    }
+    fputs("{\"$schema\": \"https://www.speedscope.app/file-format-schema.json\", \"exporter\": \"pymemtrace\","
+          " \"name\": \"", file);
+    PyObject *name = PyUnicode_DecodeFSDefault(self->path ? PyBytes_AS_STRING(self->path) : "");
+    if (name == NULL) {
+        goto finally;
+    }
+    export_write_name(file, name, 1);
+    Py_DECREF(name);
+    fputs("\",\n\"shared\": {\"frames\": [", file);
+    for (size_t i = 0; i < frame_table.size; ++i) {
+        PyObject *func = reader_string(self, frame_list[i].func_id);
+        PyObject *path = reader_string(self, frame_list[i].file_id);
+        if (func && path) {
+            fputs(i ? ",\n{\"name\": \"" : "\n{\"name\": \"", file);
+            export_write_name(file, func, 1);
+            fputs("\", \"file\": \"", file);
+            export_write_name(file, path, 1);
+            fprintf(file, "\", \"line\": %d}", frame_list[i].line_number);
+        }
+        Py_XDECREF(func);
+        Py_XDECREF(path);
+        if (func == NULL || path == NULL) {
+            goto finally;
+        }
+    }
+    fprintf(file, "]},\n\"profiles\": [{\"type\": \"sampled\", \"name\": \"Positive dRSS\", \"unit\": \"bytes\","
+                  " \"startValue\": 0, \"endValue\": %lld,\n\"samples\": [", total);
+    for (size_t i = 0; i < count; ++i) {
+        StackFrame *frames;
+        size_t depth;
+        if (export_site_frames(self, sites + i, &frames, &depth)) {
+            goto finally;
+        }
+        fputs(i ? ",\n[" : "\n[", file);
+        for (size_t j = depth; j-- > 0;) {
+            CallSite *frame = call_site_get(&frame_table, 0, frames[j].file_id, frames[j].line_number,
+                                            frames[j].func_id);
+            if (frame == NULL) {
+                PyMem_Free(frames);
+                PyErr_NoMemory();
+                goto finally;
+            }
+            fprintf(file, j ? "%llu, " : "%llu", (unsigned long long)(frame->count - 1));
+        }
+        fputc(']', file);
+        PyMem_Free(frames);
+    }
+    fputs("],\n\"weights\": [", file);
+    for (size_t i = 0; i < count; ++i) {
+        fprintf(file, i ? ", %lld" : "%lld", (long long)sites[i].d_rss_positive);
+    }
+    fputs("]}]}\n", file);
+    result = 0;
+finally:
+    PyMem_Free(frame_list);
+    PyMem_Free(frame_table.sites);
+    return result;
+}
+
+static PyObject *
+TraceReaderObject_export_stacks(TraceReaderObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = {"path", "format", NULL};
+    PyObject *path = NULL;
+    const char *format_name = "folded";
+    if (! PyArg_ParseTupleAndKeywords(args, kwds, "O&|s", kwlist, PyUnicode_FSConverter, &path, &format_name)) {
+        return NULL;
+    }
+    int format;
+    if (strcmp(format_name, "folded") == 0) {
+        format = STACK_EXPORT_FOLDED;
+    } else if (strcmp(format_name, "speedscope") == 0) {
+        format = STACK_EXPORT_SPEEDSCOPE;
+    } else {
+        Py_DECREF(path);
+        PyErr_Format(PyExc_ValueError, "format must be \"folded\" or \"speedscope\" not \"%s\"", format_name);
+        return NULL;
+    }
+    size_t saved_offset = self->offset;
+    self->offset = self->start_offset;
+    CallSiteTable table = {NULL, 0, 0};
+    TraceEvent event;
+    int result;
+    PyObject *ret = NULL;
+    FILE *file = NULL;
+    /* One pass, only the positive changes are kept as the frees of one stack would hide the growth of another. */
+    while (self->data && (result = reader_next_event(self, &event)) > 0) {
+        if (event.d_rss <= 0) {
+            continue;
+        }
+        CallSite *site = call_site_get(&table, event.stack_id, event.file_id, event.line_number, event.func_id);
+        if (site == NULL) {
+            PyErr_NoMemory();
+            goto finally;
+        }
+        site->count++;
+        site->d_rss += event.d_rss;
+        site->d_rss_positive += event.d_rss;
+    }
+    if (PyErr_Occurred()) {
+        goto finally;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < table.capacity; ++i) {
+        if (table.sites[i].key) {
+            table.sites[count++] = table.sites[i];
+        }
+    }
+    qsort(table.sites, count, sizeof(CallSite), &call_site_compare_d_rss_positive);
+    file = fopen(PyBytes_AS_STRING(path), "w");
+    if (file == NULL) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        goto finally;
+    }
+    if (format == STACK_EXPORT_FOLDED ? export_folded(self, file, table.sites, count)
+                                      : export_speedscope(self, file, table.sites, count)) {
+        goto finally;
+    }
+    long long total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total += (long long)table.sites[i].d_rss_positive;
+    }
+    ret = Py_BuildValue("(nL)", (Py_ssize_t)count, total);
+finally:
+    if (file) {
+        int error = ferror(file);
+        if ((fclose(file) || error) && ret) {
+            Py_CLEAR(ret);
+            PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        }
+    }
+    PyMem_Free(table.sites);
+    Py_DECREF(path);
+    self->offset = saved_offset;
+    return ret;
+}
+/**** END: Stack export. ****/
+
+static PyObject *
+TraceReaderObject_getformat(TraceReaderObject *self, void *Py_UNUSED(closure)) {
+    return PyUnicode_FromString(self->format == TRACE_LOG_BINARY ? "binary" : "text");
+}
+
+static PyObject *
+TraceReaderObject_getclock_source(TraceReaderObject *self, void *Py_UNUSED(closure)) {
+    if (self->clock_source < 0) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(pymemtrace_clock_source_name(self->clock_source));
+}
+
+static PyObject *
+TraceReaderObject_getmemory_counter(TraceReaderObject *self, void *Py_UNUSED(closure)) {
+    const char *name = self->clock_source < 0 ? NULL : pymemtrace_mem_counter_name(self->memory_counter);
+    if (name == NULL) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(name);
+}
+
+static PyObject *
+TraceReaderObject_getstart_time(TraceReaderObject *self, void *Py_UNUSED(closure)) {
+    if (self->clock_source < 0) {
+        Py_RETURN_NONE;
+    }
+    return PyFloat_FromDouble((double)self->clock_anchor_wall_ns / 1e9);
+}
+
+static PyObject *
+TraceReaderObject_getpid(TraceReaderObject *self, void *Py_UNUSED(closure)) {
+    if (self->pid == 0) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromUnsignedLong(self->pid);
+}
+
+static PyMemberDef TraceReaderObject_members[] = {
+    {"strings", T_OBJECT, offsetof(TraceReaderObject, strings), READONLY,
+     "A dict of id to file or function name. This is updated as batches are read."},
+    {"stacks", T_OBJECT, offsetof(TraceReaderObject, stacks), READONLY,
+     "A dict of stack id to (parent stack id, file id, line, function id), the parent is 0 for the outermost"
+     " recorded caller. This is updated as batches are read."},
+    {"batch_size", T_PYSSIZET, offsetof(TraceReaderObject, batch_size), READONLY, "Maximum events per batch."},
+    {NULL, 0, 0, 0, NULL}  /* Sentinel */
+};
+
+static PyGetSetDef TraceReaderObject_getsetters[] = {
+    {"format", (getter) TraceReaderObject_getformat, (setter) NULL, "Log format, \"text\" or \"binary\".", NULL},
+    {"clock_source", (getter) TraceReaderObject_getclock_source, (setter) NULL,
+     "Name of the clock used for the binary log, such as \"monotonic\", or None if not known.", NULL},
+    {"memory_counter", (getter) TraceReaderObject_getmemory_counter, (setter) NULL,
+     "The memory counter in the ``rss`` column of the binary log, such as \"rss\" or \"rss_anon\", or None if not"
+     " known.", NULL},
+    {"start_time", (getter) TraceReaderObject_getstart_time, (setter) NULL,
+     "Wall clock time, seconds since the Unix epoch, when the binary log was opened or None if not known."
+     " ``clock`` values are seconds since then.", NULL},
+    {"pid", (getter) TraceReaderObject_getpid, (setter) NULL,
+     "The process id that wrote the binary log or None if not known, text logs only have it in the file name.",
+     NULL},
+    {NULL, NULL, NULL, NULL, NULL}  /* Sentinel */
+};
+
+static PyMethodDef TraceReaderObject_methods[] = {
+    {"rewind", (PyCFunction) TraceReaderObject_rewind, METH_NOARGS, "Go back to the first event."},
+    {"stats", (PyCFunction) TraceReaderObject_stats, METH_NOARGS,
+     "Return the stats footer written when the log file was closed as a dict, the same as ``stats()`` of the"
+     " ``cPyMemTrace`` tracer then, or None if there is none such as when the process was killed."
+     " The current position is unchanged."},
+    {"markers", (PyCFunction) TraceReaderObject_markers, METH_NOARGS,
+     "Return the markers of the whole log, written by other extensions with the C API of ``cPyMemTrace`` or by"
+     " ``cPyMemTrace.mark()``, as a list of tuples ``(event, clock, kind, thread_id, size, label)``. ``event`` is"
+     " the event that the marker came before, ``kind`` is \"MARK\", \"ALLOC\" or \"FREE\", \"RESIDENT\" for the"
+     " resident bytes of a region registered with ``cPyMemTrace.add_region()`` or \"PARENT\", with the parent pid"
+     " as the size, in the log of a child process, and ``thread_id`` the thread that recorded it."
+     " The current position is unchanged."},
+    {"top_call_sites", (PyCFunction) TraceReaderObject_top_call_sites, METH_VARARGS | METH_KEYWORDS,
+     "Return the top ``n`` call sites by cumulative dRSS over the whole log as a list of tuples"
+     " ``(file, line, function, count, d_rss, d_rss_positive)``. The current position is unchanged."},
+    {"stack", (PyCFunction) TraceReaderObject_stack, METH_VARARGS,
+     "Return the frames of a stack id from the ``stack`` column as a list of ``(file, line, function)``,"
+     " the innermost caller first. 0 is an empty stack."},
+    {"export_stacks", (PyCFunction) TraceReaderObject_export_stacks, METH_VARARGS | METH_KEYWORDS,
+     "export_stacks(path, format=\"folded\")\n\n"
+     "Write the positive dRSS of the whole log attributed to the stacks of each event to ``path``. ``format`` is"
+     " \"folded\", lines of ``outer;...;inner bytes`` for ``flamegraph.pl``, or \"speedscope\" JSON."
+     " Each frame is the function, file and line. The callers are those recorded with ``stack_depth``, events"
+     " without them are just their own function. Returns ``(stacks, bytes)``. The current position is unchanged."},
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+PyDoc_STRVAR(
+    TraceReaderObjectType_tp_doc,
+    "Reader(path, batch_size=65536)\n\n"
+    "Read a cPyMemTrace log file, text or binary. Iterating yields dicts of column name to ``Column``"
+    " with up to ``batch_size`` events. The columns are:"
+    " ``event`` ``clock`` (seconds) ``what`` (index into ``WHAT``) ``file`` (id) ``line`` ``func`` (id)"
+    " ``rss`` ``d_rss`` ``flags`` and ``stack`` (id, 0 if none). ``strings`` maps the ids to names."
+    " Logs written with ``compression=\"gzip\"`` are decompressed into memory first."
+);
+
+static PyTypeObject TraceReaderObjectType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "cTraceReader.Reader",
+    .tp_doc = TraceReaderObjectType_tp_doc,
+    .tp_basicsize = sizeof(TraceReaderObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_new = TraceReaderObject_new,
+    .tp_init = (initproc) TraceReaderObject_init,
+    .tp_dealloc = (destructor) TraceReaderObject_dealloc,
+    .tp_iter = (getiterfunc) TraceReaderObject_iter,
+    .tp_iternext = (iternextfunc) TraceReaderObject_iternext,
+    .tp_members = TraceReaderObject_members,
+    .tp_methods = TraceReaderObject_methods,
+    .tp_getset = TraceReaderObject_getsetters,
+};
+/**** END: Reader ****/
+
+static PyModuleDef cTraceReadermodule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "cTraceReader",
+    .m_doc = "A module that reads cPyMemTrace log files.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC
+PyInit_cTraceReader(void) {
+    PyObject *m = PyModule_Create(&cTraceReadermodule);
+    if (m == NULL) {
+        return NULL;
+    }
+    if (PyType_Ready(&ColumnObjectType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&ColumnObjectType);
+    if (PyModule_AddObject(m, "Column", (PyObject *) &ColumnObjectType) < 0) {
+        Py_DECREF(&ColumnObjectType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    if (PyType_Ready(&TraceReaderObjectType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&TraceReaderObjectType);
+    if (PyModule_AddObject(m, "Reader", (PyObject *) &TraceReaderObjectType) < 0) {
+        Py_DECREF(&TraceReaderObjectType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    PyObject *what = PyTuple_New(WHAT_STRINGS_COUNT);
+    if (what == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    for (size_t i = 0; i < WHAT_STRINGS_COUNT; ++i) {
+        PyObject *value = PyUnicode_FromString(WHAT_STRINGS[i]);
+        if (value == NULL) {
+            Py_DECREF(what);
+            Py_DECREF(m);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(what, i, value);
+    }
+    if (PyModule_AddObject(m, "WHAT", what) < 0) {
+        Py_DECREF(what);
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
+}
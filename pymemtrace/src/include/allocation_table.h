@@ -0,0 +1,35 @@
+// An open addressing hash table of live allocations keyed by address.
+// Unlike PointerMap entries can be removed, this uses backward shift deletion so there are no tombstones.
+
+#ifndef CPYMEMTRACE_ALLOCATION_TABLE_H
+#define CPYMEMTRACE_ALLOCATION_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    /* 0 is an empty slot. */
+    uintptr_t address;
+    size_t size;
+    uint64_t sequence;
+    uint32_t code_id;
+    int32_t line_number;
+    uint8_t domain;
+} AllocationEntry;
+
+typedef struct {
+    AllocationEntry *entries;
+    /* Always a power of two. */
+    size_t capacity;
+    size_t size;
+    /* Sum of the sizes of all entries. */
+    size_t total_bytes;
+} AllocationTable;
+
+int allocation_table_init(AllocationTable *table, size_t capacity);
+void allocation_table_free(AllocationTable *table);
+int allocation_table_insert(AllocationTable *table, const AllocationEntry *entry);
+int allocation_table_remove(AllocationTable *table, uintptr_t address);
+const AllocationEntry *allocation_table_get(const AllocationTable *table, uintptr_t address);
+
+#endif //CPYMEMTRACE_ALLOCATION_TABLE_H
@@ -0,0 +1,36 @@
+// An open addressing hash table of call sites, keyed by (code object, line number), that accumulates RSS changes.
+// This is used by the aggregate mode of cPyMemTrace so that the output is proportional to the number of call sites
+// rather than the number of events.
+
+#ifndef CPYMEMTRACE_CALL_SITE_TABLE_H
+#define CPYMEMTRACE_CALL_SITE_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    /* NULL is an empty slot. */
+    const void *code;
+    int32_t line_number;
+    uint64_t count;
+    /* Sum of the positive and the negative changes in RSS. */
+    int64_t d_rss_positive;
+    int64_t d_rss_negative;
+    /* Largest change, only valid once count is non-zero. */
+    int64_t d_rss_max;
+} CallSiteEntry;
+
+typedef struct {
+    CallSiteEntry *entries;
+    /* Always a power of two. */
+    size_t capacity;
+    size_t size;
+} CallSiteTable;
+
+int call_site_table_init(CallSiteTable *table, size_t capacity);
+void call_site_table_free(CallSiteTable *table);
+CallSiteEntry *call_site_table_get(CallSiteTable *table, const void *code, int32_t line_number, int *is_new);
+void call_site_entry_add(CallSiteEntry *entry, int64_t d_rss);
+const CallSiteEntry **call_site_table_sorted(const CallSiteTable *table);
+
+#endif //CPYMEMTRACE_CALL_SITE_TABLE_H
@@ -5,10 +5,50 @@
 #ifndef CPYMEMTRACE_GET_RSS_H
 #define CPYMEMTRACE_GET_RSS_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 size_t getPeakRSS(void);
 size_t getCurrentRSS(void);
 size_t getCurrentRSS_alternate(void);
 
+/*
+ * Memory counters, each is a bit so that callers can ask for only the fields that they need.
+ * The cost depends on the field, on Linux:
+ *  RSS reads /proc/self/statm, cheap.
+ *  RSS_ANON, RSS_FILE, RSS_SHMEM, SWAP and PRIVATE read /proc/self/status, close to the cost of RSS.
+ *  USS and PSS read /proc/self/smaps_rollup, this walks the page tables so is much more expensive.
+ *  FAULTS uses getrusage().
+ * PRIVATE is phys_footprint on macOS, PrivateUsage on Windows and RssAnon + VmSwap on Linux.
+ */
+#define PY_MEM_TRACE_MEM_RSS        0x0001
+#define PY_MEM_TRACE_MEM_RSS_ANON   0x0002
+#define PY_MEM_TRACE_MEM_RSS_FILE   0x0004
+#define PY_MEM_TRACE_MEM_RSS_SHMEM  0x0008
+#define PY_MEM_TRACE_MEM_SWAP       0x0010
+#define PY_MEM_TRACE_MEM_USS        0x0020
+#define PY_MEM_TRACE_MEM_PSS        0x0040
+#define PY_MEM_TRACE_MEM_PRIVATE    0x0080
+#define PY_MEM_TRACE_MEM_FAULTS     0x0100
+#define PY_MEM_TRACE_MEM_ALL        0x01FF
+
+/* Sizes are in bytes, fault counts are cumulative totals. */
+typedef struct {
+    size_t rss;
+    size_t rss_anon;
+    size_t rss_file;
+    size_t rss_shmem;
+    size_t swap;
+    size_t uss;
+    size_t pss;
+    size_t private_bytes;
+    uint64_t minor_faults;
+    uint64_t major_faults;
+} pymemtrace_mem_counters;
+
+unsigned int pymemtrace_mem_counters_fill(pymemtrace_mem_counters *counters, unsigned int fields);
+size_t pymemtrace_mem_counter_read(unsigned int field);
+unsigned int pymemtrace_mem_counter_from_name(const char *name);
+const char *pymemtrace_mem_counter_name(unsigned int field);
+
 #endif //CPYMEMTRACE_GET_RSS_H
@@ -0,0 +1,80 @@
+// Per-thread buffers of allocation records for cMallocTrace.
+//
+// Each thread appends to its own buffer, found with pthread_getspecific(), without taking a lock.
+// A buffer is a linked list of fixed size chunks so that the writer never moves records that a reader may be reading.
+// Records are given a global sequence number with an atomic increment and malloc_trace_buffers_drain() merges all
+// the buffers in sequence order. The mutex is only taken when a thread creates its buffer and by the drain.
+
+#ifndef CPYMEMTRACE_MALLOC_TRACE_BUFFER_H
+#define CPYMEMTRACE_MALLOC_TRACE_BUFFER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum MallocTraceOperation {
+    MALLOC_TRACE_MALLOC = 1,
+    MALLOC_TRACE_CALLOC = 2,
+    MALLOC_TRACE_REALLOC = 3,
+    MALLOC_TRACE_FREE = 4,
+};
+
+typedef struct {
+    uint64_t sequence;
+    /* The allocated address for malloc, calloc and realloc, 0 for free. */
+    uintptr_t address;
+    /* The address being freed for free and realloc, 0 otherwise. */
+    uintptr_t old_address;
+    size_t size;
+    /* Id of the Python code object executing, 0 if unknown. */
+    uint32_t code_id;
+    int32_t line_number;
+    uint8_t operation;
+    /* PYMEM_DOMAIN_RAW etc. */
+    uint8_t domain;
+} MallocTraceRecord;
+
+#define MALLOC_TRACE_CHUNK_RECORDS 4096
+
+typedef struct MallocTraceChunk {
+    struct MallocTraceChunk *next;
+    /* Number of records that are complete, written by the owning thread with release semantics. */
+    size_t committed;
+    MallocTraceRecord records[MALLOC_TRACE_CHUNK_RECORDS];
+} MallocTraceChunk;
+
+typedef struct MallocTraceBuffer {
+    struct MallocTraceBuffer *next_buffer;
+    /* Only used by the owning thread. */
+    MallocTraceChunk *write_chunk;
+    /* Non-zero between malloc_trace_buffer_begin() and malloc_trace_buffer_commit(). */
+    int pending;
+    /* Set by the owner while it is inside an allocator hook, allocations made then are not recorded. */
+    int in_hook;
+    /* Only used by malloc_trace_buffers_drain(). */
+    MallocTraceChunk *read_chunk;
+    size_t read_index;
+} MallocTraceBuffer;
+
+typedef struct {
+    /* The next sequence number. */
+    uint64_t sequence;
+    pthread_key_t key;
+    /* Protects the list of buffers. */
+    pthread_mutex_t mutex;
+    MallocTraceBuffer *buffers;
+    /* Records lost because a chunk could not be allocated. */
+    size_t records_dropped;
+} MallocTraceBuffers;
+
+typedef void (*malloc_trace_record_callback)(void *context, const MallocTraceRecord *record);
+
+int malloc_trace_buffers_init(MallocTraceBuffers *buffers);
+void malloc_trace_buffers_free(MallocTraceBuffers *buffers);
+MallocTraceBuffer *malloc_trace_buffer_get(MallocTraceBuffers *buffers);
+uint64_t malloc_trace_buffer_begin(MallocTraceBuffers *buffers, MallocTraceBuffer *buffer);
+void malloc_trace_buffer_commit(MallocTraceBuffers *buffers, MallocTraceBuffer *buffer,
+                                const MallocTraceRecord *record);
+size_t malloc_trace_buffers_drain(MallocTraceBuffers *buffers, malloc_trace_record_callback callback, void *context);
+
+#endif //CPYMEMTRACE_MALLOC_TRACE_BUFFER_H
@@ -0,0 +1,28 @@
+// An open addressing hash map of pointer to unsigned integer.
+// This is used on the hot path to give objects such as code objects and strings a small integer id.
+
+#ifndef CPYMEMTRACE_POINTER_MAP_H
+#define CPYMEMTRACE_POINTER_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    const void *key;
+    uint32_t value;
+} PointerMapEntry;
+
+typedef struct {
+    PointerMapEntry *entries;
+    /* Always a power of two. */
+    size_t capacity;
+    size_t size;
+} PointerMap;
+
+int pointer_map_init(PointerMap *map, size_t capacity);
+void pointer_map_free(PointerMap *map);
+void pointer_map_clear(PointerMap *map);
+int pointer_map_get(const PointerMap *map, const void *key, uint32_t *value);
+int pointer_map_insert(PointerMap *map, const void *key, uint32_t value);
+
+#endif //CPYMEMTRACE_POINTER_MAP_H
@@ -0,0 +1,54 @@
+// A native thread that samples the memory and CPU usage of this process at a regular interval.
+// Samples are written to a preallocated ring of ProcessSample so the sampler thread never needs the GIL and never
+// allocates. If the ring is full the oldest sample is overwritten and counted in samples_lost.
+// The mutex is held briefly by the sampler thread to add a sample and by process_sampler_take().
+
+#ifndef CPYMEMTRACE_PROCESS_SAMPLER_H
+#define CPYMEMTRACE_PROCESS_SAMPLER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    /* Wall clock time, nanoseconds since the Unix epoch. */
+    int64_t time_ns;
+    /* Bytes. */
+    uint64_t rss;
+    uint64_t vms;
+    /* Cumulative totals, all page faults and those that needed I/O. */
+    uint64_t page_faults;
+    uint64_t major_page_faults;
+    /* Cumulative CPU time in seconds. */
+    double user_time;
+    double system_time;
+} ProcessSample;
+
+typedef struct {
+    ProcessSample *samples;
+    size_t capacity;
+    /* Index of the oldest sample and the number of samples in the ring. */
+    size_t first;
+    size_t count;
+    size_t samples_taken;
+    size_t samples_lost;
+    uint64_t interval_ns;
+    /* Linux: cached file descriptor of /proc/self/stat, -1 otherwise. */
+    int stat_file_descriptor;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+    int thread_started;
+} ProcessSampler;
+
+int process_sample_read(int stat_file_descriptor, ProcessSample *sample);
+int process_sampler_init(ProcessSampler *sampler, size_t capacity, uint64_t interval_ns);
+int process_sampler_start(ProcessSampler *sampler);
+void process_sampler_stop(ProcessSampler *sampler);
+void process_sampler_free(ProcessSampler *sampler);
+int process_sampler_sample(ProcessSampler *sampler, ProcessSample *sample);
+size_t process_sampler_take(ProcessSampler *sampler, ProcessSample *samples, size_t max_samples);
+size_t process_sampler_count(ProcessSampler *sampler);
+
+#endif //CPYMEMTRACE_PROCESS_SAMPLER_H
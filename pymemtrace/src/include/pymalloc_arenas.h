@@ -0,0 +1,68 @@
+// Finds the pymalloc pools in this process by reading their headers, this is used by cDebugMallocStats to report
+// the pools in each arena. The arenas themselves are private to Objects/obmalloc.c.
+//
+// Every POOL_SIZE aligned address in the anonymous read/write mappings in /proc/self/maps is a candidate. A candidate
+// is a pool if its header is consistent with the pymalloc geometry, for example maxnextoffset is always
+// POOL_SIZE - block size. Memory is read with pread() on /proc/self/mem so that a mapping that goes away during the
+// walk gives an error rather than a fault. This is Linux only.
+
+#ifndef CPYMEMTRACE_PYMALLOC_ARENAS_H
+#define CPYMEMTRACE_PYMALLOC_ARENAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__linux__) || defined(__linux) || defined(linux) || defined(__gnu_linux__)
+#define PYMALLOC_ARENAS_SUPPORTED 1
+#else
+#define PYMALLOC_ARENAS_SUPPORTED 0
+#endif
+
+/* struct pool_header from Objects/obmalloc.c, this is the same from Python 3.6 to 3.13. */
+typedef struct pymalloc_pool_header {
+    union {
+        uint8_t *padding;
+        unsigned int count;
+    } ref;
+    uint8_t *freeblock;
+    struct pymalloc_pool_header *nextpool;
+    struct pymalloc_pool_header *prevpool;
+    unsigned int arenaindex;
+    unsigned int szidx;
+    unsigned int nextoffset;
+    unsigned int maxnextoffset;
+} PymallocPoolHeader;
+
+/* The pymalloc geometry, from the values that _PyObject_DebugMallocStats() reports. */
+typedef struct {
+    size_t pool_size;
+    size_t arena_size;
+    /* Block sizes are (size class + 1) * alignment. */
+    size_t alignment;
+    size_t size_classes;
+    /* sizeof(struct pool_header) rounded up to the alignment. */
+    size_t pool_overhead;
+} PymallocGeometry;
+
+typedef struct {
+    uintptr_t address;
+    unsigned int arena_index;
+    unsigned int size_class;
+    unsigned int blocks_in_use;
+    /* Blocks that fit in the pool. */
+    unsigned int capacity;
+} PymallocPool;
+
+typedef struct {
+    PymallocPool *pools;
+    size_t count;
+    size_t capacity;
+    /* Candidate addresses that could not be read. */
+    size_t read_errors;
+} PymallocPools;
+
+int pymalloc_pool_header_is_valid(const PymallocGeometry *geometry, uintptr_t address, const PymallocPoolHeader *header);
+int pymalloc_pools_find(const PymallocGeometry *geometry, PymallocPools *pools);
+void pymalloc_pools_free(PymallocPools *pools);
+
+#endif //CPYMEMTRACE_PYMALLOC_ARENAS_H
@@ -0,0 +1,75 @@
+// Parses the text written by _PyObject_DebugMallocStats() and _PyObject_DebugTypeStats() into numbers.
+// This is the C equivalent of the regular expressions in pymemtrace/debug_malloc_stats.py and is used by
+// cDebugMallocStats so that a snapshot of the pymalloc state costs no Python objects per line.
+//
+// The parser works a line at a time, lines need not be NUL terminated.
+
+#ifndef CPYMEMTRACE_PYMALLOC_STATS_H
+#define CPYMEMTRACE_PYMALLOC_STATS_H
+
+#include <stddef.h>
+
+/* Far more than the 64 size classes of any pymalloc. */
+#define PYMALLOC_STATS_MAX_CLASSES 256
+/* Longer type names are truncated. */
+#define PYMALLOC_STATS_TYPE_NAME_SIZE 64
+
+/* Bits in PymallocStats.found, a snapshot is complete when all of PYMALLOC_STATS_FOUND_ALL are set. */
+#define PYMALLOC_STATS_FOUND_HEADER                 (1U << 0)
+#define PYMALLOC_STATS_FOUND_ARENAS_ALLOCATED       (1U << 1)
+#define PYMALLOC_STATS_FOUND_ARENAS_HIGHWATER       (1U << 2)
+#define PYMALLOC_STATS_FOUND_ARENAS_CURRENT         (1U << 3)
+#define PYMALLOC_STATS_FOUND_ARENA_SIZE             (1U << 4)
+#define PYMALLOC_STATS_FOUND_ALLOCATED_BYTES        (1U << 5)
+#define PYMALLOC_STATS_FOUND_AVAILABLE_BYTES        (1U << 6)
+#define PYMALLOC_STATS_FOUND_UNUSED_POOLS           (1U << 7)
+#define PYMALLOC_STATS_FOUND_POOL_HEADER_BYTES      (1U << 8)
+#define PYMALLOC_STATS_FOUND_QUANTIZATION           (1U << 9)
+#define PYMALLOC_STATS_FOUND_ARENA_ALIGNMENT        (1U << 10)
+#define PYMALLOC_STATS_FOUND_ALL                    ((1U << 11) - 1)
+
+/* A line in the size class table, the same fields as debug_malloc_stats.DebugMallocStat. */
+typedef struct {
+    size_t block_class;
+    size_t size;
+    size_t num_pools;
+    size_t blocks_in_use;
+    size_t avail_blocks;
+} PymallocClassStat;
+
+/* A line of the type statistics, the same fields as debug_malloc_stats.DebugTypeStat. */
+typedef struct {
+    size_t free_count;
+    char object_type[PYMALLOC_STATS_TYPE_NAME_SIZE];
+    size_t bytes_each;
+    size_t bytes_total;
+} PymallocTypeStat;
+
+typedef struct {
+    size_t small_block_threshold;
+    size_t size_classes;
+    size_t class_count;
+    PymallocClassStat classes[PYMALLOC_STATS_MAX_CLASSES];
+    /* As debug_malloc_stats.DebugMallocArenas. */
+    size_t ntimes_arena_allocated;
+    size_t narenas_highwater;
+    size_t narenas;
+    size_t arena_size;
+    /* As debug_malloc_stats.DebugMallocPoolsBlocks. */
+    size_t allocated_bytes;
+    size_t available_bytes;
+    size_t numfreepools;
+    size_t pool_size;
+    size_t pool_header_bytes;
+    size_t quantization;
+    size_t arena_alignment;
+    unsigned int found;
+} PymallocStats;
+
+void pymalloc_stats_init(PymallocStats *stats);
+int pymalloc_stats_parse_line(PymallocStats *stats, const char *line, size_t length);
+int pymalloc_stats_parse(PymallocStats *stats, const char *text, size_t length);
+int pymalloc_type_stat_parse_line(PymallocTypeStat *type_stat, const char *line, size_t length);
+size_t pymalloc_stats_pool_overhead(const PymallocStats *stats);
+
+#endif //CPYMEMTRACE_PYMALLOC_STATS_H
@@ -0,0 +1,117 @@
+// The C API of cPyMemTrace for other C and C++ extensions, it is exported as the capsule cPyMemTrace._C_API.
+//
+// An extension records its own native allocations, or any point of interest, as markers in the cPyMemTrace log so
+// that they appear in order with the Python events:
+//
+//     #include "pymemtrace_capi.h"
+//
+//     PyMODINIT_FUNC PyInit_myext(void) {
+//         ...
+//         if (PyMemTrace_ImportCAPI()) {
+//             /* pymemtrace is not installed, the markers below do nothing. */
+//             PyErr_Clear();
+//         }
+//         ...
+//     }
+//
+//     buffer = malloc(size);
+//     pymemtrace_alloc(size, "myext.buffer");
+//     ...
+//     pymemtrace_free(size, "myext.buffer");
+//     free(buffer);
+//     pymemtrace_mark("myext: solved");
+//
+// A large buffer can also be registered as a region so that the log has its resident bytes, see region_residency.h:
+//
+//     pymemtrace_region_add(buffer, size, "myext.buffer");
+//     ... write to buffer ...
+//     pymemtrace_region_touched(buffer);
+//     ...
+//     pymemtrace_region_remove(buffer);
+//     free(buffer);
+//
+// The marker functions can be called from any thread with or without the GIL, they take no lock and allocate nothing.
+// A marker is queued, see trace_marker_queue.h, and the next event of a traced thread writes it to that thread's log.
+// The region functions must be called with the GIL.
+// The include directory is given by pymemtrace.get_include().
+
+#ifndef CPYMEMTRACE_PYMEMTRACE_CAPI_H
+#define CPYMEMTRACE_PYMEMTRACE_CAPI_H
+
+#include <stddef.h>
+
+#define PYMEMTRACE_CAPI_CAPSULE_NAME "pymemtrace.cPyMemTrace._C_API"
+/* Functions are only ever added to the end of PyMemTraceCAPI, the version says which are present. */
+#define PYMEMTRACE_CAPI_VERSION 2
+
+/* Results of the marker functions. */
+#define PYMEMTRACE_MARKER_QUEUED 0
+/* Nothing is being traced so the marker was ignored. */
+#define PYMEMTRACE_MARKER_NOT_TRACING 1
+/* The queue was full and the marker was dropped. */
+#define PYMEMTRACE_MARKER_DROPPED (-1)
+
+/* Results of the region functions. */
+#define PYMEMTRACE_REGION_OK 0
+/* There is no region at, or containing, that address. */
+#define PYMEMTRACE_REGION_NOT_FOUND 1
+#define PYMEMTRACE_REGION_NO_MEMORY (-1)
+
+typedef struct {
+    int version;
+    /* Record a point of interest. label is copied, up to 63 bytes of it. */
+    int (*mark)(const char *label);
+    /* Record that the caller has allocated, or freed, size bytes for tag, such as the name of a buffer. */
+    int (*mark_alloc)(size_t size, const char *tag);
+    int (*mark_free)(size_t size, const char *tag);
+    /* Returns non-zero if a cPyMemTrace tracer is writing a log, a caller can skip work that is only for markers. */
+    int (*is_tracing)(void);
+    /* Version 2. Register size bytes from address as a region, replacing any region at that address. */
+    int (*region_add)(const void *address, size_t size, const char *label);
+    /* Remove the region at address, call this before the memory is freed. */
+    int (*region_remove)(const void *address);
+    /* The caller has written to the region that contains address so it is scanned again on the next RSS read. */
+    int (*region_touched)(const void *address);
+} PyMemTraceCAPI;
+
+/* cPyMemTrace itself defines PYMEMTRACE_CAPI_IMPLEMENTATION and does not need the importer. */
+#if defined(Py_PYTHON_H) && ! defined(PYMEMTRACE_CAPI_IMPLEMENTATION)
+/* Set by PyMemTrace_ImportCAPI(), NULL until then. Each translation unit that includes this has its own copy. */
+static const PyMemTraceCAPI *PyMemTrace_API = NULL;
+
+/*
+ * Import the C API, call this with the GIL, for example from the module init function.
+ * Returns 0 on success, -1 with an exception set if cPyMemTrace can not be imported or is too old.
+ */
+static inline int
+PyMemTrace_ImportCAPI(void) {
+    const PyMemTraceCAPI *api = (const PyMemTraceCAPI *)PyCapsule_Import(PYMEMTRACE_CAPI_CAPSULE_NAME, 0);
+    if (api == NULL) {
+        return -1;
+    }
+    if (api->version < PYMEMTRACE_CAPI_VERSION) {
+        PyErr_Format(PyExc_ImportError, "pymemtrace C API version %d is older than version %d.", api->version,
+                     PYMEMTRACE_CAPI_VERSION);
+        return -1;
+    }
+    PyMemTrace_API = api;
+    return 0;
+}
+
+/* These do nothing, returning PYMEMTRACE_MARKER_NOT_TRACING, if the C API has not been imported. */
+#define pymemtrace_mark(label) \
+    (PyMemTrace_API ? PyMemTrace_API->mark(label) : PYMEMTRACE_MARKER_NOT_TRACING)
+#define pymemtrace_alloc(size, tag) \
+    (PyMemTrace_API ? PyMemTrace_API->mark_alloc((size), (tag)) : PYMEMTRACE_MARKER_NOT_TRACING)
+#define pymemtrace_free(size, tag) \
+    (PyMemTrace_API ? PyMemTrace_API->mark_free((size), (tag)) : PYMEMTRACE_MARKER_NOT_TRACING)
+#define pymemtrace_is_tracing() (PyMemTrace_API ? PyMemTrace_API->is_tracing() : 0)
+#define pymemtrace_region_add(address, size, label) \
+    (PyMemTrace_API ? PyMemTrace_API->region_add((address), (size), (label)) : PYMEMTRACE_MARKER_NOT_TRACING)
+#define pymemtrace_region_remove(address) \
+    (PyMemTrace_API ? PyMemTrace_API->region_remove(address) : PYMEMTRACE_MARKER_NOT_TRACING)
+#define pymemtrace_region_touched(address) \
+    (PyMemTrace_API ? PyMemTrace_API->region_touched(address) : PYMEMTRACE_MARKER_NOT_TRACING)
+#endif
+
+#endif //CPYMEMTRACE_PYMEMTRACE_CAPI_H
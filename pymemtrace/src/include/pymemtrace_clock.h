@@ -0,0 +1,44 @@
+// Selectable timestamp sources for trace events.
+//
+// Events store raw ticks, these are only converted to seconds when output as text or when read.
+// Each clock has an anchor, the ticks and the wall clock time read together when the clock is initialised, so that
+// a trace can be lined up with wall clock logs such as those from pymemtrace.process.
+
+#ifndef CPYMEMTRACE_PYMEMTRACE_CLOCK_H
+#define CPYMEMTRACE_PYMEMTRACE_CLOCK_H
+
+#include <stdint.h>
+
+enum PyMemTraceClockSource {
+    /* clock_gettime(CLOCK_MONOTONIC), the default. */
+    PY_MEM_TRACE_CLOCK_MONOTONIC = 0,
+    /* clock_gettime(CLOCK_MONOTONIC_COARSE), cheaper with a resolution of a few milliseconds. Linux only. */
+    PY_MEM_TRACE_CLOCK_MONOTONIC_COARSE = 1,
+    /* clock_gettime(CLOCK_MONOTONIC_RAW), not subject to NTP adjustment. Linux only. */
+    PY_MEM_TRACE_CLOCK_MONOTONIC_RAW = 2,
+    /* The CPU time stamp counter, calibrated once against CLOCK_MONOTONIC. x86 and ARM64 only. */
+    PY_MEM_TRACE_CLOCK_TSC = 3,
+    /* mach_absolute_time(). macOS only. */
+    PY_MEM_TRACE_CLOCK_MACH = 4,
+    /* clock(), process CPU time, as used before the clock could be selected. */
+    PY_MEM_TRACE_CLOCK_CPU = 5,
+    PY_MEM_TRACE_CLOCK_COUNT
+};
+
+typedef struct {
+    int source;
+    uint64_t ticks_per_second;
+    double seconds_per_tick;
+    /* Ticks and wall clock time, nanoseconds since the Unix epoch, read together by pymemtrace_clock_init(). */
+    uint64_t anchor_ticks;
+    int64_t anchor_wall_ns;
+} PyMemTraceClock;
+
+int pymemtrace_clock_source_from_name(const char *name);
+const char *pymemtrace_clock_source_name(int source);
+int pymemtrace_clock_available(int source);
+int pymemtrace_clock_init(PyMemTraceClock *trace_clock, int source);
+uint64_t pymemtrace_clock_ticks(const PyMemTraceClock *trace_clock);
+double pymemtrace_clock_seconds(const PyMemTraceClock *trace_clock, uint64_t ticks);
+
+#endif //CPYMEMTRACE_PYMEMTRACE_CLOCK_H
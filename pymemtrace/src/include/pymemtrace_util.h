@@ -5,7 +5,23 @@
 #ifndef CPYMEMTRACE_PYMEMTRACE_UTIL_H
 #define CPYMEMTRACE_PYMEMTRACE_UTIL_H
 
-char *create_filename(void);
-char *current_working_directory(void);
+#include <stddef.h>
+#include <time.h>
+
+/* Buffer sizes for create_filename() and create_log_path(). */
+#define PYMEMTRACE_FILENAME_MAX 256
+#define PYMEMTRACE_PATH_MAX 4096
+
+#ifdef _WIN32
+#define PYMEMTRACE_PATH_SEPARATOR '\\'
+#else
+#define PYMEMTRACE_PATH_SEPARATOR '/'
+#endif
+
+int create_filename(char *buffer, size_t size, const char *extension, unsigned long thread_id, time_t start,
+                    long sequence);
+int create_log_path(char *buffer, size_t size, const char *directory, const char *extension, unsigned long thread_id,
+                    time_t start, long sequence);
+int current_working_directory(char *buffer, size_t size);
 
 #endif //CPYMEMTRACE_PYMEMTRACE_UTIL_H
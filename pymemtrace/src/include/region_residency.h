@@ -0,0 +1,53 @@
+// The resident bytes of registered address ranges, such as large C/C++ or NumPy buffers, so that their growth can be
+// told apart from the growth of the interpreter heap that the process RSS includes.
+//
+// Pages are counted with mincore() on Linux and macOS and QueryWorkingSetEx() on Windows. This costs one call per
+// chunk of pages of a region so a scan is incremental: only the regions that have been touched since their last scan
+// are scanned again. A region is touched when it is added and by region_residency_touch(), such as when the owner has
+// written to it.
+// The table is not thread safe, in cPyMemTrace it is only used with the GIL held.
+
+#ifndef CPYMEMTRACE_REGION_RESIDENCY_H
+#define CPYMEMTRACE_REGION_RESIDENCY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longest label including the NUL, longer labels are truncated. */
+#define REGION_RESIDENCY_LABEL_MAX 64
+
+/* resident_bytes and reported_bytes before the first scan or report. */
+#define REGION_RESIDENCY_UNKNOWN SIZE_MAX
+
+typedef struct {
+    uintptr_t address;
+    size_t size;
+    char label[REGION_RESIDENCY_LABEL_MAX];
+    /* Resident pages times the page size at the last scan, partial pages at either end count as whole pages. */
+    size_t resident_bytes;
+    /* The resident_bytes that the caller last reported, such as to a log, see region_residency_changed(). */
+    size_t reported_bytes;
+    /* Non-zero if the region must be scanned again. */
+    int touched;
+} RegionResidency;
+
+typedef struct {
+    RegionResidency *regions;
+    size_t count;
+    size_t capacity;
+    size_t page_size;
+    /* Totals of region scans and of the pages scanned. */
+    uint64_t scans;
+    uint64_t pages_scanned;
+} RegionResidencyTable;
+
+void region_residency_init(RegionResidencyTable *table);
+void region_residency_free(RegionResidencyTable *table);
+int region_residency_add(RegionResidencyTable *table, const void *address, size_t size, const char *label);
+int region_residency_remove(RegionResidencyTable *table, const void *address);
+int region_residency_touch(RegionResidencyTable *table, const void *address);
+void region_residency_touch_all(RegionResidencyTable *table);
+size_t region_residency_scan(RegionResidencyTable *table);
+RegionResidency *region_residency_changed(RegionResidencyTable *table, size_t *index);
+
+#endif //CPYMEMTRACE_REGION_RESIDENCY_H
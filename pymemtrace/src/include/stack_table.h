@@ -0,0 +1,35 @@
+// A hash consed table of call stacks, a trie where each node is a frame (code object, line number) and the id of the
+// stack that called it. A stack of any depth is then a single id and a stack that has been seen before costs nothing
+// more than the lookups.
+// This is used by cPyMemTrace to record the callers of the events that pass d_rss_trigger.
+
+#ifndef CPYMEMTRACE_STACK_TABLE_H
+#define CPYMEMTRACE_STACK_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    /* NULL is an empty slot. */
+    const void *code;
+    int32_t line_number;
+    /* The id of the calling stack, 0 is the root. */
+    uint32_t parent_id;
+    /* Ids start at 1. */
+    uint32_t id;
+} StackTableEntry;
+
+typedef struct {
+    StackTableEntry *entries;
+    /* Always a power of two. */
+    size_t capacity;
+    size_t size;
+} StackTable;
+
+int stack_table_init(StackTable *table, size_t capacity);
+void stack_table_free(StackTable *table);
+void stack_table_clear(StackTable *table);
+uint32_t stack_table_get(StackTable *table, uint32_t parent_id, const void *code, int32_t line_number, int *is_new);
+void stack_table_remove(StackTable *table, uint32_t parent_id, const void *code, int32_t line_number);
+
+#endif //CPYMEMTRACE_STACK_TABLE_H
@@ -0,0 +1,44 @@
+// Streaming gzip compression of the cPyMemTrace log files, and decompression for cTraceReader.
+//
+// The output is a standard gzip file so can also be read with zcat or Python's gzip module.
+// The deflate stream is flushed with Z_SYNC_FLUSH after each TRACE_COMPRESS_BLOCK_SIZE bytes of input so a file that
+// is still being written, or was not closed because the process crashed, can be decompressed up to the last block.
+
+#ifndef CPYMEMTRACE_TRACE_COMPRESS_H
+#define CPYMEMTRACE_TRACE_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <zlib.h>
+
+/* Bytes of input between sync flushes. */
+#define TRACE_COMPRESS_BLOCK_SIZE (1024 * 1024)
+/* Size of the buffer for compressed output. */
+#define TRACE_COMPRESS_BUFFER_SIZE (64 * 1024)
+/* Level 1 is several times faster than the default and logs are repetitive enough that it makes little difference. */
+#define TRACE_COMPRESS_DEFAULT_LEVEL 1
+
+typedef struct {
+    z_stream stream;
+    FILE *file;
+    /* Input since the last sync flush. */
+    size_t block_input;
+    int is_open;
+    /* Statistics. */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    unsigned char buffer[TRACE_COMPRESS_BUFFER_SIZE];
+} TraceCompressor;
+
+int trace_compress_open(TraceCompressor *compressor, FILE *file, int level);
+size_t trace_compress_write(TraceCompressor *compressor, const void *data, size_t size);
+int trace_compress_flush(TraceCompressor *compressor);
+int trace_compress_close(TraceCompressor *compressor);
+void trace_compress_abandon(TraceCompressor *compressor);
+
+int trace_compress_is_compressed(const void *data, size_t size);
+int trace_decompress(const void *data, size_t size, unsigned char **output, size_t *output_size);
+
+#endif //CPYMEMTRACE_TRACE_COMPRESS_H
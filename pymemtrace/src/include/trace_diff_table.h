@@ -0,0 +1,41 @@
+// An open addressing hash table of allocation sites, such as a file, a line or a traceback, that accumulates the
+// change in size and count between two walks of the tracemalloc traces. This is used by cTraceMalloc so that a
+// snapshot diff costs a table entry per site rather than Python objects per trace.
+//
+// Keys are opaque, the caller gives the hash and an equality function. Keys that are the same pointer are equal
+// without calling it.
+
+#ifndef CPYMEMTRACE_TRACE_DIFF_TABLE_H
+#define CPYMEMTRACE_TRACE_DIFF_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    /* NULL is an empty slot. */
+    const void *key;
+    uint64_t hash;
+    /* Totals from the second walk. */
+    uint64_t size;
+    uint64_t count;
+    /* Second walk less the first walk. */
+    int64_t size_diff;
+    int64_t count_diff;
+} TraceDiffEntry;
+
+typedef int (*trace_diff_key_equal)(const void *key_a, const void *key_b);
+
+typedef struct {
+    TraceDiffEntry *entries;
+    /* Always a power of two. */
+    size_t capacity;
+    size_t size;
+    trace_diff_key_equal equal;
+} TraceDiffTable;
+
+int trace_diff_table_init(TraceDiffTable *table, size_t capacity, trace_diff_key_equal equal);
+void trace_diff_table_free(TraceDiffTable *table);
+TraceDiffEntry *trace_diff_table_get(TraceDiffTable *table, const void *key, uint64_t hash, int *is_new);
+const TraceDiffEntry **trace_diff_table_sorted(const TraceDiffTable *table);
+
+#endif //CPYMEMTRACE_TRACE_DIFF_TABLE_H
@@ -0,0 +1,46 @@
+// Include and exclude patterns that decide which code objects cPyMemTrace traces. Each pattern matches the file name,
+// the module name or the function name of a code object. cPyMemTrace makes the decision once for each code object and
+// caches it on the code object so matching does not need to be fast.
+
+#ifndef CPYMEMTRACE_TRACE_FILTER_H
+#define CPYMEMTRACE_TRACE_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The prefixes of a pattern that select what it matches, a pattern without one of these matches the file name. */
+#define TRACE_FILTER_PREFIX_FILE "file:"
+#define TRACE_FILTER_PREFIX_MODULE "module:"
+#define TRACE_FILTER_PREFIX_FUNCTION "function:"
+
+enum TraceFilterField {
+    TRACE_FILTER_FILE,
+    TRACE_FILTER_MODULE,
+    TRACE_FILTER_FUNCTION,
+};
+
+typedef struct {
+    /* A TraceFilterField. */
+    int field;
+    /* Non-zero for an include pattern, zero for an exclude pattern. */
+    int include;
+    /* An fnmatch() pattern for files and functions, a dotted prefix for modules. */
+    char *text;
+} TraceFilterPattern;
+
+typedef struct {
+    TraceFilterPattern *patterns;
+    size_t count;
+    size_t include_count;
+    /* Identifies this set of patterns in the decisions cached on code objects, 0 if there are no patterns. */
+    uintptr_t generation;
+} TraceFilter;
+
+int trace_filter_add(TraceFilter *filter, const char *pattern, int include);
+int trace_filter_copy(TraceFilter *dst, const TraceFilter *src);
+void trace_filter_free(TraceFilter *filter);
+int trace_filter_uses_module(const TraceFilter *filter);
+int trace_filter_match(const TraceFilter *filter, const char *file_name, const char *module_name,
+                       const char *function_name);
+
+#endif //CPYMEMTRACE_TRACE_FILTER_H
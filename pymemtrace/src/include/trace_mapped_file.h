@@ -0,0 +1,39 @@
+// An append only log file that is written through a shared mapping of the file rather than through stdio.
+//
+// The file is extended, and mapped, in steps of grow_size bytes. Records are copied into the mapping with plain stores
+// and then the committed length, a uint64_t at committed_offset in the file header, is set with a release store.
+// The pages belong to the kernel's page cache, not to the process, so if the process is killed, for example by the
+// OOM killer, everything up to the committed length is still written to the file. A reader takes the committed length
+// rather than the file size as the end of the records.
+// Writing is done by the traced thread and needs no system call except to extend the file.
+// On close the file is truncated to the committed length.
+
+#ifndef CPYMEMTRACE_TRACE_MAPPED_FILE_H
+#define CPYMEMTRACE_TRACE_MAPPED_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    int fd;
+    unsigned char *data;
+    /* The size of the file and of the mapping. */
+    size_t size;
+    /* The bytes written from the start of the file, the last value stored in the committed length. */
+    size_t length;
+    size_t grow_size;
+    /* Offset of the uint64_t committed length in the file. */
+    size_t committed_offset;
+    /* Records that could not be written because the file could not be extended. */
+    size_t records_dropped;
+    int is_open;
+} TraceMappedFile;
+
+int trace_mapped_file_open(TraceMappedFile *file, int fd, size_t grow_size, const void *header, size_t header_size,
+                           size_t committed_offset);
+int trace_mapped_file_write(TraceMappedFile *file, const void *data, size_t size);
+void trace_mapped_file_sync(TraceMappedFile *file);
+int trace_mapped_file_close(TraceMappedFile *file);
+void trace_mapped_file_abandon(TraceMappedFile *file);
+
+#endif //CPYMEMTRACE_TRACE_MAPPED_FILE_H
@@ -0,0 +1,51 @@
+// A bounded multiple producer, single consumer queue of markers from other C extensions, see pymemtrace_capi.h.
+//
+// Producers are any thread, with or without the GIL, they claim a slot with a compare and swap on head and publish it
+// by setting the slot's sequence number. Nothing is allocated and no lock is taken, a full queue drops the marker.
+// The consumer is the traced thread that has the next event, it holds the GIL so there is only ever one.
+// This is the bounded queue of Dmitry Vyukov with the GCC/Clang __atomic builtins.
+
+#ifndef CPYMEMTRACE_TRACE_MARKER_QUEUE_H
+#define CPYMEMTRACE_TRACE_MARKER_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longest label including the NUL, longer labels are truncated. */
+#define TRACE_MARKER_LABEL_MAX 64
+
+typedef struct {
+    /* Ticks of the clock given to trace_marker_queue_push(). */
+    uint64_t clock;
+    uint64_t thread_id;
+    /* Bytes for TRACE_MARKER_ALLOC and TRACE_MARKER_FREE, 0 for TRACE_MARKER_MARK. */
+    int64_t size;
+    /* A TraceMarkerKind, see trace_record.h. */
+    uint8_t kind;
+    char label[TRACE_MARKER_LABEL_MAX];
+} TraceMarker;
+
+typedef struct {
+    /* Position + 1 once the marker is published, position + capacity once it is consumed. */
+    size_t sequence;
+    TraceMarker marker;
+} TraceMarkerSlot;
+
+typedef struct {
+    TraceMarkerSlot *slots;
+    /* Always a power of two. */
+    size_t capacity;
+    /* Monotonically increasing positions, the slot is (position & (capacity - 1)). */
+    size_t head; /* Claimed by producers. */
+    size_t tail; /* Only used by the consumer. */
+    /* Markers dropped because the queue was full. */
+    size_t records_dropped;
+} TraceMarkerQueue;
+
+int trace_marker_queue_open(TraceMarkerQueue *queue, size_t capacity);
+void trace_marker_queue_set_label(TraceMarker *marker, const char *label);
+int trace_marker_queue_push(TraceMarkerQueue *queue, const TraceMarker *marker);
+int trace_marker_queue_pop(TraceMarkerQueue *queue, TraceMarker *marker);
+size_t trace_marker_queue_records_dropped(const TraceMarkerQueue *queue);
+
+#endif //CPYMEMTRACE_TRACE_MARKER_QUEUE_H
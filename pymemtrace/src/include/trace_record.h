@@ -0,0 +1,211 @@
+// The binary trace file format written by cPyMemTrace in binary mode.
+//
+// The file starts with a TraceFileHeader and is followed by a stream of records.
+// Every record starts with a one byte record type and is a multiple of eight bytes long.
+// All values are in native byte order, the reader uses TRACE_FILE_BYTE_ORDER_MARK to check this.
+
+#ifndef CPYMEMTRACE_TRACE_RECORD_H
+#define CPYMEMTRACE_TRACE_RECORD_H
+
+#include <stdint.h>
+
+#define TRACE_FILE_MAGIC "PYMTRACE"
+#define TRACE_FILE_MAGIC_LENGTH 8
+/*
+ * Version 3 adds the stack records, version 4 the stats record and version 5 the marker record, the header is the
+ * same as version 2. Version 6 adds the TraceFileCommitted that follows the header of a mapped file.
+ */
+#define TRACE_FILE_VERSION 6
+#define TRACE_FILE_BYTE_ORDER_MARK 0x01020304
+
+typedef struct {
+    char magic[TRACE_FILE_MAGIC_LENGTH];
+    uint32_t byte_order_mark;
+    uint32_t version;
+    /* Size of this header, records start at this offset. */
+    uint32_t header_size;
+    uint32_t pid;
+    /* Conversion of TraceRecordEvent.clock to seconds. */
+    uint64_t clock_ticks_per_second;
+    int64_t d_rss_trigger;
+    /* Version 2. A PyMemTraceClockSource, see pymemtrace_clock.h. */
+    uint32_t clock_source;
+    /* The PY_MEM_TRACE_MEM_... field, see get_rss.h, logged as the RSS. 0 is the RSS. */
+    uint32_t memory_counter;
+    /* TraceRecordEvent.clock when the file was opened and the wall clock time then, nanoseconds since the Unix epoch. */
+    uint64_t clock_anchor_ticks;
+    int64_t clock_anchor_wall_ns;
+} TraceFileHeader;
+
+/*
+ * Version 6. A log file written with mmap=True, see trace_mapped_file.h, has this after the header and header_size
+ * includes it. The records end at committed_length, the file may be longer if the process was killed.
+ */
+typedef struct {
+    uint64_t committed_length;
+} TraceFileCommitted;
+
+/* Size of the version 1 header, version 1 clocks are clock() ticks since the process started. */
+#define TRACE_FILE_HEADER_V1_SIZE 40
+
+/* Record types. */
+enum TraceRecordType {
+    TRACE_RECORD_EVENT = 1,
+    TRACE_RECORD_STRING = 2,
+    /* Version 3. */
+    TRACE_RECORD_STACK = 3,
+    TRACE_RECORD_EVENT_STACK = 4,
+    /* Version 4. */
+    TRACE_RECORD_STATS = 5,
+    /* Version 5. */
+    TRACE_RECORD_MARKER = 6,
+};
+
+/* TraceRecordEvent.flags, PREV and NEXT correspond to the "PREV: " and "NEXT: " prefixes of the text format. */
+#define TRACE_RECORD_FLAG_PREV 0x01
+#define TRACE_RECORD_FLAG_NEXT 0x02
+/* The RSS was read for this event rather than carried forward from an earlier event. */
+#define TRACE_RECORD_FLAG_SAMPLED 0x04
+
+/* A single trace event. */
+typedef struct {
+    uint8_t type; /* TRACE_RECORD_EVENT */
+    uint8_t what; /* PyTrace_CALL etc. */
+    uint8_t flags;
+    uint8_t reserved;
+    int32_t line_number;
+    /* String table ids of the file name and the function name. */
+    uint32_t file_id;
+    uint32_t func_id;
+    uint64_t event_number;
+    uint64_t clock;
+    uint64_t rss;
+    int64_t d_rss;
+} TraceRecordEvent;
+
+/*
+ * Associates a string id with some text.
+ * This is followed by length bytes of UTF-8 text, not NUL terminated, padded with NULs to a multiple of eight bytes.
+ * A string record always appears before the first record that uses its id.
+ */
+typedef struct {
+    uint8_t type; /* TRACE_RECORD_STRING */
+    uint8_t reserved[3];
+    uint32_t id;
+    uint32_t length;
+    uint32_t reserved_2;
+} TraceRecordString;
+
+/*
+ * A node of the stack table, see stack_table.h, the frame (file_id, line_number, func_id) called from the stack
+ * parent_id, 0 if this is the outermost recorded frame.
+ * A stack record always appears before the first record that uses its id.
+ */
+typedef struct {
+    uint8_t type; /* TRACE_RECORD_STACK */
+    uint8_t reserved[3];
+    uint32_t id;
+    uint32_t parent_id;
+    uint32_t file_id;
+    uint32_t func_id;
+    int32_t line_number;
+} TraceRecordStack;
+
+/*
+ * The callers of an event that passed d_rss_trigger, this immediately follows the TraceRecordEvent with the same
+ * event_number. stack_id is the innermost caller.
+ */
+typedef struct {
+    uint8_t type; /* TRACE_RECORD_EVENT_STACK */
+    uint8_t reserved[3];
+    uint32_t stack_id;
+    uint64_t event_number;
+} TraceRecordEventStack;
+
+/*
+ * The counters of the tracer's own work, indexes into TraceRecordStats.values.
+ * New counters are added at the end, readers ignore any that they do not know.
+ */
+enum TraceStatsCounter {
+    /* Events given to the tracer, events_filtered were not logged because of include and exclude. */
+    TRACE_STATS_EVENTS_SEEN,
+    TRACE_STATS_EVENTS_FILTERED,
+    /* Event records or lines written to the log, including PREV events. */
+    TRACE_STATS_EVENTS_WRITTEN,
+    /* Reads of the memory counter and the nanoseconds spent in them. */
+    TRACE_STATS_RSS_READS,
+    TRACE_STATS_RSS_NS,
+    /* Nanoseconds spent formatting and writing events, or aggregating them. */
+    TRACE_STATS_OUTPUT_NS,
+    /* Bytes of the log before any compression, not including the binary file header. */
+    TRACE_STATS_BYTES_WRITTEN,
+    /* Event records dropped because the ring buffer was full or the socket receiver fell behind. */
+    TRACE_STATS_RECORDS_DROPPED,
+    TRACE_STATS_COUNT
+};
+
+/* The names of the counters in the order of TraceStatsCounter, an array initialiser. */
+#define TRACE_STATS_NAMES { \
+    "events_seen", "events_filtered", "events_written", "rss_reads", "rss_ns", "output_ns", "bytes_written", \
+    "records_dropped" \
+}
+
+/*
+ * The last record of each segment of a log, the counters are since tracing started so the last segment has the
+ * totals. This is followed by count uint64_t values, see TraceStatsCounter.
+ * The text log has the equivalent line "STATS: events_seen=... events_filtered=... ...".
+ */
+typedef struct {
+    uint8_t type; /* TRACE_RECORD_STATS */
+    uint8_t reserved[3];
+    uint32_t count;
+    uint64_t values[TRACE_STATS_COUNT];
+} TraceRecordStats;
+
+/* Prefix of the text stats line. */
+#define TRACE_STATS_TEXT_PREFIX "STATS:"
+
+/* TraceRecordMarker.kind, what another extension recorded with the C API, see pymemtrace_capi.h. */
+enum TraceMarkerKind {
+    TRACE_MARKER_MARK = 1,
+    TRACE_MARKER_ALLOC = 2,
+    TRACE_MARKER_FREE = 3,
+    /* The resident bytes of a region registered with cPyMemTrace.add_region(), see region_residency.h. */
+    TRACE_MARKER_RESIDENT = 4,
+    /*
+     * The process was started by the process whose pid is the size, the label is how, such as "fork" or "spawn".
+     * This is the first marker of the log of a child process.
+     */
+    TRACE_MARKER_PARENT = 5,
+};
+
+/* The names of the marker kinds indexed by TraceMarkerKind, an array initialiser. */
+#define TRACE_MARKER_KIND_NAMES {"", "MARK", "ALLOC", "FREE", "RESIDENT", "PARENT"}
+#define TRACE_MARKER_KIND_COUNT 6
+
+/*
+ * A marker from another extension. It was recorded before the event event_number, at clock, by the thread thread_id
+ * which need not be the thread of this log.
+ * The text log has the equivalent line "MARK: <event> <clock> <kind> <thread_id> <size> <label>" where the label is
+ * the rest of the line, or its string id with a string table.
+ */
+typedef struct {
+    uint8_t type; /* TRACE_RECORD_MARKER */
+    uint8_t kind;
+    uint8_t reserved[2];
+    /* String table id of the label or tag. */
+    uint32_t label_id;
+    uint64_t event_number;
+    uint64_t clock;
+    uint64_t thread_id;
+    /* Bytes allocated, freed or resident, 0 for TRACE_MARKER_MARK, the parent pid for TRACE_MARKER_PARENT. */
+    int64_t size;
+} TraceRecordMarker;
+
+/* Prefix of the text marker line. */
+#define TRACE_MARKER_TEXT_PREFIX "MARK:"
+
+/* Round a record length up to the record alignment. */
+#define TRACE_RECORD_ALIGN(length) (((length) + 7) & ~((size_t)7))
+
+#endif //CPYMEMTRACE_TRACE_RECORD_H
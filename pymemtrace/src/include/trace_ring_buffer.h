@@ -0,0 +1,48 @@
+// A single producer, single consumer byte ring buffer with a background writer thread.
+// The producer is the thread being traced, it copies complete records into the buffer without taking any lock.
+// The consumer is a native thread that takes everything available in a batch and passes it to a sink function.
+// The consumer never needs the GIL.
+
+#ifndef CPYMEMTRACE_TRACE_RING_BUFFER_H
+#define CPYMEMTRACE_TRACE_RING_BUFFER_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+/*
+ * Sink for the writer thread.
+ * This is called by the writer thread with contiguous data and should return the number of bytes written.
+ */
+typedef size_t (*trace_ring_buffer_sink)(void *context, const void *data, size_t size);
+
+typedef struct {
+    unsigned char *data;
+    /* Always a power of two. */
+    size_t capacity;
+    /* Monotonically increasing byte counts, the index is (count & (capacity - 1)). */
+    size_t head; /* Only written by the producer. */
+    size_t tail; /* Only written by the consumer. */
+    trace_ring_buffer_sink sink;
+    void *sink_context;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;
+    int thread_started;
+    /* Set when a dropped record has woken the writer, cleared by the next record written. Only used by the producer. */
+    int woken_for_drop;
+    /* Statistics. */
+    size_t records_dropped;
+    size_t bytes_written;
+    size_t batches_written;
+} TraceRingBuffer;
+
+int trace_ring_buffer_open(TraceRingBuffer *ring, size_t capacity, trace_ring_buffer_sink sink, void *sink_context);
+int trace_ring_buffer_write(TraceRingBuffer *ring, const void *data, size_t size);
+int trace_ring_buffer_write_wait(TraceRingBuffer *ring, const void *data, size_t size);
+void trace_ring_buffer_flush(TraceRingBuffer *ring);
+void trace_ring_buffer_set_sink(TraceRingBuffer *ring, trace_ring_buffer_sink sink, void *sink_context);
+void trace_ring_buffer_close(TraceRingBuffer *ring);
+void trace_ring_buffer_abandon(TraceRingBuffer *ring);
+
+#endif //CPYMEMTRACE_TRACE_RING_BUFFER_H
@@ -0,0 +1,75 @@
+// Streams the binary records of cPyMemTrace, see trace_record.h, as datagrams over a UNIX domain or UDP socket.
+//
+// This is a sink for the ring buffer writer thread. Records are packed whole into datagrams of at most
+// TRACE_SOCKET_DATAGRAM_SIZE bytes, each starting with a TraceSocketHeader, so every datagram can be decoded on its
+// own. The socket is non-blocking, if a datagram can not be sent because the consumer has fallen behind, or is not
+// there, it is dropped and its event and marker records are counted in records_dropped. Its string and stack records
+// are kept and sent again at the start of the next datagram so that later events can still be named.
+
+#ifndef CPYMEMTRACE_TRACE_SOCKET_H
+#define CPYMEMTRACE_TRACE_SOCKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "trace_record.h"
+
+#define TRACE_SOCKET_MAGIC "PYMTSOCK"
+#define TRACE_SOCKET_MAGIC_LENGTH 8
+#define TRACE_SOCKET_VERSION 1
+/* Maximum size of a datagram, this fits a UNIX domain socket and UDP on the loopback interface. */
+#define TRACE_SOCKET_DATAGRAM_SIZE 8192
+
+/* The start of every datagram, records follow at header_size. */
+typedef struct {
+    char magic[TRACE_SOCKET_MAGIC_LENGTH];
+    uint32_t byte_order_mark;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t pid;
+    /* The native thread id with all_threads, otherwise 0. The stream is identified by (pid, thread_id). */
+    uint64_t thread_id;
+    /* Datagrams sent on this stream before this one, a gap means datagrams were lost after they were sent. */
+    uint64_t sequence;
+    /* Event and marker records dropped by the sender so far as the consumer or the ring buffer could not keep up. */
+    uint64_t records_dropped;
+    /* The same as the header of a binary log file, for the clock and the memory counter. */
+    TraceFileHeader file_header;
+} TraceSocketHeader;
+
+typedef struct {
+    int fd;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    /* Event records dropped elsewhere, such as by the ring buffer, that are added to records_dropped. May be NULL. */
+    const size_t *other_records_dropped;
+    /* The header of every datagram, sequence and records_dropped are filled in as each is sent. */
+    TraceSocketHeader header;
+    /* The datagram being filled, it starts with the header. */
+    size_t datagram_length;
+    unsigned char datagram[TRACE_SOCKET_DATAGRAM_SIZE];
+    /* A record split between calls to trace_socket_write(). */
+    unsigned char *partial;
+    size_t partial_length;
+    size_t partial_capacity;
+    /* String and stack records from datagrams that were dropped, to send again. */
+    unsigned char *pending;
+    size_t pending_length;
+    size_t pending_capacity;
+    /* Statistics. */
+    uint64_t records_dropped;
+    uint64_t datagrams_sent;
+    uint64_t datagrams_dropped;
+    uint64_t bytes_sent;
+} TraceSocket;
+
+int trace_socket_open(TraceSocket *sink, const struct sockaddr *address, socklen_t address_length, uint64_t thread_id);
+void trace_socket_set_file_header(TraceSocket *sink, const TraceFileHeader *file_header);
+size_t trace_socket_write(TraceSocket *sink, const void *data, size_t size);
+void trace_socket_flush(TraceSocket *sink);
+void trace_socket_close(TraceSocket *sink);
+void trace_socket_abandon(TraceSocket *sink);
+uint64_t trace_socket_records_dropped(const TraceSocket *sink);
+
+#endif //CPYMEMTRACE_TRACE_SOCKET_H
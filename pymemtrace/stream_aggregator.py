@@ -0,0 +1,417 @@
+"""
+Receives the live streams of trace events that ``cPyMemTrace`` sends with ``socket_address=...`` and aggregates them,
+keyed by process ID, so that many processes can be watched from one place.
+
+Each datagram starts with a header that identifies its stream by (PID, thread ID) and carries a sequence number, so
+lost datagrams can be counted, and the count of event and marker records the sender has dropped because this receiver
+fell behind.
+The records that follow are the same as those of a ``binary=True`` log file, see ``trace_record.h``.
+
+For example, in the receiving process:
+
+.. code-block:: python
+
+    from pymemtrace import stream_aggregator
+
+    aggregator = stream_aggregator.StreamAggregator()
+    aggregator.serve('/tmp/pymemtrace.sock', duration=60.0)
+    print(aggregator)
+
+And in each traced process:
+
+.. code-block:: python
+
+    from pymemtrace import cPyMemTrace
+
+    with cPyMemTrace.Profile(socket_address='/tmp/pymemtrace.sock'):
+        pass
+
+Or from the command line: ``python -m pymemtrace.stream_aggregator /tmp/pymemtrace.sock`` or with ``host:port`` for UDP.
+"""
+import argparse
+import logging
+import os
+import select
+import socket
+import struct
+import sys
+import time
+import typing
+
+logger = logging.getLogger(__file__)
+
+#: The magic number at the start of every datagram.
+SOCKET_MAGIC = b'PYMTSOCK'
+#: The version of the datagram header that this can read.
+SOCKET_VERSION = 1
+#: Maximum size of a datagram.
+SOCKET_DATAGRAM_SIZE = 8192
+#: Written in native byte order by the sender.
+BYTE_ORDER_MARK = 0x01020304
+#: TraceSocketHeader then TraceFileHeader.
+SOCKET_HEADER_FORMAT = '8sIIIIQQQ'
+FILE_HEADER_FORMAT = '8sIIIIQqIIQq'
+#: TraceRecordEvent, TraceRecordString, TraceRecordStack, TraceRecordEventStack, the start of TraceRecordStats
+#: which is followed by count uint64_t values, and TraceRecordMarker.
+EVENT_FORMAT = 'BBBBiIIQQQq'
+STRING_FORMAT = 'B3xIII'
+STACK_FORMAT = 'B3xIIIIi'
+EVENT_STACK_FORMAT = 'B3xIQ'
+STATS_FORMAT = 'B3xI'
+MARKER_FORMAT = 'BB2xIQQQq'
+RECORD_EVENT = 1
+RECORD_STRING = 2
+RECORD_STACK = 3
+RECORD_EVENT_STACK = 4
+RECORD_STATS = 5
+RECORD_MARKER = 6
+#: Names of the TraceRecordMarker.kind values.
+MARKER_KIND_NAMES = ('', 'MARK', 'ALLOC', 'FREE', 'RESIDENT', 'PARENT')
+#: Names of the TraceRecordStats values, as ``stats()`` of the cPyMemTrace tracers.
+STATS_NAMES = (
+    'events_seen', 'events_filtered', 'events_written', 'rss_reads', 'rss_ns', 'output_ns', 'bytes_written',
+    'records_dropped',
+)
+#: Names of the TraceRecordEvent.what values, as in the text log files.
+WHAT_NAMES = ('CALL', 'EXCEPT', 'LINE', 'RETURN', 'C_CALL', 'C_EXCEPT', 'C_RETURN', 'OPCODE')
+
+
+class StreamEvent(typing.NamedTuple):
+    """A trace event decoded from a stream."""
+    pid: int
+    thread_id: int
+    event_number: int
+    #: Seconds since the traced process started the log.
+    clock: float
+    what: str
+    file: str
+    line: int
+    function: str
+    rss: int
+    d_rss: int
+    #: With ``stack_depth`` the (file, line, function) of the callers of an event that passed ``d_rss_trigger``,
+    #: innermost first.
+    stack: typing.Tuple[typing.Tuple[str, int, str], ...] = ()
+
+
+class Stream:
+    """The state of one stream, that is the log of one thread of one process."""
+
+    def __init__(self, pid: int, thread_id: int):
+        self.pid = pid
+        self.thread_id = thread_id
+        self.strings: typing.Dict[int, str] = {}
+        #: Stack id to (parent stack id, file, line, function).
+        self.stacks: typing.Dict[int, typing.Tuple[int, str, int, str]] = {}
+        self.datagrams = 0
+        #: Datagrams that were sent but not received, from gaps in the sequence numbers.
+        self.datagrams_lost = 0
+        #: Event and marker records the sender dropped because it could not send them.
+        self.records_dropped = 0
+        self.events = 0
+        self.last_rss = 0
+        self.peak_rss = 0
+        #: (file, function) to the sum of the positive RSS changes of its events.
+        self.d_rss_by_function: typing.Dict[typing.Tuple[str, str], int] = {}
+        #: The stats of the tracer, sent when it closes, empty until then.
+        self.stats: typing.Dict[str, int] = {}
+        #: Markers from other extensions and the bytes that they have allocated less those freed, by tag.
+        self.markers = 0
+        self.native_bytes_by_tag: typing.Dict[str, int] = {}
+        #: The last resident bytes of each region registered with ``cPyMemTrace.add_region()``, by label.
+        self.resident_bytes_by_region: typing.Dict[str, int] = {}
+        #: From the PARENT marker of a worker, see ``pymemtrace.workers``, the PID of its parent and how it was started.
+        #: 0 and '' if there is no PARENT marker.
+        self.parent_pid = 0
+        self.how = ''
+        self.last_received = 0.0
+        self._next_sequence = 0
+
+    def update_sequence(self, sequence: int) -> None:
+        if sequence > self._next_sequence:
+            self.datagrams_lost += sequence - self._next_sequence
+        self._next_sequence = max(self._next_sequence, sequence + 1)
+
+    def stack(self, stack_id: int) -> typing.Tuple[typing.Tuple[str, int, str], ...]:
+        """The (file, line, function) of each frame of the stack, innermost first."""
+        frames = []
+        while stack_id in self.stacks and len(frames) <= len(self.stacks):
+            stack_id, file, line, function = self.stacks[stack_id]
+            frames.append((file, line, function))
+        return tuple(frames)
+
+    def add_event(self, event: StreamEvent) -> None:
+        self.events += 1
+        self.last_rss = event.rss
+        self.peak_rss = max(self.peak_rss, event.rss)
+        if event.d_rss > 0:
+            key = (event.file, event.function)
+            self.d_rss_by_function[key] = self.d_rss_by_function.get(key, 0) + event.d_rss
+
+    def __str__(self) -> str:
+        return (
+            f'Stream PID={self.pid} thread={self.thread_id}: events={self.events} RSS={self.last_rss}'
+            f' peak={self.peak_rss} datagrams={self.datagrams} lost={self.datagrams_lost}'
+            f' dropped={self.records_dropped}'
+        )
+
+
+class StreamAggregator:
+    """
+    Decodes datagrams and aggregates them by stream, :py:meth:`by_pid` groups the streams by process.
+    If ``keep_events`` is True every :py:class:`StreamEvent` is kept in ``self.events``.
+    """
+
+    def __init__(self, keep_events: bool = False):
+        self.keep_events = keep_events
+        self.events: typing.List[StreamEvent] = []
+        self.streams: typing.Dict[typing.Tuple[int, int], Stream] = {}
+        #: Datagrams that were not from cPyMemTrace.
+        self.datagrams_rejected = 0
+
+    def feed(self, datagram: bytes) -> typing.List[StreamEvent]:
+        """Decode one datagram and return its events. Raises ValueError if it is not a cPyMemTrace datagram or a record
+        in it is malformed."""
+        header_size = struct.calcsize('=' + SOCKET_HEADER_FORMAT) + struct.calcsize('=' + FILE_HEADER_FORMAT)
+        if len(datagram) < header_size or datagram[:len(SOCKET_MAGIC)] != SOCKET_MAGIC:
+            self.datagrams_rejected += 1
+            raise ValueError(f'Not a cPyMemTrace datagram of {len(datagram)} bytes.')
+        for byte_order in ('<', '>'):
+            if struct.unpack_from(byte_order + 'I', datagram, len(SOCKET_MAGIC))[0] == BYTE_ORDER_MARK:
+                break
+        else:
+            self.datagrams_rejected += 1
+            raise ValueError('Unknown byte order.')
+        (_magic, _bom, version, record_offset, pid, thread_id, sequence, records_dropped) = struct.unpack_from(
+            byte_order + SOCKET_HEADER_FORMAT, datagram, 0
+        )
+        if version != SOCKET_VERSION or record_offset < header_size or record_offset > len(datagram):
+            self.datagrams_rejected += 1
+            raise ValueError(f'Unsupported datagram version {version} header size {record_offset}.')
+        file_header = struct.unpack_from(
+            byte_order + FILE_HEADER_FORMAT, datagram, struct.calcsize(byte_order + SOCKET_HEADER_FORMAT)
+        )
+        clock_ticks_per_second = file_header[5] or 1
+        clock_anchor_ticks = file_header[9]
+        key = (pid, thread_id)
+        stream = self.streams.get(key)
+        if stream is None:
+            stream = Stream(pid, thread_id)
+            self.streams[key] = stream
+        stream.datagrams += 1
+        stream.last_received = time.time()
+        stream.update_sequence(sequence)
+        stream.records_dropped = max(stream.records_dropped, records_dropped)
+        event_struct = struct.Struct(byte_order + EVENT_FORMAT)
+        string_struct = struct.Struct(byte_order + STRING_FORMAT)
+        stack_struct = struct.Struct(byte_order + STACK_FORMAT)
+        event_stack_struct = struct.Struct(byte_order + EVENT_STACK_FORMAT)
+        stats_struct = struct.Struct(byte_order + STATS_FORMAT)
+        marker_struct = struct.Struct(byte_order + MARKER_FORMAT)
+        events = []
+        offset = record_offset
+        try:
+            while offset + string_struct.size <= len(datagram):
+                record_type = datagram[offset]
+                if record_type == RECORD_STRING:
+                    _type, string_id, length, _reserved = string_struct.unpack_from(datagram, offset)
+                    start = offset + string_struct.size
+                    stream.strings[string_id] = datagram[start:start + length].decode('utf-8', 'replace')
+                    offset = start + ((length + 7) & ~7)
+                elif record_type == RECORD_EVENT and offset + event_struct.size <= len(datagram):
+                    (_type, what, _flags, _reserved, line, file_id, func_id, event_number, clock, rss,
+                     d_rss) = event_struct.unpack_from(datagram, offset)
+                    # Signed as time stamp counters of different cores may be slightly out of step.
+                    event = StreamEvent(
+                        pid, thread_id, event_number, (clock - clock_anchor_ticks) / clock_ticks_per_second,
+                        WHAT_NAMES[what] if what < len(WHAT_NAMES) else str(what),
+                        stream.strings.get(file_id, f'<string {file_id}>'), line,
+                        stream.strings.get(func_id, f'<string {func_id}>'), rss, d_rss,
+                    )
+                    stream.add_event(event)
+                    events.append(event)
+                    offset += event_struct.size
+                elif record_type == RECORD_STACK and offset + stack_struct.size <= len(datagram):
+                    _type, stack_id, parent_id, file_id, func_id, line = stack_struct.unpack_from(datagram, offset)
+                    stream.stacks[stack_id] = (
+                        parent_id, stream.strings.get(file_id, f'<string {file_id}>'), line,
+                        stream.strings.get(func_id, f'<string {func_id}>'),
+                    )
+                    offset += stack_struct.size
+                elif record_type == RECORD_EVENT_STACK and offset + event_stack_struct.size <= len(datagram):
+                    _type, stack_id, event_number = event_stack_struct.unpack_from(datagram, offset)
+                    # This follows its event, which may have been dropped.
+                    if events and events[-1].event_number == event_number:
+                        events[-1] = events[-1]._replace(stack=stream.stack(stack_id))
+                    offset += event_stack_struct.size
+                elif record_type == RECORD_STATS and (
+                    offset + stats_struct.size + 8 * stats_struct.unpack_from(datagram, offset)[1] <= len(datagram)
+                ):
+                    _type, count = stats_struct.unpack_from(datagram, offset)
+                    values = struct.unpack_from(f'{byte_order}{count}Q', datagram, offset + stats_struct.size)
+                    # A later version may have more values than there are names.
+                    stream.stats = dict(zip(STATS_NAMES, values))
+                    offset += stats_struct.size + 8 * count
+                elif record_type == RECORD_MARKER and offset + marker_struct.size <= len(datagram):
+                    (_type, kind, label_id, _event_number, _clock, _thread_id,
+                     size) = marker_struct.unpack_from(datagram, offset)
+                    stream.markers += 1
+                    kind_name = MARKER_KIND_NAMES[kind] if kind < len(MARKER_KIND_NAMES) else ''
+                    if kind_name in ('ALLOC', 'FREE'):
+                        tag = stream.strings.get(label_id, f'<string {label_id}>')
+                        stream.native_bytes_by_tag[tag] = stream.native_bytes_by_tag.get(tag, 0) + (
+                            size if kind_name == 'ALLOC' else -size
+                        )
+                    elif kind_name == 'RESIDENT':
+                        stream.resident_bytes_by_region[stream.strings.get(label_id, f'<string {label_id}>')] = size
+                    elif kind_name == 'PARENT':
+                        stream.parent_pid = size
+                        stream.how = stream.strings.get(label_id, f'<string {label_id}>')
+                    offset += marker_struct.size
+                else:
+                    logger.warning(
+                        'Unknown or truncated record type %d at %d in a datagram from PID %d', record_type, offset, pid
+                    )
+                    break
+        except struct.error as err:
+            raise ValueError(f'Malformed record at {offset} in a datagram from PID {pid}: {err}') from err
+        if self.keep_events:
+            self.events.extend(events)
+        return events
+
+    def by_pid(self) -> typing.Dict[int, typing.List[Stream]]:
+        """The streams of each process, by PID."""
+        result: typing.Dict[int, typing.List[Stream]] = {}
+        for (pid, _thread_id), stream in sorted(self.streams.items()):
+            result.setdefault(pid, []).append(stream)
+        return result
+
+    def top_functions(self, pid: int, n: int = 10) -> typing.List[typing.Tuple[str, str, int]]:
+        """The (file, function, d_rss) with the largest positive RSS changes in the process pid, largest first."""
+        totals: typing.Dict[typing.Tuple[str, str], int] = {}
+        for stream in self.by_pid().get(pid, []):
+            for key, value in stream.d_rss_by_function.items():
+                totals[key] = totals.get(key, 0) + value
+        ordered = sorted(totals.items(), key=lambda item: item[1], reverse=True)
+        return [(file, function, d_rss) for (file, function), d_rss in ordered[:n]]
+
+    def serve(self, sock_or_address, duration: typing.Optional[float] = None,
+              max_datagrams: typing.Optional[int] = None, timeout: float = 0.1) -> int:
+        """
+        Receive and feed datagrams from a bound socket, or an address for :py:func:`open_socket`, until ``duration``
+        seconds have passed or ``max_datagrams`` have been received. Returns the number of datagrams received.
+        If neither a duration nor a maximum is given this runs until interrupted.
+        """
+        if isinstance(sock_or_address, socket.socket):
+            sock = sock_or_address
+            own_socket = False
+        else:
+            sock = open_socket(sock_or_address)
+            own_socket = True
+        received = 0
+        t_end = None if duration is None else time.monotonic() + duration
+        try:
+            while max_datagrams is None or received < max_datagrams:
+                wait = timeout if t_end is None else max(0.0, min(timeout, t_end - time.monotonic()))
+                readable, _, _ = select.select([sock], [], [], wait)
+                if readable:
+                    datagram = sock.recv(SOCKET_DATAGRAM_SIZE)
+                    received += 1
+                    try:
+                        self.feed(datagram)
+                    except ValueError as err:
+                        logger.warning(str(err))
+                elif t_end is not None and time.monotonic() >= t_end:
+                    break
+        finally:
+            if own_socket:
+                close_socket(sock)
+        return received
+
+    def __str__(self) -> str:
+        lines = []
+        for pid, streams in self.by_pid().items():
+            lines.append(
+                f'PID {pid}: threads={len(streams)} events={sum(s.events for s in streams)}'
+                f' RSS={sum(s.last_rss for s in streams) // len(streams)}'
+                f' lost={sum(s.datagrams_lost for s in streams)} dropped={sum(s.records_dropped for s in streams)}'
+            )
+            for stream in streams:
+                lines.append(f'    {stream}')
+            for file, function, d_rss in self.top_functions(pid, 5):
+                lines.append(f'    {d_rss:12d} {function} {file}')
+        if self.datagrams_rejected:
+            lines.append(f'Rejected datagrams: {self.datagrams_rejected}')
+        return '\n'.join(lines)
+
+
+def open_socket(address, receive_buffer_size: int = 4 * 1024 * 1024) -> socket.socket:
+    """
+    Create and bind a datagram socket to receive streams. The address is a path for a UNIX domain socket, which is
+    removed by :py:func:`close_socket`, or a (host, port) tuple for UDP.
+    """
+    if isinstance(address, tuple):
+        family = socket.getaddrinfo(address[0], address[1], socket.AF_UNSPEC, socket.SOCK_DGRAM)[0][0]
+        sock = socket.socket(family, socket.SOCK_DGRAM)
+    else:
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+    try:
+        # A large receive buffer means fewer dropped records when the senders are bursty.
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, receive_buffer_size)
+        sock.bind(address)
+    except OSError:
+        sock.close()
+        raise
+    return sock
+
+
+def close_socket(sock: socket.socket) -> None:
+    """Close a socket from :py:func:`open_socket`, removing the path of a UNIX domain socket."""
+    path = sock.getsockname() if sock.family == socket.AF_UNIX else None
+    sock.close()
+    if isinstance(path, str) and path and os.path.exists(path):
+        os.unlink(path)
+
+
+def parse_address(text: str):
+    """A path for a UNIX domain socket unless it is ``host:port``."""
+    host, _, port = text.rpartition(':')
+    if host and port.isdigit() and os.sep not in text:
+        return host, int(port)
+    return text
+
+
+def main() -> int:
+    """Receive streams and print the summary at an interval."""
+    parser = argparse.ArgumentParser(
+        description='Aggregates the live streams from cPyMemTrace socket_address=...',
+    )
+    parser.add_argument('address', type=str, help='Path of a UNIX domain socket or host:port for UDP.')
+    parser.add_argument('-d', '--duration', type=float, default=None,
+                        help='Seconds to receive for, default is until interrupted.')
+    parser.add_argument('-i', '--interval', type=float, default=1.0,
+                        help='Seconds between summaries [default: %(default)s]')
+    parser.add_argument("-l", "--log_level", type=int, dest="log_level", default=20,
+                        help="Log Level (debug=10, info=20, warning=30, error=40, critical=50)"
+                             " [default: %(default)s]"
+                        )
+    args = parser.parse_args()
+    logging.basicConfig(level=args.log_level, stream=sys.stdout)
+    aggregator = StreamAggregator()
+    sock = open_socket(parse_address(args.address))
+    t_end = None if args.duration is None else time.monotonic() + args.duration
+    try:
+        while t_end is None or time.monotonic() < t_end:
+            interval = args.interval if t_end is None else min(args.interval, max(0.0, t_end - time.monotonic()))
+            aggregator.serve(sock, duration=interval)
+            print(aggregator)
+            print()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        close_socket(sock)
+    return 0
+
+
+if __name__ == '__main__':  # pragma: no cover
+    sys.exit(main())
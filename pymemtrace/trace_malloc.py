@@ -8,6 +8,11 @@ import tracemalloc
 
 import typing
 
+try:
+    from pymemtrace import cTraceMalloc
+except ImportError:  # pragma: no cover
+    cTraceMalloc = None
+
 
 class TraceMalloc:
     """A wrapper around the tracemalloc module that can compensate for tracemalloc's memory usage."""
@@ -16,13 +21,25 @@ class TraceMalloc:
     TRACE_ON = True
     ALLOWED_GRANULARITY = ('filename', 'lineno', 'traceback')
 
-    def __init__(self, statistics_granularity: str = 'lineno'):
-        """statistics_granularity can be 'filename', 'lineno' or 'traceback'."""
+    def __init__(self, statistics_granularity: str = 'lineno', native: typing.Optional[bool] = False,
+                 limit: typing.Optional[int] = None):
+        """statistics_granularity can be 'filename', 'lineno' or 'traceback'.
+
+        If native is True the difference is computed by ``cTraceMalloc.SnapshotDiff`` which walks the traces without
+        taking snapshots and skips tracemalloc's own frames as it does so. The snapshot attributes are then None.
+        None uses it if it is available.
+
+        limit is the number of statistics to keep, largest change first, None keeps all of them.
+        The diff is always over all of them."""
         if statistics_granularity not in self.ALLOWED_GRANULARITY:
             raise ValueError(
                 f'statistics_granularity must be in {self.ALLOWED_GRANULARITY} not {statistics_granularity}'
             )
+        if native and cTraceMalloc is None:
+            raise ValueError('native needs the cTraceMalloc extension')
         self.statistics_granularity = statistics_granularity
+        self.native = cTraceMalloc is not None if native is None else native
+        self.limit = limit
         if self.TRACE_ON:
             if not tracemalloc.is_tracing():
                 tracemalloc.start()
@@ -32,22 +49,42 @@ class TraceMalloc:
             self.memory_finish: typing.Optional[int] = None
             self.statistics: typing.List[tracemalloc.StatisticDiff] = []
             self._diff: typing.Optional[int] = None
+            self._size_diff: typing.Optional[int] = None
+            self._snapshot_diff = None
 
     def __enter__(self):
-        """Take a tracemalloc snapshot."""
+        """Take a tracemalloc snapshot, or walk the traces if native."""
         if self.TRACE_ON:
-            self.tracemalloc_snapshot_start = tracemalloc.take_snapshot()
+            if self.native:
+                self._snapshot_diff = cTraceMalloc.SnapshotDiff(self.statistics_granularity)
+                self._snapshot_diff.start()
+            else:
+                self.tracemalloc_snapshot_start = tracemalloc.take_snapshot()
             self.memory_start = tracemalloc.get_tracemalloc_memory()
         return self
 
     def __exit__(self, exc_type, exc_val, exc_tb):
-        """Take a tracemalloc snapshot and subtract the initial snapshot. Also note the tracemalloc memory usage."""
+        """Take a tracemalloc snapshot and subtract the initial snapshot, or walk the traces again if native.
+        Also note the tracemalloc memory usage."""
         if self.TRACE_ON:
-            self.tracemalloc_snapshot_finish = tracemalloc.take_snapshot()
-            self.memory_finish = tracemalloc.get_tracemalloc_memory()
-            self.statistics = self.tracemalloc_snapshot_finish.compare_to(
-                self.tracemalloc_snapshot_start, self.statistics_granularity
-            )
+            if self.native:
+                self._snapshot_diff.finish()
+                self.memory_finish = tracemalloc.get_tracemalloc_memory()
+                self._size_diff = self._snapshot_diff.size_diff
+                self.statistics = [
+                    tracemalloc.StatisticDiff(tracemalloc.Traceback(frames), *values)
+                    for frames, *values in self._snapshot_diff.statistics(-1 if self.limit is None else self.limit)
+                ]
+                self._snapshot_diff = None
+            else:
+                self.tracemalloc_snapshot_finish = tracemalloc.take_snapshot()
+                self.memory_finish = tracemalloc.get_tracemalloc_memory()
+                self.statistics = self.tracemalloc_snapshot_finish.compare_to(
+                    self.tracemalloc_snapshot_start, self.statistics_granularity
+                )
+                self._size_diff = sum(s.size_diff for s in self.statistics)
+                if self.limit is not None:
+                    self.statistics = self.statistics[:self.limit]
             self._diff = None
         return False
 
@@ -62,7 +99,7 @@ class TraceMalloc:
         """The net memory usage difference recorded by tracemalloc allowing for the memory usage of tracemalloc."""
         if self.TRACE_ON:
             if self._diff is None:
-                self._diff = sum(s.size_diff for s in self.statistics) - self.tracemalloc_memory_usage
+                self._diff = self._size_diff - self.tracemalloc_memory_usage
             return self._diff
         return -sys.maxsize - 1
 
@@ -78,11 +115,12 @@ class TraceMalloc:
 
 def trace_malloc_log(log_level: int):
     """Decorator that logs the decorated function the use of Python memory in bytes at the desired log level.
-    This can be switched to a NOP by setting TraceMalloc.TRACE_ON to False."""
+    This can be switched to a NOP by setting TraceMalloc.TRACE_ON to False.
+    No statistics are kept, only the diff, and the native diff is used if available."""
     def memory_inner(fn):
         @functools.wraps(fn)
         def wrapper(*args, **kwargs):
-            with TraceMalloc() as tm:
+            with TraceMalloc(native=None, limit=0) as tm:
                 result = fn(*args, ** kwargs)
             logging.log(log_level, f'TraceMalloc memory delta: {tm.diff:,d} for "{fn.__name__}()"')
             return result
@@ -0,0 +1,159 @@
+"""
+Traces the workers of ``multiprocessing`` with ``cPyMemTrace``, each worker writes its own log file named with its pid.
+
+For example:
+
+.. code-block:: python
+
+    import multiprocessing
+
+    from pymemtrace import workers
+
+    workers.trace_workers('Profile', binary=True)
+    with multiprocessing.get_context('spawn').Pool(4) as pool:
+        pool.map(work, range(100))
+
+A worker started with the spawn or forkserver start method is sent the tracer with its preparation data and starts it
+before the target is run, pymemtrace must be importable by the worker. With the fork start method a worker of a process
+that is tracing already has its own log file, see ``os.fork()`` in the ``cPyMemTrace`` documentation, otherwise the
+tracer is started. Either way the log of each worker starts with a PARENT marker and is closed when the worker exits,
+although ``multiprocessing`` ends workers with ``os._exit()``.
+
+The logs of a process and its workers can be merged into one timeline with ``pymemtrace.merge_logs``.
+"""
+import logging
+import os
+import sys
+import typing
+
+from multiprocessing import spawn
+from multiprocessing import util
+
+from pymemtrace import cPyMemTrace
+
+logger = logging.getLogger(__file__)
+
+#: The cPyMemTrace tracers that can be used.
+TRACERS = ('Profile', 'Trace', 'Monitor')
+
+#: Key of the preparation data that spawn and forkserver send to a new worker.
+PREPARATION_DATA_KEY = 'pymemtrace_workers'
+
+
+class _WorkerTracing:
+    """The tracer and its arguments for workers. This is pickled into the preparation data of spawned workers."""
+
+    def __init__(self, tracer: str, kwargs: typing.Dict[str, typing.Any], parent_pid: int = 0, how: str = ''):
+        self.tracer = tracer
+        self.kwargs = kwargs
+        # Set for a worker that is sent this, a forked worker has these from getppid() and "fork".
+        self.parent_pid = parent_pid
+        self.how = how
+
+    def __getstate__(self):
+        return self.tracer, self.kwargs, self.parent_pid, self.how
+
+    def __setstate__(self, state):
+        # This is unpickled by a spawned worker before it is prepared, its sys.path and working directory are not yet
+        # those of the parent, so the tracer is started once spawn.prepare() has done that.
+        global _spawned_tracing, _original_prepare
+        self.tracer, self.kwargs, self.parent_pid, self.how = state
+        _spawned_tracing = self
+        if _original_prepare is None:
+            _original_prepare = spawn.prepare
+            spawn.prepare = _prepare
+
+
+#: The tracing of workers by this process, None if trace_workers() has not been called.
+_worker_tracing: typing.Optional[_WorkerTracing] = None
+#: The tracing sent to this process by its parent if it was spawned.
+_spawned_tracing: typing.Optional[_WorkerTracing] = None
+#: The tracer started by _start_worker() in this worker, it is attached until the worker exits.
+_worker_tracer = None
+_original_get_preparation_data = None
+_original_prepare = None
+
+
+def _get_preparation_data(name):
+    """Replaces multiprocessing.spawn.get_preparation_data() to add the tracing of the new worker."""
+    data = _original_get_preparation_data(name)
+    if _worker_tracing is not None:
+        # The start method in the data is the default one, not necessarily that of the context starting this worker.
+        caller = sys._getframe(1).f_globals.get('__name__')
+        how = 'forkserver' if caller == 'multiprocessing.popen_forkserver' else 'spawn'
+        data[PREPARATION_DATA_KEY] = _WorkerTracing(_worker_tracing.tracer, _worker_tracing.kwargs, os.getpid(), how)
+    return data
+
+
+def _prepare(data):
+    """Replaces multiprocessing.spawn.prepare() in a spawned worker, this is called before the process target is
+    unpickled and run."""
+    spawn.prepare = _original_prepare
+    _original_prepare(data)
+    _start_worker(_spawned_tracing)
+
+
+def _exit_function(*args, **kwargs):
+    """Replaces multiprocessing.util._exit_function() in a worker to close the log at the end."""
+    global _worker_tracer
+    try:
+        _original_exit_function(*args, **kwargs)
+    finally:
+        if _worker_tracer is not None:
+            _worker_tracer.__exit__(None, None, None)
+            _worker_tracer = None
+        # A forked worker may be tracing with its parent's tracer.
+        cPyMemTrace._detach_all()
+
+
+_original_exit_function = util._exit_function
+
+
+def _start_worker(worker_tracing: _WorkerTracing) -> None:
+    """Start tracing in a worker process before the process target is run."""
+    global _worker_tracer
+    if cPyMemTrace.is_tracing():
+        # A fork of a process that is tracing, the log was opened and marked in the child by cPyMemTrace.
+        logger.debug('Worker %d is already tracing.', os.getpid())
+    else:
+        _worker_tracer = getattr(cPyMemTrace, worker_tracing.tracer)(**worker_tracing.kwargs)
+        _worker_tracer.__enter__()
+        cPyMemTrace.mark_parent(worker_tracing.parent_pid or os.getppid(), worker_tracing.how or 'fork')
+    # The workers of this worker are traced the same way.
+    _install(_WorkerTracing(worker_tracing.tracer, worker_tracing.kwargs))
+    # Process._bootstrap() calls this for every start method and then ends the worker with os._exit().
+    util._exit_function = _exit_function
+
+
+def _install(worker_tracing: _WorkerTracing) -> None:
+    global _worker_tracing, _original_get_preparation_data
+    if _original_get_preparation_data is None:
+        _original_get_preparation_data = spawn.get_preparation_data
+        spawn.get_preparation_data = _get_preparation_data
+    _worker_tracing = worker_tracing
+    # This keeps the registration, which is weak, for workers started with fork.
+    util.register_after_fork(_worker_tracing, _start_worker)
+
+
+def trace_workers(tracer: str = 'Profile', **kwargs) -> None:
+    """Trace the multiprocessing workers started after this with ``cPyMemTrace.<tracer>(**kwargs)``.
+
+    kwargs are the arguments of the tracer, they must be picklable. ``file`` can not be used as each worker has its own
+    log file. Calling this again replaces the tracer for workers started after that."""
+    if tracer not in TRACERS or not hasattr(cPyMemTrace, tracer):
+        raise ValueError(f'tracer must be one of {[t for t in TRACERS if hasattr(cPyMemTrace, t)]} not "{tracer}"')
+    if 'file' in kwargs:
+        raise ValueError('file can not be used for workers, each worker writes its own log file.')
+    # Check the arguments here rather than in each worker.
+    getattr(cPyMemTrace, tracer)(**kwargs)
+    _install(_WorkerTracing(tracer, dict(kwargs)))
+
+
+def untrace_workers() -> None:
+    """Workers started after this are not traced, unless they are forked from a process that is tracing."""
+    global _worker_tracing, _original_get_preparation_data
+    if _original_get_preparation_data is not None:
+        spawn.get_preparation_data = _original_get_preparation_data
+        _original_get_preparation_data = None
+    # This also drops the after fork registration.
+    _worker_tracing = None
@@ -108,8 +108,19 @@ setup(
         Extension(
             "pymemtrace.cPyMemTrace",
             sources=[
+              'pymemtrace/src/c/call_site_table.c',
               'pymemtrace/src/c/get_rss.c',
+              'pymemtrace/src/c/pointer_map.c',
+              'pymemtrace/src/c/pymemtrace_clock.c',
               'pymemtrace/src/c/pymemtrace_util.c',
+              'pymemtrace/src/c/region_residency.c',
+              'pymemtrace/src/c/stack_table.c',
+              'pymemtrace/src/c/trace_compress.c',
+              'pymemtrace/src/c/trace_filter.c',
+              'pymemtrace/src/c/trace_mapped_file.c',
+              'pymemtrace/src/c/trace_marker_queue.c',
+              'pymemtrace/src/c/trace_ring_buffer.c',
+              'pymemtrace/src/c/trace_socket.c',
               'pymemtrace/src/cpy/cPyMemTrace.c',
             ],
             include_dirs=[
@@ -117,6 +128,80 @@ setup(
                 os.path.join('pymemtrace', 'src', 'include'),
             ],
             library_dirs=[os.getcwd(), ],  # path to .a or .so file(s)
+            libraries=['z'],
+            extra_compile_args=extra_compile_args,
+        ),
+        Extension(
+            "pymemtrace.cTraceReader",
+            sources=[
+              'pymemtrace/src/c/get_rss.c',
+              'pymemtrace/src/c/pymemtrace_clock.c',
+              'pymemtrace/src/c/trace_compress.c',
+              'pymemtrace/src/cpy/cTraceReader.c',
+            ],
+            include_dirs=[
+                '/usr/local/include',
+                os.path.join('pymemtrace', 'src', 'include'),
+            ],
+            library_dirs=[os.getcwd(), ],  # path to .a or .so file(s)
+            libraries=['z'],
+            extra_compile_args=extra_compile_args,
+        ),
+        Extension(
+            "pymemtrace.cMallocTrace",
+            sources=[
+              'pymemtrace/src/c/allocation_table.c',
+              'pymemtrace/src/c/malloc_trace_buffer.c',
+              'pymemtrace/src/c/pointer_map.c',
+              'pymemtrace/src/c/pymemtrace_util.c',
+              'pymemtrace/src/cpy/cMallocTrace.c',
+            ],
+            include_dirs=[
+                '/usr/local/include',
+                os.path.join('pymemtrace', 'src', 'include'),
+            ],
+            library_dirs=[os.getcwd(), ],  # path to .a or .so file(s)
+            extra_compile_args=extra_compile_args,
+        ),
+        Extension(
+            "pymemtrace.cProcessSampler",
+            sources=[
+              'pymemtrace/src/c/process_sampler.c',
+              'pymemtrace/src/cpy/cProcessSampler.c',
+            ],
+            include_dirs=[
+                '/usr/local/include',
+                os.path.join('pymemtrace', 'src', 'include'),
+            ],
+            library_dirs=[os.getcwd(), ],  # path to .a or .so file(s)
+            extra_compile_args=extra_compile_args,
+        ),
+        Extension(
+            "pymemtrace.cTraceMalloc",
+            sources=[
+              'pymemtrace/src/c/pointer_map.c',
+              'pymemtrace/src/c/trace_diff_table.c',
+              'pymemtrace/src/cpy/cTraceMalloc.c',
+            ],
+            include_dirs=[
+                '/usr/local/include',
+                os.path.join('pymemtrace', 'src', 'include'),
+            ],
+            library_dirs=[os.getcwd(), ],  # path to .a or .so file(s)
+            extra_compile_args=extra_compile_args,
+        ),
+        Extension(
+            "pymemtrace.cDebugMallocStats",
+            sources=[
+              'pymemtrace/src/c/pymalloc_arenas.c',
+              'pymemtrace/src/c/pymalloc_stats.c',
+              'pymemtrace/src/cpy/cDebugMallocStats.c',
+            ],
+            include_dirs=[
+                '/usr/local/include',
+                os.path.join('pymemtrace', 'src', 'include'),
+            ],
+            library_dirs=[os.getcwd(), ],  # path to .a or .so file(s)
             extra_compile_args=extra_compile_args,
         ),
         Extension(
@@ -128,6 +213,7 @@ setup(
                 '/usr/local/include',
                 # os.path.join('pymemtrace', 'src', 'include'),
             ],
+            libraries=['m'],
             library_dirs=[os.getcwd(), ],  # path to .a or .so file(s)
             extra_compile_args=extra_compile_args,
         ),
@@ -0,0 +1,122 @@
+import collections
+
+import pytest
+
+from pymemtrace import arena_fragmentation
+from pymemtrace.util import gnuplot
+
+has_pools = pytest.mark.skipif(
+    arena_fragmentation.cDebugMallocStats is None or not arena_fragmentation.cDebugMallocStats.HAS_POOLS,
+    reason='No cDebugMallocStats.pools()'
+)
+
+#: Four pools per arena, 16 byte blocks have a capacity of 253 and 32 byte blocks 126.
+EXAMPLE_POOLS = {
+    'pool_size': 4096,
+    'arena_size': 4 * 4096,
+    'alignment': 16,
+    'pool_overhead': 48,
+    'pools': [
+        # address, arena_index, size_class, blocks_in_use, capacity
+        (0x10000, 0, 0, 10, 253),
+        (0x11000, 0, 1, 126, 126),
+        (0x12000, 0, 1, 0, 126),
+        (0x20000, 1, 0, 5, 253),
+        (0x30000, 2, 1, 100, 126),
+    ],
+}
+
+
+def test_arena_fragmentation_example_arenas():
+    fragmentation = arena_fragmentation.ArenaFragmentation(EXAMPLE_POOLS)
+    assert list(fragmentation.arenas) == [0, 1, 2]
+    arena = fragmentation.arenas[0]
+    assert (arena.pools_used, arena.pools_full, arena.pools_empty) == (1, 1, 2)
+    assert arena.blocks_in_use == 136
+    assert arena.pinned_by() == [0, 1]
+    assert arena.size_classes() == {0: (1, 10, 253), 1: (1, 126, 126)}
+    assert arena.address == 0x10000
+
+
+def test_arena_fragmentation_example_capacity():
+    fragmentation = arena_fragmentation.ArenaFragmentation(EXAMPLE_POOLS)
+    assert fragmentation.capacity(0) == 253
+    assert fragmentation.capacity(1) == 126
+    assert fragmentation.block_size(1) == 32
+
+
+@pytest.mark.parametrize(
+    'size_classes, expected',
+    (
+        ((), 0),
+        ((0,), 4096),
+        ((1,), 0),
+        ((0, 1), 4096),
+    ),
+)
+def test_arena_fragmentation_example_reclaimable_pool_bytes(size_classes, expected):
+    fragmentation = arena_fragmentation.ArenaFragmentation(EXAMPLE_POOLS)
+    assert fragmentation.reclaimable_pool_bytes(size_classes) == expected
+
+
+@pytest.mark.parametrize(
+    'size_classes, expected',
+    (
+        ((), 0),
+        # Arena 1 moves into the pool of 16 byte blocks in arena 0.
+        ((0,), 4 * 4096),
+        # Arena 2 moves into an empty pool in arena 0.
+        ((1,), 4 * 4096),
+        # Arenas 1 and 2, then arena 0 has no room to go to.
+        ((0, 1), 2 * 4 * 4096),
+    ),
+)
+def test_arena_fragmentation_example_reclaimable_arena_bytes(size_classes, expected):
+    fragmentation = arena_fragmentation.ArenaFragmentation(EXAMPLE_POOLS)
+    assert fragmentation.reclaimable_arena_bytes(size_classes) == expected
+
+
+def test_arena_fragmentation_example_occupancy_table():
+    fragmentation = arena_fragmentation.ArenaFragmentation(EXAMPLE_POOLS)
+    table = fragmentation.occupancy_table()
+    assert table[0][0] == '#Position'
+    # Three arenas by two size classes.
+    assert len(table) == 1 + 3 * 2
+    assert table[1] == [0, 0, '0.040', 0, 1, 10]
+    assert table[4] == [1, 1, 'NaN', 1, 0, 0]
+    # Rectangular so it can be written.
+    assert gnuplot.create_gnuplot_dat(table)
+
+
+def test_arena_fragmentation_example_arena_table():
+    fragmentation = arena_fragmentation.ArenaFragmentation(EXAMPLE_POOLS)
+    assert fragmentation.arena_table()[1:] == [[0, 1, 1, 2, 136, 2], [1, 1, 0, 3, 5, 1], [2, 1, 0, 3, 100, 1]]
+
+
+@has_pools
+def test_pools_match_malloc_stats():
+    pools = arena_fragmentation.cDebugMallocStats.pools()
+    assert pools['read_errors'] == 0
+    pool_count = collections.Counter()
+    blocks_in_use = collections.Counter()
+    for _address, _arena_index, size_class, blocks, _capacity in pools['pools']:
+        if blocks:
+            pool_count[size_class] += 1
+            blocks_in_use[size_class] += blocks
+    for block_class, _size, num_pools, blocks, _avail_blocks in pools['malloc_stats']:
+        assert (pool_count[block_class], blocks_in_use[block_class]) == (num_pools, blocks)
+    assert len(set(pool[1] for pool in pools['pools'])) == pools['narenas']
+
+
+@has_pools
+def test_arena_fragmentation():
+    keep = [str(i) * 3 for i in range(100000)]
+    del keep[::3]
+    fragmentation = arena_fragmentation.ArenaFragmentation()
+    assert fragmentation.arenas
+    for arena in fragmentation.arenas.values():
+        assert arena.pools_used + arena.pools_full + arena.pools_empty == fragmentation.pools_per_arena
+    all_classes = fragmentation.size_classes()
+    assert 0 <= fragmentation.reclaimable_arena_bytes(all_classes) <= len(fragmentation.arenas) * fragmentation.arena_size
+    assert fragmentation.reclaimable_pool_bytes(all_classes) >= 0
+    assert repr(fragmentation).startswith(' Arena ')
@@ -0,0 +1,45 @@
+import json
+import sys
+
+import pytest
+
+from pymemtrace.benchmarks import bm_cpymemtrace
+
+
+@pytest.mark.parametrize('workload', sorted(bm_cpymemtrace.WORKLOADS))
+def test_workload(workload):
+    assert bm_cpymemtrace.time_workload(1, 'none', workload, '.') > 0.0
+
+
+@pytest.mark.parametrize('tracer', bm_cpymemtrace.available_tracers())
+def test_count_events(tracer):
+    events = bm_cpymemtrace.count_events('calls', tracer)
+    if tracer == 'none':
+        assert events == 0
+    else:
+        # _fibonacci(15) is 1973 calls, each has a call and a return event.
+        assert events >= 2 * 1973
+
+
+def test_run_simple(tmp_path):
+    result = bm_cpymemtrace.run_simple(['none', 'profile_binary'], ['calls'], 1, 2)
+    assert result['version'] == 1
+    benchmarks = result['benchmarks']
+    assert [(b['tracer'], b['workload']) for b in benchmarks] == [('none', 'calls'), ('profile_binary', 'calls')]
+    assert benchmarks[0]['ns_per_event'] is None
+    assert benchmarks[1]['events'] > 0
+    assert len(benchmarks[1]['seconds']) == 2
+    assert isinstance(benchmarks[1]['ns_per_event'], float)
+
+
+def test_main(tmp_path, monkeypatch):
+    output = tmp_path / 'out.json'
+    monkeypatch.setattr(sys, 'argv', [
+        'bm_cpymemtrace', '--simple', '--tracer', 'profile_text', '--workload', 'strings', '--loops', '1',
+        '--repeat', '1', '-o', str(output),
+    ])
+    monkeypatch.chdir(tmp_path)
+    assert bm_cpymemtrace.main() == 0
+    with open(output) as file:
+        result = json.load(file)
+    assert [b['tracer'] for b in result['benchmarks']] == ['profile_text']
@@ -0,0 +1,126 @@
+import os
+import sys
+import threading
+
+import pytest
+
+from pymemtrace import cMallocTrace
+from pymemtrace import parse_dtrace_output
+
+#: On Python 3.11 the current frame can not be read in an allocator hook.
+has_location = pytest.mark.skipif(sys.version_info[:2] == (3, 11), reason='No Python location on Python 3.11')
+
+
+def _allocate(size):
+    return bytearray(size)
+
+
+def _parse_log(path):
+    with open(path, 'rb') as f:
+        return parse_dtrace_output.parse_py_flow_malloc_free(f)
+
+
+def test_log_file(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cMallocTrace.MallocTracker() as tracker:
+        b = _allocate(1024 ** 2)
+    assert os.path.dirname(tracker.log_path) == str(tmp_path)
+    assert tracker.log_path.endswith('.malloc.log')
+    mallocs = _parse_log(tracker.log_path)
+    assert any(m.size >= 1024 ** 2 for m in mallocs.values())
+    # The parser and the tracker agree on what is still live.
+    assert set(mallocs) == set(entry[0] for entry in tracker.live())
+    del b
+
+
+@has_location
+def test_log_file_location(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cMallocTrace.MallocTracker() as tracker:
+        b = _allocate(1024 ** 2)
+    mallocs = _parse_log(tracker.log_path)
+    (malloc,) = [m for m in mallocs.values() if m.size >= 1024 ** 2]
+    assert malloc.pid == os.getpid()
+    assert malloc.file == 'test_cMallocTrace.py'
+    assert malloc.function == '_allocate'
+    del b
+
+
+def test_no_log_file(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cMallocTrace.MallocTracker(log=False) as tracker:
+        b = _allocate(1024)
+    assert tracker.log_path is None
+    assert os.listdir(tmp_path) == []
+    assert tracker.records > 0
+    del b
+
+
+def test_live(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    keep = []
+    with cMallocTrace.MallocTracker(log=False) as tracker:
+        for _i in range(4):
+            keep.append(_allocate(100000))
+            _allocate(200000)
+    live = [entry for entry in tracker.live() if entry[1] >= 100000]
+    # Only the allocations that are kept are live.
+    assert [entry[1] for entry in live] == [100001] * 4
+    assert all(entry[2] in ('RAW', 'MEM', 'OBJ') for entry in live)
+    assert tracker.live_count >= 4
+    assert tracker.live_bytes >= 4 * 100001
+
+
+@has_location
+def test_summary(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    keep = []
+    with cMallocTrace.MallocTracker(log=False) as tracker:
+        for _i in range(4):
+            keep.append(_allocate(100000))
+    summary = tracker.summary(1)
+    assert len(summary) == 1
+    file, _line, function, count, size = summary[0]
+    assert (file, function) == ('test_cMallocTrace.py', '_allocate')
+    # The bytearray objects and their buffers.
+    assert count >= 4
+    assert size >= 4 * 100000
+
+
+def test_flush(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cMallocTrace.MallocTracker() as tracker:
+        b = _allocate(1024 ** 2)
+        assert tracker.flush() > 0
+        assert any(entry[1] >= 1024 ** 2 for entry in tracker.live())
+    del b
+
+
+def test_threads_raw(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+
+    def worker():
+        for _i in range(1000):
+            bytes(5000)
+
+    with cMallocTrace.MallocTracker(raw=True) as tracker:
+        threads = [threading.Thread(target=worker) for _i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+    assert tracker.records_dropped == 0
+    # Each allocation leads to one record, an allocation made by an allocator that is itself traced is not recorded.
+    assert tracker.records >= 4 * 1000 * 2
+    assert set(_parse_log(tracker.log_path)) == set(entry[0] for entry in tracker.live())
+
+
+def test_nested_raises(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cMallocTrace.MallocTracker(log=False):
+        with pytest.raises(RuntimeError):
+            with cMallocTrace.MallocTracker(log=False):
+                pass
+    # The first tracker has been removed.
+    with cMallocTrace.MallocTracker(log=False):
+        pass
@@ -8,3 +8,98 @@ from pymemtrace import cMemLeak
 def test_cmalloc_object():
     cobj = cMemLeak.CMalloc(1024)
     assert cobj.size == 1024
+
+
+@pytest.mark.parametrize('allocator', ['malloc', 'raw', 'pymalloc'])
+def test_bulk_alloc(allocator):
+    bulk = cMemLeak.BulkAlloc(1000, 128, allocator=allocator)
+    assert bulk.count == 1000
+    assert bulk.blocks == 1000
+    assert bulk.bytes == 128 * 1000
+    assert bulk.allocator == allocator
+    assert bulk.distribution == 'fixed'
+    bulk.free_all()
+    assert (bulk.blocks, bulk.bytes) == (0, 0)
+    assert bulk.refill() == 1000
+    assert bulk.bytes == 128 * 1000
+
+
+@pytest.mark.parametrize(
+    'distribution, size, max_size',
+    (
+        ('fixed', 64, 0),
+        ('uniform', 16, 1024),
+        ('log_uniform', 16, 1024 ** 2),
+    )
+)
+def test_bulk_alloc_distribution(distribution, size, max_size):
+    bulk = cMemLeak.BulkAlloc(1000, size, max_size, distribution)
+    assert bulk.distribution == distribution
+    assert size * 1000 <= bulk.bytes <= max(size, max_size) * 1000
+
+
+def test_bulk_alloc_seed():
+    def workload(seed):
+        bulk = cMemLeak.BulkAlloc(1000, 16, 4096, 'uniform', seed=seed)
+        bulk.churn(4, 0.25)
+        return bulk.bytes
+
+    assert workload(1) == workload(1)
+    assert workload(1) != workload(2)
+
+
+def test_bulk_alloc_free_fraction():
+    bulk = cMemLeak.BulkAlloc(1000, 64)
+    assert bulk.free_fraction(0.25) == 250
+    assert bulk.blocks == 750
+    assert bulk.free_fraction(0.0) == 0
+    assert bulk.free_fraction(1.0) == 750
+    assert bulk.blocks == 0
+
+
+def test_bulk_alloc_free_pattern():
+    bulk = cMemLeak.BulkAlloc(1000, 64)
+    assert bulk.free_pattern(3, 1) == 250
+    assert bulk.blocks == 750
+    # Already freed.
+    assert bulk.free_pattern(3, 1) == 0
+    # Every odd index, half of which are already freed.
+    assert bulk.free_pattern(1, 1) == 250
+
+
+def test_bulk_alloc_churn():
+    bulk = cMemLeak.BulkAlloc(1000, 64)
+    assert bulk.churn(10, 0.5) == 5000
+    assert bulk.blocks == 1000
+    assert bulk.churn(0) == 0
+
+
+def test_bulk_alloc_touch():
+    bulk = cMemLeak.BulkAlloc(16, 1024 ** 2, touch=True)
+    assert bulk.bytes == 16 * 1024 ** 2
+    bulk.touch()
+
+
+@pytest.mark.parametrize(
+    'args, kwargs, error',
+    (
+        ((-1,), {}, ValueError),
+        ((10,), {'allocator': 'new'}, ValueError),
+        ((10,), {'distribution': 'normal'}, ValueError),
+        ((10, 64, 32, 'uniform'), {}, ValueError),
+        (('10',), {}, TypeError),
+    )
+)
+def test_bulk_alloc_raises(args, kwargs, error):
+    with pytest.raises(error):
+        cMemLeak.BulkAlloc(*args, **kwargs)
+
+
+def test_bulk_alloc_method_raises():
+    bulk = cMemLeak.BulkAlloc(10)
+    with pytest.raises(ValueError):
+        bulk.free_fraction(1.5)
+    with pytest.raises(ValueError):
+        bulk.free_pattern(0, 0)
+    with pytest.raises(ValueError):
+        bulk.churn(-1)
@@ -0,0 +1,88 @@
+import mmap
+import time
+
+import pytest
+
+from pymemtrace import cProcessSampler
+
+
+def _touch(size):
+    """Returns an anonymous mapping of size bytes that is resident. This does not change the state of malloc()."""
+    mapping = mmap.mmap(-1, size)
+    for offset in range(0, size, mmap.PAGESIZE):
+        mapping[offset] = 1
+    return mapping
+
+
+def test_fields():
+    assert cProcessSampler.FIELDS == (
+        'time', 'rss', 'vms', 'page_faults', 'major_page_faults', 'user_time', 'system_time'
+    )
+
+
+def test_sample():
+    before = time.time()
+    sample = cProcessSampler.Sampler().sample()
+    assert len(sample) == len(cProcessSampler.FIELDS)
+    timestamp, rss, vms, page_faults, major_page_faults, user_time, system_time = sample
+    assert before <= timestamp <= time.time()
+    assert 0 < rss <= vms
+    assert page_faults >= major_page_faults >= 0
+    assert user_time >= 0.0 and system_time >= 0.0
+
+
+def test_sampler_thread():
+    sampler = cProcessSampler.Sampler(interval=0.01)
+    assert not sampler.running
+    with sampler:
+        assert sampler.running
+        # Let the first sample be taken before allocating.
+        time.sleep(0.05)
+        b = _touch(16 * 1024 ** 2)
+        time.sleep(0.15)
+        b.close()
+    assert not sampler.running
+    assert sampler.pending == sampler.samples_taken
+    samples = sampler.read()
+    assert sampler.pending == 0
+    assert len(samples) == sampler.samples_taken
+    assert 10 <= len(samples) <= 25
+    times = [sample[0] for sample in samples]
+    assert times == sorted(times)
+    assert max(sample[1] for sample in samples) - samples[0][1] >= 16 * 1024 ** 2
+    assert sampler.read() == []
+
+
+def test_read_n():
+    sampler = cProcessSampler.Sampler(interval=0.01)
+    with sampler:
+        time.sleep(0.1)
+    count = sampler.pending
+    first = sampler.read(2)
+    assert len(first) == 2
+    rest = sampler.read()
+    assert len(rest) == count - 2
+    assert first[-1][0] <= rest[0][0]
+
+
+def test_capacity():
+    sampler = cProcessSampler.Sampler(interval=0.005, capacity=4)
+    with sampler:
+        time.sleep(0.1)
+    samples = sampler.read()
+    assert len(samples) == 4
+    assert sampler.samples_lost == sampler.samples_taken - 4
+    # The oldest samples were overwritten.
+    assert samples[-1][0] > time.time() - 0.05
+
+
+def test_start_twice_raises():
+    with cProcessSampler.Sampler(interval=0.01) as sampler:
+        with pytest.raises(RuntimeError):
+            sampler.start()
+
+
+@pytest.mark.parametrize('kwargs', ({'interval': 0.0}, {'interval': -1.0}, {'capacity': 0}))
+def test_sampler_raises(kwargs):
+    with pytest.raises(ValueError):
+        cProcessSampler.Sampler(**kwargs)
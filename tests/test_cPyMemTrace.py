@@ -0,0 +1,1237 @@
+import ctypes
+import gzip
+import mmap
+import os
+import re
+import signal
+import socket
+import struct
+import sys
+import threading
+import time
+import zlib
+
+import pytest
+
+from pymemtrace import cPyMemTrace
+
+
+def _log_files(directory, extension):
+    return sorted(f for f in os.listdir(directory) if f.endswith(extension))
+
+
+def _allocate(size):
+    return bytearray(size)
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_text_log_file(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    with klass(0):
+        b = _allocate(1024 ** 2)
+    del b
+    files = _log_files(tmp_path, '.log')
+    assert len(files) == 1
+    with open(tmp_path / files[0]) as f:
+        lines = f.readlines()
+    assert lines[0].split() == ['Event', 'dEvent', 'Clock', 'What', 'File', '#line', 'Function', 'RSS', 'dRSS']
+    assert len(lines) > 1
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_text_log_file_intern_strings(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    with klass(0, intern_strings=True):
+        b = _allocate(1024 ** 2)
+    del b
+    files = _log_files(tmp_path, '.log')
+    assert len(files) == 1
+    with open(tmp_path / files[0]) as f:
+        lines = f.readlines()
+    strings = {}
+    for line in lines[1:]:
+        fields = line.split()
+        if fields[0] == 'STR:':
+            strings[int(fields[1])] = fields[2]
+        elif fields[0] != 'STATS:':
+            # File and function are ids that must already be in the string table.
+            m = re.search(r' (\d+)\s+#\s*\d+ (\d+) ', line)
+            assert m is not None
+            assert int(m.group(1)) in strings
+            assert int(m.group(2)) in strings
+    assert '_allocate' in strings.values()
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_text_log_file_sample_every(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    with klass(0, sample_every=4):
+        for _i in range(8):
+            _allocate(1024)
+    files = _log_files(tmp_path, '.log')
+    assert len(files) == 1
+    with open(tmp_path / files[0]) as f:
+        lines = f.readlines()
+    assert lines[0].split()[-1] == 'Sampled'
+    sampled = [line.split()[-1] for line in lines[1:] if not line.startswith('STATS:')]
+    assert set(sampled) == {'S', '-'}
+    # Event 0, 4, 8, ... are sampled.
+    assert sampled[:5] == ['S', '-', '-', '-', 'S']
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_text_log_file_estimate(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    keep = []
+    with klass(1024 ** 2 // 2, estimate=True):
+        for _i in range(4):
+            keep.append(_allocate(1024 ** 2))
+    files = _log_files(tmp_path, '.log')
+    with open(tmp_path / files[0]) as f:
+        lines = f.readlines()
+    assert lines[0].split()[-1] == 'Sampled'
+    next_lines = [line.split() for line in lines[1:] if line.startswith('NEXT:')]
+    assert len(next_lines) > 0
+    # The RSS only changes on events where it is read.
+    assert all(fields[-1] == 'S' for fields in next_lines if int(fields[-2]) != 0)
+
+
+class _PyMemAllocatorEx(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_void_p) for name in ('ctx', 'malloc', 'calloc', 'realloc', 'free')]
+
+
+def _allocators():
+    """The (ctx, malloc) of the RAW, MEM and OBJ allocators."""
+    result = []
+    for domain in range(3):
+        allocator = _PyMemAllocatorEx()
+        ctypes.pythonapi.PyMem_GetAllocator(ctypes.c_int(domain), ctypes.byref(allocator))
+        result.append((allocator.ctx, allocator.malloc))
+    return result
+
+
+def test_estimate_removed_after_other_hook(tmp_path, monkeypatch):
+    from pymemtrace import cMallocTrace
+    monkeypatch.chdir(tmp_path)
+    original = _allocators()
+    profiler = cPyMemTrace.Profile(estimate=True)
+    profiler.__enter__()
+    hooked = _allocators()
+    assert hooked != original
+    with cMallocTrace.MallocTracker():
+        # The hooks of the tracker are over the estimate hooks so those can not be removed yet.
+        profiler.__exit__(None, None, None)
+    assert _allocators() == hooked
+    with cPyMemTrace.Profile():
+        pass
+    assert _allocators() == original
+
+
+@pytest.mark.parametrize(
+    'kwargs',
+    (
+        {'sample_every': -1},
+        {'sample_interval_us': -1},
+    )
+)
+def test_sample_raises(kwargs):
+    with pytest.raises(ValueError):
+        cPyMemTrace.Profile(**kwargs)
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_binary_log_file(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    with klass(0, binary=True):
+        b = _allocate(1024 ** 2)
+    del b
+    files = _log_files(tmp_path, '.bin')
+    assert len(files) == 1
+    with open(tmp_path / files[0], 'rb') as f:
+        data = f.read()
+    magic, byte_order_mark, version, header_size, pid, ticks_per_second, d_rss_trigger = struct.unpack_from(
+        '8sIIIIQq', data
+    )
+    assert magic == b'PYMTRACE'
+    assert byte_order_mark == 0x01020304
+    assert pid == os.getpid()
+    assert d_rss_trigger == 0
+    # The first record after the header is the string record for the file name.
+    assert data[header_size] == 2
+    assert len(data) > header_size
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_text_log_file_clock(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    before = time.time()
+    with klass(0) as profiler:
+        time.sleep(0.01)
+        b = _allocate(1024 ** 2)
+    del b
+    assert before <= profiler.start_time <= time.time()
+    files = _log_files(tmp_path, '.log')
+    with open(tmp_path / files[0]) as f:
+        lines = [line for line in f.readlines()[1:] if not line.startswith('STATS:')]
+    # The Clock column is seconds since start_time.
+    clocks = [float(line.split()[3 if line.startswith(('PREV:', 'NEXT:')) else 2]) for line in lines]
+    assert clocks == sorted(clocks)
+    assert 0.0 <= clocks[0] and 0.01 <= clocks[-1] < time.time() - before
+
+
+@pytest.mark.parametrize('clock', ('process', 'MONOTONIC', ''))
+def test_clock_raises(clock):
+    with pytest.raises(ValueError):
+        cPyMemTrace.Profile(clock=clock)
+
+
+def test_memory_counters():
+    counters = cPyMemTrace.memory_counters()
+    assert 'rss' in counters
+    assert all(isinstance(value, int) and value >= 0 for value in counters.values())
+    if sys.platform.startswith('linux'):
+        assert set(counters) == {
+            'rss', 'rss_anon', 'rss_file', 'rss_shmem', 'swap', 'uss', 'pss', 'private', 'minor_faults', 'major_faults'
+        }
+        assert counters['rss_anon'] + counters['rss_file'] + counters['rss_shmem'] == counters['rss']
+        assert counters['uss'] <= counters['pss'] <= counters['rss']
+
+
+def test_memory_counters_fields():
+    counters = cPyMemTrace.memory_counters(('rss', 'faults'))
+    assert set(counters) <= {'rss', 'minor_faults', 'major_faults'}
+    assert 'rss' in counters
+    with pytest.raises(ValueError):
+        cPyMemTrace.memory_counters(('rss', 'vms'))
+
+
+@pytest.mark.skipif(not sys.platform.startswith('linux'), reason='rss_anon is only available on Linux')
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_text_log_file_memory_counter(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    before = cPyMemTrace.memory_counters(('rss_anon',))['rss_anon']
+    with klass(-1, memory_counter='rss_anon'):
+        b = _allocate(1024 ** 2)
+    del b
+    files = _log_files(tmp_path, '.log')
+    with open(tmp_path / files[0]) as f:
+        lines = [line for line in f.readlines()[1:] if not line.startswith('STATS:')]
+    assert len(lines) > 0
+    # The RSS column is the anonymous RSS which is well below the RSS.
+    rss_anon = [int(line.split()[-2]) for line in lines]
+    assert all(0.5 * before < value < cPyMemTrace.rss() for value in rss_anon)
+
+
+@pytest.mark.parametrize('memory_counter', ('faults', 'vms', 'RSS', ''))
+def test_memory_counter_raises(memory_counter):
+    with pytest.raises(ValueError):
+        cPyMemTrace.Profile(memory_counter=memory_counter)
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_aggregate(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    keep = []
+    with klass(aggregate=True) as tracer:
+        for _i in range(8):
+            keep.append(_allocate(1024 ** 2))
+        live = tracer.summary()
+    final = tracer.summary()
+    assert len(final) >= len(live) > 0
+    # No event log, just the summary.
+    assert _log_files(tmp_path, '.log') == []
+    files = _log_files(tmp_path, '.sites')
+    assert len(files) == 1
+    file, _line, function, count, d_rss_positive, d_rss_negative, d_rss_max = final[0]
+    assert os.path.basename(file) == 'test_cPyMemTrace.py'
+    assert function == '_allocate'
+    assert count >= 8
+    assert d_rss_positive >= 4 * 1024 ** 2
+    assert d_rss_negative <= 0
+    assert 0 < d_rss_max <= d_rss_positive
+    assert [row[4] for row in final] == sorted((row[4] for row in final), reverse=True)
+    assert tracer.summary(n=1) == final[:1]
+    with open(tmp_path / files[0]) as f:
+        lines = f.readlines()
+    assert lines[0].split() == ['File', '#line', 'Function', 'Count', 'dRSS+', 'dRSS-', 'dRSSmax']
+    assert len(lines) == len(final) + 1
+    assert lines[1].split()[-5] == function
+
+
+def test_aggregate_raises():
+    with pytest.raises(ValueError):
+        cPyMemTrace.Profile(aggregate=True, binary=True)
+    with pytest.raises(RuntimeError):
+        cPyMemTrace.Profile().summary()
+
+
+def _thread_id():
+    if hasattr(threading, 'get_native_id'):
+        return threading.get_native_id()
+    return threading.get_ident()
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_all_threads(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    thread_ids = []
+    start = threading.Event()
+
+    def worker():
+        thread_ids.append(_thread_id())
+        start.wait()
+        _allocate(1024 ** 2)
+
+    existing = threading.Thread(target=worker)
+    existing.start()
+    with klass(0, all_threads=True):
+        start.set()
+        existing.join()
+        new = threading.Thread(target=worker)
+        new.start()
+        new.join()
+        _allocate(1024)
+    files = _log_files(tmp_path, '.log')
+    suffixes = sorted(int(f.split('.')[0].split('_')[-1]) for f in files)
+    assert suffixes == sorted(thread_ids + [_thread_id()])
+    for name in files:
+        with open(tmp_path / name) as f:
+            functions = [line.split()[-3] for line in f.readlines()[1:]]
+        if name.split('.')[0].endswith('_{}'.format(_thread_id())):
+            assert 'worker' not in functions
+        else:
+            assert '_allocate' in functions
+            assert 'test_all_threads' not in functions
+
+
+def test_not_all_threads(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Profile(0):
+        thread = threading.Thread(target=_allocate, args=(1024,))
+        thread.start()
+        thread.join()
+    files = _log_files(tmp_path, '.log')
+    assert len(files) == 1
+    assert len(files[0].split('.')[0].split('_')) == 3
+
+
+def _segment_numbers(files):
+    return [int(re.match(r'\d+_\d+_\d+-(\d{6})\.', name).group(1)) for name in files]
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+@pytest.mark.parametrize('binary', (False, True))
+def test_rotate_bytes(tmp_path, monkeypatch, klass, binary):
+    monkeypatch.chdir(tmp_path)
+    with klass(0, binary=binary, rotate_bytes=4096):
+        for _i in range(100):
+            _allocate(1024)
+    files = _log_files(tmp_path, '.bin' if binary else '.log')
+    assert len(files) > 2
+    assert _segment_numbers(files) == list(range(len(files)))
+    from pymemtrace import cTraceReader
+    event_numbers = []
+    for name in files:
+        # Each segment has its own header and string table.
+        reader = cTraceReader.Reader(str(tmp_path / name))
+        functions = set()
+        for batch in reader:
+            event_numbers.extend(memoryview(batch['event']).tolist())
+            functions.update(reader.strings[func] for func in memoryview(batch['func']).tolist())
+        assert '_allocate' in functions
+    # Events carry on from one segment to the next.
+    assert event_numbers == sorted(event_numbers)
+    assert len(set(event_numbers)) == len(event_numbers)
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_rotate_seconds(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    with klass(0, rotate_seconds=0.05):
+        for _i in range(3):
+            _allocate(1024)
+            time.sleep(0.1)
+    files = _log_files(tmp_path, '.log')
+    assert len(files) >= 3
+    assert _segment_numbers(files) == list(range(len(files)))
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+@pytest.mark.parametrize('binary', (False, True))
+def test_flush_and_rotate(tmp_path, monkeypatch, klass, binary):
+    monkeypatch.chdir(tmp_path)
+    extension = '.bin' if binary else '.log'
+    with klass(0, binary=binary) as tracer:
+        _allocate(1024)
+        tracer.flush()
+        files = _log_files(tmp_path, extension)
+        assert len(files) == 1
+        # Written while the log file is still open.
+        assert b'_allocate' in (tmp_path / files[0]).read_bytes()
+        tracer.rotate()
+        _allocate(1024)
+    files = _log_files(tmp_path, extension)
+    assert len(files) == 2
+    # A log file without a sequence number is followed by segment 1.
+    assert re.match(r'\d+_\d+_\d+\.', files[1])
+    assert files[0] == files[1].replace(extension, '-000001' + extension)
+
+
+@pytest.mark.skipif(not hasattr(signal, 'SIGUSR1'), reason='Requires SIGUSR1')
+def test_rotate_signal(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    cPyMemTrace.set_rotate_signal(signal.SIGUSR1)
+    try:
+        with cPyMemTrace.Profile(0, rotate_bytes=1024 ** 3):
+            _allocate(1024)
+            os.kill(os.getpid(), signal.SIGUSR1)
+            _allocate(1024)
+    finally:
+        cPyMemTrace.set_rotate_signal(0)
+    assert _segment_numbers(_log_files(tmp_path, '.log')) == [0, 1]
+
+
+@pytest.mark.skipif(not hasattr(signal, 'SIGUSR2'), reason='Requires SIGUSR2')
+def test_flush_signal(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    cPyMemTrace.set_flush_signal(signal.SIGUSR2)
+    try:
+        with cPyMemTrace.Profile(0):
+            os.kill(os.getpid(), signal.SIGUSR2)
+            _allocate(1024)
+            files = _log_files(tmp_path, '.log')
+            assert os.path.getsize(tmp_path / files[0]) > 0
+    finally:
+        cPyMemTrace.set_flush_signal(0)
+
+
+def test_rotate_raises():
+    with pytest.raises(ValueError):
+        cPyMemTrace.Profile(rotate_bytes=-1)
+    with pytest.raises(ValueError):
+        cPyMemTrace.Profile(rotate_seconds=-1.0)
+    with pytest.raises(ValueError):
+        cPyMemTrace.Profile(aggregate=True, rotate_bytes=4096)
+    with pytest.raises(RuntimeError):
+        cPyMemTrace.Profile().rotate()
+    with pytest.raises(RuntimeError):
+        cPyMemTrace.Trace().flush()
+
+
+def test_rotate_aggregate_raises(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Profile(aggregate=True) as profiler:
+        with pytest.raises(RuntimeError):
+            profiler.rotate()
+
+
+@pytest.mark.skipif(not hasattr(signal, 'SIGUSR1'), reason='Requires SIGUSR1')
+def test_signal_raises():
+    with pytest.raises(ValueError):
+        cPyMemTrace.set_rotate_signal(-1)
+    cPyMemTrace.set_rotate_signal(signal.SIGUSR1)
+    try:
+        with pytest.raises(ValueError):
+            cPyMemTrace.set_flush_signal(signal.SIGUSR1)
+    finally:
+        cPyMemTrace.set_rotate_signal(0)
+    with pytest.raises(OSError):
+        cPyMemTrace.set_flush_signal(signal.SIGKILL)
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+@pytest.mark.parametrize('binary', (False, True))
+def test_compression(tmp_path, monkeypatch, klass, binary):
+    monkeypatch.chdir(tmp_path)
+    extension = '.bin.gz' if binary else '.log.gz'
+    with klass(0, binary=binary, compression='gzip') as tracer:
+        b = _allocate(1024 ** 2)
+        tracer.flush()
+        files = _log_files(tmp_path, extension)
+        assert len(files) == 1
+        # Everything so far can be decompressed while the log file is still open.
+        partial = zlib.decompressobj(31).decompress((tmp_path / files[0]).read_bytes())
+        assert b'_allocate' in partial
+    del b
+    assert _log_files(tmp_path, '.log') == []
+    assert _log_files(tmp_path, '.bin') == []
+    data = gzip.decompress((tmp_path / files[0]).read_bytes())
+    assert data.startswith(partial)
+    if binary:
+        assert data[:8] == b'PYMTRACE'
+    else:
+        lines = data.decode().splitlines()
+        assert lines[0].split() == ['Event', 'dEvent', 'Clock', 'What', 'File', '#line', 'Function', 'RSS', 'dRSS']
+        assert any('_allocate' in line for line in lines[1:])
+
+
+def test_compression_rotate(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Profile(0, compression='gzip', rotate_bytes=4096):
+        for _i in range(100):
+            _allocate(1024)
+    files = _log_files(tmp_path, '.log.gz')
+    assert len(files) > 2
+    assert _segment_numbers(files) == list(range(len(files)))
+    for name in files:
+        assert gzip.decompress((tmp_path / name).read_bytes()).split()[0] == b'Event'
+
+
+def test_compression_raises():
+    with pytest.raises(ValueError):
+        cPyMemTrace.Profile(compression='lz4')
+    with pytest.raises(ValueError):
+        cPyMemTrace.Profile(aggregate=True, compression='gzip')
+
+
+@pytest.mark.parametrize('binary', (False, True))
+def test_directory(tmp_path, monkeypatch, binary):
+    cwd = tmp_path / 'cwd'
+    directory = tmp_path / 'out'
+    cwd.mkdir()
+    directory.mkdir()
+    monkeypatch.chdir(cwd)
+    with cPyMemTrace.Profile(0, binary=binary, directory=directory, rotate_bytes=4096):
+        for _i in range(100):
+            _allocate(1024)
+    assert os.listdir(str(cwd)) == []
+    files = _log_files(directory, '.bin' if binary else '.log')
+    assert len(files) > 2
+    assert _segment_numbers(files) == list(range(len(files)))
+
+
+def test_directory_raises(tmp_path):
+    with pytest.raises(FileNotFoundError):
+        cPyMemTrace.Profile(directory=str(tmp_path / 'missing'))
+    (tmp_path / 'file').write_text('')
+    with pytest.raises(NotADirectoryError):
+        cPyMemTrace.Profile(directory=str(tmp_path / 'file'))
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+@pytest.mark.parametrize('binary', (False, True))
+def test_file(tmp_path, monkeypatch, klass, binary):
+    monkeypatch.chdir(tmp_path)
+    with open(str(tmp_path / 'trace.out'), 'wb') as f:
+        with klass(0, binary=binary, file=f):
+            _allocate(1024 ** 2)
+        # The file object is still usable.
+        f.write(b'END')
+    assert _log_files(tmp_path, '.log') == []
+    assert _log_files(tmp_path, '.bin') == []
+    data = (tmp_path / 'trace.out').read_bytes()
+    if binary:
+        assert data[:8] == b'PYMTRACE'
+    else:
+        assert data.split()[0] == b'Event'
+    assert b'_allocate' in data
+    assert data.endswith(b'END')
+
+
+def _pipe():
+    read_fd, write_fd = os.pipe()
+    return os.fdopen(read_fd, 'rb'), os.fdopen(write_fd, 'wb')
+
+
+@pytest.mark.parametrize('make_pair', (_pipe, socket.socketpair))
+def test_file_stream(tmp_path, monkeypatch, make_pair):
+    monkeypatch.chdir(tmp_path)
+    reader, writer = make_pair()
+    received = []
+
+    def collect():
+        read = reader.read if hasattr(reader, 'read') else lambda: b''.join(iter(lambda: reader.recv(65536), b''))
+        received.append(read())
+
+    collector = threading.Thread(target=collect)
+    collector.start()
+    try:
+        with cPyMemTrace.Profile(0, compression='gzip', file=writer.fileno(), buffer_size=0):
+            for _i in range(100):
+                _allocate(1024)
+    finally:
+        writer.close()
+        collector.join()
+        reader.close()
+    assert os.listdir(str(tmp_path)) == []
+    data = gzip.decompress(received[0])
+    assert data.split()[0] == b'Event'
+    assert b'_allocate' in data
+
+
+def test_file_raises(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with pytest.raises(TypeError):
+        cPyMemTrace.Profile(file='trace.out')
+    with open(str(tmp_path / 'trace.out'), 'wb') as f:
+        with pytest.raises(ValueError):
+            cPyMemTrace.Profile(file=f, directory=str(tmp_path))
+        with pytest.raises(ValueError):
+            cPyMemTrace.Profile(file=f, all_threads=True)
+        with pytest.raises(ValueError):
+            cPyMemTrace.Profile(file=f, rotate_bytes=4096)
+        with cPyMemTrace.Profile(file=f) as profiler:
+            profiler.flush()
+            with pytest.raises(RuntimeError):
+                profiler.rotate()
+
+
+def _receive_all(receiver):
+    datagrams = []
+    while True:
+        try:
+            datagrams.append(receiver.recv(65536))
+        except BlockingIOError:
+            return datagrams
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_socket_address(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    path = str(tmp_path / 's.sock')
+    receiver = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+    receiver.bind(path)
+    receiver.setblocking(False)
+    with receiver:
+        with klass(0, socket_address=path) as profiler:
+            for _i in range(10):
+                _allocate(1024)
+        datagrams = _receive_all(receiver)
+    assert profiler.records_dropped == 0
+    assert os.listdir(str(tmp_path)) == ['s.sock']
+    assert len(datagrams) > 0
+    for datagram in datagrams:
+        assert len(datagram) <= 8192
+        assert datagram[:8] == b'PYMTSOCK'
+        assert struct.unpack_from('=I', datagram, 20)[0] == os.getpid()
+    assert any(b'_allocate' in datagram for datagram in datagrams)
+
+
+def test_socket_address_no_receiver(tmp_path):
+    """Nothing is listening so every datagram fails but tracing carries on."""
+    with cPyMemTrace.Profile(0, socket_address=str(tmp_path / 'none.sock')) as profiler:
+        for _i in range(100):
+            _allocate(1024)
+        profiler.flush()
+        assert profiler.records_dropped > 0
+    assert profiler.records_dropped > 0
+    assert os.listdir(str(tmp_path)) == []
+
+
+def test_socket_address_no_receiver_markers(tmp_path):
+    """The markers of the datagrams that fail are counted as well as the events."""
+    with cPyMemTrace.Profile(0, socket_address=str(tmp_path / 'none.sock')) as profiler:
+        for _i in range(10):
+            _allocate(1024)
+            assert cPyMemTrace.mark('dropped') == 0
+    assert profiler.records_dropped == profiler.stats()['events_written'] + 10
+
+
+def test_socket_address_raises(tmp_path):
+    path = str(tmp_path / 's.sock')
+    for kwargs in ({'compression': 'gzip'}, {'directory': str(tmp_path)}, {'rotate_bytes': 4096},
+                   {'aggregate': True}):
+        with pytest.raises(ValueError):
+            cPyMemTrace.Profile(socket_address=path, **kwargs)
+    with pytest.raises(ValueError):
+        cPyMemTrace.Profile(socket_address='x' * 200)
+    with pytest.raises(TypeError):
+        cPyMemTrace.Profile(socket_address=('localhost',))
+    with cPyMemTrace.Profile(socket_address=path) as profiler:
+        with pytest.raises(RuntimeError):
+            profiler.rotate()
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+def test_mmap(tmp_path, monkeypatch, klass):
+    monkeypatch.chdir(tmp_path)
+    # A small buffer_size so that the file is extended several times.
+    with klass(0, binary=True, mmap=True, buffer_size=4096) as profiler:
+        for _i in range(100):
+            _allocate(1024 ** 2)
+        assert cPyMemTrace.mark('mapped') == 0
+    stats = profiler.stats()
+    assert stats['records_dropped'] == 0
+    assert stats['bytes_written'] > 4096
+    (name,) = _log_files(tmp_path, '.bin')
+    data = (tmp_path / name).read_bytes()
+    magic, _byte_order_mark, version, header_size = struct.unpack_from('8sIII', data)
+    assert magic == b'PYMTRACE'
+    assert version >= 6
+    (committed_length,) = struct.unpack_from('Q', data, header_size - 8)
+    # The file is truncated to the committed length when it is closed, the stats footer follows the counted bytes.
+    assert committed_length == len(data)
+    assert header_size + stats['bytes_written'] < len(data)
+    from pymemtrace import cTraceReader
+    reader = cTraceReader.Reader(str(tmp_path / name))
+    assert reader.stats()['events_written'] == stats['events_written']
+    assert [marker[5] for marker in reader.markers()] == ['mapped']
+
+
+def test_mmap_rotate(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Profile(0, binary=True, mmap=True, rotate_bytes=4096):
+        for _i in range(100):
+            _allocate(1024 ** 2)
+    files = _log_files(tmp_path, '.bin')
+    assert len(files) > 1
+    for name in files:
+        assert (tmp_path / name).read_bytes()[:8] == b'PYMTRACE'
+
+
+_MMAP_KILLED_SCRIPT = """
+import os, signal
+from pymemtrace import cPyMemTrace
+
+def allocate(size):
+    return bytearray(size)
+
+profiler = cPyMemTrace.Profile(0, binary=True, mmap=True)
+profiler.__enter__()
+for _i in range(100):
+    allocate(1024 ** 2)
+os.kill(os.getpid(), signal.SIGKILL)
+"""
+
+
+@pytest.mark.skipif(not hasattr(signal, 'SIGKILL'), reason='Requires SIGKILL')
+def test_mmap_killed(tmp_path):
+    import subprocess
+    result = subprocess.run([sys.executable, '-c', _MMAP_KILLED_SCRIPT], cwd=str(tmp_path))
+    assert result.returncode == -signal.SIGKILL
+    (name,) = _log_files(tmp_path, '.bin')
+    # The file is still the size that it was extended to but the records end at the committed length.
+    size = os.path.getsize(str(tmp_path / name))
+    from pymemtrace import cTraceReader
+    reader = cTraceReader.Reader(str(tmp_path / name))
+    functions = set()
+    for batch in reader:
+        functions.update(reader.strings[i] for i in memoryview(batch['func']).tolist())
+        assert len(batch['event']) > 0
+    assert 'allocate' in functions
+    with open(str(tmp_path / name), 'rb') as f:
+        data = f.read()
+    (header_size,) = struct.unpack_from('I', data, 16)
+    (committed_length,) = struct.unpack_from('Q', data, header_size - 8)
+    assert header_size < committed_length < size
+
+
+_MMAP_FULL_SCRIPT = """
+import resource, signal
+from pymemtrace import cPyMemTrace
+
+functions = {}
+for i in range(200):
+    exec(f'def function_{i}(size):\\n    return bytearray(size)', functions)
+    exec(f'def caller_{i}(size):\\n    return function_{i}(size)', functions)
+signal.signal(signal.SIGXFSZ, signal.SIG_IGN)
+soft, hard = resource.getrlimit(resource.RLIMIT_FSIZE)
+with cPyMemTrace.Profile(0, binary=True, mmap=True, buffer_size=4096, stack_depth=1) as profiler:
+    # The file can not be extended so the later strings and stacks are not written.
+    resource.setrlimit(resource.RLIMIT_FSIZE, (4096, hard))
+    for i in range(200):
+        functions[f'caller_{i}'](1024)
+    assert profiler.stats()['records_dropped'] > 0
+    resource.setrlimit(resource.RLIMIT_FSIZE, (soft, hard))
+    for i in range(200):
+        functions[f'caller_{i}'](1024)
+"""
+
+
+@pytest.mark.skipif(not hasattr(signal, 'SIGXFSZ'), reason='Requires RLIMIT_FSIZE')
+def test_mmap_full(tmp_path):
+    import subprocess
+    result = subprocess.run([sys.executable, '-c', _MMAP_FULL_SCRIPT], cwd=str(tmp_path))
+    assert result.returncode == 0
+    (name,) = _log_files(tmp_path, '.bin')
+    from pymemtrace import cTraceReader
+    reader = cTraceReader.Reader(str(tmp_path / name))
+    functions = set()
+    callers = set()
+    for batch in reader:
+        functions.update(reader.strings[i] for i in memoryview(batch['func']).tolist())
+        for stack in memoryview(batch['stack']).tolist():
+            callers.update(function for _file, _line, function in reader.stack(stack))
+    # Every string and stack that was dropped is written when it is next used.
+    assert {f'function_{i}' for i in range(200)} <= functions
+    assert {f'caller_{i}' for i in range(200)} <= callers
+
+
+def test_mmap_raises(tmp_path):
+    for kwargs in ({}, {'binary': True, 'compression': 'gzip'}, {'binary': True, 'file': 1},
+                   {'binary': True, 'socket_address': str(tmp_path / 's.sock')}, {'aggregate': True}):
+        with pytest.raises(ValueError):
+            cPyMemTrace.Profile(mmap=True, **kwargs)
+
+
+@pytest.mark.skipif(not hasattr(os, 'register_at_fork'), reason='Requires os.register_at_fork')
+@pytest.mark.parametrize('klass_name', ('Profile', 'Trace', 'Monitor'))
+@pytest.mark.parametrize('kwargs', ({}, {'binary': True}, {'binary': True, 'mmap': True}))
+def test_fork(tmp_path, monkeypatch, klass_name, kwargs):
+    if not hasattr(cPyMemTrace, klass_name):
+        pytest.skip('Requires sys.monitoring')
+    monkeypatch.chdir(tmp_path)
+    with getattr(cPyMemTrace, klass_name)(0, **kwargs) as tracer:
+        _allocate(1024 ** 2)
+        pid = os.fork()
+        if pid == 0:
+            try:
+                _allocate(1024 ** 2)
+                tracer.__exit__(None, None, None)
+            finally:
+                os._exit(0)
+        _allocate(1024 ** 2)
+        _, status = os.waitpid(pid, 0)
+        assert status == 0
+    from pymemtrace import cTraceReader
+    files = _log_files(tmp_path, '.bin' if kwargs.get('binary') else '.log')
+    assert len(files) == 2
+    readers = {}
+    for name in files:
+        reader = cTraceReader.Reader(str(tmp_path / name))
+        readers[reader.pid or int(name.split('_')[2].split('.')[0])] = reader
+    assert set(readers) == {os.getpid(), pid}
+    parents = [
+        (size, label) for _event, _clock, kind, _thread_id, size, label in readers[pid].markers()
+        if kind == 'PARENT'
+    ]
+    assert parents == [(os.getpid(), 'fork')]
+    assert [m for m in readers[os.getpid()].markers() if m[2] == 'PARENT'] == []
+    for reader in readers.values():
+        events = sum(len(batch['event']) for batch in reader)
+        if kwargs.get('binary'):
+            # Each process has written all of its own events and none of the other's.
+            assert reader.stats()['events_written'] == events
+        assert events > 0
+
+
+@pytest.mark.skipif(not hasattr(os, 'register_at_fork'), reason='Requires os.register_at_fork')
+def test_fork_outlives_profile(tmp_path, monkeypatch):
+    # The child opens its log with the filter after the Profile that it came from has gone.
+    monkeypatch.chdir(tmp_path)
+    profiler = cPyMemTrace.Profile(0, exclude='function:_filter_inner')
+    profiler.__enter__()
+    del profiler
+    [str(i) * 64 for i in range(1024)]
+    pid = os.fork()
+    if pid == 0:
+        try:
+            _filter_outer()
+            cPyMemTrace._detach_all()
+        finally:
+            os._exit(0)
+    _, status = os.waitpid(pid, 0)
+    cPyMemTrace._detach_all()
+    assert status == 0
+    (name,) = [name for name in _log_files(tmp_path, '.log') if name.endswith(f'_{pid}.log')]
+    with open(tmp_path / name) as f:
+        functions = {word for line in f.readlines()[1:] for word in line.split()}
+    assert functions & {'_filter_outer', '_filter_inner'} == {'_filter_outer'}
+
+
+def test_mark_parent(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    assert not cPyMemTrace.is_tracing()
+    with cPyMemTrace.Profile(0, binary=True):
+        assert cPyMemTrace.is_tracing()
+        cPyMemTrace.mark_parent(1234, 'spawn')
+        _allocate(1024)
+    assert not cPyMemTrace.is_tracing()
+    markers = _read_markers(tmp_path, '.bin')
+    assert [(kind, size, label) for _event, _clock, kind, _thread_id, size, label in markers] == [
+        ('PARENT', 1234, 'spawn')
+    ]
+    with pytest.raises(ValueError):
+        cPyMemTrace.mark_parent(0, 'fork')
+
+
+monitor_only =pytest.mark.skipif(not hasattr(cPyMemTrace, 'Monitor'), reason='Requires sys.monitoring')
+
+
+@monitor_only
+@pytest.mark.parametrize('kwargs', ({}, {'c_calls': True}, {'binary': True}, {'intern_strings': True}))
+def test_monitor(tmp_path, monkeypatch, kwargs):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Monitor(0, **kwargs):
+        b = _allocate(1024 ** 2)
+    del b
+    files = _log_files(tmp_path, '.bin' if kwargs.get('binary') else '.log')
+    assert len(files) == 1
+    from pymemtrace import cTraceReader
+    reader = cTraceReader.Reader(str(tmp_path / files[0]))
+    events = []
+    for batch in reader:
+        for what, func in zip(memoryview(batch['what']).tolist(), memoryview(batch['func']).tolist()):
+            events.append((cTraceReader.WHAT[what], reader.strings[func]))
+    assert ('CALL', '_allocate') in events
+    assert ('RETURN', '_allocate') in events
+    if kwargs.get('c_calls'):
+        assert ('C_CALL', 'bytearray') in events
+    else:
+        assert all(what in ('CALL', 'RETURN') for what, _func in events)
+
+
+def _call(function, argument):
+    return function(argument)
+
+
+@monitor_only
+def test_monitor_c_calls_disable_after_python_call(tmp_path, monkeypatch):
+    # A call site that has called a Python function still logs the C functions that it calls later.
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Monitor(0, c_calls=True, disable_after=1000):
+        for _i in range(3):
+            _call(_allocate, 1)
+        for _i in range(3):
+            _call(len, [1])
+    (name,) = _log_files(tmp_path, '.log')
+    with open(tmp_path / name) as f:
+        lines = [line.split() for line in f.readlines()[1:]]
+    whats = [fields[4] for fields in lines if fields[0] == 'NEXT:' and fields[-3] == 'len']
+    assert whats.count('C_CALL') == 3
+    assert whats.count('C_RETURN') == 3
+
+
+@monitor_only
+def test_monitor_disable_after(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Monitor(0, disable_after=4):
+        for _i in range(100):
+            _allocate(8)
+    files = _log_files(tmp_path, '.log')
+    with open(tmp_path / files[0]) as f:
+        lines = [line for line in f.readlines()[1:] if ' _allocate ' in line]
+    # Far fewer events than the 200 calls and returns.
+    assert 0 < len(lines) < 50
+
+
+@monitor_only
+def test_monitor_disable_after_sampled(tmp_path, monkeypatch):
+    # Events that do not read the RSS do not add more references to the code object.
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Monitor(0, disable_after=4, sample_every=1000):
+        # The first event reads the RSS, none of those of _allocate() do.
+        _filter_inner()
+        references = sys.getrefcount(_allocate.__code__)
+        for _i in range(100):
+            _allocate(8)
+        assert sys.getrefcount(_allocate.__code__) <= references + 1
+
+
+@monitor_only
+def test_monitor_nested_raises(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Monitor():
+        with pytest.raises(ValueError):
+            with cPyMemTrace.Monitor():
+                pass
+    # The tool id has been released.
+    with cPyMemTrace.Monitor():
+        pass
+
+
+@monitor_only
+def test_monitor_raises():
+    with pytest.raises(ValueError):
+        cPyMemTrace.Monitor(disable_after=-1)
+
+
+@monitor_only
+def test_monitor_rotate(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Monitor(0, rotate_bytes=4096) as monitor:
+        for _i in range(100):
+            _allocate(1024)
+        monitor.flush()
+        monitor.rotate()
+    files = _log_files(tmp_path, '.log')
+    assert len(files) > 2
+    assert _segment_numbers(files) == list(range(len(files)))
+
+
+def _filter_inner():
+    return _allocate(1024)
+
+
+def _filter_outer():
+    return [_filter_inner() for _i in range(4)]
+
+
+@pytest.mark.parametrize('klass_name', ('Profile', 'Trace', 'Monitor'))
+@pytest.mark.parametrize(
+    'kwargs, expected',
+    (
+        ({}, {'_filter_outer', '_filter_inner'}),
+        ({'include': 'function:_filter_inner'}, {'_filter_inner'}),
+        ({'include': ['*/test_cPyMemTrace.py'], 'exclude': 'function:_filter_in*'}, {'_filter_outer'}),
+        ({'exclude': ('function:_filter_outer', 'function:_filter_inner')}, set()),
+        ({'include': 'module:' + __name__}, {'_filter_outer', '_filter_inner'}),
+        ({'include': 'module:' + __name__ + 'x'}, set()),
+        ({'include': 'file:*/no_such_file.py'}, set()),
+    )
+)
+def test_filter(tmp_path, monkeypatch, klass_name, kwargs, expected):
+    if not hasattr(cPyMemTrace, klass_name):
+        pytest.skip('Requires sys.monitoring')
+    monkeypatch.chdir(tmp_path)
+    with getattr(cPyMemTrace, klass_name)(0, **kwargs):
+        _filter_outer()
+    (name,) = _log_files(tmp_path, '.log')
+    with open(tmp_path / name) as f:
+        functions = {word for line in f.readlines()[1:] for word in line.split()}
+    assert functions & {'_filter_outer', '_filter_inner'} == expected
+
+
+def test_filter_changed(tmp_path, monkeypatch):
+    # The decision cached on the code object by one filter is not used by the next.
+    for kwargs, expected in (({'exclude': 'function:_filter_inner'}, 0), ({}, 8), ({'exclude': 'function:_x'}, 8)):
+        with cPyMemTrace.Profile(0, directory=str(tmp_path), **kwargs):
+            _filter_outer()
+        (name,) = _log_files(tmp_path, '.log')
+        with open(tmp_path / name) as f:
+            assert len([line for line in f.readlines() if ' _filter_inner ' in line]) == expected
+        os.remove(str(tmp_path / name))
+
+
+@pytest.mark.parametrize('kwargs', ({'include': 1}, {'exclude': [b'x']}, {'include': ['a', None]}))
+def test_filter_raises(kwargs):
+    with pytest.raises(TypeError):
+        cPyMemTrace.Profile(**kwargs)
+
+
+def test_filter_all_threads_outlives_profile(tmp_path, monkeypatch):
+    # New threads use the filter after the Profile that it came from has gone.
+    monkeypatch.chdir(tmp_path)
+    profiler = cPyMemTrace.Profile(0, all_threads=True, exclude='function:_filter_inner')
+    profiler.__enter__()
+    del profiler
+    [str(i) * 64 for i in range(1024)]
+    thread = threading.Thread(target=_filter_outer)
+    thread.start()
+    thread.join()
+    cPyMemTrace._detach_all()
+    names = [name for name in _log_files(tmp_path, '.log') if not name.endswith(f'_{_thread_id()}.log')]
+    assert len(names) == 1
+    with open(tmp_path / names[0]) as f:
+        functions = {word for line in f.readlines()[1:] for word in line.split()}
+    assert functions & {'_filter_outer', '_filter_inner'} == {'_filter_outer'}
+
+
+@pytest.mark.parametrize('klass', (cPyMemTrace.Profile, cPyMemTrace.Trace))
+@pytest.mark.parametrize('binary', (False, True))
+def test_stats(tmp_path, monkeypatch, klass, binary):
+    monkeypatch.chdir(tmp_path)
+    with klass(0, binary=binary) as profiler:
+        b = _allocate(1024 ** 2)
+    del b
+    stats = profiler.stats()
+    assert set(stats) == {
+        'events_seen', 'events_filtered', 'events_written', 'rss_reads', 'rss_ns', 'output_ns', 'bytes_written',
+        'records_dropped',
+    }
+    assert stats['events_seen'] > 0
+    assert 0 < stats['rss_reads'] <= stats['events_seen']
+    assert 0 < stats['events_written']
+    assert stats['rss_ns'] > 0 and stats['output_ns'] > 0
+    assert stats['bytes_written'] > 0
+    assert stats['records_dropped'] == 0
+    # The footer record of the log file has the same counts.
+    from pymemtrace import cTraceReader
+    (name,) = _log_files(tmp_path, '.bin' if binary else '.log')
+    footer = cTraceReader.Reader(str(tmp_path / name)).stats()
+    for key in ('events_seen', 'events_filtered', 'events_written', 'rss_reads'):
+        assert footer[key] == stats[key]
+
+
+def test_stats_filtered(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Profile(0, exclude='function:_filter_inner') as profiler:
+        _filter_outer()
+    stats = profiler.stats()
+    # The call and return of each _filter_inner() are not traced.
+    assert stats['events_filtered'] >= 8
+    assert stats['events_written'] < stats['events_seen']
+
+
+def test_stats_raises():
+    profiler = cPyMemTrace.Profile()
+    with pytest.raises(RuntimeError):
+        profiler.stats()
+
+
+@monitor_only
+def test_monitor_stats(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Monitor(0, binary=True) as monitor:
+        _allocate(1024)
+    stats = monitor.stats()
+    assert stats['events_seen'] >= 2
+    assert stats['events_written'] > 0
+    assert stats['bytes_written'] > 0
+
+
+class _CAPI(ctypes.Structure):
+    """PyMemTraceCAPI in pymemtrace_capi.h, ctypes releases the GIL when these are called."""
+    _fields_ = [
+        ('version', ctypes.c_int),
+        ('mark', ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_char_p)),
+        ('mark_alloc', ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_size_t, ctypes.c_char_p)),
+        ('mark_free', ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_size_t, ctypes.c_char_p)),
+        ('is_tracing', ctypes.CFUNCTYPE(ctypes.c_int)),
+    ]
+
+
+def _capi():
+    get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+    get_pointer.restype = ctypes.c_void_p
+    get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+    return _CAPI.from_address(get_pointer(cPyMemTrace._C_API, b'pymemtrace.cPyMemTrace._C_API'))
+
+
+def _read_markers(directory, extension):
+    from pymemtrace import cTraceReader
+    (name,) = _log_files(directory, extension)
+    return cTraceReader.Reader(str(directory / name)).markers()
+
+
+@pytest.mark.parametrize('kwargs', ({}, {'intern_strings': True}, {'binary': True}, {'binary': True, 'mmap': True}))
+def test_mark(tmp_path, monkeypatch, kwargs):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Profile(0, **kwargs):
+        assert cPyMemTrace.mark('start of work') == 0
+        assert cPyMemTrace.mark_alloc(1024 ** 2, 'buffer') == 0
+        b = _allocate(1024)
+        assert cPyMemTrace.mark_free(1024 ** 2, 'buffer') == 0
+    del b
+    markers = _read_markers(tmp_path, '.bin' if kwargs.get('binary') else '.log')
+    assert [(kind, size, label) for _event, _clock, kind, _thread_id, size, label in markers] == [
+        ('MARK', 0, 'start of work'), ('ALLOC', 1024 ** 2, 'buffer'), ('FREE', 1024 ** 2, 'buffer'),
+    ]
+    events = [marker[0] for marker in markers]
+    clocks = [marker[1] for marker in markers]
+    assert events == sorted(events) and events[0] > 0
+    assert clocks == sorted(clocks) and clocks[0] >= 0.0
+    assert all(marker[3] == threading.get_ident() for marker in markers)
+
+
+def test_mark_not_tracing(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    assert cPyMemTrace.mark('ignored') == 1
+    with cPyMemTrace.Profile(0):
+        assert _capi().is_tracing()
+    assert not _capi().is_tracing()
+    # Nothing is queued between tracers.
+    assert cPyMemTrace.mark_alloc(8, 'ignored') == 1
+    with cPyMemTrace.Profile(0):
+        pass
+    assert _read_markers(tmp_path, '.log') == []
+
+
+def test_mark_raises():
+    with pytest.raises(ValueError):
+        cPyMemTrace.mark_alloc(-1, 'buffer')
+    with pytest.raises(TypeError):
+        cPyMemTrace.mark(None)
+
+
+def test_capi_threads(tmp_path, monkeypatch):
+    api = _capi()
+    assert api.version >= 1
+    count = 200
+    dropped = cPyMemTrace.markers_dropped()
+
+    def worker(index):
+        tag = 'thread {}'.format(index).encode()
+        for _i in range(count):
+            api.mark_alloc(64, tag)
+            api.mark_free(64, tag)
+
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Profile(0, binary=True):
+        threads = [threading.Thread(target=worker, args=(i,)) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        while any(thread.is_alive() for thread in threads):
+            _allocate(1024)
+        for thread in threads:
+            thread.join()
+        assert api.mark(b'done') == 0
+    markers = _read_markers(tmp_path, '.bin')
+    assert markers[-1][2] == 'MARK' and markers[-1][5] == 'done'
+    assert len(markers) - 1 + cPyMemTrace.markers_dropped() - dropped == 4 * 2 * count
+    # The markers of each thread are in the order they were made.
+    for i in range(4):
+        kinds = [marker[2] for marker in markers if marker[5] == 'thread {}'.format(i)]
+        assert all(a != b for a, b in zip(kinds, kinds[1:]))
+
+
+class _RegionBuffer:
+    """Anonymous mapped pages that are not resident until they are written, unlike malloc() that may reuse pages."""
+    def __init__(self, size):
+        self.size = size
+        self._map = mmap.mmap(-1, size)
+        self.buffer = ctypes.addressof(ctypes.c_char.from_buffer(self._map))
+
+
+def _region_buffer(size):
+    return _RegionBuffer(size)
+
+
+def test_regions():
+    buffer = _region_buffer(8 * 1024 ** 2)
+    cPyMemTrace.add_region(buffer.buffer, buffer.size, 'buffer')
+    try:
+        ((address, size, resident, label),) = [r for r in cPyMemTrace.regions() if r[0] == buffer.buffer]
+        assert (address, size, label) == (buffer.buffer, buffer.size, 'buffer')
+        assert resident < buffer.size // 2
+        ctypes.memset(buffer.buffer, 1, buffer.size)
+        # Not touched so not scanned again.
+        assert [r[2] for r in cPyMemTrace.regions() if r[0] == buffer.buffer] == [resident]
+        assert cPyMemTrace.touch_region(buffer.buffer + 1024)
+        assert [r[2] for r in cPyMemTrace.regions() if r[0] == buffer.buffer][0] >= buffer.size
+        assert not cPyMemTrace.touch_region(buffer.buffer + buffer.size)
+    finally:
+        assert cPyMemTrace.remove_region(buffer.buffer)
+    assert not cPyMemTrace.remove_region(buffer.buffer)
+    assert buffer.buffer not in [r[0] for r in cPyMemTrace.regions(rescan=True)]
+
+
+def test_regions_label():
+    buffer = _region_buffer(1024)
+    cPyMemTrace.add_region(buffer.buffer, buffer.size)
+    try:
+        assert [r[3] for r in cPyMemTrace.regions() if r[0] == buffer.buffer] == [hex(buffer.buffer)]
+    finally:
+        cPyMemTrace.remove_region(buffer.buffer)
+
+
+@pytest.mark.parametrize('kwargs', ({}, {'intern_strings': True}, {'binary': True}))
+def test_regions_log(tmp_path, monkeypatch, kwargs):
+    buffer = _region_buffer(8 * 1024 ** 2)
+    monkeypatch.chdir(tmp_path)
+    cPyMemTrace.add_region(buffer.buffer, buffer.size, 'buffer')
+    try:
+        with cPyMemTrace.Profile(0, **kwargs):
+            _allocate(1024)
+            ctypes.memset(buffer.buffer, 1, buffer.size)
+            cPyMemTrace.touch_region(buffer.buffer)
+            _allocate(1024)
+            # Unchanged so not written again.
+            cPyMemTrace.touch_region(buffer.buffer)
+            _allocate(1024)
+    finally:
+        cPyMemTrace.remove_region(buffer.buffer)
+    markers = _read_markers(tmp_path, '.bin' if kwargs.get('binary') else '.log')
+    resident = [(size, label) for _event, _clock, kind, _thread_id, size, label in markers if kind == 'RESIDENT']
+    assert len(resident) == 2
+    assert resident[0][0] < buffer.size // 2
+    assert resident[1][0] >= buffer.size
+    assert {label for _size, label in resident} == {'buffer'}
+
+
+def test_regions_raises():
+    with pytest.raises(ValueError):
+        cPyMemTrace.add_region(4096, 0)
+    with pytest.raises(TypeError):
+        cPyMemTrace.add_region('buffer', 4096)
+    assert _capi().version >= 2
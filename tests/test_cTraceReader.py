@@ -0,0 +1,407 @@
+import gzip
+import json
+import os
+import sys
+import time
+
+import pytest
+
+from pymemtrace import cPyMemTrace
+from pymemtrace import cTraceReader
+
+
+COLUMNS = ('event', 'clock', 'what', 'file', 'line', 'func', 'rss', 'd_rss', 'flags', 'stack')
+#: TRACE_RECORD_FLAG_SAMPLED in trace_record.h
+FLAG_SAMPLED = 0x04
+
+
+def _allocate(size):
+    return bytearray(size)
+
+
+def _write_log(directory, **kwargs):
+    with cPyMemTrace.Profile(0, **kwargs):
+        for _i in range(4):
+            _allocate(1024 ** 2)
+    extension = ('.bin' if kwargs.get('binary') else '.log') + ('.gz' if kwargs.get('compression') else '')
+    files = [f for f in os.listdir(directory) if f.endswith(extension)]
+    assert len(files) == 1
+    return os.path.join(directory, files[0])
+
+
+def _read_all(reader):
+    result = {name: [] for name in COLUMNS}
+    for batch in reader:
+        assert set(batch.keys()) == set(COLUMNS)
+        for name in COLUMNS:
+            result[name].extend(memoryview(batch[name]).tolist())
+    return result
+
+
+@pytest.mark.parametrize(
+    'kwargs',
+    (
+        {},
+        {'intern_strings': True},
+        {'sample_every': 4},
+        {'intern_strings': True, 'sample_every': 4},
+        {'binary': True},
+        {'binary': True, 'mmap': True},
+    )
+)
+def test_reader(tmp_path, monkeypatch, kwargs):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path), **kwargs)
+    reader = cTraceReader.Reader(path)
+    assert reader.format == ('binary' if kwargs.get('binary') else 'text')
+    columns = _read_all(reader)
+    assert len(columns['event']) > 0
+    assert columns['event'] == sorted(columns['event'])
+    for name in ('file', 'func'):
+        assert all(i in reader.strings for i in columns[name])
+    functions = [reader.strings[i] for i in columns['func']]
+    assert functions.count('_allocate') >= 8
+    whats = {cTraceReader.WHAT[i] for i in columns['what']}
+    assert 'CALL' in whats and 'RETURN' in whats
+    assert all(rss > 0 for rss in columns['rss'])
+
+
+def test_reader_matches_text_log(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path))
+    with open(path) as f:
+        lines = [line for line in f.readlines()[1:] if not line.startswith('STATS:')]
+    columns = _read_all(cTraceReader.Reader(path))
+    assert len(columns['event']) == len(lines)
+    for line, event, line_number, rss, d_rss in zip(
+            lines, columns['event'], columns['line'], columns['rss'], columns['d_rss']):
+        fields = line.split()
+        if fields[0] in ('PREV:', 'NEXT:'):
+            fields = fields[1:]
+        assert int(fields[0]) == event
+        assert int(fields[-2]) == rss
+        assert int(fields[-1]) == d_rss
+        assert '#{:4d}'.format(line_number) in line
+
+
+def test_reader_batch_size(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path), binary=True)
+    total = len(_read_all(cTraceReader.Reader(path))['event'])
+    batches = list(cTraceReader.Reader(path, batch_size=3))
+    assert all(len(batch['event']) == 3 for batch in batches[:-1])
+    assert sum(len(batch['event']) for batch in batches) == total
+
+
+def test_reader_column_buffer(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path))
+    batch = next(iter(cTraceReader.Reader(path)))
+    column = batch['d_rss']
+    view = memoryview(column)
+    assert column.format == 'q'
+    assert view.format == 'q'
+    assert view.itemsize == 8
+    assert view.readonly
+    assert len(view) == len(column)
+
+
+def test_reader_rewind(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path))
+    reader = cTraceReader.Reader(path)
+    first = _read_all(reader)
+    assert list(reader) == []
+    reader.rewind()
+    assert _read_all(reader) == first
+
+
+@pytest.mark.parametrize('kwargs', ({}, {'binary': True}))
+def test_top_call_sites(tmp_path, monkeypatch, kwargs):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path), **kwargs)
+    reader = cTraceReader.Reader(path)
+    columns = _read_all(reader)
+    sites = reader.top_call_sites(1000)
+    assert sum(site[3] for site in sites) == len(columns['event'])
+    assert sum(site[4] for site in sites) == sum(columns['d_rss'])
+    d_rss = [site[4] for site in sites]
+    assert d_rss == sorted(d_rss, reverse=True)
+    assert len(reader.top_call_sites(2)) == 2
+    assert list(reader) == []
+
+
+@pytest.mark.parametrize('clock', ('monotonic', 'monotonic_coarse', 'monotonic_raw', 'tsc', 'mach', 'cpu'))
+def test_reader_clock(tmp_path, monkeypatch, clock):
+    monkeypatch.chdir(tmp_path)
+    try:
+        profile = cPyMemTrace.Profile(0, binary=True, clock=clock)
+    except ValueError:
+        pytest.skip('Clock {} is not available'.format(clock))
+    before = time.time()
+    with profile:
+        for _i in range(4):
+            _allocate(1024 ** 2)
+    after = time.time()
+    (path,) = [f for f in os.listdir(str(tmp_path)) if f.endswith('.bin')]
+    reader = cTraceReader.Reader(path)
+    assert reader.clock_source == clock
+    assert reader.start_time == profile.start_time
+    assert before <= reader.start_time <= after
+    clocks = _read_all(reader)['clock']
+    assert len(clocks) > 0
+    # Events are from a single thread, the clocks are seconds since start_time.
+    assert clocks == sorted(clocks)
+    assert -0.001 < clocks[0] and clocks[-1] < after - before + 0.001
+
+
+def test_reader_text_clock(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    reader = cTraceReader.Reader(_write_log(str(tmp_path)))
+    assert reader.clock_source is None
+    assert reader.start_time is None
+
+
+def _no_allocation():
+    pass
+
+
+def test_reader_estimate(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    keep = []
+    with cPyMemTrace.Profile(256 * 1024, binary=True, estimate=True):
+        for _i in range(1000):
+            _no_allocation()
+        # Twice the size that is looked for as the RSS change can be a page or so less than the allocation.
+        for _i in range(4):
+            keep.append(_allocate(2 * 1024 ** 2))
+    (path,) = [f for f in os.listdir(str(tmp_path)) if f.endswith('.bin')]
+    columns = _read_all(cTraceReader.Reader(path))
+    # Only the events either side of a change are logged, the RSS is read on the first event and after each allocation.
+    changes = [(flags, d_rss) for flags, d_rss in zip(columns['flags'], columns['d_rss']) if d_rss >= 1024 ** 2]
+    assert len(changes) >= 4
+    assert all(flags & FLAG_SAMPLED for flags, _d_rss in changes)
+    assert len(columns['event']) < 50
+
+
+def test_reader_memory_counter(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    reader = cTraceReader.Reader(_write_log(str(tmp_path), binary=True))
+    assert reader.memory_counter == 'rss'
+    if sys.platform.startswith('linux'):
+        for path in os.listdir(str(tmp_path)):
+            os.remove(path)
+        reader = cTraceReader.Reader(_write_log(str(tmp_path), binary=True, memory_counter='rss_anon'))
+        assert reader.memory_counter == 'rss_anon'
+        assert all(0 < value < cPyMemTrace.rss() for value in _read_all(reader)['rss'])
+    reader = cTraceReader.Reader(_write_log(str(tmp_path), memory_counter='rss'))
+    assert reader.memory_counter is None
+
+
+def _helper(size):
+    return _allocate(size)
+
+
+# Above the largest glibc mmap threshold so that every allocation is new pages whatever earlier tests have freed.
+STACK_ALLOCATION = 40 * 1024 ** 2
+
+
+def _caller_a():
+    return [len(_helper(STACK_ALLOCATION)) for _i in range(2)]
+
+
+def _caller_b():
+    return [len(_helper(STACK_ALLOCATION)) for _i in range(2)]
+
+
+@pytest.mark.parametrize('klass_name', ('Profile', 'Trace', 'Monitor'))
+def test_reader_stack(tmp_path, monkeypatch, klass_name):
+    if not hasattr(cPyMemTrace, klass_name):
+        pytest.skip('Requires sys.monitoring')
+    monkeypatch.chdir(tmp_path)
+    with getattr(cPyMemTrace, klass_name)(binary=True, stack_depth=8):
+        _caller_a()
+        _caller_b()
+    (path,) = [f for f in os.listdir(str(tmp_path)) if f.endswith('.bin')]
+    reader = cTraceReader.Reader(path)
+    columns = _read_all(reader)
+    callers = set()
+    for func, d_rss, flags, stack in zip(columns['func'], columns['d_rss'], columns['flags'], columns['stack']):
+        if reader.strings[func] == '_allocate' and d_rss >= 1024 ** 2:
+            frames = reader.stack(stack)
+            assert frames[0][2] == '_helper'
+            assert frames[0][0] == __file__
+            callers.add(next(function for _file, _line, function in frames if function.startswith('_caller')))
+        if not flags & 0x02:
+            # Only the events that pass d_rss_trigger have a stack.
+            assert stack == 0
+    assert callers == {'_caller_a', '_caller_b'}
+    # Repeated stacks share their ids.
+    assert len(reader.stacks) < 2 * 8 + 8
+    assert reader.stack(0) == []
+    with pytest.raises(KeyError):
+        reader.stack(len(reader.stacks) + 1)
+
+
+def test_reader_stack_depth(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    reader = cTraceReader.Reader(_write_log(str(tmp_path), binary=True, stack_depth=1))
+    stacks = [stack for stack in _read_all(reader)['stack'] if stack]
+    assert len(stacks) > 0
+    assert all(len(reader.stack(stack)) == 1 for stack in stacks)
+
+
+def _write_stack_log(directory):
+    with cPyMemTrace.Profile(binary=True, stack_depth=8):
+        _caller_a()
+        _caller_b()
+    (path,) = [f for f in os.listdir(directory) if f.endswith('.bin')]
+    return path
+
+
+def test_export_stacks_folded(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    reader = cTraceReader.Reader(_write_stack_log(str(tmp_path)))
+    columns = _read_all(reader)
+    result = reader.export_stacks('out.folded')
+    with open('out.folded') as file:
+        lines = [line.rsplit(' ', 1) for line in file.read().splitlines()]
+    total = sum(d_rss for d_rss in columns['d_rss'] if d_rss > 0)
+    assert result == (len(lines), total)
+    assert sum(int(weight) for _stack, weight in lines) == total
+    stacks = [stack for stack, _weight in lines]
+    for caller in ('_caller_a', '_caller_b'):
+        assert any(f';{caller} (' in stack and f';_helper ({__file__}:' in stack
+                   and f';_allocate ({__file__}:' in stack for stack in stacks)
+    weights = [int(weight) for _stack, weight in lines]
+    assert weights == sorted(weights, reverse=True)
+    assert list(reader) == []
+
+
+def test_export_stacks_speedscope(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    reader = cTraceReader.Reader(_write_stack_log(str(tmp_path)))
+    stacks, total = reader.export_stacks('out.json', format='speedscope')
+    with open('out.json') as file:
+        document = json.load(file)
+    frames = document['shared']['frames']
+    (profile,) = document['profiles']
+    assert profile['unit'] == 'bytes'
+    assert profile['endValue'] == sum(profile['weights']) == total
+    assert len(profile['samples']) == len(profile['weights']) == stacks
+    assert all(0 <= index < len(frames) for sample in profile['samples'] for index in sample)
+    names = [[frames[index]['name'] for index in sample] for sample in profile['samples']]
+    assert any(sample[-2:] == ['_helper', '_allocate'] for sample in names)
+    assert all(frame['file'] for frame in frames)
+
+
+def test_export_stacks_without_callers(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    reader = cTraceReader.Reader(_write_log(str(tmp_path)))
+    stacks, total = reader.export_stacks('out.folded')
+    with open('out.folded') as file:
+        lines = file.read().splitlines()
+    assert len(lines) == stacks > 0
+    assert all(';' not in line for line in lines)
+    assert total == sum(d_rss for d_rss in _read_all(reader)['d_rss'] if d_rss > 0)
+
+
+def test_export_stacks_raises(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    reader = cTraceReader.Reader(_write_log(str(tmp_path), binary=True))
+    with pytest.raises(ValueError):
+        reader.export_stacks('out.svg', format='svg')
+    with pytest.raises(OSError):
+        reader.export_stacks(str(tmp_path / 'missing' / 'out.folded'))
+
+
+@pytest.mark.parametrize('kwargs', ({}, {'binary': True}, {'compression': 'gzip'}))
+def test_reader_stats(tmp_path, monkeypatch, kwargs):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path), **kwargs)
+    reader = cTraceReader.Reader(path)
+    stats = reader.stats()
+    assert stats['events_seen'] > 0
+    assert stats['events_written'] == len(_read_all(reader)['event'])
+    assert stats['bytes_written'] > 0
+    # Reading the stats does not change the position of the reader.
+    reader.rewind()
+    first = next(iter(reader))
+    assert reader.stats() == stats
+    assert len(first['event']) > 0
+
+
+def test_reader_stats_without_footer(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path))
+    with open(path) as f:
+        lines = [line for line in f.readlines() if not line.startswith('STATS:')]
+    with open(path, 'w') as f:
+        f.writelines(lines)
+    assert cTraceReader.Reader(path).stats() is None
+
+
+@pytest.mark.parametrize('kwargs', ({}, {'binary': True}))
+def test_reader_markers(tmp_path, monkeypatch, kwargs):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Profile(0, **kwargs):
+        for i in range(4):
+            cPyMemTrace.mark_alloc(1024 ** 2, 'native')
+            _allocate(1024 ** 2)
+    path = os.path.join(str(tmp_path), os.listdir(str(tmp_path))[0])
+    reader = cTraceReader.Reader(path)
+    first = next(iter(reader))
+    markers = reader.markers()
+    assert [(kind, size, label) for _event, _clock, kind, _thread_id, size, label in markers] == [
+        ('ALLOC', 1024 ** 2, 'native')] * 4
+    # Markers are not events and reading them does not change the position.
+    assert len(first['event']) == reader.stats()['events_written']
+    assert list(reader) == []
+
+
+def test_reader_missing_file(tmp_path):
+    with pytest.raises(OSError):
+        cTraceReader.Reader(str(tmp_path / 'missing.log'))
+
+
+def test_reader_empty_file(tmp_path):
+    path = tmp_path / 'empty.log'
+    path.write_text('')
+    assert list(cTraceReader.Reader(str(path))) == []
+
+
+@pytest.mark.parametrize('binary', (False, True))
+def test_reader_compressed(tmp_path, monkeypatch, binary):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path), binary=binary, intern_strings=True, compression='gzip')
+    # The same as reading the decompressed file.
+    decompressed_path = str(tmp_path / 'decompressed')
+    with gzip.open(path) as f_in, open(decompressed_path, 'wb') as f_out:
+        f_out.write(f_in.read())
+    reader = cTraceReader.Reader(path)
+    expected = cTraceReader.Reader(decompressed_path)
+    assert reader.format == expected.format == ('binary' if binary else 'text')
+    columns = _read_all(reader)
+    assert columns == _read_all(expected)
+    assert reader.strings == expected.strings
+    assert len(columns['event']) > 0
+
+
+def test_reader_compressed_truncated(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path), binary=True, compression='gzip')
+    with open(path, 'rb') as f:
+        data = f.read()
+    # As if the log file was still being written.
+    truncated_path = str(tmp_path / 'truncated.bin.gz')
+    with open(truncated_path, 'wb') as f:
+        f.write(data[:len(data) - 16])
+    events = _read_all(cTraceReader.Reader(truncated_path))['event']
+    assert events == _read_all(cTraceReader.Reader(path))['event'][:len(events)]
+
+
+def test_reader_compressed_corrupt(tmp_path):
+    path = tmp_path / 'corrupt.log.gz'
+    path.write_bytes(b'\x1f\x8b' + b'\xff' * 64)
+    with pytest.raises(ValueError):
+        cTraceReader.Reader(str(path))
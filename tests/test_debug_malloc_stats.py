@@ -552,3 +552,65 @@ def test_diff_debugmallocstats_diff():
         '+1 free 19-sized PyTupleObjects * 176 bytes each =                   +0',
     ]
     assert result == expected
+
+
+has_native = pytest.mark.skipif(debug_malloc_stats.cDebugMallocStats is None, reason='No cDebugMallocStats')
+
+
+def _sys_debug_malloc_stats_values(sdms):
+    return (
+        sdms.small_block_threshold, sdms.size_classes, sdms.malloc_stats, sdms.type_stats, sdms.type_map,
+        vars(sdms.arenas), vars(sdms.pools_blocks),
+    )
+
+
+@has_native
+def test_native_debugmallocstats():
+    result = debug_malloc_stats.cDebugMallocStats.debugmallocstats()
+    assert result.startswith(b'Small block threshold = ')
+    if debug_malloc_stats.cDebugMallocStats.HAS_TYPE_STATS:
+        assert b' free PyDictObjects * ' in result
+
+
+@has_native
+def test_native_parse_example():
+    native = debug_malloc_stats.SysDebugMallocStats(SYS_DEBUGMALLOCSTATS_EXAMPLE, native=True)
+    sdms = debug_malloc_stats.SysDebugMallocStats(SYS_DEBUGMALLOCSTATS_EXAMPLE, native=False)
+    assert _sys_debug_malloc_stats_values(native) == _sys_debug_malloc_stats_values(sdms)
+    assert repr(native).encode('ascii') == SYS_DEBUGMALLOCSTATS_EXAMPLE
+
+
+@has_native
+def test_native_parse_pool_overhead():
+    result = debug_malloc_stats.cDebugMallocStats.parse(SYS_DEBUGMALLOCSTATS_EXAMPLE)
+    sdms = debug_malloc_stats.SysDebugMallocStats(SYS_DEBUGMALLOCSTATS_EXAMPLE, native=False)
+    num_pools = sum(v.num_pools for v in sdms.malloc_stats)
+    assert result['pool_overhead'] == sdms.pools_blocks.pool_overhead(num_pools)
+
+
+@has_native
+def test_native_parse_raises():
+    with pytest.raises(ValueError):
+        debug_malloc_stats.cDebugMallocStats.parse(b'Small block threshold = 512, in 32 size classes.\n')
+
+
+@has_native
+def test_native_stats():
+    native = debug_malloc_stats.SysDebugMallocStats(native=True)
+    # These do not change with allocations.
+    assert native.small_block_threshold == debug_malloc_stats.SysDebugMallocStats(native=False).small_block_threshold
+    assert native.malloc_stats
+    assert native.arenas.narenas > 0
+    assert native.pools_blocks.total == native.arenas.arenas_total
+    if debug_malloc_stats.cDebugMallocStats.HAS_TYPE_STATS:
+        assert native.has_object_type(b'PyDictObjects')
+    else:
+        assert native.type_stats == []
+
+
+@has_native
+def test_native_diff():
+    with debug_malloc_stats.DiffSysDebugMallocStats(native=True) as diff_dms:
+        keep = [tuple(range(4)) for _i in range(1000)]
+    assert '# bytes in allocated blocks' in diff_dms.diff()
+    del keep
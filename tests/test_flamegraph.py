@@ -0,0 +1,42 @@
+import os
+
+import pytest
+
+from pymemtrace import cPyMemTrace
+from pymemtrace import flamegraph
+
+
+def _allocate(size):
+    return bytearray(size)
+
+
+def _write_log(directory):
+    with cPyMemTrace.Profile(binary=True, stack_depth=4):
+        for _i in range(4):
+            _allocate(1024 ** 2)
+    (path,) = [f for f in os.listdir(directory) if f.endswith('.bin')]
+    return path
+
+
+@pytest.mark.parametrize('format', ('folded', 'speedscope'))
+def test_export(tmp_path, monkeypatch, format):
+    monkeypatch.chdir(tmp_path)
+    path = _write_log(str(tmp_path))
+    output, stacks, size = flamegraph.export(path, format=format)
+    assert output == path + flamegraph.EXTENSIONS[format]
+    assert os.path.getsize(output) > 0
+    assert stacks > 0
+    assert size > 0
+
+
+def test_export_output(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    output, _stacks, _size = flamegraph.export(_write_log(str(tmp_path)), 'memory.folded')
+    assert output == 'memory.folded'
+    with open(output) as file:
+        assert '_allocate (' in file.read()
+
+
+def test_export_raises(tmp_path):
+    with pytest.raises(ValueError):
+        flamegraph.export(str(tmp_path / 'a.bin'), format='svg')
@@ -0,0 +1,79 @@
+import io
+import os
+import sys
+
+import pytest
+
+from pymemtrace import cPyMemTrace
+from pymemtrace import merge_logs
+
+
+def _allocate(size):
+    return bytearray(size)
+
+
+def _write_logs(directory, **kwargs):
+    """Write the log of this process and of a forked child, returns the child pid and the log paths."""
+    with cPyMemTrace.Profile(0, **kwargs) as profiler:
+        _allocate(1024 ** 2)
+        pid = os.fork()
+        if pid == 0:
+            try:
+                _allocate(1024 ** 2)
+                profiler.__exit__(None, None, None)
+            finally:
+                os._exit(0)
+        os.waitpid(pid, 0)
+        _allocate(1024 ** 2)
+    extension = '.bin' if kwargs.get('binary') else '.log'
+    return pid, sorted(os.path.join(directory, f) for f in os.listdir(directory) if f.endswith(extension))
+
+
+fork_only = pytest.mark.skipif(not hasattr(os, 'register_at_fork'), reason='Requires os.register_at_fork')
+
+
+@fork_only
+@pytest.mark.parametrize('kwargs', ({}, {'binary': True}))
+def test_merge(tmp_path, monkeypatch, kwargs):
+    monkeypatch.chdir(tmp_path)
+    pid, paths = _write_logs(str(tmp_path), **kwargs)
+    process_logs, events = merge_logs.merge(paths)
+    assert [(p.pid, p.parent_pid, p.how) for p in process_logs] == [(os.getpid(), 0, ''), (pid, os.getpid(), 'fork')]
+    events = list(events)
+    times = [e.time for e in events]
+    assert times == sorted(times)
+    assert {e.pid for e in events} == {os.getpid(), pid}
+    assert {e.function for e in events if e.pid == pid} >= {'_allocate'}
+
+
+@fork_only
+def test_write_timeline(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    pid, paths = _write_logs(str(tmp_path), binary=True)
+    output = io.StringIO()
+    count = merge_logs.write_timeline(paths, output)
+    lines = output.getvalue().splitlines()
+    assert lines[0] == '# Processes:'
+    assert lines[1].startswith(f'# {os.getpid()} ')
+    assert lines[2].startswith(f'#     {pid} fork of {os.getpid()} ')
+    header = lines.index(next(line for line in lines if not line.startswith('#')))
+    assert lines[header].split() == ['Time', 'PID', 'Event', 'What', 'File', '#line', 'Function', 'RSS', 'dRSS']
+    assert len(lines) - header - 1 == count > 0
+
+
+def test_main(tmp_path, monkeypatch):
+    monkeypatch.chdir(tmp_path)
+    with cPyMemTrace.Profile(0, binary=True):
+        _allocate(1024 ** 2)
+    (path,) = os.listdir(str(tmp_path))
+    monkeypatch.setattr(sys, 'argv', ['merge_logs', path, '-o', 'timeline.txt'])
+    assert merge_logs.main() == 0
+    with open('timeline.txt') as file:
+        assert '_allocate' in file.read()
+
+
+def test_read_process_log_raises(tmp_path):
+    path = tmp_path / 'a.log'
+    path.write_text('')
+    with pytest.raises(ValueError):
+        merge_logs.read_process_log(str(path))
@@ -1,6 +1,10 @@
 import datetime
 import io
+import logging
+import mmap
+import os
 import pprint
+import time
 
 import pytest
 
@@ -144,3 +148,36 @@ def test_extract_json_as_table():
     assert t_max == {24098: 5.3028600215911865}
     assert rss_min == {24098: 28475392}
     assert rss_max == {24098: 56565760}
+
+
+def _touch(size):
+    """Returns an anonymous mapping of size bytes that is resident. This does not change the state of malloc()."""
+    mapping = mmap.mmap(-1, size)
+    for offset in range(0, size, mmap.PAGESIZE):
+        mapping[offset] = 1
+    return mapping
+
+
+def test_log_process_native():
+    stream = io.StringIO()
+    handler = logging.StreamHandler(stream)
+    handler.setFormatter(logging.Formatter('%(asctime)s - %(levelname)-8s - %(message)s'))
+    process.logger.addHandler(handler)
+    process.logger.setLevel(logging.INFO)
+    try:
+        with process.log_process(interval=0.01, flush_interval=0.1, native=True):
+            process.add_message_to_queue('Allocate')
+            b = _touch(16 * 1024 ** 2)
+            time.sleep(0.25)
+            b.close()
+    finally:
+        process.logger.removeHandler(handler)
+    json_data = process.extract_json(io.StringIO(stream.getvalue()))
+    # START, at least one sample for every interval and STOP.
+    assert len(json_data) > 10
+    assert [record['label'] for record in process.extract_labels_from_json(json_data)] == ['Allocate']
+    timestamps = [record[process.KEY_TIMESTAMP] for record in json_data if process.KEY_LABEL not in record]
+    assert timestamps == sorted(timestamps)
+    assert max(record['memory_info']['rss'] for record in json_data) >= 16 * 1024 ** 2
+    table, _t_min, _t_max, _rss_min, _rss_max = process.extract_json_as_table(json_data)
+    assert len(table[os.getpid()]) == len(json_data) + 1
@@ -0,0 +1,202 @@
+import multiprocessing
+import os
+import socket
+import struct
+
+import pytest
+
+from pymemtrace import cPyMemTrace
+from pymemtrace import stream_aggregator
+
+
+def _allocate(size):
+    return b' ' * size
+
+
+def _trace(path, count):
+    with cPyMemTrace.Profile(0, socket_address=path):
+        for _i in range(count):
+            _allocate(1024 ** 2)
+
+
+def _datagram(pid=1234, thread_id=0, sequence=0, records_dropped=0, records=b'', clock_anchor_ticks=0):
+    header = struct.pack('=' + stream_aggregator.SOCKET_HEADER_FORMAT, b'PYMTSOCK', 0x01020304, 1, 112, pid,
+                         thread_id, sequence, records_dropped)
+    file_header = struct.pack('=' + stream_aggregator.FILE_HEADER_FORMAT, b'PYMTRACE', 0x01020304, 2, 64, pid,
+                              1000, 0, 0, 0, clock_anchor_ticks, 0)
+    return header + file_header + records
+
+
+def _string(string_id, text):
+    data = text.encode()
+    return struct.pack('=' + stream_aggregator.STRING_FORMAT, 2, string_id, len(data), 0) + data.ljust(
+        (len(data) + 7) & ~7, b'\0')
+
+
+def _event(event_number, file_id, func_id, rss, d_rss, what=0):
+    return struct.pack('=' + stream_aggregator.EVENT_FORMAT, 1, what, 0, 0, 42, file_id, func_id, event_number,
+                       event_number * 1000, rss, d_rss)
+
+
+def test_feed():
+    aggregator = stream_aggregator.StreamAggregator(keep_events=True)
+    events = aggregator.feed(
+        _datagram(records=_string(1, 'file.py') + _string(2, 'func') + _event(0, 1, 2, 4096, 4096, what=3))
+    )
+    assert len(events) == 1
+    assert events[0] == stream_aggregator.StreamEvent(1234, 0, 0, 0.0, 'RETURN', 'file.py', 42, 'func', 4096, 4096)
+    # Datagram 1 is lost, the strings are remembered from datagram 0.
+    aggregator.feed(
+        _datagram(sequence=2, records_dropped=3, records=_event(5, 1, 2, 8192, 4096), clock_anchor_ticks=1000)
+    )
+    stream = aggregator.streams[(1234, 0)]
+    assert stream.events == 2
+    assert stream.datagrams == 2
+    assert stream.datagrams_lost == 1
+    assert stream.records_dropped == 3
+    assert stream.peak_rss == 8192
+    assert aggregator.top_functions(1234) == [('file.py', 'func', 8192)]
+    # The clock is seconds since the anchor in the file header.
+    assert aggregator.events[1].clock == 4.0
+    aggregator.feed(_datagram(sequence=3, records=_event(6, 1, 2, 8192, 0), clock_anchor_ticks=7000))
+    assert aggregator.events[2].clock == -1.0
+    assert 'PID 1234' in str(aggregator)
+
+
+def test_feed_stats():
+    aggregator = stream_aggregator.StreamAggregator()
+    values = tuple(range(10, 10 + len(stream_aggregator.STATS_NAMES)))
+    stats = struct.pack('=' + stream_aggregator.STATS_FORMAT, stream_aggregator.RECORD_STATS, len(values))
+    stats += struct.pack(f'={len(values)}Q', *values)
+    aggregator.feed(_datagram(records=_event(0, 0, 0, 4096, 4096) + stats))
+    stream = aggregator.streams[(1234, 0)]
+    assert stream.events == 1
+    assert stream.stats == dict(zip(stream_aggregator.STATS_NAMES, values))
+
+
+def test_feed_stats_truncated():
+    aggregator = stream_aggregator.StreamAggregator()
+    values = tuple(range(10, 10 + len(stream_aggregator.STATS_NAMES)))
+    stats = struct.pack('=' + stream_aggregator.STATS_FORMAT, stream_aggregator.RECORD_STATS, len(values) + 100)
+    stats += struct.pack(f'={len(values)}Q', *values)
+    aggregator.feed(_datagram(records=_event(0, 0, 0, 4096, 4096) + stats))
+    stream = aggregator.streams[(1234, 0)]
+    assert stream.events == 1
+    assert stream.stats == {}
+
+
+def test_feed_stack():
+    aggregator = stream_aggregator.StreamAggregator()
+    stacks = (
+        struct.pack('=' + stream_aggregator.STACK_FORMAT, 3, 1, 0, 1, 3, 10)
+        + struct.pack('=' + stream_aggregator.STACK_FORMAT, 3, 2, 1, 1, 2, 20)
+    )
+    event_stack = struct.pack('=' + stream_aggregator.EVENT_STACK_FORMAT, 4, 2, 7)
+    (event,) = aggregator.feed(
+        _datagram(records=_string(1, 'file.py') + _string(2, 'func') + _string(3, 'main') + stacks
+                  + _event(7, 1, 2, 4096, 4096) + event_stack)
+    )
+    assert event.stack == (('file.py', 20, 'func'), ('file.py', 10, 'main'))
+
+
+def test_stream_stack_depth(tmp_path):
+    path = str(tmp_path / 's.sock')
+    sock = stream_aggregator.open_socket(path)
+    aggregator = stream_aggregator.StreamAggregator(keep_events=True)
+    try:
+        with cPyMemTrace.Profile(socket_address=path, stack_depth=4):
+            for _i in range(4):
+                _allocate(1024 ** 2)
+        aggregator.serve(sock, duration=0.2)
+    finally:
+        stream_aggregator.close_socket(sock)
+    stacks = [event.stack for event in aggregator.events if event.function == '_allocate' and event.d_rss > 0]
+    assert len(stacks) > 0
+    assert all(stack[0][2] == 'test_stream_stack_depth' for stack in stacks)
+
+
+def test_feed_by_pid():
+    aggregator = stream_aggregator.StreamAggregator()
+    for pid, thread_id in ((1, 0), (2, 10), (2, 11)):
+        aggregator.feed(_datagram(pid=pid, thread_id=thread_id, records=_string(1, 'f') + _event(0, 1, 1, 1, 1)))
+    by_pid = aggregator.by_pid()
+    assert sorted(by_pid) == [1, 2]
+    assert [s.thread_id for s in by_pid[2]] == [10, 11]
+
+
+@pytest.mark.parametrize('datagram', (b'', b'PYMTSOCK' + b'\0' * 200, b'X' * 200))
+def test_feed_raises(datagram):
+    aggregator = stream_aggregator.StreamAggregator()
+    with pytest.raises(ValueError):
+        aggregator.feed(datagram)
+    assert aggregator.datagrams_rejected == 1
+
+
+def test_parse_address():
+    assert stream_aggregator.parse_address('localhost:9999') == ('localhost', 9999)
+    assert stream_aggregator.parse_address('/tmp/a.sock') == '/tmp/a.sock'
+
+
+def test_serve_processes(tmp_path):
+    path = str(tmp_path / 's.sock')
+    sock = stream_aggregator.open_socket(path)
+    aggregator = stream_aggregator.StreamAggregator(keep_events=True)
+    try:
+        processes = [multiprocessing.Process(target=_trace, args=(path, 10)) for _i in range(2)]
+        for process in processes:
+            process.start()
+        # Receive while the processes are running.
+        while any(process.is_alive() for process in processes):
+            aggregator.serve(sock, duration=0.1)
+        aggregator.serve(sock, duration=0.1)
+        for process in processes:
+            process.join()
+    finally:
+        stream_aggregator.close_socket(sock)
+    assert not os.path.exists(path)
+    by_pid = aggregator.by_pid()
+    assert sorted(by_pid) == sorted(process.pid for process in processes)
+    clocks = [event.clock for event in aggregator.events]
+    assert clocks and all(-1.0 < clock < 60.0 for clock in clocks)
+    for pid in by_pid:
+        assert '_allocate' in [function for _file, function, _d_rss in aggregator.top_functions(pid)]
+
+
+def test_serve_socket_in_process():
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+    sender = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+    sock.bind('\0pymemtrace_test_%d' % os.getpid())
+    try:
+        sender.sendto(_datagram(records=_string(1, 'f') + _event(0, 1, 1, 1, 1)), sock.getsockname())
+        sender.sendto(b'not a datagram', sock.getsockname())
+        aggregator = stream_aggregator.StreamAggregator()
+        assert aggregator.serve(sock, max_datagrams=2) == 2
+    finally:
+        sender.close()
+        sock.close()
+    assert aggregator.streams[(1234, 0)].events == 1
+    assert aggregator.datagrams_rejected == 1
+
+
+def test_feed_marker():
+    aggregator = stream_aggregator.StreamAggregator()
+    records = _string(1, 'buffer')
+    for kind, size in ((2, 4096), (2, 8192), (3, 4096), (1, 0), (4, 4096), (4, 8192)):
+        records += struct.pack('=' + stream_aggregator.MARKER_FORMAT, stream_aggregator.RECORD_MARKER, kind, 1, 0,
+                               1000, 42, size)
+    aggregator.feed(_datagram(records=records))
+    stream = aggregator.streams[(1234, 0)]
+    assert stream.markers == 6
+    assert stream.native_bytes_by_tag == {'buffer': 8192}
+    assert stream.resident_bytes_by_region == {'buffer': 8192}
+    assert stream.parent_pid == 0
+
+
+def test_feed_marker_parent():
+    aggregator = stream_aggregator.StreamAggregator()
+    records = _string(1, 'spawn') + struct.pack('=' + stream_aggregator.MARKER_FORMAT, stream_aggregator.RECORD_MARKER,
+                                                 5, 1, 0, 1000, 42, 4321)
+    aggregator.feed(_datagram(records=records))
+    stream = aggregator.streams[(1234, 0)]
+    assert stream.markers == 1
+    assert (stream.parent_pid, stream.how) == (4321, 'spawn')
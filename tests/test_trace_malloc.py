@@ -1,5 +1,9 @@
+import contextlib
+import tracemalloc
+
 import pytest
 
+from pymemtrace import cTraceMalloc
 from pymemtrace import trace_malloc
 
 
@@ -17,5 +21,132 @@ def test_trace_malloc_simple():
     assert len(tm.statistics) > 3
 
 
+
+@pytest.mark.parametrize('statistics_granularity', trace_malloc.TraceMalloc.ALLOWED_GRANULARITY)
+def test_trace_malloc_native(statistics_granularity):
+    list_of_bytes = []
+    with trace_malloc.TraceMalloc(statistics_granularity, native=True, limit=4) as tm:
+        list_of_bytes.extend(bytearray(1000) for _i in range(100))
+    assert tm.tracemalloc_snapshot_start is None
+    assert 0 < len(tm.statistics) <= 4
+    assert tm.net_statistics() == tm.statistics
+    assert tm.statistics[0].size_diff >= 100 * 1000
+    # Less the growth of tracemalloc itself.
+    assert tm.diff > 50 * 1000
+
+
+def test_trace_malloc_limit():
+    with trace_malloc.TraceMalloc(limit=1) as tm:
+        b = bytearray(100000)
+    assert len(tm.statistics) == 1
+    assert tm.diff > 50 * 1000
+    del b
+
+
+# cTraceMalloc tests are here, after test_trace_malloc_simple(), as that test relies on tracemalloc not having been
+# started before.
+
+
+@contextlib.contextmanager
+def _tracing():
+    was_tracing = tracemalloc.is_tracing()
+    if not was_tracing:
+        tracemalloc.start()
+    try:
+        yield
+    finally:
+        if not was_tracing:
+            tracemalloc.stop()
+
+
+def _allocate(count):
+    return [bytearray(1000) for _i in range(count)]
+
+
+def test_diff_lineno():
+    with _tracing():
+        with cTraceMalloc.SnapshotDiff() as diff:
+            keep = _allocate(100)
+        assert diff.key_type == 'lineno'
+        assert diff.size_diff >= 100 * 1000
+        assert diff.count_diff >= 100
+        frames, size, size_diff, count, count_diff = diff.statistics(1)[0]
+        (frame,) = frames
+        assert frame[0] == __file__
+        assert size_diff >= 100 * 1000 and size >= size_diff
+        assert count_diff >= 100 and count >= count_diff
+        del keep
+
+
+def test_diff_matches_compare_to():
+    with _tracing():
+        keep = []
+        snapshot = tracemalloc.take_snapshot()
+        with cTraceMalloc.SnapshotDiff() as diff:
+            keep.append(_allocate(100))
+        statistic = tracemalloc.take_snapshot().compare_to(snapshot, 'lineno')[0]
+        frames, size, size_diff, count, count_diff = diff.statistics(1)[0]
+        native = tracemalloc.StatisticDiff(tracemalloc.Traceback(frames), size, size_diff, count, count_diff)
+        assert native.traceback == statistic.traceback
+        assert native.size_diff == statistic.size_diff
+        assert native.count_diff == statistic.count_diff
+
+
+@pytest.mark.parametrize('key_type', ('filename', 'traceback'))
+def test_diff_key_type(key_type):
+    with _tracing():
+        with cTraceMalloc.SnapshotDiff(key_type) as diff:
+            keep = _allocate(100)
+        frames = diff.statistics(1)[0][0]
+        assert frames[0][0] == __file__
+        if key_type == 'filename':
+            assert frames == ((__file__, 0),)
+        del keep
+
+
+def test_diff_limit_and_order():
+    with _tracing():
+        with cTraceMalloc.SnapshotDiff() as diff:
+            keep = _allocate(100)
+        statistics = diff.statistics()
+        assert len(statistics) == diff.sites
+        sizes = [abs(s[2]) for s in statistics]
+        assert sizes == sorted(sizes, reverse=True)
+        assert diff.statistics(2) == statistics[:2]
+        assert diff.statistics(0) == []
+        del keep
+
+
+def test_diff_exclude():
+    with _tracing():
+        with cTraceMalloc.SnapshotDiff(exclude=(__file__,)) as diff:
+            keep = _allocate(100)
+        assert diff.exclude == (__file__,)
+        assert diff.traces_excluded >= 100
+        assert all(s[0][0][0] != __file__ for s in diff.statistics())
+        del keep
+        assert cTraceMalloc.SnapshotDiff().exclude == (tracemalloc.__file__,)
+
+
+def test_diff_raises():
+    with _tracing():
+        with pytest.raises(ValueError):
+            cTraceMalloc.SnapshotDiff('line')
+        with pytest.raises(TypeError):
+            cTraceMalloc.SnapshotDiff(exclude=(1,))
+        diff = cTraceMalloc.SnapshotDiff()
+        with pytest.raises(RuntimeError):
+            diff.finish()
+        diff.start()
+        with pytest.raises(RuntimeError):
+            diff.statistics()
+
+
+def test_diff_not_tracing():
+    if tracemalloc.is_tracing():
+        pytest.skip('tracemalloc is tracing')
+    with pytest.raises(RuntimeError):
+        cTraceMalloc.SnapshotDiff().start()
+
 if __name__ == '__main__':
     test_trace_malloc_simple()
@@ -0,0 +1,105 @@
+import multiprocessing
+import os
+import threading
+
+import pytest
+
+from pymemtrace import cPyMemTrace
+from pymemtrace import cTraceReader
+from pymemtrace import workers
+
+
+def _allocate(size):
+    return bytearray(size)
+
+
+def _work(count):
+    for _i in range(count):
+        _allocate(1024 ** 2)
+
+
+@pytest.fixture
+def untrace_workers():
+    yield
+    workers.untrace_workers()
+
+
+def _worker_logs(directory):
+    result = {}
+    for name in sorted(os.listdir(directory)):
+        if name.endswith('.bin'):
+            reader = cTraceReader.Reader(os.path.join(directory, name))
+            result[reader.pid] = reader
+    return result
+
+
+@pytest.mark.parametrize('method', ('spawn', 'forkserver', 'fork'))
+def test_trace_workers(tmp_path, monkeypatch, untrace_workers, method):
+    if method not in multiprocessing.get_all_start_methods():
+        pytest.skip(f'Requires the {method} start method')
+    monkeypatch.chdir(tmp_path)
+    workers.trace_workers('Profile', d_rss_trigger=0, binary=True)
+    process = multiprocessing.get_context(method).Process(target=_work, args=(4,))
+    process.start()
+    process.join()
+    assert process.exitcode == 0
+    logs = _worker_logs(str(tmp_path))
+    assert list(logs) == [process.pid]
+    reader = logs[process.pid]
+    parents = [(size, label) for _event, _clock, kind, _thread_id, size, label in reader.markers() if kind == 'PARENT']
+    assert parents == [(os.getpid(), method)]
+    # The log was closed although the worker ended with os._exit().
+    stats = reader.stats()
+    assert stats is not None and stats['events_written'] > 0
+    functions = set()
+    for batch in reader:
+        functions.update(reader.strings[i] for i in memoryview(batch['func']).tolist())
+    assert '_work' in functions
+
+
+def test_untrace_workers(tmp_path, monkeypatch, untrace_workers):
+    monkeypatch.chdir(tmp_path)
+    workers.trace_workers('Profile', binary=True)
+    workers.untrace_workers()
+    process = multiprocessing.get_context('spawn').Process(target=_work, args=(1,))
+    process.start()
+    process.join()
+    assert process.exitcode == 0
+    assert os.listdir(str(tmp_path)) == []
+
+
+def test_trace_workers_raises():
+    with pytest.raises(ValueError):
+        workers.trace_workers('Tracer')
+    with pytest.raises(ValueError):
+        workers.trace_workers('Profile', file=1)
+    with pytest.raises(ValueError):
+        workers.trace_workers('Profile', mmap=True)
+    assert not cPyMemTrace.is_tracing()
+
+
+def _work_in_thread(count):
+    thread = threading.Thread(target=_work, args=(count,))
+    thread.start()
+    thread.join()
+
+
+@pytest.mark.parametrize('method', ('spawn', 'fork'))
+def test_trace_workers_filter(tmp_path, monkeypatch, untrace_workers, method):
+    # The worker's tracer stays alive while it is attached, new threads copy its filter.
+    if method not in multiprocessing.get_all_start_methods():
+        pytest.skip(f'Requires the {method} start method')
+    monkeypatch.chdir(tmp_path)
+    workers.trace_workers('Profile', d_rss_trigger=0, binary=True, all_threads=True, exclude='function:_allocate')
+    process = multiprocessing.get_context(method).Process(target=_work_in_thread, args=(4,))
+    process.start()
+    process.join()
+    assert process.exitcode == 0
+    functions = set()
+    for name in os.listdir(str(tmp_path)):
+        reader = cTraceReader.Reader(os.path.join(str(tmp_path), name))
+        assert reader.stats() is not None
+        for batch in reader:
+            functions.update(reader.strings[i] for i in memoryview(batch['func']).tolist())
+    assert '_work' in functions
+    assert '_allocate' not in functions